@@ -63,6 +63,7 @@ testScriptsExt=(
     'invalidblockrequest.py'
 #    'forknotify.py'
     'p2p-acceptblock.py'
+    'p2p-compactblocks.py'
 );
 
 if [ "x$ENABLE_ZMQ" = "x1" ]; then
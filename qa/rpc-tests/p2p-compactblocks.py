@@ -0,0 +1,232 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.mininode import CBlockHeader, CInv, CTransaction, \
+    NodeConn, NodeConnCB, NetworkThread, BlockTransactions, \
+    BlockTransactionsRequest, msg_blocktxn, msg_cmpctblock, msg_getblocktxn, \
+    msg_getdata, msg_ping, msg_pong, msg_sendcmpct, mininode_lock, \
+    header_and_shortids_from_block, get_siphash_keys, calculate_shortid
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, initialize_chain_clean, \
+    start_node, p2p_port
+from test_framework.blocktools import create_block, create_coinbase
+
+import cStringIO
+import os
+import time
+
+'''
+CompactBlocksTest -- test compact block relay (BIP152).
+
+1. The node announces that it speaks compact blocks on connection, without
+   asking for them to be pushed.
+
+2. A peer that sends sendcmpct(announce=True) gets new blocks pushed as
+   cmpctblock, with the coinbase prefilled and short ids for the rest.
+
+3. getdata for MSG_CMPCT_BLOCK and getblocktxn are answered.
+
+4. A cmpctblock whose transactions are all in the node's mempool is
+   reconstructed without a round-trip.
+
+5. For a cmpctblock with transactions missing from the mempool, the node asks
+   for them with getblocktxn and accepts the block once they arrive in
+   blocktxn.
+'''
+
+MSG_CMPCT_BLOCK = 17
+
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+        self.last_sendcmpct = None
+        self.last_cmpctblock = None
+        self.last_getblocktxn = None
+        self.last_blocktxn = None
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def on_sendcmpct(self, conn, message):
+        self.last_sendcmpct = message
+
+    def on_cmpctblock(self, conn, message):
+        self.last_cmpctblock = message
+
+    def on_getblocktxn(self, conn, message):
+        self.last_getblocktxn = message
+
+    def on_blocktxn(self, conn, message):
+        self.last_blocktxn = message
+
+    # Wait until the named message attribute is set, and return it
+    def wait_for(self, attr, timeout=30):
+        sleep_time = 0.05
+        while timeout > 0:
+            with mininode_lock:
+                value = getattr(self, attr)
+                if value is not None:
+                    return value
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+        raise AssertionError("timed out waiting for " + attr)
+
+    def clear(self, attr):
+        with mininode_lock:
+            setattr(self, attr, None)
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+
+class CompactBlocksTest(BitcoinTestFramework):
+    def add_options(self, parser):
+        parser.add_option("--testbinary", dest="testbinary",
+                          default=os.getenv("BITCOIND", "bitcoind"),
+                          help="bitcoind binary to test")
+
+    def setup_chain(self):
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug"],
+                                     binary=self.options.testbinary))
+
+    # A transaction spending one of the node's coins, signed but not broadcast
+    def make_tx(self):
+        node = self.nodes[0]
+        utxo = node.listunspent()[0]
+        inputs = [{"txid": utxo["txid"], "vout": utxo["vout"]}]
+        outputs = {node.getnewaddress(): utxo["amount"] - 1}
+        signed = node.signrawtransaction(node.createrawtransaction(inputs, outputs))
+        assert(signed["complete"])
+        tx = CTransaction()
+        tx.deserialize(cStringIO.StringIO(signed["hex"].decode("hex")))
+        tx.calc_sha256()
+        return (tx, signed["hex"])
+
+    def build_block_with(self, txs):
+        node = self.nodes[0]
+        tip = int("0x" + node.getbestblockhash() + "L", 0)
+        block_time = node.getblock(node.getbestblockhash())["time"] + 1
+        block = create_block(tip, create_coinbase(), block_time)
+        block.vtx.extend(txs)
+        block.hashMerkleRoot = block.calc_merkle_root()
+        block.solve()
+        return block
+
+    def run_test(self):
+        node = self.nodes[0]
+        test_node = TestNode()
+        connection = NodeConn('127.0.0.1', p2p_port(0), node, test_node)
+        test_node.add_connection(connection)
+        NetworkThread().start()
+        test_node.wait_for_verack()
+
+        # 1. The node speaks compact blocks but wants them announced by inv
+        sendcmpct = test_node.wait_for("last_sendcmpct")
+        assert_equal(sendcmpct.announce, False)
+        assert_equal(sendcmpct.version, 1)
+
+        # Leave IBD and mature some coins to spend
+        node.generate(101)
+
+        # 2. Ask for new blocks to be pushed as compact blocks
+        test_node.send_message(msg_sendcmpct(announce=True, version=1))
+        test_node.sync_with_ping()
+
+        (tx, tx_hex) = self.make_tx()
+        node.sendrawtransaction(tx_hex)
+        test_node.clear("last_cmpctblock")
+        node.generate(1)
+        tip = node.getbestblockhash()
+
+        cmpctblock = test_node.wait_for("last_cmpctblock").header_and_shortids
+        cmpctblock.header.calc_sha256()
+        assert_equal(cmpctblock.header.hash, tip)
+        assert_equal(cmpctblock.prefilled_txn_length, 1)
+        assert_equal(cmpctblock.prefilled_txn[0].index, 0)
+        assert_equal(cmpctblock.shortids_length, 1)
+        [k0, k1] = get_siphash_keys(cmpctblock.header, cmpctblock.nonce)
+        assert_equal(cmpctblock.shortids[0], calculate_shortid(k0, k1, tx.sha256))
+        print "New block pushed as a compact block"
+
+        # 3. getdata for a compact block and getblocktxn are answered
+        test_node.clear("last_cmpctblock")
+        getdata = msg_getdata()
+        getdata.inv.append(CInv(MSG_CMPCT_BLOCK, int("0x" + tip + "L", 0)))
+        test_node.send_message(getdata)
+        cmpctblock = test_node.wait_for("last_cmpctblock").header_and_shortids
+        cmpctblock.header.calc_sha256()
+        assert_equal(cmpctblock.header.hash, tip)
+
+        req = BlockTransactionsRequest(int("0x" + tip + "L", 0), [1])
+        test_node.send_message(msg_getblocktxn(req))
+        blocktxn = test_node.wait_for("last_blocktxn").block_transactions
+        assert_equal(len(blocktxn.transactions), 1)
+        blocktxn.transactions[0].calc_sha256()
+        assert_equal(blocktxn.transactions[0].sha256, tx.sha256)
+        print "getdata(MSG_CMPCT_BLOCK) and getblocktxn answered"
+
+        # 4. A block made of mempool transactions is rebuilt without a round-trip
+        (tx, tx_hex) = self.make_tx()
+        node.sendrawtransaction(tx_hex)
+        block = self.build_block_with([tx])
+        test_node.clear("last_getblocktxn")
+        test_node.send_message(msg_cmpctblock(header_and_shortids_from_block(block, nonce=1)))
+        test_node.sync_with_ping()
+        assert_equal(node.getbestblockhash(), block.hash)
+        assert(test_node.last_getblocktxn is None)
+        print "Compact block rebuilt from the mempool"
+
+        # 5. Missing transactions are fetched with getblocktxn
+        (tx, tx_hex) = self.make_tx()
+        block = self.build_block_with([tx])
+        test_node.send_message(msg_cmpctblock(header_and_shortids_from_block(block, nonce=2)))
+        getblocktxn = test_node.wait_for("last_getblocktxn").block_txn_request
+        assert_equal(getblocktxn.blockhash, block.sha256)
+        assert_equal(getblocktxn.indexes, [1])
+        assert(node.getbestblockhash() != block.hash)
+
+        test_node.send_message(msg_blocktxn(BlockTransactions(block.sha256, [tx])))
+        test_node.sync_with_ping()
+        assert_equal(node.getbestblockhash(), block.hash)
+        print "Compact block completed with blocktxn"
+
+        connection.disconnect_node()
+
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
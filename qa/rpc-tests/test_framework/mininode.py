@@ -91,6 +91,27 @@ def ser_string(s):
     return chr(255) + struct.pack("<Q", len(s)) + s
 
 
+def deser_compact_size(f):
+    nit = struct.unpack("<B", f.read(1))[0]
+    if nit == 253:
+        nit = struct.unpack("<H", f.read(2))[0]
+    elif nit == 254:
+        nit = struct.unpack("<I", f.read(4))[0]
+    elif nit == 255:
+        nit = struct.unpack("<Q", f.read(8))[0]
+    return nit
+
+
+def ser_compact_size(l):
+    if l < 253:
+        return chr(l)
+    elif l < 0x10000:
+        return chr(253) + struct.pack("<H", l)
+    elif l < 0x100000000L:
+        return chr(254) + struct.pack("<I", l)
+    return chr(255) + struct.pack("<Q", l)
+
+
 def deser_uint256(f):
     r = 0L
     for i in xrange(8):
@@ -115,6 +136,65 @@ def uint256_from_str(s):
     return r
 
 
+def rotl64(x, b):
+    return ((x << b) | (x >> (64 - b))) & 0xFFFFFFFFFFFFFFFFL
+
+
+def siphash_round(v0, v1, v2, v3):
+    v0 = (v0 + v1) & 0xFFFFFFFFFFFFFFFFL
+    v1 = rotl64(v1, 13)
+    v1 ^= v0
+    v0 = rotl64(v0, 32)
+    v2 = (v2 + v3) & 0xFFFFFFFFFFFFFFFFL
+    v3 = rotl64(v3, 16)
+    v3 ^= v2
+    v0 = (v0 + v3) & 0xFFFFFFFFFFFFFFFFL
+    v3 = rotl64(v3, 21)
+    v3 ^= v0
+    v2 = (v2 + v1) & 0xFFFFFFFFFFFFFFFFL
+    v1 = rotl64(v1, 17)
+    v1 ^= v2
+    v2 = rotl64(v2, 32)
+    return (v0, v1, v2, v3)
+
+
+# SipHash-2-4 of a uint256, as SipHashUint256() in hash.cpp
+def siphash256(k0, k1, h):
+    n0 = h & 0xFFFFFFFFFFFFFFFFL
+    n1 = (h >> 64) & 0xFFFFFFFFFFFFFFFFL
+    n2 = (h >> 128) & 0xFFFFFFFFFFFFFFFFL
+    n3 = (h >> 192) & 0xFFFFFFFFFFFFFFFFL
+    v0 = 0x736f6d6570736575L ^ k0
+    v1 = 0x646f72616e646f6dL ^ k1
+    v2 = 0x6c7967656e657261L ^ k0
+    v3 = 0x7465646279746573L ^ k1 ^ n0
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0 ^= n0
+    v3 ^= n1
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0 ^= n1
+    v3 ^= n2
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0 ^= n2
+    v3 ^= n3
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0 ^= n3
+    v3 ^= 0x2000000000000000L
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0 ^= 0x2000000000000000L
+    v2 ^= 0xFF
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    v0, v1, v2, v3 = siphash_round(v0, v1, v2, v3)
+    return v0 ^ v1 ^ v2 ^ v3
+
+
 def uint256_from_compact(c):
     nbytes = (c >> 24) & 0xFF
     v = (c & 0xFFFFFFL) << (8 * (nbytes - 3))
@@ -304,7 +384,8 @@ class CInv(object):
     typemap = {
         0: "Error",
         1: "TX",
-        2: "Block"}
+        2: "Block",
+        17: "CompactBlock"}
 
     def __init__(self, t=0, h=0L):
         self.type = t
@@ -789,6 +870,149 @@ class CBlock(CBlockHeader):
                self.nNonce, repr(self.nSolution), repr(self.vtx))
 
 
+class PrefilledTransaction(object):
+    def __init__(self, index=0, tx=None):
+        self.index = index
+        self.tx = tx
+
+    def deserialize(self, f):
+        self.index = deser_compact_size(f)
+        self.tx = CTransaction()
+        self.tx.deserialize(f)
+
+    def serialize(self):
+        r = ""
+        r += ser_compact_size(self.index)
+        r += self.tx.serialize()
+        return r
+
+    def __repr__(self):
+        return "PrefilledTransaction(index=%d, tx=%s)" % (self.index, repr(self.tx))
+
+
+# This is what we send on the wire, in a cmpctblock message.
+class P2PHeaderAndShortIDs(object):
+    def __init__(self):
+        self.header = CBlockHeader()
+        self.nonce = 0
+        self.shortids_length = 0
+        self.shortids = []
+        self.prefilled_txn_length = 0
+        self.prefilled_txn = []
+
+    def deserialize(self, f):
+        self.header.deserialize(f)
+        self.nonce = struct.unpack("<Q", f.read(8))[0]
+        self.shortids_length = deser_compact_size(f)
+        for i in xrange(self.shortids_length):
+            # shortids are defined to be 6 bytes in the spec, so append
+            # two zero bytes and read it in as an 8-byte number
+            self.shortids.append(struct.unpack("<Q", f.read(6) + '\x00\x00')[0])
+        self.prefilled_txn = deser_vector(f, PrefilledTransaction)
+        self.prefilled_txn_length = len(self.prefilled_txn)
+
+    def serialize(self):
+        r = ""
+        r += self.header.serialize()
+        r += struct.pack("<Q", self.nonce)
+        r += ser_compact_size(self.shortids_length)
+        for x in self.shortids:
+            # We only want the first 6 bytes
+            r += struct.pack("<Q", x)[0:6]
+        r += ser_vector(self.prefilled_txn)
+        return r
+
+    def __repr__(self):
+        return "P2PHeaderAndShortIDs(header=%s, nonce=%d, shortids_length=%d, shortids=%s, prefilled_txn_length=%d, prefilledtxn=%s" \
+            % (repr(self.header), self.nonce, self.shortids_length, repr(self.shortids), self.prefilled_txn_length, repr(self.prefilled_txn))
+
+
+# Calculate the BIP 152-compact blocks shortid for a given transaction hash
+def calculate_shortid(k0, k1, tx_hash):
+    expected_shortid = siphash256(k0, k1, tx_hash)
+    expected_shortid &= 0x0000ffffffffffffL
+    return expected_shortid
+
+
+# The key for the short ids is the first 16 bytes of SHA256(header || nonce)
+def get_siphash_keys(header, nonce):
+    header_nonce = header.serialize()
+    header_nonce += struct.pack("<Q", nonce)
+    hash_header_nonce_as_str = sha256(header_nonce)
+    key0 = struct.unpack("<Q", hash_header_nonce_as_str[0:8])[0]
+    key1 = struct.unpack("<Q", hash_header_nonce_as_str[8:16])[0]
+    return [key0, key1]
+
+
+# Builds the cmpctblock for a block, prefilling the transactions at
+# prefill_list (the coinbase by default)
+def header_and_shortids_from_block(block, nonce=0, prefill_list=[0]):
+    p2p = P2PHeaderAndShortIDs()
+    p2p.header = CBlockHeader(block)
+    p2p.nonce = nonce
+    [k0, k1] = get_siphash_keys(p2p.header, nonce)
+    last_index = -1
+    for i in xrange(len(block.vtx)):
+        if i in prefill_list:
+            p2p.prefilled_txn.append(PrefilledTransaction(i - last_index - 1, block.vtx[i]))
+            last_index = i
+        else:
+            block.vtx[i].calc_sha256()
+            p2p.shortids.append(calculate_shortid(k0, k1, block.vtx[i].sha256))
+    p2p.shortids_length = len(p2p.shortids)
+    p2p.prefilled_txn_length = len(p2p.prefilled_txn)
+    return p2p
+
+
+class BlockTransactionsRequest(object):
+    def __init__(self, blockhash=0, indexes=None):
+        self.blockhash = blockhash
+        self.indexes = indexes if indexes != None else []
+
+    def deserialize(self, f):
+        self.blockhash = deser_uint256(f)
+        indexes_length = deser_compact_size(f)
+        for i in xrange(indexes_length):
+            self.indexes.append(deser_compact_size(f))
+        # Indexes are differentially encoded
+        last_index = -1
+        for i in xrange(len(self.indexes)):
+            self.indexes[i] += last_index + 1
+            last_index = self.indexes[i]
+
+    def serialize(self):
+        r = ""
+        r += ser_uint256(self.blockhash)
+        r += ser_compact_size(len(self.indexes))
+        last_index = -1
+        for x in self.indexes:
+            r += ser_compact_size(x - last_index - 1)
+            last_index = x
+        return r
+
+    def __repr__(self):
+        return "BlockTransactionsRequest(hash=%064x indexes=%s)" % (self.blockhash, repr(self.indexes))
+
+
+class BlockTransactions(object):
+    def __init__(self, blockhash=0, transactions=None):
+        self.blockhash = blockhash
+        self.transactions = transactions if transactions != None else []
+
+    def deserialize(self, f):
+        self.blockhash = deser_uint256(f)
+        self.transactions = deser_vector(f, CTransaction)
+
+    def serialize(self):
+        r = ""
+        r += ser_uint256(self.blockhash)
+        r += ser_vector(self.transactions)
+        return r
+
+    def __repr__(self):
+        return "BlockTransactions(hash=%064x transactions=%s)" % (self.blockhash, repr(self.transactions))
+
+
 class CUnsignedAlert(object):
     def __init__(self):
         self.nVersion = 1
@@ -1226,6 +1450,78 @@ class msg_reject(object):
             % (self.message, self.code, self.reason, self.data)
 
 
+class msg_sendcmpct(object):
+    command = "sendcmpct"
+
+    def __init__(self, announce=False, version=1):
+        self.announce = announce
+        self.version = version
+
+    def deserialize(self, f):
+        self.announce = struct.unpack("<?", f.read(1))[0]
+        self.version = struct.unpack("<Q", f.read(8))[0]
+
+    def serialize(self):
+        r = ""
+        r += struct.pack("<?", self.announce)
+        r += struct.pack("<Q", self.version)
+        return r
+
+    def __repr__(self):
+        return "msg_sendcmpct(announce=%s, version=%lu)" % (self.announce, self.version)
+
+
+class msg_cmpctblock(object):
+    command = "cmpctblock"
+
+    def __init__(self, header_and_shortids=None):
+        self.header_and_shortids = header_and_shortids
+
+    def deserialize(self, f):
+        self.header_and_shortids = P2PHeaderAndShortIDs()
+        self.header_and_shortids.deserialize(f)
+
+    def serialize(self):
+        return self.header_and_shortids.serialize()
+
+    def __repr__(self):
+        return "msg_cmpctblock(HeaderAndShortIDs=%s)" % repr(self.header_and_shortids)
+
+
+class msg_getblocktxn(object):
+    command = "getblocktxn"
+
+    def __init__(self, block_txn_request=None):
+        self.block_txn_request = block_txn_request
+
+    def deserialize(self, f):
+        self.block_txn_request = BlockTransactionsRequest()
+        self.block_txn_request.deserialize(f)
+
+    def serialize(self):
+        return self.block_txn_request.serialize()
+
+    def __repr__(self):
+        return "msg_getblocktxn(block_txn_request=%s)" % (repr(self.block_txn_request))
+
+
+class msg_blocktxn(object):
+    command = "blocktxn"
+
+    def __init__(self, block_transactions=None):
+        self.block_transactions = block_transactions
+
+    def deserialize(self, f):
+        self.block_transactions = BlockTransactions()
+        self.block_transactions.deserialize(f)
+
+    def serialize(self):
+        return self.block_transactions.serialize()
+
+    def __repr__(self):
+        return "msg_blocktxn(block_transactions=%s)" % (repr(self.block_transactions))
+
+
 # This is what a callback should look like for NodeConn
 # Reimplement the on_* functions to provide handling for events
 class NodeConnCB(object):
@@ -1251,7 +1547,11 @@ class NodeConnCB(object):
             "headers": self.on_headers,
             "getheaders": self.on_getheaders,
             "reject": self.on_reject,
-            "mempool": self.on_mempool
+            "mempool": self.on_mempool,
+            "sendcmpct": self.on_sendcmpct,
+            "cmpctblock": self.on_cmpctblock,
+            "getblocktxn": self.on_getblocktxn,
+            "blocktxn": self.on_blocktxn
         }
 
     def deliver(self, conn, message):
@@ -1297,6 +1597,10 @@ class NodeConnCB(object):
     def on_close(self, conn): pass
     def on_mempool(self, conn): pass
     def on_pong(self, conn, message): pass
+    def on_sendcmpct(self, conn, message): pass
+    def on_cmpctblock(self, conn, message): pass
+    def on_getblocktxn(self, conn, message): pass
+    def on_blocktxn(self, conn, message): pass
 
 
 # The actual NodeConn class
@@ -1318,7 +1622,11 @@ class NodeConn(asyncore.dispatcher):
         "headers": msg_headers,
         "getheaders": msg_getheaders,
         "reject": msg_reject,
-        "mempool": msg_mempool
+        "mempool": msg_mempool,
+        "sendcmpct": msg_sendcmpct,
+        "cmpctblock": msg_cmpctblock,
+        "getblocktxn": msg_getblocktxn,
+        "blocktxn": msg_blocktxn
     }
     MAGIC_BYTES = {
         "mainnet": "\x24\xe9\x27\x64",   # mainnet
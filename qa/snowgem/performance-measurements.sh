@@ -200,6 +200,9 @@ case "$1" in
             trydecryptnotes)
                 vidulum_rpc zcbenchmark trydecryptnotes 1000 "${@:3}"
                 ;;
+            trydecryptsaplingnotes)
+                vidulum_rpc zcbenchmark trydecryptsaplingnotes 10 "${@:3}"
+                ;;
             incnotewitnesses)
                 vidulum_rpc zcbenchmark incnotewitnesses 100 "${@:3}"
                 ;;
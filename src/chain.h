@@ -183,11 +183,19 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     uint256 nNonce;
-    std::vector<unsigned char> nSolution;
 
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
+protected:
+    //! Equihash solution of the header, by far the largest part of an entry.
+    //! Dropped from memory by TrimSolution() once the entry is settled and in
+    //! the block tree DB, and loaded back from there by GetBlockHeader().
+    std::vector<unsigned char> nSolution;
+    bool fSolutionTrimmed;
+
+public:
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -217,6 +225,7 @@ public:
         nBits          = 0;
         nNonce         = uint256();
         nSolution.clear();
+        fSolutionTrimmed = false;
     }
 
     CBlockIndex()
@@ -255,9 +264,45 @@ public:
         return ret;
     }
 
-    CBlockHeader GetBlockHeader() const
+    //! Whether the Equihash solution is held in memory
+    bool HasSolution() const
+    {
+        return !fSolutionTrimmed;
+    }
+
+    //! Only valid if HasSolution()
+    const std::vector<unsigned char>& GetSolution() const
+    {
+        assert(!fSolutionTrimmed);
+        return nSolution;
+    }
+
+    void SetSolution(const std::vector<unsigned char>& nSolutionIn)
+    {
+        nSolution = nSolutionIn;
+        fSolutionTrimmed = false;
+    }
+
+    //! Free the Equihash solution. Only call once the entry has been written
+    //! to the block tree DB; cs_main must be held.
+    void TrimSolution()
+    {
+        std::vector<unsigned char>().swap(nSolution);
+        fSolutionTrimmed = true;
+    }
+
+    //! Whether the entry has reached a state it is not expected to leave, so
+    //! its solution can be trimmed without having to be read back to rewrite
+    //! the entry later.
+    bool IsSettled() const
+    {
+        return (nStatus & BLOCK_FAILED_MASK) || IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    //! Fills in the header, leaving out a trimmed solution, and returns
+    //! whether the solution was filled in. cs_main must be held.
+    bool GetBlockHeaderInMemory(CBlockHeader& block) const
     {
-        CBlockHeader block;
         block.nVersion       = nVersion;
         if (pprev)
             block.hashPrevBlock = pprev->GetBlockHash();
@@ -266,10 +311,16 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        if (fSolutionTrimmed)
+            return false;
         block.nSolution      = nSolution;
-        return block;
+        return true;
     }
 
+    //! Loads a trimmed solution back from the block tree DB, so cs_main must
+    //! be held. Defined in main.cpp.
+    CBlockHeader GetBlockHeader() const;
+
     uint256 GetBlockHash() const
     {
         return *phashBlock;
@@ -388,6 +439,10 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+        if (!ser_action.ForRead()) {
+            // A trimmed solution must be loaded back before rewriting the entry
+            assert(!fSolutionTrimmed);
+        }
         READWRITE(nSolution);
 
         // Only read/write nSproutValue if the client version used to create
@@ -406,7 +461,7 @@ public:
         // them to CBlockTreeDB::LoadBlockIndexGuts() in txdb.cpp :)
     }
 
-    uint256 GetBlockHash() const
+    CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
         block.nVersion        = nVersion;
@@ -417,7 +472,12 @@ public:
         block.nBits           = nBits;
         block.nNonce          = nNonce;
         block.nSolution       = nSolution;
-        return block.GetHash();
+        return block;
+    }
+
+    uint256 GetBlockHash() const
+    {
+        return GetBlockHeader().GetHash();
     }
 
 
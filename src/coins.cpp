@@ -82,7 +82,11 @@ bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn, bool fPooledIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0), fPooled(fPooledIn)
+{
+    if (fPooled)
+        ResetCacheMaps();
+}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -517,13 +521,29 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
     return true;
 }
 
+template<typename Map>
+static void ResetCacheMap(Map& map, bool fPooled)
+{
+    if (!fPooled) {
+        map.clear();
+        return;
+    }
+    // Clearing a pooled map would keep its chunks, which count as usage
+    Map(0, typename Map::hasher(), typename Map::key_equal(),
+        typename Map::allocator_type(std::make_shared<CPoolResource>())).swap(map);
+}
+
+void CCoinsViewCache::ResetCacheMaps() {
+    ResetCacheMap(cacheCoins, fPooled);
+    ResetCacheMap(cacheSproutAnchors, fPooled);
+    ResetCacheMap(cacheSaplingAnchors, fPooled);
+    ResetCacheMap(cacheSproutNullifiers, fPooled);
+    ResetCacheMap(cacheSaplingNullifiers, fPooled);
+}
+
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, cacheSproutAnchors, cacheSaplingAnchors, cacheSproutNullifiers, cacheSaplingNullifiers);
-    cacheCoins.clear();
-    cacheSproutAnchors.clear();
-    cacheSaplingAnchors.clear();
-    cacheSproutNullifiers.clear();
-    cacheSaplingNullifiers.clear();
+    ResetCacheMaps();
     cachedCoinsUsage = 0;
     return fOk;
 }
@@ -10,6 +10,7 @@
 #include "core_memusage.h"
 #include "memusage.h"
 #include "serialize.h"
+#include "support/allocators/pool.h"
 #include "uint256.h"
 
 #include <assert.h>
@@ -317,10 +318,17 @@ enum ShieldedType
     SAPLING,
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
-typedef boost::unordered_map<uint256, CAnchorsSproutCacheEntry, CCoinsKeyHasher> CAnchorsSproutMap;
-typedef boost::unordered_map<uint256, CAnchorsSaplingCacheEntry, CCoinsKeyHasher> CAnchorsSaplingMap;
-typedef boost::unordered_map<uint256, CNullifiersCacheEntry, CCoinsKeyHasher> CNullifiersMap;
+/** The cache maps can allocate their nodes from a pool owned by each map, see pool_allocator. */
+template<typename Entry>
+struct CCoinsCacheMap
+{
+    typedef boost::unordered_map<uint256, Entry, CCoinsKeyHasher, std::equal_to<uint256>, pool_allocator<std::pair<const uint256, Entry> > > type;
+};
+
+typedef CCoinsCacheMap<CCoinsCacheEntry>::type CCoinsMap;
+typedef CCoinsCacheMap<CAnchorsSproutCacheEntry>::type CAnchorsSproutMap;
+typedef CCoinsCacheMap<CAnchorsSaplingCacheEntry>::type CAnchorsSaplingMap;
+typedef CCoinsCacheMap<CNullifiersCacheEntry>::type CNullifiersMap;
 
 struct CCoinsStats
 {
@@ -455,8 +463,18 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Whether the cache maps allocate their nodes from pools. */
+    bool fPooled;
+
+    /* Empty the cache maps, giving pooled maps fresh pools. */
+    void ResetCacheMaps();
+
 public:
-    CCoinsViewCache(CCoinsView *baseIn);
+    /**
+     * A long-lived cache such as pcoinsTip can set fPooledIn so its entries
+     * come from pools; the pools are released on each Flush().
+     */
+    CCoinsViewCache(CCoinsView *baseIn, bool fPooledIn = false);
     ~CCoinsViewCache();
 
     // Standard CCoinsView methods
@@ -0,0 +1,249 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2018 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include "uint256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Fixed-size cache of 256-bit keys based on cuckoo hashing.
+ *
+ * Every key can live in one of eight slots, picked by eight 32-bit words
+ * of the key itself; keys must therefore already be uniformly distributed
+ * (e.g. salted hashes). Slots are stored as atomic words, so contains()
+ * never takes a lock, while insertions are serialized by a mutex.
+ *
+ * Instead of tracking an exact LRU order, slots carry two flags:
+ * - a "collection" flag, set when a slot may be overwritten (it is empty,
+ *   or its entry was erased by a reader);
+ * - an "epoch" flag, set when the entry was inserted in the current epoch.
+ * Once enough of the table was filled during the current epoch, entries
+ * from the previous epoch are marked for collection, so the oldest half
+ * of the cache is reclaimed in one pass instead of evicting entry by entry.
+ *
+ * A concurrent insert can briefly hide an entry being moved between slots
+ * from a reader; that only causes a spurious miss.
+ */
+class CCuckooCache
+{
+private:
+    //! One key, stored as independently readable atomic words
+    struct Slot {
+        std::atomic<uint64_t> words[4];
+    };
+
+    std::unique_ptr<Slot[]> table;
+    //! Bit-packed collection flags, one bit per slot
+    std::unique_ptr<std::atomic<uint8_t>[]> collection_flags;
+    //! Epoch flags; only touched with cs_insert held
+    std::vector<bool> epoch_flags;
+
+    uint32_t nSize;
+    //! Maximum number of displacements before an insert gives up on an entry
+    uint8_t depth_limit;
+    //! Number of inserts before the epoch fill level is checked again
+    uint32_t epoch_heuristic_counter;
+    //! Number of fresh entries after which a new epoch is started
+    uint32_t epoch_size;
+
+    boost::mutex cs_insert;
+
+    static void Load(const uint256& key, uint64_t (&words)[4])
+    {
+        memcpy(words, key.begin(), 32);
+    }
+
+    bool SlotEquals(uint32_t loc, const uint64_t (&words)[4]) const
+    {
+        for (int i = 0; i < 4; i++) {
+            if (table[loc].words[i].load(std::memory_order_relaxed) != words[i])
+                return false;
+        }
+        return true;
+    }
+
+    void SlotStore(uint32_t loc, const uint64_t (&words)[4])
+    {
+        for (int i = 0; i < 4; i++)
+            table[loc].words[i].store(words[i], std::memory_order_relaxed);
+    }
+
+    void SlotRead(uint32_t loc, uint64_t (&words)[4]) const
+    {
+        for (int i = 0; i < 4; i++)
+            words[i] = table[loc].words[i].load(std::memory_order_relaxed);
+    }
+
+    bool IsCollectable(uint32_t loc) const
+    {
+        return collection_flags[loc >> 3].load(std::memory_order_relaxed) & (1 << (loc & 7));
+    }
+
+    void AllowErase(uint32_t loc)
+    {
+        collection_flags[loc >> 3].fetch_or(1 << (loc & 7), std::memory_order_relaxed);
+    }
+
+    void PleaseKeep(uint32_t loc)
+    {
+        collection_flags[loc >> 3].fetch_and(~(1 << (loc & 7)), std::memory_order_relaxed);
+    }
+
+    /** Map the eight 32-bit words of the key onto [0, nSize) without a division */
+    void ComputeLocations(const uint64_t (&words)[4], uint32_t (&locs)[8]) const
+    {
+        uint32_t h[8];
+        memcpy(h, words, sizeof(h));
+        for (int i = 0; i < 8; i++)
+            locs[i] = (uint32_t)(((uint64_t)h[i] * (uint64_t)nSize) >> 32);
+    }
+
+    /**
+     * Start a new epoch if enough entries were added during this one: flag
+     * every entry of the previous epoch for collection. Scanning the whole
+     * table is expensive, so the next check is scheduled no earlier than
+     * the number of inserts that could possibly fill the epoch.
+     */
+    void EpochCheck()
+    {
+        if (epoch_heuristic_counter != 0) {
+            --epoch_heuristic_counter;
+            return;
+        }
+        uint32_t epoch_unused_count = 0;
+        for (uint32_t i = 0; i < nSize; ++i)
+            epoch_unused_count += epoch_flags[i] && !IsCollectable(i);
+        if (epoch_unused_count >= epoch_size) {
+            for (uint32_t i = 0; i < nSize; ++i) {
+                if (epoch_flags[i])
+                    epoch_flags[i] = false;
+                else
+                    AllowErase(i);
+            }
+            epoch_heuristic_counter = epoch_size;
+        } else {
+            epoch_heuristic_counter = std::max(1u, std::max(epoch_size / 16,
+                        epoch_size - std::min(epoch_size, epoch_unused_count)));
+        }
+    }
+
+public:
+    CCuckooCache() : nSize(0), depth_limit(0), epoch_heuristic_counter(0), epoch_size(0) {}
+
+    /** Allocate room for nEntries keys, discarding any current contents */
+    void Setup(uint32_t nEntries)
+    {
+        boost::unique_lock<boost::mutex> lock(cs_insert);
+        nSize = std::max<uint32_t>(2, nEntries);
+        table.reset(new Slot[nSize]);
+        collection_flags.reset(new std::atomic<uint8_t>[(nSize + 7) / 8]);
+        for (uint32_t i = 0; i < nSize; i++) {
+            for (int j = 0; j < 4; j++)
+                table[i].words[j].store(0, std::memory_order_relaxed);
+        }
+        for (uint32_t i = 0; i < (nSize + 7) / 8; i++)
+            collection_flags[i].store(0xFF, std::memory_order_relaxed);
+        epoch_flags.assign(nSize, false);
+        depth_limit = 0;
+        while ((1U << depth_limit) < nSize && depth_limit < 31)
+            depth_limit++;
+        epoch_size = std::max<uint32_t>(1, (45 * (uint64_t)nSize) / 100);
+        epoch_heuristic_counter = epoch_size;
+    }
+
+    /** Number of slots allocated by Setup() */
+    uint32_t Size() const { return nSize; }
+
+    /** Memory used by the table and flags, in bytes */
+    size_t DynamicMemoryUsage() const
+    {
+        return nSize * sizeof(Slot) + (nSize + 7) / 8 + nSize / 8;
+    }
+
+    /** Insert a key; when the table is full an old entry may be dropped */
+    void Insert(const uint256& key)
+    {
+        if (nSize == 0)
+            return;
+
+        boost::unique_lock<boost::mutex> lock(cs_insert);
+        EpochCheck();
+
+        uint64_t e[4];
+        Load(key, e);
+        uint32_t locs[8];
+        ComputeLocations(e, locs);
+
+        // Don't store the same key twice
+        for (int i = 0; i < 8; i++) {
+            if (SlotEquals(locs[i], e)) {
+                PleaseKeep(locs[i]);
+                epoch_flags[locs[i]] = true;
+                return;
+            }
+        }
+
+        uint32_t last_loc = nSize;
+        bool last_epoch = true;
+        for (uint8_t depth = 0; depth < depth_limit; ++depth) {
+            for (int i = 0; i < 8; i++) {
+                if (!IsCollectable(locs[i]))
+                    continue;
+                SlotStore(locs[i], e);
+                PleaseKeep(locs[i]);
+                epoch_flags[locs[i]] = last_epoch;
+                return;
+            }
+            // No free slot: displace the occupant of the slot after the one
+            // we were kicked out of, and try to place it instead.
+            int next = (std::find(locs, locs + 8, last_loc) - locs + 1) & 7;
+            last_loc = locs[next];
+            uint64_t displaced[4];
+            SlotRead(last_loc, displaced);
+            SlotStore(last_loc, e);
+            memcpy(e, displaced, sizeof(e));
+            bool epoch = last_epoch;
+            last_epoch = epoch_flags[last_loc];
+            epoch_flags[last_loc] = epoch;
+            ComputeLocations(e, locs);
+        }
+        // The key left over after depth_limit displacements is dropped.
+    }
+
+    /**
+     * Return whether key is present. Never blocks. If fErase is set the
+     * entry is flagged so that a later insert may reuse its slot.
+     */
+    bool Contains(const uint256& key, bool fErase)
+    {
+        if (nSize == 0)
+            return false;
+
+        uint64_t e[4];
+        Load(key, e);
+        uint32_t locs[8];
+        ComputeLocations(e, locs);
+        for (int i = 0; i < 8; i++) {
+            if (SlotEquals(locs[i], e)) {
+                if (fErase)
+                    AllowErase(locs[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif // BITCOIN_CUCKOOCACHE_H
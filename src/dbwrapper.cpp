@@ -5,6 +5,7 @@
 #include "dbwrapper.h"
 
 #include "util.h"
+#include "utilstrencodings.h"
 
 #include <boost/filesystem.hpp>
 
@@ -14,14 +15,47 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+const CDBProfile DBPROFILE_DEFAULT = {"default", 64, 25, 4 * 1024};
+// More open files avoid reopening tables on random coin lookups.
+const CDBProfile DBPROFILE_CHAINSTATE = {"chainstate", 256, 25, 4 * 1024};
+// Index entries are mostly read in key order, which larger blocks serve with
+// fewer reads. A bigger write buffer means fewer level-0 compactions while
+// indexing during IBD.
+const CDBProfile DBPROFILE_BLOCK_INDEX = {"blockindex", 128, 35, 16 * 1024};
+const CDBProfile DBPROFILE_SMALL = {"small", 16, 25, 4 * 1024};
+
+static const CDBProfile* const dbProfiles[] = {&DBPROFILE_DEFAULT, &DBPROFILE_CHAINSTATE, &DBPROFILE_BLOCK_INDEX, &DBPROFILE_SMALL};
+
+const CDBProfile* GetDBProfile(const std::string& strName)
+{
+    for (size_t i = 0; i < ARRAYLEN(dbProfiles); i++) {
+        if (strName == dbProfiles[i]->name)
+            return dbProfiles[i];
+    }
+    return NULL;
+}
+
+std::string GetDBProfileNames()
+{
+    std::string strNames;
+    for (size_t i = 0; i < ARRAYLEN(dbProfiles); i++) {
+        if (i > 0)
+            strNames += ", ";
+        strNames += dbProfiles[i]->name;
+    }
+    return strNames;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = nCacheSize * profile.nWriteBufferPercent / 100;
+    options.block_cache = leveldb::NewLRUCache(nCacheSize - 2 * options.write_buffer_size);
+    options.block_size = profile.nBlockSize;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -30,14 +64,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -49,7 +83,7 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
             dbwrapper_private::HandleError(result);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Opening LevelDB in %s (profile %s)\n", path.string(), profile.name);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
@@ -82,6 +116,11 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+bool CDBWrapper::GetProperty(const std::string& strName, std::string& strValue) const
+{
+    return pdb->GetProperty(strName, &strValue);
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
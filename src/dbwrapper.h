@@ -27,6 +27,33 @@ public:
 
 class CDBWrapper;
 
+/** LevelDB settings suited to the access pattern of one database. */
+struct CDBProfile
+{
+    const char* name;
+    //! Number of table files LevelDB keeps open
+    int nMaxOpenFiles;
+    //! Share of the cache, in percent, for each of the up to two write buffers held in
+    //! memory at once; the rest is used as block cache
+    int nWriteBufferPercent;
+    //! Size of a table block
+    size_t nBlockSize;
+};
+
+/** The settings all databases used before profiles were introduced */
+extern const CDBProfile DBPROFILE_DEFAULT;
+/** Random reads and large batched writes of already compact coins */
+extern const CDBProfile DBPROFILE_CHAINSTATE;
+/** Block index and the address, spent and timestamp indexes: write heavy and scanned by key range */
+extern const CDBProfile DBPROFILE_BLOCK_INDEX;
+/** Small, rarely written databases */
+extern const CDBProfile DBPROFILE_SMALL;
+
+/** Return the profile called strName, or NULL if there is none. */
+const CDBProfile* GetDBProfile(const std::string& strName);
+/** Names of all profiles, for help messages. */
+std::string GetDBProfileNames();
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -140,6 +167,11 @@ public:
         return piter->value().size();
     }
 
+    //! Serialized value, for callers that deserialize it elsewhere
+    std::string GetValueRaw() {
+        return piter->value().ToString();
+    }
+
 };
 
 class CDBWrapper
@@ -172,8 +204,9 @@ public:
      * @param[in] nCacheSize  Configures various leveldb cache settings.
      * @param[in] fMemory     If true, use leveldb's memory environment.
      * @param[in] fWipe       If true, remove all existing data.
+     * @param[in] profile     LevelDB settings to open the database with.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = DBPROFILE_DEFAULT);
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -259,6 +292,12 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Read a LevelDB property such as "leveldb.stats". Returns false if the
+     * property is unknown.
+     */
+    bool GetProperty(const std::string& strName, std::string& strValue) const;
 };
 
 #endif // BITCOIN_DBWRAPPER_H
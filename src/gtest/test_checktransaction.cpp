@@ -255,6 +255,49 @@ TEST(checktransaction_tests, OversizeSaplingTxns) {
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
 }
 
+TEST(checktransaction_tests, SaplingProofChecksCanBeDeferred) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.fOverwintered = true;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.nVersion = SAPLING_TX_VERSION;
+
+    // An output description with an invalid proof
+    mtx.vShieldedOutput.push_back(OutputDescription());
+
+    // Change the proof types (which requires re-signing the JoinSplit data)
+    mtx.vjoinsplit[0].proof = libzcash::GrothProof();
+    mtx.vjoinsplit[1].proof = libzcash::GrothProof();
+    CreateJoinSplitSignature(mtx, NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId);
+
+    CTransaction tx(mtx);
+
+    {
+        MockCValidationState state;
+        EXPECT_CALL(state, DoS(100, false, REJECT_INVALID, "bad-txns-sapling-output-description-invalid", false)).Times(1);
+        EXPECT_FALSE(ContextualCheckTransaction(tx, state, 1, 100));
+    }
+
+    {
+        // ConnectBlock is responsible for the Sapling checks of block transactions
+        CValidationState state;
+        EXPECT_TRUE(ContextualCheckTransaction(tx, state, 1, 100, []() { return false; }, false));
+
+        uint256 dataToBeSigned = SignatureHash(CScript(), tx, NOT_AN_INPUT, SIGHASH_ALL, 0,
+                                               NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId);
+        CSaplingCheck check(tx, dataToBeSigned);
+        EXPECT_FALSE(check());
+        EXPECT_EQ(check.GetRejectReason(), "bad-txns-sapling-output-description-invalid");
+    }
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+}
+
 TEST(checktransaction_tests, bad_txns_vout_negative) {
     CMutableTransaction mtx = GetValidTransaction();
     mtx.vout[0].nValue = -1;
@@ -512,6 +555,24 @@ TEST(checktransaction_tests, bad_txns_invalid_joinsplit_signature) {
     ContextualCheckTransaction(tx, state, 0, 100, []() { return false; });
 }
 
+TEST(checktransaction_tests, bad_txns_invalid_joinsplit_signature_deferred) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.joinSplitSig[0] += 1;
+    CTransaction tx(mtx);
+
+    // The signature check is left to ConnectBlock's proof check queue
+    CValidationState state;
+    EXPECT_TRUE(ContextualCheckTransaction(tx, state, 0, 100, []() { return false; }, false));
+
+    uint256 dataToBeSigned = SignatureHash(CScript(), tx, NOT_AN_INPUT, SIGHASH_ALL, 0,
+                                           NetworkUpgradeInfo[Consensus::BASE_SPROUT].nBranchId);
+    CProofCheck check(CProofCheck::CHECK_JOINSPLIT_SIG, tx, 0, dataToBeSigned);
+    EXPECT_FALSE(check());
+    EXPECT_EQ(check.GetRejectReason(), "bad-txns-invalid-joinsplit-signature");
+}
+
 TEST(checktransaction_tests, non_canonical_ed25519_signature) {
     SelectParams(CBaseChainParams::REGTEST);
 
@@ -18,6 +18,7 @@
 
 #include <stdexcept>
 
+#include "random.h"
 #include "utilstrencodings.h"
 #include "version.h"
 #include "serialize.h"
@@ -342,3 +343,118 @@ TEST(merkletree, testZeroElements) {
         ASSERT_TRUE(newTree.root() == oldroot);
     }
 }
+
+template<typename Tree, typename Witness, typename SubtreeCache>
+void test_append_batch(size_t nBlocks)
+{
+    Tree tree;
+    std::vector<Witness> incremental;
+    std::vector<Witness> batched;
+
+    for (size_t block = 0; block < nBlocks; block++) {
+        SubtreeCache cache(tree);
+        size_t nExisting = incremental.size();
+        std::vector<Witness> created;
+
+        int nLeaves = GetRandInt(10) == 0 ? GetRandInt(64) : GetRandInt(8);
+        for (int i = 0; i < nLeaves; i++) {
+            uint256 leaf = GetRandHash();
+            tree.append(leaf);
+            cache.append(leaf);
+            for (Witness& wit : incremental) {
+                wit.append(leaf);
+            }
+            if (GetRandInt(3) == 0) {
+                incremental.push_back(tree.witness());
+                created.push_back(cache.current().witness());
+            }
+        }
+
+        for (size_t i = 0; i < nExisting; i++) {
+            batched[i].append_batch(cache);
+        }
+        for (Witness& wit : created) {
+            wit.append_batch(cache);
+            batched.push_back(wit);
+        }
+
+        ASSERT_TRUE(cache.current() == tree);
+        ASSERT_EQ(incremental.size(), batched.size());
+        for (size_t i = 0; i < incremental.size(); i++) {
+            ASSERT_TRUE(incremental[i] == batched[i]);
+            ASSERT_TRUE(incremental[i].root() == tree.root());
+        }
+    }
+}
+
+TEST(merkletree, AppendBatchMatchesAppend) {
+    test_append_batch<SproutMerkleTree, SproutWitness, SproutSubtreeCache>(100);
+}
+
+TEST(merkletree, AppendBatchMatchesAppendSapling) {
+    test_append_batch<SaplingMerkleTree, SaplingWitness, SaplingSubtreeCache>(50);
+}
+
+template<typename Tree, typename Witness>
+void test_rewind(size_t nBlocks)
+{
+    Tree tree;
+    std::vector<Tree> frontiers;
+    // Each witness as it was after every block since it was created
+    std::vector<std::vector<Witness>> history;
+    std::vector<Witness> witnesses;
+
+    for (size_t block = 0; block < nBlocks; block++) {
+        int nLeaves = GetRandInt(10) == 0 ? GetRandInt(64) : GetRandInt(8);
+        for (int i = 0; i < nLeaves; i++) {
+            uint256 leaf = GetRandHash();
+            tree.append(leaf);
+            for (Witness& wit : witnesses) {
+                wit.append(leaf);
+            }
+            if (GetRandInt(3) == 0) {
+                witnesses.push_back(tree.witness());
+                history.emplace_back();
+            }
+        }
+        frontiers.push_back(tree);
+        for (size_t i = 0; i < witnesses.size(); i++) {
+            history[i].push_back(witnesses[i]);
+        }
+    }
+
+    for (size_t i = 0; i < witnesses.size(); i++) {
+        size_t first = nBlocks - history[i].size();
+        for (size_t block = first; block < nBlocks; block++) {
+            Witness rewound = witnesses[i];
+            ASSERT_TRUE(rewound.rewind(frontiers[block]));
+            const Witness& expected = history[i][block - first];
+            ASSERT_TRUE(rewound.root() == frontiers[block].root());
+            ASSERT_TRUE(rewound.path().authentication_path == expected.path().authentication_path);
+
+            // The rewound witness must keep working as the tree grows again
+            Witness regrown = expected;
+            for (int j = 0; j < 3; j++) {
+                uint256 leaf = GetRandHash();
+                rewound.append(leaf);
+                regrown.append(leaf);
+            }
+            ASSERT_TRUE(rewound.root() == regrown.root());
+        }
+
+        // A frontier that does not hold the witnessed leaf is rejected
+        if (first > 0 && frontiers[first - 1].size() <= witnesses[i].position()) {
+            Witness rewound = witnesses[i];
+            ASSERT_FALSE(rewound.rewind(frontiers[first - 1]));
+            ASSERT_TRUE(rewound.root() == witnesses[i].root());
+        }
+    }
+}
+
+TEST(merkletree, RewindMatchesEarlierWitness) {
+    test_rewind<SproutMerkleTree, SproutWitness>(40);
+}
+
+TEST(merkletree, RewindMatchesEarlierWitnessSapling) {
+    test_rewind<SaplingMerkleTree, SaplingWitness>(20);
+}
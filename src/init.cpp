@@ -37,6 +37,7 @@
 #include "sporkdb.h"
 #include "scheduler.h"
 #include "txdb.h"
+#include "txvalidationcache.h"
 #include "torcontrol.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -101,9 +102,27 @@ static AMQPNotificationInterface* pAMQPNotificationInterface = NULL;
 // anyway.
 #define MIN_CORE_FILEDESCRIPTORS 0
 #else
-#define MIN_CORE_FILEDESCRIPTORS 150
+// Block and undo files, debug.log and the wallet. The files LevelDB keeps
+// open are added by GetCoreFileDescriptors().
+#define MIN_CORE_FILEDESCRIPTORS 50
 #endif
 
+/** File descriptors needed besides the ones for connections */
+static int GetCoreFileDescriptors()
+{
+#ifdef WIN32
+    return MIN_CORE_FILEDESCRIPTORS;
+#else
+    // Unknown profile names fail startup later on
+    const CDBProfile* chainstate = GetDBProfile(GetArg("-chainstatedbprofile", DBPROFILE_CHAINSTATE.name));
+    const CDBProfile* blockindex = GetDBProfile(GetArg("-blockindexdbprofile", DBPROFILE_BLOCK_INDEX.name));
+    return MIN_CORE_FILEDESCRIPTORS +
+           (chainstate ? chainstate : &DBPROFILE_CHAINSTATE)->nMaxOpenFiles +
+           (blockindex ? blockindex : &DBPROFILE_BLOCK_INDEX)->nMaxOpenFiles +
+           DBPROFILE_SMALL.nMaxOpenFiles; // sporks
+#endif
+}
+
 /** Used to pass flags to the Bind() function */
 enum BindFlags {
     BF_NONE         = 0,
@@ -243,6 +262,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsWriter;
+        pcoinsWriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -353,6 +374,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("This help message"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write the chainstate to disk on a background thread while blocks are connected (default: %u)"), DEFAULT_BACKGROUND_FLUSH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288));
     strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3));
@@ -366,10 +388,12 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-fastindexload", strprintf(_("Trust block index entries whose proof of work was checked at an earlier start (default: %u)"), DEFAULT_FAST_INDEX_LOAD));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxrelaycache=<n>", strprintf(_("Keep up to <n> megabytes of recently relayed transactions in memory for serving them to peers (default: %u)"), DEFAULT_MAX_RELAY_CACHE_SIZE));
     strUsage += HelpMessageOpt("-mempooltxinputlimit=<n>", _("[DEPRECATED FROM OVERWINTER] Set the maximum number of transparent inputs in a transaction that the mempool will accept (default: 0 = no limit applied)"));
-    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script and proof verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "vidulumd.pid"));
@@ -377,7 +401,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet support and is incompatible with -txindex. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+    strUsage += HelpMessageOpt("-rawblockcache=<n>", strprintf(_("Keep up to <n> megabytes of recent serialized blocks in memory for serving them to peers (default: %u)"), DEFAULT_RAW_BLOCK_CACHE_SIZE));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files on startup"));
+    strUsage += HelpMessageOpt("-reindexthreads=<n>", strprintf(_("Read and check block files on <n> threads during -reindex (0 to %d, 0 = one file at a time, default: %d)"),
+        MAX_REINDEX_THREADS, DEFAULT_REINDEX_THREADS));
 #if !defined(WIN32)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
@@ -403,6 +430,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), DEFAULT_MAX_PEER_CONNECTIONS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
+    strUsage += HelpMessageOpt("-msgworkers=<n>", strprintf(_("Number of threads handling pings, addresses and other messages that need no block or transaction processing (0-%d, 0 = handle all messages on one thread, default: %d)"), MAX_MESSAGE_WORKERS, DEFAULT_MESSAGE_WORKERS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -413,6 +442,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), 1));
     strUsage += HelpMessageOpt("-seednode=<ip>", _("Connect to a node to retrieve peer addresses, and disconnect"));
+    strUsage += HelpMessageOpt("-socketevents=<mode>", strprintf(_("Wait for socket events with <mode>, epoll (Linux only, no connection limit from FD_SETSIZE) or select (default: %s)"), GetDefaultSocketEventsMode()));
     strUsage += HelpMessageOpt("-timeout=<n>", strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT));
     strUsage += HelpMessageOpt("-torcontrol=<ip>:<port>", strprintf(_("Tor control port to use if onion listening enabled (default: %s)"), DEFAULT_TOR_CONTROL));
     strUsage += HelpMessageOpt("-torpassword=<pass>", _("Tor control port password (default: empty)"));
@@ -430,6 +460,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
         CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-saplingdecryptthreads=<n>", strprintf(_("Set the number of threads used to trial-decrypt Sapling outputs (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
+        -GetNumCores(), MAX_SAPLING_DECRYPT_THREADS, DEFAULT_SAPLING_DECRYPT_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), 1));
@@ -465,6 +497,8 @@ std::string HelpMessage(HelpMessageMode mode)
     if (showDebug)
     {
         strUsage += HelpMessageOpt("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", 1));
+        strUsage += HelpMessageOpt("-blockindexdbprofile=<name>", strprintf("LevelDB settings for the block index and address, spent and timestamp indexes (%s; default: %s)", GetDBProfileNames(), DBPROFILE_BLOCK_INDEX.name));
+        strUsage += HelpMessageOpt("-chainstatedbprofile=<name>", strprintf("LevelDB settings for the chainstate database (%s; default: %s)", GetDBProfileNames(), DBPROFILE_CHAINSTATE.name));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)", 100));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", 0));
         strUsage += HelpMessageOpt("-testsafemode", strprintf("Force safe mode (default: %u)", 0));
@@ -497,7 +531,8 @@ std::string HelpMessage(HelpMessageMode mode)
     {
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", 0));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> entries (default: %u)", 50000));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> entries (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-txvalidationcachesize=<n>", strprintf("Limit the number of mempool-validated transactions remembered for block validation to <n> (default: %u)", DEFAULT_TX_VALIDATION_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for relaying (default: %s)"),
@@ -645,17 +680,25 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
+        int nReindexThreads = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+        if (nReindexThreads > 0) {
+            // A failed reindex has shut the node down; leave the flag set so
+            // the next start reindexes again
+            if (!ReindexBlockFiles(std::min(nReindexThreads, MAX_REINDEX_THREADS)))
+                return;
+        } else {
+            int nFile = 0;
+            while (true) {
+                CDiskBlockPos pos(nFile, 0);
+                if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                    break; // No block files left to reindex
+                FILE *file = OpenBlockFile(pos, true);
+                if (!file)
+                    break; // This error is logged in OpenBlockFile
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+                LoadExternalBlockFile(file, &pos);
+                nFile++;
+            }
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -946,15 +989,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         if (SoftSetArg("-swifttxdepth", 0))
             LogPrintf("AppInit2 : parameter interaction: -enableswifttx=false -> setting -nSwiftTXDepth=0\n");
     }
+    std::string strSocketEvents = GetArg("-socketevents", GetDefaultSocketEventsMode());
+    if (!SetSocketEventsMode(strSocketEvents))
+        return InitError(strprintf(_("Unsupported -socketevents mode: '%s'"), strSocketEvents));
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
-    int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
-    if (nFD < MIN_CORE_FILEDESCRIPTORS)
+    int nCoreFD = GetCoreFileDescriptors();
+    // select() only handles sockets below FD_SETSIZE
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - nCoreFD));
+    nMaxConnections = std::max(nMaxConnections, 0);
+    int nFD = RaiseFileDescriptorLimit(nMaxConnections + nCoreFD);
+    if (nFD < nCoreFD)
         return InitError(_("Not enough file descriptors available."));
-    if (nFD - MIN_CORE_FILEDESCRIPTORS < nMaxConnections)
-        nMaxConnections = nFD - MIN_CORE_FILEDESCRIPTORS;
+    if (nFD - nCoreFD < nMaxConnections)
+        nMaxConnections = nFD - nCoreFD;
 
     // if using block pruning, then disable txindex
     // also disable the wallet (for now, until SPV support is implemented in wallet)
@@ -1018,6 +1069,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nMessageWorkers = GetArg("-msgworkers", DEFAULT_MESSAGE_WORKERS);
+    if (nMessageWorkers < 0)
+        nMessageWorkers = 0;
+    else if (nMessageWorkers > MAX_MESSAGE_WORKERS)
+        nMessageWorkers = MAX_MESSAGE_WORKERS;
+
     fServer = GetBoolArg("-server", false);
 
     // block pruning; get the amount of disk space (in MB) to allot for block & undo files
@@ -1104,6 +1161,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         return InitError(strprintf(_("Invalid value for -expiryDelta='%u' (must be least %u)"), expiryDelta, minExpiryDelta));
     }
     bSpendZeroConfChange = GetBoolArg("-spendzeroconfchange", true);
+    nSaplingDecryptThreads = GetArg("-saplingdecryptthreads", DEFAULT_SAPLING_DECRYPT_THREADS);
+    if (nSaplingDecryptThreads <= 0)
+        nSaplingDecryptThreads += GetNumCores();
+    if (nSaplingDecryptThreads < 1)
+        nSaplingDecryptThreads = 1;
+    else if (nSaplingDecryptThreads > MAX_SAPLING_DECRYPT_THREADS)
+        nSaplingDecryptThreads = MAX_SAPLING_DECRYPT_THREADS;
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", false);
 
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
@@ -1231,12 +1295,22 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %u threads for script, proof and header verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadProofCheck);
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        }
     }
 
+#ifdef ENABLE_WALLET
+    if (!fDisableWallet) {
+        for (int i = 0; i < nSaplingDecryptThreads - 1; i++)
+            threadGroup.create_thread(&ThreadSaplingDecrypt);
+    }
+#endif
+
     if (mapArgs.count("-sporkkey")) // spork priv key
     {
         if (!sporkManager.SetPrivKey(GetArg("-sporkkey", "")))
@@ -1420,6 +1494,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
 
+    if (mapArgs.count("-maxuploadtarget")) {
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET)*1024*1024);
+    }
+
     bool fBound = false;
     if (fListen) {
         if (mapArgs.count("-bind") || mapArgs.count("-whitebind")) {
@@ -1514,6 +1592,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    if (!GetDBProfile(GetArg("-chainstatedbprofile", DBPROFILE_CHAINSTATE.name)))
+        return InitError(strprintf(_("Unknown database profile '%s' (available: %s)"), GetArg("-chainstatedbprofile", ""), GetDBProfileNames()));
+    if (!GetDBProfile(GetArg("-blockindexdbprofile", DBPROFILE_BLOCK_INDEX.name)))
+        return InitError(strprintf(_("Unknown database profile '%s' (available: %s)"), GetArg("-blockindexdbprofile", ""), GetDBProfileNames()));
+
     // cache size calculations
     int64_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
@@ -1529,6 +1612,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
+    int64_t nRawBlockCache = std::max((int64_t)0, GetArg("-rawblockcache", DEFAULT_RAW_BLOCK_CACHE_SIZE)) << 20;
+    rawBlockCache.SetMaxBytes(nRawBlockCache);
+    LogPrintf("* Using %.1fMiB for serialized blocks served to peers\n", nRawBlockCache * (1.0 / 1024 / 1024));
+    int64_t nRelayCache = std::max((int64_t)0, GetArg("-maxrelaycache", DEFAULT_MAX_RELAY_CACHE_SIZE)) << 20;
+    relayCache.SetMaxBytes(nRelayCache);
+    LogPrintf("* Using %.1fMiB for relayed transactions served to peers\n", nRelayCache * (1.0 / 1024 / 1024));
 
     bool clearWitnessCaches = false;
 
@@ -1544,16 +1633,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinsWriter;
+                delete pcoinsdbview;
                 delete pblocktree;
                 delete pSporkDB;
 
                 pSporkDB = new CSporkDB(0, false, false);
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                pcoinsWriter = NULL;
+                if (GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH))
+                    pcoinsWriter = new CCoinsViewBackgroundFlush(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsWriter ? (CCoinsView*)pcoinsWriter : pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(pcoinscatcher, true);
 
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
@@ -1772,7 +1865,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            if (pwalletMain->ScanForWalletTransactions(pindexRescan, true) < 0)
+                return InitError(_("Failed to rescan the wallet: a block could not be read from disk. You may need to rebuild the database using -reindex."));
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(chainActive.GetLocator());
             nWalletDBUpdated++;
@@ -11,11 +11,13 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "deprecation.h"
 #include "init.h"
 #include "masternode-budget.h"
@@ -31,6 +33,7 @@
 #include "swifttx.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txvalidationcache.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -42,6 +45,8 @@
 
 #include <algorithm>
 #include <atomic>
+#include <list>
+#include <memory>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -99,6 +104,9 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
 CTxMemPool mempool(::minRelayTxFee);
 
+/** Transactions whose scripts and proofs passed when accepted to the mempool */
+static CTxValidationCache txValidationCache;
+
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
@@ -154,6 +162,8 @@ namespace {
     set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
     /** Number of nodes with fSyncStarted. */
     int nSyncStarted = 0;
+    /** Set when a peer with a header sync getheaders outstanding went away, so another sync peer takes over. */
+    bool fHeadersRequestLost = false;
     /** All pairs A->B, where A (or one if its ancestors) misses transactions, but B has transactions.
       * Pruned nodes may have entries where B is missing data.
       */
@@ -222,6 +232,16 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /** Peers we asked to push new blocks to us as compact blocks, least recently useful first. Protected by cs_main. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /**
+     * The compact block for the most recent block we built one for, shared by
+     * every peer it is sent to. Protected by cs_main.
+     */
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pMostRecentCompactBlock;
+    uint256 hashMostRecentCompactBlock;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -269,6 +289,12 @@ struct CNodeState {
     CBlockIndex *pindexLastCommonBlock;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! Since when a header sync getheaders to this peer is outstanding (in seconds), or 0.
+    int64_t nHeadersRequestTime;
+    //! When this peer was last sent a header sync getheaders (in microseconds).
+    int64_t nLastHeadersRequest;
+    //! Number of headers messages in a row from this peer that did not connect to our block index.
+    int nUnconnectingHeaders;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
@@ -276,6 +302,13 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer understands our version of compact blocks.
+    bool fSupportsDesiredCmpctVersion;
+    //! Whether this peer wants new blocks pushed as compact blocks instead of announced by inv.
+    bool fPreferHeaderAndIDs;
+    //! The compact block this peer sent us that still awaits its "blocktxn", if any.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+    uint256 hashPartialBlock;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -285,10 +318,15 @@ struct CNodeState {
         hashLastUnknownBlock.SetNull();
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
+        nHeadersRequestTime = 0;
+        nLastHeadersRequest = 0;
+        nUnconnectingHeaders = 0;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fSupportsDesiredCmpctVersion = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -338,6 +376,8 @@ void FinalizeNode(NodeId nodeid) {
 
     if (state->fSyncStarted)
         nSyncStarted--;
+    if (state->nHeadersRequestTime)
+        fHeadersRequestLost = true;
 
     if (state->nMisbehavior == 0 && state->fCurrentlyConnected) {
         AddressCurrentlyConnected(state->address);
@@ -347,6 +387,7 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -357,6 +398,8 @@ bool MarkBlockAsReceived(const uint256& hash) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (state->partialBlock && state->hashPartialBlock == hash)
+            state->partialBlock.reset();
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -385,6 +428,17 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+// Requires cs_main.
+// A compact block we requested from pfrom but will not reconstruct is asked
+// for in full, rather than left in flight until the download times out.
+void RequestFullBlockIfInFlight(CNode* pfrom, const uint256& hash) {
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId()) {
+        vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+        pfrom->PushMessage("getdata", vInv);
+    }
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -418,6 +472,49 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+/**
+ * Ask a peer that supports compact blocks to push new blocks to us as
+ * "cmpctblock" without waiting for our getdata. At most
+ * MAX_HB_CMPCTBLOCK_PEERS peers are in this mode; the one that least
+ * recently gave us a useful block is switched back to announcing by inv.
+ * Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fSupportsDesiredCmpctVersion)
+        return;
+
+    NodeId nodeid = pfrom->GetId();
+    list<NodeId>::iterator it = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), nodeid);
+    if (it != lNodesAnnouncingHeaderAndIDs.end()) {
+        lNodesAnnouncingHeaderAndIDs.splice(lNodesAnnouncingHeaderAndIDs.end(), lNodesAnnouncingHeaderAndIDs, it);
+        return;
+    }
+
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCTBLOCK_PEERS) {
+        NodeId nodeidOld = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeidOld) {
+                pnode->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+}
+
+/** Returns the compact block for a block, reusing the one built last if it is the same. Requires cs_main. */
+std::shared_ptr<const CBlockHeaderAndShortTxIDs> GetCompactBlock(const CBlock& block) {
+    uint256 hash = block.GetHash();
+    if (!pMostRecentCompactBlock || hashMostRecentCompactBlock != hash) {
+        pMostRecentCompactBlock = std::make_shared<const CBlockHeaderAndShortTxIDs>(block);
+        hashMostRecentCompactBlock = hash;
+    }
+    return pMostRecentCompactBlock;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -575,9 +672,61 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewBackgroundFlush *pcoinsWriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
+namespace {
+    /**
+     * Solutions of trimmed block index entries loaded back from the block
+     * tree DB, least recently used first, so that peers syncing the same
+     * headers do not each go to disk.
+     */
+    typedef std::list<std::pair<uint256, std::vector<unsigned char> > > SolutionCache;
+    CCriticalSection cs_solutionCache;
+    SolutionCache listSolutionCache;
+    std::map<uint256, SolutionCache::iterator> mapSolutionCache;
+
+    /** Loads the solution of a trimmed entry. Does not need cs_main. */
+    bool LoadBlockSolution(const uint256& hash, std::vector<unsigned char>& nSolution)
+    {
+        {
+            LOCK(cs_solutionCache);
+            std::map<uint256, SolutionCache::iterator>::iterator it = mapSolutionCache.find(hash);
+            if (it != mapSolutionCache.end()) {
+                listSolutionCache.splice(listSolutionCache.end(), listSolutionCache, it->second);
+                nSolution = it->second->second;
+                return true;
+            }
+        }
+
+        if (!pblocktree->ReadBlockSolution(hash, nSolution))
+            return false;
+
+        LOCK(cs_solutionCache);
+        if (mapSolutionCache.count(hash))
+            return true;
+        mapSolutionCache[hash] = listSolutionCache.insert(listSolutionCache.end(), std::make_pair(hash, nSolution));
+        if (listSolutionCache.size() > SOLUTION_CACHE_SIZE) {
+            mapSolutionCache.erase(listSolutionCache.front().first);
+            listSolutionCache.pop_front();
+        }
+        return true;
+    }
+} // anon namespace
+
+CBlockHeader CBlockIndex::GetBlockHeader() const
+{
+    CBlockHeader block;
+    if (GetBlockHeaderInMemory(block))
+        return block;
+
+    AssertLockHeld(cs_main);
+    if (!LoadBlockSolution(GetBlockHash(), block.nSolution))
+        throw std::runtime_error(strprintf("%s: failed to read solution of block %s", __func__, GetBlockHash().ToString()));
+    return block;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -897,13 +1046,16 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
  * 2. ProcessNewBlock calls AcceptBlock, which calls CheckBlock (which calls CheckTransaction)
  *    and ContextualCheckBlock (which calls this function).
  * 3. The isInitBlockDownload argument is only to assist with testing.
+ * 4. ContextualCheckBlock skips the joinSplitSig and Sapling checks;
+ *    ConnectBlock verifies them on the proof check queue.
  */
 bool ContextualCheckTransaction(
         const CTransaction& tx,
         CValidationState &state,
         const int nHeight,
         const int dosLevel,
-        bool (*isInitBlockDownload)())
+        bool (*isInitBlockDownload)(),
+        bool fCheckShieldedProofs)
 {
     bool overwinterActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_OVERWINTER);
     bool saplingActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING);
@@ -989,9 +1141,10 @@ bool ContextualCheckTransaction(
 
     uint256 dataToBeSigned;
 
-    if (!tx.vjoinsplit.empty() ||
-        !tx.vShieldedSpend.empty() ||
-        !tx.vShieldedOutput.empty())
+    if (fCheckShieldedProofs &&
+        (!tx.vjoinsplit.empty() ||
+         !tx.vShieldedSpend.empty() ||
+         !tx.vShieldedOutput.empty()))
     {
         auto consensusBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
         // Empty output script.
@@ -1004,7 +1157,7 @@ bool ContextualCheckTransaction(
         }
     }
 
-    if (!tx.vjoinsplit.empty())
+    if (fCheckShieldedProofs && !tx.vjoinsplit.empty())
     {
         BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
 
@@ -1020,57 +1173,15 @@ bool ContextualCheckTransaction(
         }
     }
 
-    if (!tx.vShieldedSpend.empty() ||
-        !tx.vShieldedOutput.empty())
+    if (fCheckShieldedProofs &&
+        (!tx.vShieldedSpend.empty() ||
+         !tx.vShieldedOutput.empty()))
     {
-        auto ctx = librustzcash_sapling_verification_ctx_init();
-
-        for (const SpendDescription &spend : tx.vShieldedSpend) {
-            if (!librustzcash_sapling_check_spend(
-                ctx,
-                spend.cv.begin(),
-                spend.anchor.begin(),
-                spend.nullifier.begin(),
-                spend.rk.begin(),
-                spend.zkproof.begin(),
-                spend.spendAuthSig.begin(),
-                dataToBeSigned.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
-            }
-        }
-
-        for (const OutputDescription &output : tx.vShieldedOutput) {
-            if (!librustzcash_sapling_check_output(
-                ctx,
-                output.cv.begin(),
-                output.cm.begin(),
-                output.ephemeralKey.begin(),
-                output.zkproof.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
-            }
+        CSaplingCheck check(tx, dataToBeSigned);
+        if (!check()) {
+            return state.DoS(100, error("ContextualCheckTransaction(): %s", check.GetError()),
+                                  REJECT_INVALID, check.GetRejectReason());
         }
-
-        if (!librustzcash_sapling_final_check(
-            ctx,
-            tx.valueBalance,
-            tx.bindingSig.begin(),
-            dataToBeSigned.begin()
-        ))
-        {
-            librustzcash_sapling_verification_ctx_free(ctx);
-            return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
-                                  REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
-        }
-
-        librustzcash_sapling_verification_ctx_free(ctx);
     }
     return true;
 }
@@ -1672,6 +1783,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Scripts, JoinSplits and Sapling descriptions have all been verified
+        // for the next block's branch; ConnectBlock need not do so again.
+        txValidationCache.Set(hash, consensusBranchId, STANDARD_SCRIPT_VERIFY_FLAGS, CTxValidationCache::CHECK_ALL);
+
         // Store transaction in memory
         pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
 
@@ -2029,21 +2144,127 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::M
     return true;
 }
 
+namespace {
+
+/** A block file mapped read-only into memory, unmapped when the last reference is dropped */
+struct CMappedBlockFile
+{
+    const unsigned char* const pData;
+    const size_t nSize;
+
+    CMappedBlockFile(const unsigned char* pDataIn, size_t nSizeIn) : pData(pDataIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile() { UnmapFile(pData, nSize); }
+};
+typedef std::shared_ptr<const CMappedBlockFile> MappedBlockFileRef;
+
+CCriticalSection cs_mappedBlockFiles;
+/** Mapped block files by file number, most recently used first */
+std::list<std::pair<int, MappedBlockFileRef> > listMappedBlockFiles;
+
+} // anon namespace
+
+/**
+ * Return a mapping of block file nFile. Only files no longer written to are
+ * mapped; returns NULL for the others or if mapping fails.
+ */
+static MappedBlockFileRef GetMappedBlockFile(int nFile)
+{
+    // A 32-bit address space cannot hold several block files
+    if (sizeof(void*) < 8)
+        return MappedBlockFileRef();
+    {
+        LOCK(cs_LastBlockFile);
+        if (nFile >= nLastBlockFile)
+            return MappedBlockFileRef();
+    }
+
+    LOCK(cs_mappedBlockFiles);
+    for (std::list<std::pair<int, MappedBlockFileRef> >::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it) {
+        if (it->first == nFile) {
+            listMappedBlockFiles.splice(listMappedBlockFiles.begin(), listMappedBlockFiles, it);
+            return it->second;
+        }
+    }
+
+    FILE* file = OpenBlockFile(CDiskBlockPos(nFile, 0), true);
+    if (!file)
+        return MappedBlockFileRef();
+    size_t nSize = 0;
+    const unsigned char* pData = MapFileReadOnly(file, nSize);
+    fclose(file);
+    if (!pData)
+        return MappedBlockFileRef();
+
+    MappedBlockFileRef mapped = std::make_shared<const CMappedBlockFile>(pData, nSize);
+    listMappedBlockFiles.push_front(std::make_pair(nFile, mapped));
+    if (listMappedBlockFiles.size() > MAX_MAPPED_BLOCK_FILES)
+        listMappedBlockFiles.pop_back();
+    return mapped;
+}
+
+/** Drop the mappings of the given block files, or of all of them if pFiles is NULL. */
+static void UnmapBlockFiles(const std::set<int>* pFiles)
+{
+    LOCK(cs_mappedBlockFiles);
+    for (std::list<std::pair<int, MappedBlockFileRef> >::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end();) {
+        if (!pFiles || pFiles->count(it->first))
+            it = listMappedBlockFiles.erase(it);
+        else
+            ++it;
+    }
+}
+
+/**
+ * Find the block stored at pos in a mapped block file. Returns false if the
+ * file is not mapped or the record around pos does not look like a block, in
+ * which case it should be read through OpenBlockFile.
+ */
+static bool GetMappedBlock(const CDiskBlockPos& pos, MappedBlockFileRef& mapped, const unsigned char*& pBlock, unsigned int& nBlockSize)
+{
+    mapped = GetMappedBlockFile(pos.nFile);
+    if (!mapped)
+        return false;
+    // Each block is preceded by the network magic and its size
+    if (pos.nPos < 8 || pos.nPos > mapped->nSize)
+        return false;
+    const unsigned char* pHeader = mapped->pData + pos.nPos - 8;
+    if (memcmp(pHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return false;
+    nBlockSize = ReadLE32(pHeader + 4);
+    if (nBlockSize > mapped->nSize - pos.nPos)
+        return false;
+    pBlock = mapped->pData + pos.nPos;
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    MappedBlockFileRef mapped;
+    const unsigned char* pBlock;
+    unsigned int nBlockSize;
+    if (GetMappedBlock(pos, mapped, pBlock, nBlockSize)) {
+        try {
+            CBufferReader reader(pBlock, nBlockSize, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check the header
@@ -2064,6 +2285,117 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+CRawBlockCache rawBlockCache(DEFAULT_RAW_BLOCK_CACHE_SIZE << 20);
+
+CRawBlockCache::CRawBlockCache(size_t nMaxBytesIn) : nMaxBytes(nMaxBytesIn), nBytes(0), nHits(0), nMisses(0), nBytesSaved(0)
+{
+}
+
+void CRawBlockCache::Trim()
+{
+    while (nBytes > nMaxBytes) {
+        nBytes -= listBlocks.back().second->size();
+        mapBlocks.erase(listBlocks.back().first);
+        listBlocks.pop_back();
+    }
+}
+
+CRawBlockCache::RawBlockRef CRawBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, std::list<std::pair<uint256, RawBlockRef> >::iterator>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end()) {
+        nMisses++;
+        return RawBlockRef();
+    }
+    listBlocks.splice(listBlocks.begin(), listBlocks, it->second);
+    nHits++;
+    nBytesSaved += it->second->second->size();
+    return it->second->second;
+}
+
+void CRawBlockCache::Insert(const uint256& hash, const RawBlockRef& block)
+{
+    LOCK(cs);
+    if (block->size() > nMaxBytes || mapBlocks.count(hash))
+        return;
+    listBlocks.push_front(std::make_pair(hash, block));
+    mapBlocks[hash] = listBlocks.begin();
+    nBytes += block->size();
+    Trim();
+}
+
+void CRawBlockCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+void CRawBlockCache::Clear()
+{
+    LOCK(cs);
+    listBlocks.clear();
+    mapBlocks.clear();
+    nBytes = 0;
+}
+
+void CRawBlockCache::GetStats(CRawBlockCacheStats& stats) const
+{
+    LOCK(cs);
+    stats.nHits = nHits;
+    stats.nMisses = nMisses;
+    stats.nBytesSaved = nBytesSaved;
+    stats.nBlocks = listBlocks.size();
+    stats.nBytes = nBytes;
+    stats.nMaxBytes = nMaxBytes;
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vBlock, const CBlockIndex* pindex)
+{
+    const CDiskBlockPos pos = pindex->GetBlockPos();
+    vBlock.clear();
+
+    MappedBlockFileRef mapped;
+    const unsigned char* pBlock;
+    unsigned int nBlockSize;
+    if (GetMappedBlock(pos, mapped, pBlock, nBlockSize)) {
+        vBlock.assign(pBlock, pBlock + nBlockSize);
+    } else {
+        if (pos.nPos < 4)
+            return error("%s: invalid position %s", __func__, pos.ToString());
+        // Open history file at the block size that precedes the block
+        CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 4), true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+        try {
+            unsigned int nSize;
+            filein >> nSize;
+            if (nSize > MAX_BLOCK_SIZE_AFTER_UPGRADE)
+                return error("%s: invalid block size %u at %s", __func__, nSize, pos.ToString());
+            vBlock.resize(nSize);
+            if (nSize > 0)
+                filein.read((char*)&vBlock[0], nSize);
+        }
+        catch (const std::exception& e) {
+            return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    }
+
+    // Check that the bytes are the block we expect by hashing its header
+    CBlockHeader header;
+    try {
+        CBufferReader reader(vBlock.empty() ? NULL : &vBlock[0], vBlock.size(), SER_DISK, CLIENT_VERSION);
+        reader >> header;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("%s: GetHash() doesn't match index for %s at %s", __func__, pindex->ToString(), pos.ToString());
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy;
@@ -2316,6 +2648,126 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CSaplingCheck::operator()() {
+    auto ctx = librustzcash_sapling_verification_ctx_init();
+
+    for (const SpendDescription &spend : ptxTo->vShieldedSpend) {
+        if (!librustzcash_sapling_check_spend(
+            ctx,
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
+            dataToBeSigned.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strError = "Sapling spend description invalid";
+            strRejectReason = "bad-txns-sapling-spend-description-invalid";
+            return false;
+        }
+    }
+
+    for (const OutputDescription &output : ptxTo->vShieldedOutput) {
+        if (!librustzcash_sapling_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cm.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strError = "Sapling output description invalid";
+            strRejectReason = "bad-txns-sapling-output-description-invalid";
+            return false;
+        }
+    }
+
+    if (!librustzcash_sapling_final_check(
+        ctx,
+        ptxTo->valueBalance,
+        ptxTo->bindingSig.begin(),
+        dataToBeSigned.begin()
+    ))
+    {
+        librustzcash_sapling_verification_ctx_free(ctx);
+        strError = "Sapling binding signature invalid";
+        strRejectReason = "bad-txns-sapling-binding-signature-invalid";
+        return false;
+    }
+
+    librustzcash_sapling_verification_ctx_free(ctx);
+    return true;
+}
+
+bool CProofCheck::operator()() {
+    switch (type) {
+    case CHECK_JOINSPLIT_PROOF: {
+        auto verifier = libzcash::ProofVerifier::Strict();
+        if (!ptxTo->vjoinsplit[nJoinSplit].Verify(*pvidulumParams, verifier, ptxTo->joinSplitPubKey)) {
+            strError = strprintf("joinsplit %u does not verify", nJoinSplit);
+            strRejectReason = "bad-txns-joinsplit-verification-failed";
+        }
+        break;
+    }
+    case CHECK_JOINSPLIT_SIG:
+        // We rely on libsodium to check that the signature is canonical.
+        if (crypto_sign_verify_detached(&ptxTo->joinSplitSig[0],
+                                        dataToBeSigned.begin(), 32,
+                                        ptxTo->joinSplitPubKey.begin()
+                                        ) != 0) {
+            strError = "invalid joinsplit signature";
+            strRejectReason = "bad-txns-invalid-joinsplit-signature";
+        }
+        break;
+    case CHECK_SAPLING: {
+        CSaplingCheck check(*ptxTo, dataToBeSigned);
+        if (!check()) {
+            strError = check.GetError();
+            strRejectReason = check.GetRejectReason();
+        }
+        break;
+    }
+    case CHECK_NONE:
+        break;
+    }
+    if (!strRejectReason.empty()) {
+        if (pfailure)
+            pfailure->Record(*this);
+        return ::error("CProofCheck(): %s: %s", ptxTo->GetHash().ToString(), strError);
+    }
+    return true;
+}
+
+void CProofCheckFailure::Record(const CProofCheck& check)
+{
+    LOCK(cs);
+    if (!strRejectReason.empty())
+        return;
+    txid = check.GetTransaction()->GetHash();
+    strRejectReason = check.GetRejectReason();
+    strError = check.GetError();
+}
+
+bool CProofCheckFailure::Get(uint256& txidOut, std::string& strRejectReasonOut, std::string& strErrorOut) const
+{
+    LOCK(cs);
+    if (strRejectReason.empty())
+        return false;
+    txidOut = txid;
+    strRejectReasonOut = strRejectReason;
+    strErrorOut = strError;
+    return true;
+}
+
+bool CHeaderCheck::operator()() {
+    return CheckEquihashSolution(pheader, Params()) &&
+           CheckProofOfWork(pheader->GetHash(), pheader->nBits, Params().GetConsensus());
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -2774,6 +3226,20 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CProofCheck> proofcheckqueue(16);
+
+void ThreadProofCheck() {
+    RenameThread("vidulum-proofch");
+    proofcheckqueue.Thread();
+}
+
+static CCheckQueue<CHeaderCheck> headercheckqueue(8);
+
+void ThreadHeaderCheck() {
+    RenameThread("vidulum-headerch");
+    headercheckqueue.Thread();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2838,6 +3304,7 @@ void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const
 
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
+static int64_t nTimeProofVerify = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
@@ -2856,11 +3323,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in.
+    // JoinSplit proofs are verified below on the proof check queue.
+    if (!CheckBlock(block, state, disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2897,6 +3364,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CBlockUndo blockundo;
 
     CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // Only JoinSplit proofs are skipped below the last checkpoint, as CheckBlock
+    // did; signatures and Sapling proofs are always verified
+    CCheckQueueControl<CProofCheck> proofControl(nScriptCheckThreads ? &proofcheckqueue : NULL);
+    CProofCheckFailure proofFailure;
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
@@ -2936,6 +3407,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+
+    // JoinSplit proofs and signatures, Sapling proofs and binding signatures
+    // are handed to the proof check queue. Without worker threads they are
+    // collected for the whole block and verified once all cheaper checks
+    // have passed.
+    std::vector<CProofCheck> vProofChecks;
+    unsigned int nJoinSplits = 0;
+    unsigned int nSaplingSpends = 0;
+    unsigned int nSaplingOutputs = 0;
+    unsigned int nCachedTxs = 0;
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -3004,14 +3485,55 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                  REJECT_INVALID, "bad-blk-sigops");
         }
 
-        txdata.emplace_back(tx);
+        // Skip the script and proof checks of transactions that were fully
+        // verified when they were accepted to the mempool.
+        bool fCachedValid = fExpensiveChecks && !tx.IsCoinBase() &&
+            txValidationCache.Get(txhash, consensusBranchId, flags, CTxValidationCache::CHECK_ALL, !fJustCheck);
+        if (fCachedValid) {
+            nCachedTxs++;
+            txdata.emplace_back();
+        } else {
+            txdata.emplace_back(tx);
+        }
+
+        if (!fCachedValid &&
+            (!tx.vjoinsplit.empty() || !tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty()))
+        {
+            // Empty output script.
+            CScript scriptCode;
+            uint256 dataToBeSigned;
+            try {
+                dataToBeSigned = SignatureHash(scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId, &txdata[i]);
+            } catch (std::logic_error ex) {
+                return state.DoS(100, error("ConnectBlock(): error computing signature hash"),
+                                 REJECT_INVALID, "error-computing-signature-hash");
+            }
+
+            std::vector<CProofCheck> vChecks;
+            if (fExpensiveChecks) {
+                for (unsigned int j = 0; j < tx.vjoinsplit.size(); j++)
+                    vChecks.push_back(CProofCheck(CProofCheck::CHECK_JOINSPLIT_PROOF, tx, j, dataToBeSigned, &proofFailure));
+                nJoinSplits += tx.vjoinsplit.size();
+            }
+            if (!tx.vjoinsplit.empty())
+                vChecks.push_back(CProofCheck(CProofCheck::CHECK_JOINSPLIT_SIG, tx, 0, dataToBeSigned, &proofFailure));
+            if (!tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty())
+                vChecks.push_back(CProofCheck(CProofCheck::CHECK_SAPLING, tx, 0, dataToBeSigned, &proofFailure));
+            nSaplingSpends += tx.vShieldedSpend.size();
+            nSaplingOutputs += tx.vShieldedOutput.size();
+
+            if (nScriptCheckThreads)
+                proofControl.Add(vChecks);
+            else
+                vProofChecks.insert(vProofChecks.end(), vChecks.begin(), vChecks.end());
+        }
 
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
-            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, false, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
+            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks && !fCachedValid, flags, false, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -3086,6 +3608,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
+    LogPrint("bench", "      - %u transactions already verified in the mempool\n", nCachedTxs);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
     if(!IsBlockValueValid(block, blockReward))
@@ -3099,6 +3622,22 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
+    BOOST_FOREACH(CProofCheck& check, vProofChecks) {
+        if (!check())
+            return state.DoS(100, error("ConnectBlock(): %s in transaction %s", check.GetError(), check.GetTransaction()->GetHash().ToString()),
+                             REJECT_INVALID, check.GetRejectReason());
+    }
+    if (!proofControl.Wait()) {
+        uint256 txid;
+        std::string strRejectReason, strError;
+        if (!proofFailure.Get(txid, strRejectReason, strError))
+            return state.DoS(100, error("ConnectBlock(): proof verification failed"), REJECT_INVALID, "bad-txns-proof-verification-failed");
+        return state.DoS(100, error("ConnectBlock(): %s in transaction %s", strError, txid.ToString()),
+                         REJECT_INVALID, strRejectReason);
+    }
+    int64_t nTimeProofs = GetTimeMicros(); nTimeProofVerify += nTimeProofs - nTime2;
+    LogPrint("bench", "    - Verify %u joinsplits, %u Sapling spends, %u Sapling outputs: %.2fms [%.2fs]\n", nJoinSplits, nSaplingSpends, nSaplingOutputs, 0.001 * (nTimeProofs - nTime2), nTimeProofVerify * 0.000001);
+
     if (fJustCheck)
         return true;
 
@@ -3174,8 +3713,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
-    int64_t nTime3 = GetTimeMicros(); nTimeIndex += nTime3 - nTime2;
-    LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
+    int64_t nTime3 = GetTimeMicros(); nTimeIndex += nTime3 - nTimeProofs;
+    LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTimeProofs), nTimeIndex * 0.000001);
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
@@ -3258,14 +3797,23 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 setDirtyFileInfo.erase(it++);
             }
             std::vector<const CBlockIndex*> vBlocks;
+            std::vector<CBlockIndex*> vWritten;
             vBlocks.reserve(setDirtyBlockIndex.size());
+            vWritten.reserve(setDirtyBlockIndex.size());
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
                 vBlocks.push_back(*it);
+                vWritten.push_back(*it);
                 setDirtyBlockIndex.erase(it++);
             }
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            // The solutions are on disk now. Entries that may still change
+            // keep theirs, so rewriting them needs no read of the old entry.
+            BOOST_FOREACH(CBlockIndex* pindex, vWritten) {
+                if (pindex->IsSettled())
+                    pindex->TrimSolution();
+            }
         }
         // Finally remove any pruned files
         if (fFlushForPrune)
@@ -3284,6 +3832,10 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // With a background writer, Flush() only hands the entries over. Callers
+        // that need them on disk (shutdown, pruning) wait for the write here.
+        if (pcoinsWriter && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsWriter->WaitForFlush())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -3454,6 +4006,7 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(pindexNew->GetBlockHash());
+        CNode::RecordBlockSize(::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
@@ -3756,11 +4309,38 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainParams.Checkpoints());
+            // Peers that asked for it get the new tip pushed as a compact block right away,
+            // which saves them the getdata round-trip and the transactions they already have.
+            std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock;
+            std::set<NodeId> setCompactPeers;
+            if (pblock && pblock->GetHash() == hashNewTip) {
+                LOCK(cs_main);
+                for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+                    if (it->second.fPreferHeaderAndIDs)
+                        setCompactPeers.insert(it->first);
+                if (!setCompactPeers.empty())
+                    pcmpctblock = GetCompactBlock(*pblock);
+            }
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                CInv inv(MSG_BLOCK, hashNewTip);
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (pcmpctblock && setCompactPeers.count(pnode->GetId())) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->setInventoryKnown.count(inv);
+                        }
+                        if (!fKnown) {
+                            pnode->AddInventoryKnown(inv);
+                            pnode->PushMessage(NetMsgType::CMPCTBLOCK, *pcmpctblock);
+                        }
+                    } else {
+                        pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -4095,7 +4675,13 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
                 bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context.
-                             
+
+    // The parallel reindex checks these before handing the block over
+    if (block.fPreChecked) {
+        fCheckPOW = false;
+        fCheckMerkleRoot = false;
+    }
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -4258,8 +4844,9 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     // Check that all transactions are finalized
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
 
-        // Check transaction contextually against consensus rules at block height
-        if (!ContextualCheckTransaction(tx, state, nHeight, 100)) {
+        // Check transaction contextually against consensus rules at block height.
+        // Shielded proofs and signatures are verified in ConnectBlock.
+        if (!ContextualCheckTransaction(tx, state, nHeight, 100, IsInitialBlockDownload, false)) {
             return false; // Failure reason has been set in validation state object
         }
 
@@ -4306,7 +4893,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool fCheckPOW)
 {
     const CChainParams& chainparams = Params();
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -4326,7 +4913,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -4369,7 +4956,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     CBlockIndex *&pindex = *ppindex;
 
-    if (!AcceptBlockHeader(block, state, &pindex))
+    if (!AcceptBlockHeader(block, state, &pindex, !block.fPreChecked))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -4555,6 +5142,7 @@ void PruneOneBlockFile(const int fileNumber)
 
 void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
+    UnmapBlockFiles(&setFilesToPrune);
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
@@ -4681,8 +5269,18 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts())
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Every entry is checked before it is written, so once a start has loaded
+    // the whole index with its proof of work checked, later starts trust it
+    bool fIndexVerified = false;
+    if (GetBoolArg("-fastindexload", DEFAULT_FAST_INDEX_LOAD))
+        pblocktree->ReadFlag("verifiedblockindex", fIndexVerified);
+    if (!pblocktree->LoadBlockIndexGuts(fIndexVerified))
         return false;
+    if (!fIndexVerified)
+        pblocktree->WriteFlag("verifiedblockindex", true);
+    int64_t nTimeGuts = GetTimeMicros();
 
     boost::this_thread::interruption_point();
 
@@ -4750,6 +5348,8 @@ bool static LoadBlockIndexDB()
             pindexBestHeader = pindex;
     }
 
+    int64_t nTimeChainWork = GetTimeMicros();
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -4784,6 +5384,7 @@ bool static LoadBlockIndexDB()
             return false;
         }
     }
+    int64_t nTimeFiles = GetTimeMicros();
 
     // Check whether we have ever pruned block & undo files
     pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
@@ -4825,6 +5426,11 @@ bool static LoadBlockIndexDB()
         }
     }
 
+    int64_t nTimeEnd = GetTimeMicros();
+    LogPrintf("%s: loaded %u entries in %.2fms: entries %.2fms, chain work %.2fms, block files %.2fms, in-memory data %.2fms\n", __func__,
+        mapBlockIndex.size(), (nTimeEnd - nTimeStart) * 0.001, (nTimeGuts - nTimeStart) * 0.001,
+        (nTimeChainWork - nTimeGuts) * 0.001, (nTimeFiles - nTimeChainWork) * 0.001, (nTimeEnd - nTimeFiles) * 0.001);
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -5104,6 +5710,7 @@ void UnloadBlockIndex()
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
+    UnmapBlockFiles(NULL);
     nBlockSequenceId = 1;
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
@@ -5290,6 +5897,246 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+namespace {
+
+/** A block read from a block file by the parallel reindex */
+struct CReindexBlock
+{
+    CBlock block;
+    uint256 hash;
+    CDiskBlockPos pos;
+};
+typedef std::shared_ptr<CReindexBlock> CReindexBlockRef;
+
+/** A block file as handed over by a reindex reader thread */
+struct CReindexFile
+{
+    bool fFound;
+    bool fFailed;
+    std::vector<CReindexBlockRef> vBlocks;
+
+    CReindexFile() : fFound(false), fFailed(false) {}
+};
+
+/**
+ * Read and deserialize every block in blk<nFile>.dat. The Equihash solution,
+ * proof of work and merkle root do not depend on the chain, so they are
+ * checked here rather than on the thread connecting the blocks. Returns false
+ * once there are no block files left, and throws if the file cannot be read.
+ */
+bool ReadBlockFileForReindex(int nFile, std::vector<CReindexBlockRef>& vBlocks)
+{
+    const CChainParams& chainparams = Params();
+    CDiskBlockPos pos(nFile, 0);
+    if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+        return false; // No block files left to reindex
+    FILE* file = OpenBlockFile(pos, true);
+    if (!file)
+        return false; // This error is logged in OpenBlockFile
+
+    // This takes over file and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(file, 2*MAX_BLOCK_SIZE(90000000), MAX_BLOCK_SIZE(90000000)+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE(90000000))
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            CReindexBlockRef pblock = std::make_shared<CReindexBlock>();
+            blkdat >> pblock->block;
+            nRewind = blkdat.GetPos();
+            pblock->hash = pblock->block.GetHash();
+            pblock->pos = CDiskBlockPos(nFile, nBlockPos);
+
+            // Blocks failing these are left for CheckBlock to reject
+            bool fMutated;
+            pblock->block.fPreChecked =
+                CheckEquihashSolution(&pblock->block, chainparams) &&
+                CheckProofOfWork(pblock->hash, pblock->block.nBits, chainparams.GetConsensus()) &&
+                pblock->block.BuildMerkleTree(&fMutated) == pblock->block.hashMerkleRoot && !fMutated;
+            vBlocks.push_back(pblock);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+/** Pass a reindexed block on to ProcessNewBlock unless it was processed before */
+bool ProcessReindexBlock(CReindexBlock& reindexBlock, int& nLoaded)
+{
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(reindexBlock.hash);
+        if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+            return true;
+    }
+    CValidationState state;
+    if (ProcessNewBlock(state, NULL, &reindexBlock.block, true, &reindexBlock.pos))
+        nLoaded++;
+    return !state.IsError();
+}
+
+} // anon namespace
+
+bool ReindexBlockFiles(int nThreads)
+{
+    const CChainParams& chainparams = Params();
+    int64_t nStart = GetTimeMillis();
+
+    // Reader threads claim files in order and hand them over through mapRead,
+    // staying at most nThreads files ahead of the blocks being connected.
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    int nFileNext = 0;
+    int nFileDone = 0;
+    std::map<int, CReindexFile> mapRead;
+
+    boost::thread_group readers;
+    for (int i = 0; i < nThreads; i++) {
+        readers.create_thread([&]() {
+            RenameThread("vidulum-reindex");
+            while (true) {
+                int nFile;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (nFileNext >= nFileDone + nThreads)
+                        cond.wait(lock);
+                    nFile = nFileNext++;
+                }
+                CReindexFile read;
+                try {
+                    read.fFound = ReadBlockFileForReindex(nFile, read.vBlocks);
+                } catch (const std::exception& e) {
+                    // Left to the import thread, which stops at this file
+                    LogPrintf("ReindexBlockFiles: error reading blk%05u.dat: %s\n", (unsigned int)nFile, e.what());
+                    read.fFailed = true;
+                }
+                bool fLast = !read.fFound || read.fFailed;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    mapRead[nFile] = std::move(read);
+                }
+                cond.notify_all();
+                if (fLast)
+                    return;
+            }
+        });
+    }
+
+    // Blocks whose parent is not known yet, by parent hash. Only the first
+    // MAX_REINDEX_REORDER_BLOCKS keep their contents, the others are read
+    // back from disk once their parent arrives.
+    std::multimap<uint256, CReindexBlockRef> mapBlocksUnknownParent;
+    unsigned int nBuffered = 0;
+    int nLoaded = 0;
+    bool fError = false;
+    try {
+        for (int nFile = 0; !fError; nFile++) {
+            CReindexFile read;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!mapRead.count(nFile))
+                    cond.wait(lock);
+                read = std::move(mapRead[nFile]);
+                mapRead.erase(nFile);
+                nFileDone = nFile + 1;
+            }
+            cond.notify_all();
+            if (read.fFailed) {
+                AbortNode(strprintf("System error: failed to read block file blk%05u.dat", (unsigned int)nFile));
+                fError = true;
+                break;
+            }
+            if (!read.fFound)
+                break;
+            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+
+            for (const CReindexBlockRef& pblock : read.vBlocks) {
+                boost::this_thread::interruption_point();
+
+                // detect out of order blocks, and store them for later
+                bool fParentKnown;
+                {
+                    LOCK(cs_main);
+                    fParentKnown = pblock->hash == chainparams.GetConsensus().hashGenesisBlock ||
+                        mapBlockIndex.count(pblock->block.hashPrevBlock);
+                }
+                if (!fParentKnown) {
+                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, pblock->hash.ToString(),
+                            pblock->block.hashPrevBlock.ToString());
+                    if (nBuffered < MAX_REINDEX_REORDER_BLOCKS)
+                        nBuffered++;
+                    else
+                        pblock->block.SetNull();
+                    mapBlocksUnknownParent.insert(std::make_pair(pblock->block.hashPrevBlock, pblock));
+                    continue;
+                }
+
+                if (!ProcessReindexBlock(*pblock, nLoaded)) {
+                    fError = true;
+                    break;
+                }
+
+                // Recursively process earlier encountered successors of this block
+                deque<uint256> queue;
+                queue.push_back(pblock->hash);
+                while (!queue.empty()) {
+                    uint256 head = queue.front();
+                    queue.pop_front();
+                    std::pair<std::multimap<uint256, CReindexBlockRef>::iterator, std::multimap<uint256, CReindexBlockRef>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    for (std::multimap<uint256, CReindexBlockRef>::iterator it = range.first; it != range.second; ++it) {
+                        CReindexBlock& child = *it->second;
+                        if (!child.block.IsNull())
+                            nBuffered--;
+                        else if (!ReadBlockFromDisk(child.block, child.pos))
+                            continue;
+                        LogPrintf("%s: Processing out of order child %s of %s\n", __func__, child.hash.ToString(),
+                                head.ToString());
+                        ProcessReindexBlock(child, nLoaded);
+                        LOCK(cs_main);
+                        if (mapBlockIndex.count(child.hash))
+                            queue.push_back(child.hash);
+                    }
+                    mapBlocksUnknownParent.erase(range.first, range.second);
+                }
+            }
+        }
+    } catch (...) {
+        readers.interrupt_all();
+        readers.join_all();
+        throw;
+    }
+    readers.interrupt_all();
+    readers.join_all();
+
+    LogPrintf("Reindexed %i blocks on %d reader threads in %dms\n", nLoaded, nThreads, GetTimeMillis() - nStart);
+    return !fError;
+}
+
 void static CheckBlockIndex()
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -5624,6 +6471,28 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * Return the serialized block of pindex for a peer. Blocks within
+ * MIN_BLOCKS_TO_KEEP of the tip go through rawBlockCache; older ones are
+ * only read from disk, so a peer syncing from us does not evict them.
+ */
+static CRawBlockCache::RawBlockRef ReadRawBlockForPeer(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    bool fRecent = chainActive.Height() - pindex->nHeight < (int)MIN_BLOCKS_TO_KEEP;
+    if (fRecent) {
+        CRawBlockCache::RawBlockRef cached = rawBlockCache.Get(pindex->GetBlockHash());
+        if (cached)
+            return cached;
+    }
+    std::shared_ptr<std::vector<unsigned char> > vBlock = std::make_shared<std::vector<unsigned char> >();
+    if (!ReadRawBlockFromDisk(*vBlock, pindex))
+        return CRawBlockCache::RawBlockRef();
+    if (fRecent)
+        rawBlockCache.Insert(pindex->GetBlockHash(), vBlock);
+    return vBlock;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     int currentHeight = GetHeight();
@@ -5644,7 +6513,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -5665,21 +6534,63 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // disconnect node in case we have reached the outbound limit for serving historical blocks
+                // never disconnect whitelisted nodes
+                static const int nOneWeek = 7 * 24 * 60 * 60; // assume > 1 week = historical
+                if (send && CNode::OutboundTargetReached(true) && ( ((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+                {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                    //disconnect node
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Pruned nodes may have deleted the block, so check whether
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    // Send block from the cache or disk
+                    CRawBlockCache::RawBlockRef rawBlock = ReadRawBlockForPeer((*mi).second);
+                    if (!rawBlock)
                         assert(!"cannot load block from disk");
+                    // Old blocks wait behind our other traffic to the peer,
+                    // along with the messages that must follow them
+                    bool fHistorical = mi->second->nHeight <= chainActive.Height() - MIN_HISTORICAL_BLOCK_DEPTH;
+                    SendClass blockClass = fHistorical ? SEND_CLASS_HISTORY : SEND_CLASS_TIP;
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // Blocks are stored in their network serialization, so send the bytes as they are
+                        CSendClassScope sendClass(pfrom, blockClass);
+                        pfrom->PushMessage("block", CFlatData(const_cast<std::vector<unsigned char>&>(*rawBlock)));
+                    }
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // A peer is unlikely to have the transactions of a deeper block in its
+                        // mempool, so send those in full
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                            std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock;
+                            if (pMostRecentCompactBlock && hashMostRecentCompactBlock == inv.hash) {
+                                pcmpctblock = pMostRecentCompactBlock;
+                            } else {
+                                CBlock block;
+                                CBufferReader(&(*rawBlock)[0], rawBlock->size(), SER_NETWORK, PROTOCOL_VERSION) >> block;
+                                pcmpctblock = GetCompactBlock(block);
+                            }
+                            pfrom->PushMessage(NetMsgType::CMPCTBLOCK, *pcmpctblock);
+                        } else {
+                            CSendClassScope sendClass(pfrom, blockClass);
+                            pfrom->PushMessage("block", CFlatData(const_cast<std::vector<unsigned char>&>(*rawBlock)));
+                        }
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Merkle blocks depend on the peer's filter, so only the block itself is cached
+                        CBlock block;
+                        CBufferReader(&(*rawBlock)[0], rawBlock->size(), SER_NETWORK, PROTOCOL_VERSION) >> block;
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
+                            CSendClassScope sendClass(pfrom, blockClass);
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
@@ -5705,6 +6616,7 @@ void static ProcessGetData(CNode* pfrom)
                         // wait for other stuff first.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        CSendClassScope sendClass(pfrom, blockClass);
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue.SetNull();
                     }
@@ -5714,7 +6626,7 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Check the mempool to see if a transaction is expiring soon.  If so, do not send to peer.
                 // Note that a transaction enters the mempool first, before the serialized form is cached
-                // in mapRelay after a successful relay.
+                // in the relay cache after a successful relay.
                 bool isExpiringSoon = false;
                 bool pushed = false;
                 CTransaction tx;
@@ -5725,13 +6637,10 @@ void static ProcessGetData(CNode* pfrom)
 
                 if (!isExpiringSoon) {
                     // Send stream from relay memory
-                    {
-                        LOCK(cs_mapRelay);
-                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                        if (mi != mapRelay.end()) {
-                            pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                            pushed = true;
-                        }
+                    CRelayCache::DataRef data = relayCache.Get(inv);
+                    if (data) {
+                        pfrom->PushMessage(inv.GetCommand(), *data);
+                        pushed = true;
                     }
                     if (!pushed && inv.type == MSG_TX) {
                         if (isInMempool) {
@@ -5859,7 +6768,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5878,10 +6787,81 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+/**
+ * Validate and store a block received from a peer, whether sent in full or
+ * rebuilt from a compact block, and report it back if it is invalid. A peer
+ * whose block becomes our new tip is asked to push the next ones compactly.
+ */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, bool fForceProcessing)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block, fForceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", std::string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+        return;
+    }
+
+    LOCK(cs_main);
+    if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == block.GetHash())
+        MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+}
+
+/** Number of headers a "headers" message exchanged with a peer of this version may hold. */
+unsigned int static MaxHeadersResults(int nVersion)
+{
+    return nVersion >= LARGE_HEADERS_VERSION ? MAX_HEADERS_RESULTS_LARGE : MAX_HEADERS_RESULTS;
+}
+
+/** Send a header synchronization getheaders, remembering when so that a peer not answering it is noticed. Requires cs_main. */
+void static PushHeadersRequest(CNode* pto, const CBlockLocator& locator)
+{
+    CNodeState *state = State(pto->GetId());
+    state->nHeadersRequestTime = GetTime();
+    state->nLastHeadersRequest = GetTimeMicros();
+    pto->PushMessage("getheaders", locator, uint256());
+}
+
+/**
+ * During initial block download, ask for the headers following nHeight from
+ * the sync peer that was asked least recently, among those with no request
+ * outstanding that were already past nHeight when they connected. Spreading
+ * the requests over the sync peers keeps a slow peer from holding up the
+ * whole header chain. Returns false if no peer qualifies. Requires cs_main.
+ */
+bool static RequestHeadersFromSyncPeer(const CBlockLocator& locator, int nHeight, const CNode* pnodeExclude)
+{
+    CNode* pnodeBest = NULL;
+    int64_t nBestLastRequest = 0;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        if (pnode == pnodeExclude || pnode->fDisconnect || !pnode->fSuccessfullyConnected || pnode->nStartingHeight <= nHeight)
+            continue;
+        CNodeState *state = State(pnode->GetId());
+        if (state == NULL || !state->fSyncStarted || state->nHeadersRequestTime != 0)
+            continue;
+        if (pnodeBest == NULL || state->nLastHeadersRequest < nBestLastRequest) {
+            pnodeBest = pnode;
+            nBestLastRequest = state->nLastHeadersRequest;
+        }
+    }
+    if (pnodeBest == NULL)
+        return false;
+
+    LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", nHeight, pnodeBest->id, pnodeBest->nStartingHeight);
+    PushHeadersRequest(pnodeBest, locator);
+    return true;
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, CRecvStream& vPayload, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
-    LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
+    LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vPayload.size(), pfrom->id);
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -5980,10 +6960,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 if (addr.IsRoutable())
                 {
                     LogPrintf("ProcessMessages: advertizing address %s\n", addr.ToString());
+                    LOCK(pfrom->cs_vSend);
                     pfrom->PushAddress(addr);
                 } else if (IsPeerAddrLocalGood(pfrom)) {
                     addr.SetIP(pfrom->addrLocal);
                     LogPrintf("ProcessMessages: advertizing address %s\n", addr.ToString());
+                    LOCK(pfrom->cs_vSend);
                     pfrom->PushAddress(addr);
                 }
             }
@@ -6044,6 +7026,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we understand compact blocks, but want them announced
+        // by inv until it has proven to be a good source of new blocks.
+        // Older peers ignore the unknown message.
+        pfrom->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
     }
 
 
@@ -6073,6 +7060,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         if (vAddr.size() > 1000)
         {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("message addr size() = %u", vAddr.size());
         }
@@ -6092,6 +7080,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
             {
                 // Relay to a limited number of other nodes
+                vector<CNode*> vRelayTo;
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
@@ -6114,8 +7103,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         mapMix.insert(make_pair(hashKey, pnode));
                     }
                     int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
-                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
-                        ((*mi).second)->PushAddress(addr);
+                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi) {
+                        (*mi).second->AddRef();
+                        vRelayTo.push_back((*mi).second);
+                    }
+                }
+                // This runs on a message worker while SendMessages may be using
+                // the addresses of these nodes; cs_vSend is not taken under cs_vNodes
+                // as SendMessages takes them the other way round
+                BOOST_FOREACH(CNode* pnode, vRelayTo) {
+                    LOCK(pnode->cs_vSend);
+                    pnode->PushAddress(addr);
+                }
+                {
+                    LOCK(cs_vNodes);
+                    BOOST_FOREACH(CNode* pnode, vRelayTo)
+                        pnode->Release();
                 }
             }
             // Do not store addresses outside our network
@@ -6172,7 +7175,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        // A peer that speaks compact blocks can send this one without
+                        // the transactions we already have in our mempool
+                        if (nodestate->fSupportsDesiredCmpctVersion)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -6266,37 +7274,52 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        LOCK(cs_main);
-
-        if (IsInitialBlockDownload())
-            return true;
-
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
+        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+        vector<CBlock> vHeaders;
+        // Headers whose solution was trimmed, with their block hash
+        vector<pair<size_t, uint256> > vTrimmed;
         {
-            // If locator is null, return the hashStop block
-            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
+            LOCK(cs_main);
+
+            if (IsInitialBlockDownload())
                 return true;
-            pindex = (*mi).second;
-        }
-        else
-        {
-            // Find the last block the caller has in the main chain
-            pindex = FindForkInGlobalIndex(chainActive, locator);
-            if (pindex)
-                pindex = chainActive.Next(pindex);
+
+            CBlockIndex* pindex = NULL;
+            if (locator.IsNull())
+            {
+                // If locator is null, return the hashStop block
+                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                if (mi == mapBlockIndex.end())
+                    return true;
+                pindex = (*mi).second;
+            }
+            else
+            {
+                // Find the last block the caller has in the main chain
+                pindex = FindForkInGlobalIndex(chainActive, locator);
+                if (pindex)
+                    pindex = chainActive.Next(pindex);
+            }
+
+            int nLimit = MaxHeadersResults(pfrom->nVersion);
+            LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+            for (; pindex; pindex = chainActive.Next(pindex))
+            {
+                vHeaders.push_back(CBlock());
+                if (!pindex->GetBlockHeaderInMemory(vHeaders.back()))
+                    vTrimmed.push_back(make_pair(vHeaders.size() - 1, pindex->GetBlockHash()));
+                if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                    break;
+            }
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
-        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
-        {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+        // A full reply may need a thousand solutions from the block tree DB,
+        // so they are read without holding cs_main
+        for (size_t i = 0; i < vTrimmed.size(); i++) {
+            if (!LoadBlockSolution(vTrimmed[i].second, vHeaders[vTrimmed[i].first].nSolution)) {
+                LogPrintf("getheaders: failed to read solution of block %s\n", vTrimmed[i].second.ToString());
+                return true;
+            }
         }
         pfrom->PushMessage("headers", vHeaders);
     }
@@ -6314,10 +7337,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         int64_t sigTime;
 
         if (strCommand == "tx") {
-            vRecv >> tx;
+            vPayload >> tx;
         } else if (strCommand == "dstx") {
             //these allow masternodes to publish a limited amount of free transactions
-            vRecv >> tx >> vin >> vchSig >> sigTime;
+            vPayload >> tx >> vin >> vchSig >> sigTime;
 
             CMasternode* pmn = mnodeman.Find(vin);
             if (pmn != NULL) {
@@ -6488,32 +7511,83 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         std::vector<CBlockHeader> headers;
 
         // Bypass the normal CBlock deserialization, as we don't want to risk deserializing 2000 full blocks.
-        unsigned int nCount = ReadCompactSize(vRecv);
-        if (nCount > MAX_HEADERS_RESULTS) {
+        unsigned int nCount = ReadCompactSize(vPayload);
+        if (nCount > MaxHeadersResults(pfrom->nVersion)) {
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 20);
             return error("headers message size = %u", nCount);
         }
         headers.resize(nCount);
         for (unsigned int n = 0; n < nCount; n++) {
-            vRecv >> headers[n];
-            ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
+            vPayload >> headers[n];
+            ReadCompactSize(vPayload); // ignore tx count; assume it is 0.
         }
+        bool fMoreHeaders = nCount == MaxHeadersResults(pfrom->nVersion);
 
+        // The Equihash solutions of headers we do not have yet are checked
+        // across the header check threads, without holding cs_main.
+        std::vector<CHeaderCheck> vChecks;
+        {
         LOCK(cs_main);
+        CNodeState *nodestate = State(pfrom->GetId());
+        nodestate->nHeadersRequestTime = 0;
 
         if (nCount == 0) {
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
 
-        CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+        BlockMap::iterator mi = mapBlockIndex.find(headers[0].hashPrevBlock);
+        if (mi == mapBlockIndex.end()) {
+            // A reply to a request made before the previous batch turned out
+            // to be invalid, or a new block on a chain we have not seen yet:
+            // ask again from our best header instead of failing the header.
+            if (++nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            LogPrint("net", "unconnecting headers (%s) from peer=%d\n", headers[0].hashPrevBlock.ToString(), pfrom->id);
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+        nodestate->nUnconnectingHeaders = 0;
+        int nLastHeight = mi->second->nHeight + nCount;
+
+        for (unsigned int n = 0; n < nCount; n++) {
+            if (n > 0 && headers[n].hashPrevBlock != headers[n - 1].GetHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, &pindexLast)) {
+            if (!mapBlockIndex.count(headers[n].GetHash()))
+                vChecks.push_back(CHeaderCheck(headers[n]));
+        }
+
+        if (fMoreHeaders) {
+            // Headers message had its maximum size; the peer may have more headers.
+            // Ask for them now, so that the next batch is on its way while this
+            // one is being verified.
+            CBlockLocator locator = chainActive.GetLocator(pindexBestHeader);
+            locator.vHave.insert(locator.vHave.begin(), headers.back().GetHash());
+            if (!IsInitialBlockDownload() || !RequestHeadersFromSyncPeer(locator, nLastHeight, NULL)) {
+                LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", nLastHeight, pfrom->id, pfrom->nStartingHeight);
+                PushHeadersRequest(pfrom, locator);
+            }
+        }
+        }
+
+        bool fChecked = false;
+        if (!vChecks.empty() && nScriptCheckThreads) {
+            CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+            control.Add(vChecks);
+            fChecked = control.Wait();
+        }
+
+        LOCK(cs_main);
+        CBlockIndex *pindexBestHeaderBefore = pindexBestHeader;
+        CBlockIndex *pindexLast = NULL;
+        BOOST_FOREACH(const CBlockHeader& header, headers) {
+            CValidationState state;
+            // Headers that failed the parallel check are checked again here,
+            // to get the misbehaviour score of the failure right.
+            if (!AcceptBlockHeader(header, state, &pindexLast, !fChecked)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -6526,12 +7600,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
+        if (!fMoreHeaders && pindexBestHeader != pindexBestHeaderBefore && IsInitialBlockDownload()) {
+            // This peer has no more headers, but another sync peer may have.
+            RequestHeadersFromSyncPeer(chainActive.GetLocator(pindexBestHeader), pindexBestHeader->nHeight, pfrom);
         }
 
         CheckBlockIndex();
@@ -6540,30 +7611,224 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
-        vRecv >> block;
+        vPayload >> block;
 
         CInv inv(MSG_BLOCK, block.GetHash());
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBlockFromPeer(pfrom, block, forceProcessing);
+    }
+
+
+    else if (strCommand == NetMsgType::SENDCMPCT)
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            CNodeState *nodestate = State(pfrom->GetId());
+            nodestate->fSupportsDesiredCmpctVersion = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vPayload >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            RequestFullBlockIfInFlight(pfrom, hash);
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received in cmpctblock from peer=%d", pfrom->id);
+            }
+        }
+        if (pindex == NULL) {
+            RequestFullBlockIfInFlight(pfrom, hash);
+            return true;
+        }
+
+        CInv inv(MSG_BLOCK, hash);
+        pfrom->AddInventoryKnown(inv);
+        UpdateBlockAvailability(pfrom->GetId(), hash);
+
+        // Nothing to do if we have the block already or it would not improve our chain
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            return true;
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || pindex->nTx != 0) {
+            // Our mempool is unlikely to help with a block we requested anyway
+            RequestFullBlockIfInFlight(pfrom, hash);
+            return true;
+        }
+
+        // Only blocks close to our tip are likely to be made of transactions we have;
+        // anything further away is left to the regular block download.
+        if (pindex->nHeight > chainActive.Height() + 2) {
+            RequestFullBlockIfInFlight(pfrom, hash);
+            return true;
+        }
+
+        CNodeState *nodestate = State(pfrom->GetId());
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first != pfrom->GetId())
+            return true; // Being downloaded from another peer already
+        if (itInFlight == mapBlocksInFlight.end()) {
+            if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+                return true;
+            MarkBlockAsInFlight(pfrom->GetId(), hash, chainparams.GetConsensus(), pindex);
+        }
+
+        std::vector<CTransaction> vExtraTxn;
+        vExtraTxn.reserve(mapOrphanTransactions.size());
+        for (map<uint256, COrphanTx>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            vExtraTxn.push_back(it->second.tx);
+
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock = std::make_shared<PartiallyDownloadedBlock>(&mempool);
+        ReadStatus status = partialBlock->InitData(cmpctblock, vExtraTxn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            return error("peer=%d sent us invalid compact block", pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Duplicate txindexes, the block is now in-flight, so just request it
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vInv);
+            return true;
+        }
+
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock->IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (req.indexes.empty()) {
+            // Everything is in our mempool, no round-trip needed
+            status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+            if (status == READ_STATUS_OK) {
+                fBlockReconstructed = true;
+            } else {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
             }
+        } else {
+            nodestate->partialBlock = partialBlock;
+            nodestate->hashPartialBlock = hash;
+            req.blockhash = hash;
+            pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+        }
         }
 
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, true);
+    }
+
+
+    else if (strCommand == NetMsgType::GETBLOCKTXN)
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second))
+            return error("%s: cannot load block %s from disk", __func__, req.blockhash.ToString());
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+    }
+
+
+    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vPayload >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+        LOCK(cs_main);
+
+        CNodeState *nodestate = State(pfrom->GetId());
+        if (!nodestate->partialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return true;
+        }
+
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+        nodestate->partialBlock.reset();
+        ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            return error("Peer %d sent us invalid compact block/non-matching block transactions", pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now :(
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage("getdata", vInv);
+        } else {
+            fBlockRead = true;
+        }
+        }
+
+        if (fBlockRead)
+            ProcessBlockFromPeer(pfrom, block, true);
     }
 
 
@@ -6582,8 +7847,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
         vector<CAddress> vAddr = addrman.GetAddr();
+        // Other message workers may be relaying addresses to this node
+        LOCK(pfrom->cs_vSend);
+        pfrom->vAddrToSend.clear();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
     }
@@ -6842,8 +8109,95 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_ENFORCEMENT;
 }
 
+CMessageLatencyStats messageLatencyStats;
+
+void CLatencyHistogram::Add(int64_t nMicros)
+{
+    nMicros = std::max(nMicros, (int64_t)0);
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = std::max(nMaxMicros, nMicros);
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && (nMicros >> (nBucket + 1)) > 0)
+        nBucket++;
+    vBuckets[nBucket]++;
+}
+
+void CMessageLatencyStats::Record(const std::string& strCommand, bool fWorker, int64_t nQueueMicros, int64_t nProcessMicros)
+{
+    LOCK(cs);
+    Key key(strCommand, fWorker);
+    if (!mapLatency.count(key) && mapLatency.size() >= MAX_COMMANDS)
+        key.first = "other";
+    CMessageLatency& latency = mapLatency[key];
+    latency.queue.Add(nQueueMicros);
+    latency.process.Add(nProcessMicros);
+}
+
+void CMessageLatencyStats::GetStats(std::map<Key, CMessageLatency>& mapLatencyOut) const
+{
+    LOCK(cs);
+    mapLatencyOut = mapLatency;
+}
+
+/**
+ * Whether a message is handled by the message workers. These only touch
+ * the peer itself, the address manager and the masternode list (under its
+ * own locks); anything that reads or changes chain, mempool or masternode
+ * sync state is handled by the message handler thread, one message at a
+ * time. That includes inv: AlreadyHave looks into the spork, SwiftX and
+ * budget maps, which the handler thread changes without cs_main, and the
+ * answer requests blocks. A peer's messages are never reordered: the
+ * handler thread leaves a peer to a worker until the worker reaches a
+ * message that is not for it.
+ */
+static bool IsWorkerMessage(const CNode* pfrom, const CNetMessage& msg)
+{
+    // The version handshake sets up what the other messages rely on
+    if (pfrom->nVersion == 0)
+        return false;
+
+    std::string strCommand = msg.hdr.GetCommand();
+    // Workers only check the signature of a masternode ping
+    if (strCommand == "mnp")
+        return !msg.fPrechecked;
+    return strCommand == "ping" || strCommand == "pong" ||
+           strCommand == "addr" || strCommand == "getaddr";
+}
+
+/**
+ * Whether ProcessMessage deserializes the command straight from the payload
+ * slabs. These are the transactions and blocks, which make up nearly all the
+ * bytes received; the rest get a contiguous copy of their payload.
+ */
+static bool IsParsedInPlace(const std::string& strCommand)
+{
+    return strCommand == "tx" || strCommand == "dstx" || strCommand == "headers" ||
+           strCommand == "block" || strCommand == NetMsgType::CMPCTBLOCK ||
+           strCommand == NetMsgType::BLOCKTXN;
+}
+
+/** Verify the signature of a masternode ping on a message worker; false if it is bad */
+static bool PrecheckMasternodePing(CNode* pfrom, const CDataStream& vRecv)
+{
+    // Leave the message as it is for when it is processed
+    CDataStream ssPing(vRecv);
+    CMasternodePing mnp;
+    ssPing >> mnp;
+
+    int nDoS = 0;
+    if (!mnodeman.PrecheckPing(mnp, nDoS)) {
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+        return false;
+    }
+    return true;
+}
+
 // requires LOCK(cs_vRecvMsg)
-bool ProcessMessages(CNode* pfrom)
+bool ProcessMessages(CNode* pfrom, bool fWorker)
 {
     //if (fDebug)
     //    LogPrintf("%s(%u messages)\n", __func__, pfrom->vRecvMsg.size());
@@ -6858,11 +8212,13 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
-        ProcessGetData(pfrom);
+    if (!fWorker) {
+        if (!pfrom->vRecvGetData.empty())
+            ProcessGetData(pfrom);
 
-    // this maintains the order of responses
-    if (!pfrom->vRecvGetData.empty()) return fOk;
+        // this maintains the order of responses
+        if (!pfrom->vRecvGetData.empty()) return fOk;
+    }
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -6875,13 +8231,21 @@ bool ProcessMessages(CNode* pfrom)
 
         //if (fDebug)
         //    LogPrintf("%s(message %u msgsz, %u bytes, complete:%s)\n", __func__,
-        //            msg.hdr.nMessageSize, msg.vRecv.size(),
+        //            msg.hdr.nMessageSize, msg.payload.size(),
         //            msg.complete() ? "Y" : "N");
 
         // end, if an incomplete message is found
         if (!msg.complete())
             break;
 
+        // Stop at a message for the other kind of thread; the message handler
+        // thread hands the node over to a worker (see ThreadMessageWorker)
+        if (nMessageWorkers > 0 && IsWorkerMessage(pfrom, msg) != fWorker) {
+            if (!fWorker)
+                pfrom->fOnMsgWorker = true;
+            break;
+        }
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -6905,8 +8269,7 @@ bool ProcessMessages(CNode* pfrom)
         unsigned int nMessageSize = hdr.nMessageSize;
 
         // Checksum
-        CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        uint256 hash = msg.payload.GetHash();
         unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
         if (nChecksum != hdr.nChecksum)
         {
@@ -6915,11 +8278,28 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        CRecvStream vPayload(msg.payload, msg.nType, msg.nVersion);
+        CDataStream vRecv(msg.nType, msg.nVersion);
+        if (!IsParsedInPlace(strCommand)) {
+            vRecv.reserve(nMessageSize);
+            msg.payload.CopyTo(vRecv);
+        }
+
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (fWorker && strCommand == "mnp") {
+                // The ping itself is processed in order by the message handler thread
+                fRet = PrecheckMasternodePing(pfrom, vRecv);
+                if (fRet) {
+                    msg.fPrechecked = true;
+                    it--;
+                }
+            } else {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, vPayload, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -6949,10 +8329,14 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        messageLatencyStats.Record(strCommand, fWorker, nStart - msg.nTime, GetTimeMicros() - nStart);
+
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
-        break;
+        // Workers go on through the node's messages, the handler thread moves on to the next node
+        if (!fWorker)
+            break;
     }
 
     // In case the connection got shut down, its receive buffer was wiped
@@ -7008,19 +8392,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         static int64_t nLastRebroadcast;
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
         {
+            // Only flag the nodes here: their address queues are guarded by
+            // their own cs_vSend, which must not be taken under cs_vNodes
             LOCK(cs_vNodes);
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->addrKnown.reset();
+                    pnode->fResetAddrKnown = true;
 
                 // Rebroadcast our address
-                AdvertizeLocal(pnode);
+                pnode->fAdvertizeLocal = true;
             }
             if (!vNodes.empty())
                 nLastRebroadcast = GetTime();
         }
+        if (pto->fResetAddrKnown.exchange(false))
+            pto->addrKnown.reset();
+        if (pto->fAdvertizeLocal.exchange(false))
+            AdvertizeLocal(pto);
 
         //
         // Message: addr
@@ -7072,14 +8462,33 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pindexBestHeader == NULL)
             pindexBestHeader = chainActive.Tip();
         bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
+        bool fNearTip = pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60;
         if (!state.fSyncStarted && !pto->fClient && !fImporting && !fReindex) {
-            // Only actively request headers from a single peer, unless we're close to today.
-            if ((nSyncStarted == 0 && fFetch) || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
+            // Only actively request headers from a few peers, unless we're close to today.
+            if ((nSyncStarted < MAX_HEADERS_SYNC_PEERS && fFetch) || fNearTip) {
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256());
+                // Far from today a single getheaders is outstanding at a time, and
+                // the other sync peers take turns answering the follow-up ones.
+                if (nSyncStarted == 1 || fNearTip) {
+                    CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    PushHeadersRequest(pto, chainActive.GetLocator(pindexStart));
+                }
+            }
+        }
+        if (state.fSyncStarted && fHeadersRequestLost && !fImporting && !fReindex) {
+            // The peer that was to send the next headers went away; take over.
+            fHeadersRequestLost = false;
+            LogPrint("net", "getheaders (%d) to peer=%d after losing a sync peer (startheight:%d)\n", pindexBestHeader->nHeight, pto->id, pto->nStartingHeight);
+            PushHeadersRequest(pto, chainActive.GetLocator(pindexBestHeader));
+        }
+        if (state.nHeadersRequestTime != 0 && !fNearTip && GetTime() - state.nHeadersRequestTime > HEADERS_DOWNLOAD_TIMEOUT) {
+            state.nHeadersRequestTime = 0;
+            fHeadersRequestLost = true;
+            if (!pto->fWhitelisted) {
+                LogPrintf("Timeout downloading headers from peer=%d, disconnecting\n", pto->id);
+                pto->fDisconnect = true;
             }
         }
 
@@ -30,7 +30,9 @@
 
 #include <algorithm>
 #include <exception>
+#include <list>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -41,6 +43,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewBackgroundFlush;
 class CSporkDB;
 class CBloomFilter;
 class CInv;
@@ -84,6 +87,12 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of threads reading block files during -reindex */
+static const int MAX_REINDEX_THREADS = 16;
+/** -reindexthreads default (0 = read block files one at a time) */
+static const int DEFAULT_REINDEX_THREADS = 0;
+/** Blocks with an unknown parent the parallel reindex keeps in memory; beyond this only their position is kept */
+static const unsigned int MAX_REINDEX_REORDER_BLOCKS = 1024;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -91,11 +100,39 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 160;
+/** Number of headers sent in one getheaders result to peers at LARGE_HEADERS_VERSION or later. */
+static const unsigned int MAX_HEADERS_RESULTS_LARGE = 1000;
+/** Number of Equihash solutions loaded back from the block tree DB that are kept in memory
+ *  for serving headers, see CBlockIndex::GetBlockHeader(). */
+static const unsigned int SOLUTION_CACHE_SIZE = 4 * MAX_HEADERS_RESULTS_LARGE;
+/** Number of peers the getheaders requests of initial headers synchronization are spread over. */
+static const int MAX_HEADERS_SYNC_PEERS = 3;
+/** Timeout in seconds for a peer to answer a getheaders request of initial headers synchronization. */
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT = 2 * 60;
+/** Number of unconnecting headers messages a peer may send before it is penalized. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of a block below the tip for it to be served as a compact block;
+ *  a peer asking for anything deeper is unlikely to have its transactions in its mempool. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block below the tip for which "getblocktxn" is answered. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Depth below the tip from which blocks are sent to peers as SEND_CLASS_HISTORY, behind all other traffic. */
+static const int MIN_HISTORICAL_BLOCK_DEPTH = 10;
+/** Number of peers asked to push new blocks to us as compact blocks without an inv round-trip. */
+static const unsigned int MAX_HB_CMPCTBLOCK_PEERS = 3;
+/** Number of block files no longer written to that are kept mapped into memory for reading blocks. */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 8;
+/** Default for -rawblockcache, in megabytes. */
+static const unsigned int DEFAULT_RAW_BLOCK_CACHE_SIZE = 32;
+/** Default for -fastindexload, trusting block index entries verified at an earlier start. */
+static const bool DEFAULT_FAST_INDEX_LOAD = true;
+/** Default for -backgroundflush, writing the chainstate to disk on a separate thread. */
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -114,7 +151,7 @@ static const unsigned int DEFAULT_REORG_MN_CHECK = 10;
 BOOST_STATIC_ASSERT(DEFAULT_BLOCK_PRIORITY_SIZE <= DEFAULT_BLOCK_MAX_SIZE);
 
 #define equihash_parameters_acceptable(N, K) \
-    ((CBlockHeader::HEADER_SIZE + equihash_solution_size(N, K))*MAX_HEADERS_RESULTS < \
+    ((CBlockHeader::HEADER_SIZE + equihash_solution_size(N, K))*MAX_HEADERS_RESULTS_LARGE < \
      MAX_PROTOCOL_MESSAGE_LENGTH-1000)
 
 struct BlockHasher
@@ -208,14 +245,21 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Reindex the blk?????.dat files, reading and checking them on nThreads threads. Returns false
+ *  on an error, which has shut the node down. */
+bool ReindexBlockFiles(int nThreads);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
-/** Process protocol messages received from a given node */
-bool ProcessMessages(CNode* pfrom);
+/**
+ * Process protocol messages received from a given node. Messages that need
+ * no consensus state are left for the message workers, which process only
+ * those (fWorker); see ThreadMessageWorker.
+ */
+bool ProcessMessages(CNode* pfrom, bool fWorker);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -225,6 +269,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the shielded proof checking thread */
+void ThreadProofCheck();
+/** Run an instance of the block header proof-of-work checking thread */
+void ThreadHeaderCheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -701,9 +749,14 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/**
+ * Check a transaction contextually against a set of consensus rules.
+ * If fCheckShieldedProofs is false, the joinSplitSig and the Sapling proof
+ * and binding signature checks are left to the caller (see CProofCheck).
+ */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state, int nHeight, int dosLevel,
-                                bool (*isInitBlockDownload)() = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)() = IsInitialBlockDownload,
+                                bool fCheckShieldedProofs = true);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -798,6 +851,129 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the Sapling checks of one transaction: all of its
+ * spend and output proofs plus the binding signature, which must share a
+ * single librustzcash verification context.
+ * Note that this stores references to the transaction
+ */
+class CSaplingCheck
+{
+private:
+    const CTransaction *ptxTo;
+    uint256 dataToBeSigned;
+    std::string strRejectReason;
+    std::string strError;
+
+public:
+    CSaplingCheck(): ptxTo(0) {}
+    CSaplingCheck(const CTransaction& txToIn, const uint256& dataToBeSignedIn) :
+        ptxTo(&txToIn), dataToBeSigned(dataToBeSignedIn) { }
+
+    bool operator()();
+
+    void swap(CSaplingCheck &check) {
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+        strRejectReason.swap(check.strRejectReason);
+        strError.swap(check.strError);
+    }
+
+    const CTransaction* GetTransaction() const { return ptxTo; }
+    const std::string& GetRejectReason() const { return strRejectReason; }
+    const std::string& GetError() const { return strError; }
+};
+
+class CProofCheck;
+
+/**
+ * Where the checks run on the proof check queue report the first failure,
+ * so that ConnectBlock can reject the block with its reason.
+ */
+class CProofCheckFailure
+{
+private:
+    mutable CCriticalSection cs;
+    uint256 txid;
+    std::string strRejectReason;
+    std::string strError;
+
+public:
+    void Record(const CProofCheck& check);
+    //! Returns false if no check failed
+    bool Get(uint256& txidOut, std::string& strRejectReasonOut, std::string& strErrorOut) const;
+};
+
+/**
+ * Closure representing one shielded verification job: a Sprout JoinSplit
+ * proof, a transaction's joinSplitSig, or the Sapling checks of a
+ * transaction. These are run on the proof check queue by ConnectBlock.
+ * Note that this stores references to the transaction and the failure sink
+ */
+class CProofCheck
+{
+public:
+    enum CheckType {
+        CHECK_NONE,
+        CHECK_JOINSPLIT_PROOF,
+        CHECK_JOINSPLIT_SIG,
+        CHECK_SAPLING,
+    };
+
+private:
+    CheckType type;
+    const CTransaction *ptxTo;
+    unsigned int nJoinSplit;
+    uint256 dataToBeSigned;
+    CProofCheckFailure *pfailure;
+    std::string strRejectReason;
+    std::string strError;
+
+public:
+    CProofCheck(): type(CHECK_NONE), ptxTo(0), nJoinSplit(0), pfailure(0) {}
+    CProofCheck(CheckType typeIn, const CTransaction& txToIn, unsigned int nJoinSplitIn, const uint256& dataToBeSignedIn,
+                CProofCheckFailure* pfailureIn = NULL) :
+        type(typeIn), ptxTo(&txToIn), nJoinSplit(nJoinSplitIn), dataToBeSigned(dataToBeSignedIn), pfailure(pfailureIn) { }
+
+    bool operator()();
+
+    void swap(CProofCheck &check) {
+        std::swap(type, check.type);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nJoinSplit, check.nJoinSplit);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+        std::swap(pfailure, check.pfailure);
+        strRejectReason.swap(check.strRejectReason);
+        strError.swap(check.strError);
+    }
+
+    const CTransaction* GetTransaction() const { return ptxTo; }
+    const std::string& GetRejectReason() const { return strRejectReason; }
+    const std::string& GetError() const { return strError; }
+};
+
+/**
+ * Closure representing the proof-of-work checks of one block header, its
+ * Equihash solution and its hash against nBits. These are run on the header
+ * check queue for the headers of a "headers" message.
+ * Note that this stores references to the header
+ */
+class CHeaderCheck
+{
+private:
+    const CBlockHeader *pheader;
+
+public:
+    CHeaderCheck(): pheader(0) {}
+    CHeaderCheck(const CBlockHeader& headerIn) : pheader(&headerIn) { }
+
+    bool operator()();
+
+    void swap(CHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+    }
+};
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes);
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
 bool GetAddressIndex(uint160 addressHash, int type,
@@ -810,6 +986,108 @@ bool GetAddressUnspent(uint160 addressHash, int type,
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the serialized block of pindex as stored, without deserializing it. */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vBlock, const CBlockIndex* pindex);
+
+struct CRawBlockCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    //! Bytes served from the cache instead of being read from disk
+    uint64_t nBytesSaved;
+    size_t nBlocks;
+    size_t nBytes;
+    size_t nMaxBytes;
+};
+
+/**
+ * Least recently used cache of serialized blocks, bounded in bytes. Used to
+ * answer getdata requests for recent blocks, which many peers tend to ask
+ * for at about the same time, without going to disk.
+ */
+class CRawBlockCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<unsigned char> > RawBlockRef;
+
+private:
+    mutable CCriticalSection cs;
+    size_t nMaxBytes;
+    size_t nBytes;
+    //! Most recently used first
+    std::list<std::pair<uint256, RawBlockRef> > listBlocks;
+    std::map<uint256, std::list<std::pair<uint256, RawBlockRef> >::iterator> mapBlocks;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nBytesSaved;
+
+    void Trim();
+
+public:
+    CRawBlockCache(size_t nMaxBytesIn);
+
+    /** Look up a block, counting the hit or miss. */
+    RawBlockRef Get(const uint256& hash);
+    /** Add a block. Blocks larger than the whole cache are not kept. */
+    void Insert(const uint256& hash, const RawBlockRef& block);
+    void SetMaxBytes(size_t nMaxBytesIn);
+    void Clear();
+    void GetStats(CRawBlockCacheStats& stats) const;
+};
+
+/** Serialized recent blocks served to peers */
+extern CRawBlockCache rawBlockCache;
+
+/** Log2-bucketed histogram of message handling times, in microseconds */
+struct CLatencyHistogram
+{
+    //! Bucket i counts times from 2^i up to 2^(i+1) microseconds; the last one also all longer ones
+    static const int BUCKETS = 24;
+
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vBuckets[BUCKETS];
+
+    CLatencyHistogram() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+
+    void Add(int64_t nMicros);
+};
+
+struct CMessageLatency
+{
+    //! From receipt of the message to the start of its processing
+    CLatencyHistogram queue;
+    CLatencyHistogram process;
+};
+
+/**
+ * Latency of received messages by command and by the thread that handled
+ * them (message worker or message handler). Commands are picked by peers, so
+ * past MAX_COMMANDS entries any new command is counted as "other".
+ */
+class CMessageLatencyStats
+{
+public:
+    //! Command, and whether a message worker handled it
+    typedef std::pair<std::string, bool> Key;
+
+    static const size_t MAX_COMMANDS = 64;
+
+private:
+    mutable CCriticalSection cs;
+    std::map<Key, CMessageLatency> mapLatency;
+
+public:
+    void Record(const std::string& strCommand, bool fWorker, int64_t nQueueMicros, int64_t nProcessMicros);
+    void GetStats(std::map<Key, CMessageLatency>& mapLatencyOut) const;
+};
+
+/** Latency of the messages processed by ProcessMessages */
+extern CMessageLatencyStats messageLatencyStats;
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -847,7 +1125,7 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
  * If dbp is non-NULL, the file is known to already reside on disk
  */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, bool fRequested, CDiskBlockPos* dbp);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool fCheckPOW = true);
 
 
 
@@ -938,6 +1216,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the background chainstate writer below pcoinsTip, if enabled (protected by cs_main) */
+extern CCoinsViewBackgroundFlush *pcoinsWriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -62,6 +62,8 @@ public:
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    /// Check the signature against the masternode's key, setting nDos if it does not match
+    bool VerifySignature(const CPubKey& pubKeyMasternode, int& nDos);
     void Relay();
 
     uint256 GetHash()
@@ -347,6 +347,7 @@ void CMasternodeMan::Clear()
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    setPrecheckedPings.clear();
     nDsqCount = 0;
 }
 
@@ -751,6 +752,47 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
+static uint256 PrecheckedPingHash(const CMasternodePing& mnp, const CPubKey& pubKeyMasternode)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << mnp << pubKeyMasternode;
+    return ss.GetHash();
+}
+
+bool CMasternodeMan::PrecheckPing(CMasternodePing& mnp, int& nDos)
+{
+    if (fLiteMode || !masternodeSync.IsBlockchainSynced()) return true;
+
+    // Pings that CheckAndUpdate rejects before looking at the signature are left to it
+    if (mnp.sigTime > GetAdjustedTime() + 60 * 60 || mnp.sigTime <= GetAdjustedTime() - 60 * 60) return true;
+
+    CPubKey pubKeyMasternode;
+    {
+        LOCK(cs);
+        CMasternode* pmn = Find(mnp.vin);
+        if (pmn == NULL || pmn->protocolVersion < masternodePayments.GetMinMasternodePaymentsProto() ||
+            !pmn->IsEnabled() || pmn->IsPingedWithin(MASTERNODE_MIN_MNP_SECONDS - 60, mnp.sigTime))
+            return true;
+        pubKeyMasternode = pmn->pubKeyMasternode;
+    }
+
+    if (!mnp.VerifySignature(pubKeyMasternode, nDos)) return false;
+
+    LOCK(cs);
+    // Entries are removed when their ping is processed; this only bounds the
+    // ones left behind by peers that disconnected in between
+    if (setPrecheckedPings.size() >= MASTERNODES_MAX_PRECHECKED_PINGS)
+        setPrecheckedPings.clear();
+    setPrecheckedPings.insert(PrecheckedPingHash(mnp, pubKeyMasternode));
+    return true;
+}
+
+bool CMasternodeMan::IsPingPrechecked(const CMasternodePing& mnp, const CPubKey& pubKeyMasternode)
+{
+    LOCK(cs);
+    return setPrecheckedPings.erase(PrecheckedPingHash(mnp, pubKeyMasternode)) > 0;
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -843,7 +885,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if (i != mAskedUsForMasternodeList.end()) {
                     int64_t t = (*i).second;
                     if (GetTime() < t) {
-                        Misbehaving(pfrom->GetId(), 34);
+                        {
+                            LOCK(cs_main);
+                            Misbehaving(pfrom->GetId(), 34);
+                        }
                         LogPrint("masternode","dseg - peer already asked me for the list\n");
                         return;
                     }
@@ -856,6 +901,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
+        LOCK(cs);
         BOOST_FOREACH (CMasternode& mn, vMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
@@ -17,6 +17,7 @@
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_MAX_PRECHECKED_PINGS 10000
 
 using namespace std;
 
@@ -66,6 +67,8 @@ private:
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // pings whose signature a message worker verified, by hash of ping and key
+    std::set<uint256> setPrecheckedPings;
 
 public:
     // Keep track of all broadcasts I've seen
@@ -145,6 +148,11 @@ public:
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+    /// Verify the signature of a ping ahead of ProcessMessage, off the message handler thread; false if it is bad
+    bool PrecheckPing(CMasternodePing& mnp, int& nDos);
+    /// Whether PrecheckPing verified this ping against this key, forgetting it if so
+    bool IsPingPrechecked(const CMasternodePing& mnp, const CPubKey& pubKeyMasternode);
+
     /// Return the number of (unique) Masternodes
     int size() { return vMasternodes.size(); }
 
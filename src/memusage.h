@@ -5,6 +5,8 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "support/allocators/pool.h"
+
 #include <stdlib.h>
 
 #include <map>
@@ -115,6 +117,17 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+// A pooled map holds all of its pool's chunks, including free and not yet used blocks
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, std::equal_to<X>, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    const CPoolResource* resource = m.get_allocator().GetResource();
+    if (!resource)
+        return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+    return MallocUsage(sizeof(CPoolResource)) + resource->ChunkBytes() +
+           (resource->LargeBytes() ? MallocUsage(resource->LargeBytes()) : 0);
+}
+
 }
 
 #endif
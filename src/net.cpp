@@ -25,6 +25,9 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #endif
 
 #include <boost/filesystem.hpp>
@@ -52,6 +55,56 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 30;
+    /** Number of socket events taken from epoll at a time. */
+    const int MAX_SOCKET_EVENTS = 256;
+    /** Size of the socket reads; a message payload with at least this much
+     *  left to receive is read straight into its slabs. */
+    const unsigned int RECV_CHUNK_SIZE = 0x10000;
+
+    /** Bytes of each send class a peer's send queue may send per turn. The
+     *  tip gets enough for a block, the rest share what is left of a round. */
+    const uint64_t SEND_CLASS_QUANTUM[SEND_CLASS_MAX] = {
+        2 * 1024 * 1024,    // SEND_CLASS_TIP
+        256 * 1024,         // SEND_CLASS_MASTERNODE
+        128 * 1024,         // SEND_CLASS_TX
+        64 * 1024,          // SEND_CLASS_HISTORY
+    };
+
+    struct SendClassCommand {
+        const char* pszCommand;
+        SendClass sendClass;
+    };
+
+    /** Commands sent in a class other than SEND_CLASS_TIP */
+    const SendClassCommand SEND_CLASS_COMMANDS[] = {
+        {"mnb", SEND_CLASS_MASTERNODE},
+        {"mnp", SEND_CLASS_MASTERNODE},
+        {"mnw", SEND_CLASS_MASTERNODE},
+        {"mnget", SEND_CLASS_MASTERNODE},
+        {"mnvs", SEND_CLASS_MASTERNODE},
+        {"dseg", SEND_CLASS_MASTERNODE},
+        {"dsee", SEND_CLASS_MASTERNODE},
+        {"dseep", SEND_CLASS_MASTERNODE},
+        {"ssc", SEND_CLASS_MASTERNODE},
+        {"mprop", SEND_CLASS_MASTERNODE},
+        {"mvote", SEND_CLASS_MASTERNODE},
+        {"fbs", SEND_CLASS_MASTERNODE},
+        {"fbvote", SEND_CLASS_MASTERNODE},
+        {"spork", SEND_CLASS_MASTERNODE},
+        {"getsporks", SEND_CLASS_MASTERNODE},
+        {"ix", SEND_CLASS_MASTERNODE},
+        {"txlvote", SEND_CLASS_MASTERNODE},
+        {"dsa", SEND_CLASS_MASTERNODE},
+        {"dsc", SEND_CLASS_MASTERNODE},
+        {"dsf", SEND_CLASS_MASTERNODE},
+        {"dsi", SEND_CLASS_MASTERNODE},
+        {"dsq", SEND_CLASS_MASTERNODE},
+        {"dsr", SEND_CLASS_MASTERNODE},
+        {"dss", SEND_CLASS_MASTERNODE},
+        {"dssu", SEND_CLASS_MASTERNODE},
+        {"tx", SEND_CLASS_TX},
+        {"dstx", SEND_CLASS_TX},
+    };
 
     struct ListenSocket {
         SOCKET socket;
@@ -76,14 +129,19 @@ static std::vector<ListenSocket> vhListenSocket;
 static list<CNode*> vNodesDisconnected;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+#if HAVE_SYS_EPOLL_H
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_EPOLL;
+#else
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+#endif
+static int hEpoll = -1;
+int nMessageWorkers = 0;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache(DEFAULT_MAX_RELAY_CACHE_SIZE << 20);
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -101,10 +159,42 @@ CCriticalSection cs_nLastNodeId;
 static CSemaphore *semOutbound = NULL;
 static boost::condition_variable messageHandlerCondition;
 
+// Nodes handed to the message workers, each at most once (see CNode::fOnMsgWorker)
+static std::deque<CNode*> vMsgWorkerQueue;
+static boost::mutex mutexMsgWorkerQueue;
+static boost::condition_variable condMsgWorkerQueue;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+/** Whether the socket handler can wait on a socket: select() only takes descriptors below FD_SETSIZE. */
+static bool IsWaitableSocket(SOCKET hSocket)
+{
+    return nSocketEventsMode == SOCKETEVENTS_EPOLL || IsSelectableSocket(hSocket);
+}
+
+/**
+ * Register a new node's socket with epoll, edge-triggered. Readiness is then
+ * reported once per change, and recorded on the node until the socket
+ * handler has drained it. A closed socket leaves the epoll set by itself.
+ */
+static bool AddSocketEvents(CNode* pnode)
+{
+#if HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL)
+        return true;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+        return false;
+    }
+#endif
+    return true;
+}
+
 void AddOneShot(const std::string& strDest)
 {
     LOCK(cs_vOneShots);
@@ -211,6 +301,7 @@ void AdvertizeLocal(CNode *pnode)
         if (addrLocal.IsRoutable())
         {
             LogPrintf("AdvertizeLocal: advertizing address %s\n", addrLocal.ToString());
+            LOCK(pnode->cs_vSend);
             pnode->PushAddress(addrLocal);
         }
     }
@@ -318,6 +409,12 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+CSendClassStats CNode::sendClassStats[SEND_CLASS_MAX];
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
+uint64_t CNode::nRecentBlockSize = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -401,7 +498,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsWaitableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -412,6 +509,8 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        if (!AddSocketEvents(pnode))
+            pnode->CloseSocketDisconnect();
 
         {
             LOCK(cs_vNodes);
@@ -685,20 +784,54 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nRemaining = hdr.nMessageSize - payload.size();
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    // Slabs are sized for the rest of the message, so up to a slab is
+    // allocated ahead, but never more than the total message size.
+    unsigned int nDone = 0;
+    while (nDone < nCopy) {
+        unsigned int nWindow;
+        char* pchWindow = GetDataWindow(nWindow);
+        nWindow = std::min(nWindow, nCopy - nDone);
+        memcpy(pchWindow, pch + nDone, nWindow);
+        payload.Commit(nWindow);
+        nDone += nWindow;
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
-
     return nCopy;
 }
 
+char* CNetMessage::GetDataWindow(unsigned int& nWindow)
+{
+    size_t nAvail;
+    char* pch = payload.GetWindow(hdr.nMessageSize - payload.size(), nAvail);
+    nWindow = nAvail;
+    return pch;
+}
+
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvWindow(unsigned int& nWindow)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.hdr.nMessageSize - msg.payload.size() < RECV_CHUNK_SIZE)
+        return NULL;
+    return msg.GetDataWindow(nWindow);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedInPlace(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.payload.Commit(nBytes);
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        messageHandlerCondition.notify_one();
+    }
+}
+
 
 
 
@@ -707,24 +840,49 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// requires LOCK(cs_vSend)
+int CNode::SelectSendClass()
+{
+    assert(nSendSize > 0);
+    // Messages cannot be interleaved, so finish the one being sent
+    if (nSendOffset > 0)
+        return nSendClass;
+
+    while (true) {
+        const std::deque<CSendMessage>& queue = vSendMsg[nSendClass];
+        if (queue.empty()) {
+            // A class does not save up its turns while it has nothing to send
+            vSendDeficit[nSendClass] = 0;
+        } else if (vSendDeficit[nSendClass] >= (int64_t)queue.front().data.size()) {
+            return nSendClass;
+        }
+        // Next class's turn
+        nSendClass = (nSendClass + 1) % SEND_CLASS_MAX;
+        if (!vSendMsg[nSendClass].empty())
+            vSendDeficit[nSendClass] += SEND_CLASS_QUANTUM[nSendClass];
+    }
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
-
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+    while (pnode->nSendSize > 0) {
+        int nClass = pnode->SelectSendClass();
+        const CSendMessage &msg = pnode->vSendMsg[nClass].front();
+        const CSerializeData &data = msg.data;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
             pnode->nSendOffset += nBytes;
-            pnode->RecordBytesSent(nBytes);
+            pnode->RecordBytesSent(nBytes, pnode->fWhitelisted);
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
+                pnode->vSendDeficit[nClass] -= data.size();
+                CNode::RecordMessageSent(nClass, data.size(), GetTimeMicros() - msg.nTimeQueued);
+                pnode->vSendMsg[nClass].pop_front();
             } else {
                 // could not send full message; stop sending more
                 break;
@@ -744,11 +902,8 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->nSendSize == 0)
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
-    }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 class CNodeRef {
@@ -981,7 +1136,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         LogPrint("net", "masternode list is not synced or masternode protection flag is not enabled\n");
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsWaitableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1017,6 +1172,8 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     CNode* pnode = new CNode(hSocket, addr, "", true);
     pnode->AddRef();
     pnode->fWhitelisted = whitelisted;
+    if (!AddSocketEvents(pnode))
+        pnode->CloseSocketDisconnect();
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
@@ -1026,6 +1183,76 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+/** Whether a node has queued data, which is sent before receiving more from it. */
+static bool HasDataToSend(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    return lockSend && pnode->nSendSize > 0;
+}
+
+/** Whether a node's receive buffer can take more data. */
+static bool HasRoomToReceive(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    return lockRecv && (
+        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+        pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+}
+
+/**
+ * Whether epoll already reported a socket of the node ready for work this
+ * thread can do now. Epoll does not report it again until it was drained.
+ */
+static bool HasPendingSocketEvents(CNode* pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    if (HasDataToSend(pnode))
+        return pnode->fCanSendData;
+    return pnode->fHasSocketError || (pnode->fHasRecvData && HasRoomToReceive(pnode));
+}
+
+/**
+ * Wait up to nTimeout milliseconds for epoll to report socket events, and
+ * record them on the nodes. Nodes are only deleted by this thread, after
+ * their socket was closed, which removes it from the epoll set, so the
+ * nodes the events point to are still alive. Returns whether a listening
+ * socket has a connection to accept.
+ */
+static bool WaitForSocketEvents(int nTimeout)
+{
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, nTimeout);
+    boost::this_thread::interruption_point();
+    if (nEvents < 0) {
+        if (errno != EINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        MilliSleep(nTimeout);
+        return false;
+    }
+
+    bool fAcceptReady = false;
+    for (int i = 0; i < nEvents; i++) {
+        // Listening sockets are registered without a node
+        if (events[i].data.ptr == NULL) {
+            fAcceptReady = true;
+            continue;
+        }
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            pnode->fHasSocketError = true;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+            pnode->fHasRecvData = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fCanSendData = true;
+    }
+    return fAcceptReady;
+#else
+    return false;
+#endif
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
@@ -1107,73 +1334,84 @@ void ThreadSocketHandler()
         FD_ZERO(&fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        bool fAcceptReady = false;
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+            // Only collect new events without waiting while a socket still
+            // has data left from an earlier pass, such as a large block
+            // arriving one receive chunk at a time
+            int nTimeout = timeout.tv_usec / 1000;
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (HasPendingSocketEvents(pnode)) {
+                        nTimeout = 0;
+                        break;
+                    }
+                }
+            }
+            fAcceptReady = WaitForSocketEvents(nTimeout);
+        } else {
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
+
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket.socket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket.socket);
                 have_fds = true;
+            }
 
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+
+                    // Implement the following logic:
+                    // * If there is data to send, select() for sending data. As this only
+                    //   happens when optimistic write failed, we choose to first drain the
+                    //   write buffer in this case before receiving more. This avoids
+                    //   needlessly queueing received data, if the remote peer is not themselves
+                    //   receiving data. This means properly utilizing TCP flow control signalling.
+                    // * Otherwise, if there is no (complete) message in the receive buffer,
+                    //   or there is space left in the buffer, select() for receiving data.
+                    // * (if neither of the above applies, there is certainly one message
+                    //   in the receiver buffer ready to be processed).
+                    // Together, that means that at least one of the following is always possible,
+                    // so we don't deadlock:
+                    // * We send some data.
+                    // * We wait for data to be received (and disconnect after timeout).
+                    // * We process a message in the buffer (message handler thread).
+                    if (HasDataToSend(pnode)) {
                         FD_SET(pnode->hSocket, &fdsetSend);
                         continue;
                     }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (HasRoomToReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
         }
 
         //
@@ -1181,7 +1419,7 @@ void ThreadSocketHandler()
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && (fAcceptReady || FD_ISSET(hListenSocket.socket, &fdsetRecv)))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1206,18 +1444,41 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fRecv;
+            if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+                // The select() logic above, applied to the sockets epoll
+                // reported readable, which stay so until drained
+                fRecv = pnode->fHasSocketError ||
+                    (pnode->fHasRecvData && !HasDataToSend(pnode) && HasRoomToReceive(pnode));
+            } else {
+                fRecv = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+            }
+            if (fRecv)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
                     {
                         // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        char pchBuf[RECV_CHUNK_SIZE];
+                        // The bulk of a large message (a block) goes straight
+                        // into its pooled slabs instead of through pchBuf
+                        unsigned int nWindow = 0;
+                        char* pchWindow = pnode->GetRecvWindow(nWindow);
+                        if (pchWindow == NULL) {
+                            pchWindow = pchBuf;
+                            nWindow = sizeof(pchBuf);
+                        }
+                        int nBytes = recv(pnode->hSocket, pchWindow, nWindow, MSG_DONTWAIT);
+                        // A short read empties the socket; epoll reports it
+                        // again when more data arrives
+                        if (nBytes < (int)nWindow)
+                            pnode->fHasRecvData = false;
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (pchWindow != pchBuf)
+                                pnode->ReceivedInPlace(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1250,11 +1511,21 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            bool fSend;
+            if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+                fSend = pnode->fCanSendData && pnode->nSendSize > 0;
+            else
+                fSend = FD_ISSET(pnode->hSocket, &fdsetSend);
+            if (fSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // Data left over means the socket is full; epoll reports
+                    // when it has room again
+                    if (pnode->nSendSize > 0)
+                        pnode->fCanSendData = false;
+                }
             }
 
             //
@@ -1577,6 +1848,57 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+/** Hand a node whose next message was left for the workers to a message worker. */
+static void QueueMessageWorker(CNode* pnode)
+{
+    {
+        LOCK(cs_vNodes);
+        pnode->AddRef();
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgWorkerQueue);
+        vMsgWorkerQueue.push_back(pnode);
+    }
+    condMsgWorkerQueue.notify_one();
+}
+
+/**
+ * Process the messages that need no consensus state (pings, addresses,
+ * masternode list requests, masternode ping signatures) of one node at a time,
+ * until a message that has to be handled in order with block and
+ * transaction processing is next; that one is left to ThreadMessageHandler.
+ */
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgWorkerQueue);
+            while (vMsgWorkerQueue.empty())
+                condMsgWorkerQueue.wait(lock);
+            pnode = vMsgWorkerQueue.front();
+            vMsgWorkerQueue.pop_front();
+        }
+
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            if (!pnode->fDisconnect && !g_signals.ProcessMessages(pnode, true))
+                pnode->CloseSocketDisconnect();
+        }
+        pnode->fOnMsgWorker = false;
+
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+
+        // The rest of this node's messages are for the message handler thread
+        messageHandlerCondition.notify_one();
+    }
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1603,7 +1925,7 @@ void ThreadMessageHandler()
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
+            if (pnode->fDisconnect || pnode->fOnMsgWorker)
                 continue;
 
             // Receive messages
@@ -1611,9 +1933,15 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
-                    if (!g_signals.ProcessMessages(pnode))
+                    if (!g_signals.ProcessMessages(pnode, false))
                         pnode->CloseSocketDisconnect();
 
+                    if (pnode->fOnMsgWorker)
+                    {
+                        QueueMessageWorker(pnode);
+                        continue;
+                    }
+
                     if (pnode->nSendSize < SendBufferSize())
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
@@ -1672,7 +2000,7 @@ bool BindListenPort(const CService &addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (!IsWaitableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -1822,6 +2150,27 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#if HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed, falling back to select: %s\n", NetworkErrorString(errno));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
+        }
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            if (hEpoll == -1)
+                break;
+            // Level-triggered, as one connection is accepted per loop
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(errno));
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select");
+
     Discover(threadGroup);
 
     //
@@ -1844,6 +2193,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageWorkers; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgworker", &ThreadMessageWorker));
+    LogPrintf("Using %d message worker threads\n", nMessageWorkers);
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
@@ -1880,6 +2232,11 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#if HAVE_SYS_EPOLL_H
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1908,30 +2265,103 @@ instance_of_cnetcleanup;
 
 
 
+CRelayCache::CRelayCache(size_t nMaxBytesIn) :
+    nMaxBytes(nMaxBytesIn), nBytes(0), vSlots(RELAY_CACHE_EXPIRY / RELAY_CACHE_SLOT_SECONDS + 1), nSlot(0), nEvicted(0)
+{
+}
+
+void CRelayCache::EraseSlot(std::deque<CInv>& slot)
+{
+    BOOST_FOREACH(const CInv& inv, slot) {
+        std::map<CInv, DataRef>::iterator it = mapRelay.find(inv);
+        if (it != mapRelay.end()) {
+            nBytes -= it->second->size();
+            mapRelay.erase(it);
+        }
+    }
+    slot.clear();
+}
+
+void CRelayCache::Expire(int64_t nNow)
+{
+    int64_t nNowSlot = nNow / RELAY_CACHE_SLOT_SECONDS;
+    // After a long pause every slot is expired, no need to turn the wheel further
+    nSlot = std::max(nSlot, nNowSlot - (int64_t)vSlots.size());
+    while (nSlot < nNowSlot) {
+        nSlot++;
+        EraseSlot(Slot(nSlot));
+    }
+}
+
+void CRelayCache::Trim()
+{
+    // The slot after the current one is the oldest
+    for (int64_t n = nSlot + 1; nBytes > nMaxBytes && n <= nSlot + (int64_t)vSlots.size(); n++) {
+        std::deque<CInv>& slot = Slot(n);
+        while (nBytes > nMaxBytes && !slot.empty()) {
+            std::map<CInv, DataRef>::iterator it = mapRelay.find(slot.front());
+            if (it != mapRelay.end()) {
+                nBytes -= it->second->size();
+                mapRelay.erase(it);
+                nEvicted++;
+            }
+            slot.pop_front();
+        }
+    }
+}
+
+CRelayCache::DataRef CRelayCache::Get(const CInv& inv)
+{
+    LOCK(cs);
+    Expire(GetTime());
+    std::map<CInv, DataRef>::const_iterator it = mapRelay.find(inv);
+    if (it == mapRelay.end())
+        return DataRef();
+    return it->second;
+}
+
+void CRelayCache::Insert(const CInv& inv, const DataRef& data)
+{
+    LOCK(cs);
+    Expire(GetTime());
+    if (data->size() > nMaxBytes || !mapRelay.insert(std::make_pair(inv, data)).second)
+        return;
+    Slot(nSlot).push_back(inv);
+    nBytes += data->size();
+    Trim();
+}
+
+void CRelayCache::SetMaxBytes(size_t nMaxBytesIn)
+{
+    LOCK(cs);
+    nMaxBytes = nMaxBytesIn;
+    Trim();
+}
+
+void CRelayCache::GetStats(CRelayCacheStats& stats) const
+{
+    LOCK(cs);
+    stats.nEntries = mapRelay.size();
+    stats.nBytes = nBytes;
+    stats.nMaxBytes = nMaxBytes;
+    stats.nEvicted = nEvicted;
+}
+
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
+    // Serialized once, straight into the buffer shared by all the replies
+    std::shared_ptr<CDataStream> ss = std::make_shared<CDataStream>(SER_NETWORK, PROTOCOL_VERSION);
+    ss->reserve(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+    *ss << tx;
     RelayTransaction(tx, ss);
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const CRelayCache::DataRef& data)
 {
     CInv inv(MSG_TX, tx.GetHash());
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+    // Save original serialized message so newer versions are preserved
+    relayCache.Insert(inv, data);
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1977,10 +2407,123 @@ void CNode::RecordBytesRecv(uint64_t bytes)
     nTotalBytesRecv += bytes;
 }
 
-void CNode::RecordBytesSent(uint64_t bytes)
+void CNode::RecordBytesSent(uint64_t bytes, bool fWhitelisted)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+
+    // Whitelisted peers are always served, so their traffic is not held
+    // against the target for everyone else
+    if (!fWhitelisted)
+        nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::RecordBlockSize(uint64_t nSize)
+{
+    LOCK(cs_totalBytesSent);
+    // Moving average over roughly the last 64 blocks
+    if (nRecentBlockSize == 0)
+        nRecentBlockSize = nSize;
+    else
+        nRecentBlockSize = (nRecentBlockSize * 63 + nSize) / 64;
+}
+
+void CNode::RecordMessageSent(int nClass, uint64_t nBytes, int64_t nWaitMicros)
+{
+    LOCK(cs_totalBytesSent);
+    CSendClassStats& stats = sendClassStats[nClass];
+    stats.nMessages++;
+    stats.nBytes += nBytes;
+    stats.nTotalWaitMicros += nWaitMicros;
+    stats.nMaxWaitMicros = std::max(stats.nMaxWaitMicros, nWaitMicros);
+}
+
+void CNode::GetSendClassStats(std::vector<CSendClassStats>& vStats)
+{
+    LOCK(cs_totalBytesSent);
+    vStats.assign(sendClassStats, sendClassStats + SEND_CLASS_MAX);
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - GetTime();
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe)
+    {
+        // reset measure-cycle in case of changing
+        // the timeframe
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit)
+    {
+        // keep a large enough buffer to at least relay each block once; blocks
+        // are far below the maximum size, so reserve what recent ones took
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / Params().GetConsensus().nPowTargetSpacing * nRecentBlockSize;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2134,6 +2677,55 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
+bool SetSocketEventsMode(const std::string& strMode)
+{
+    if (strMode == "select") {
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#if HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        nSocketEventsMode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetDefaultSocketEventsMode()
+{
+#if HAVE_SYS_EPOLL_H
+    return "epoll";
+#else
+    return "select";
+#endif
+}
+
+SendClass GetSendClass(const char* pszCommand)
+{
+    for (size_t i = 0; i < ARRAYLEN(SEND_CLASS_COMMANDS); i++) {
+        if (strcmp(pszCommand, SEND_CLASS_COMMANDS[i].pszCommand) == 0)
+            return SEND_CLASS_COMMANDS[i].sendClass;
+    }
+    return SEND_CLASS_TIP;
+}
+
+const char* GetSendClassName(int nClass)
+{
+    switch (nClass) {
+    case SEND_CLASS_TIP: return "tip";
+    case SEND_CLASS_MASTERNODE: return "masternode";
+    case SEND_CLASS_TX: return "tx";
+    case SEND_CLASS_HISTORY: return "history";
+    }
+    return "unknown";
+}
+
+uint64_t GetSendClassQuantum(int nClass)
+{
+    return SEND_CLASS_QUANTUM[nClass];
+}
+
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
@@ -2142,6 +2734,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nServices = 0;
     hSocket = hSocketIn;
     nRecvVersion = INIT_PROTO_VERSION;
+    fHasRecvData = false;
+    fCanSendData = false;
+    fHasSocketError = false;
+    fOnMsgWorker = false;
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
@@ -2162,11 +2758,18 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendClass = SEND_CLASS_TIP;
+    for (int i = 0; i < SEND_CLASS_MAX; i++)
+        vSendDeficit[i] = 0;
+    nSendClassOverride = -1;
+    nSendClassQueued = SEND_CLASS_TIP;
     hashContinue = uint256();
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
     fSentAddr = false;
+    fResetAddrKnown = false;
+    fAdvertizeLocal = false;
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2240,6 +2843,7 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
+    nSendClassQueued = nSendClassOverride >= 0 ? nSendClassOverride : GetSendClass(pszCommand);
     ssSend << CMessageHeader(Params().MessageStart(), pszCommand, 0);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
@@ -2285,12 +2889,15 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    bool fQueueEmpty = nSendSize == 0;
+    std::deque<CSendMessage>& queue = vSendMsg[nSendClassQueued];
+    queue.push_back(CSendMessage());
+    ssSend.GetAndClear(queue.back().data);
+    queue.back().nTimeQueued = GetTimeMicros();
+    nSendSize += queue.back().data.size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (fQueueEmpty)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -14,12 +14,15 @@
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
+#include "recvbuffer.h"
 #include "streams.h"
 #include "sync.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -61,10 +64,55 @@ static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The period before a network upgrade activates, where connections to upgrading peers are preferred (in blocks). */
 static const int NETWORK_UPGRADE_PEER_PREFERENCE_BLOCK_PERIOD = 24 * 24 * 3;
+/** -msgworkers default, the threads handling messages that need no consensus state */
+static const int DEFAULT_MESSAGE_WORKERS = 2;
+/** Maximum number of message worker threads */
+static const int MAX_MESSAGE_WORKERS = 16;
+/** Default for -maxrelaycache, in megabytes. */
+static const unsigned int DEFAULT_MAX_RELAY_CACHE_SIZE = 16;
+/** Time relayed transactions are kept for serving them to peers (in seconds). */
+static const int RELAY_CACHE_EXPIRY = 15 * 60;
+/** Width of a slot of the relay cache expiry wheel (in seconds). */
+static const int RELAY_CACHE_SLOT_SECONDS = 60;
+/** -maxuploadtarget default, in megabytes per MAX_UPLOAD_TIMEFRAME; 0 = no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The period -maxuploadtarget applies to (in seconds). */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+
+/**
+ * Classes of outbound messages, from the most urgent. Each peer's send queue
+ * takes turns between them, sending up to a byte budget of each class per
+ * turn (deficit round robin), so that a peer downloading old blocks neither
+ * holds up our votes and new blocks to it nor is starved by them.
+ */
+enum SendClass {
+    SEND_CLASS_TIP,         //!< New blocks and headers, and the network's control messages
+    SEND_CLASS_MASTERNODE,  //!< Masternode, budget, spork and instantsend messages
+    SEND_CLASS_TX,          //!< Transaction relay
+    SEND_CLASS_HISTORY,     //!< Blocks below the tip, for peers catching up
+    SEND_CLASS_MAX
+};
+
+/** The send class of a command; blocks are sent as SEND_CLASS_TIP unless queued with CSendClassScope. */
+SendClass GetSendClass(const char* pszCommand);
+const char* GetSendClassName(int nClass);
+/** Bytes of a class each peer's send queue may send per turn */
+uint64_t GetSendClassQuantum(int nClass);
+
+/** How the socket handler thread waits for sockets to become ready. */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
+/** Set the socket events mode from a -socketevents value; false if it is unknown or not supported by this build. */
+bool SetSocketEventsMode(const std::string& strMode);
+/** The -socketevents value used when none is given: epoll where the build supports it. */
+std::string GetDefaultSocketEventsMode();
+
 void AddOneShot(const std::string& strDest);
 void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
@@ -101,7 +149,7 @@ struct CombinerAll
 struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
-    boost::signals2::signal<bool (CNode*), CombinerAll> ProcessMessages;
+    boost::signals2::signal<bool (CNode*, bool), CombinerAll> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
@@ -138,6 +186,57 @@ bool IsReachable(const CNetAddr &addr);
 CAddress GetLocalAddress(const CNetAddr *paddrPeer = NULL);
 
 
+struct CRelayCacheStats
+{
+    size_t nEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+    //! Entries dropped before expiring to stay within nMaxBytes
+    uint64_t nEvicted;
+};
+
+/**
+ * The serialized form of relayed transactions, kept for RELAY_CACHE_EXPIRY
+ * to answer getdata requests following our inv. Bounded in bytes: when it is
+ * full the oldest entries go first, and a request for a transaction no longer
+ * cached is answered from the mempool if it is still there.
+ *
+ * Entries are refcounted so that replies share them, and expire on a wheel
+ * of RELAY_CACHE_SLOT_SECONDS wide slots, each holding the entries added in
+ * that time.
+ */
+class CRelayCache
+{
+public:
+    typedef std::shared_ptr<const CDataStream> DataRef;
+
+private:
+    mutable CCriticalSection cs;
+    size_t nMaxBytes;
+    size_t nBytes;
+    std::map<CInv, DataRef> mapRelay;
+    //! Entries by the slot they were added in, wrapping around
+    std::vector<std::deque<CInv> > vSlots;
+    //! Number of the current slot, the time divided by the slot width
+    int64_t nSlot;
+    uint64_t nEvicted;
+
+    std::deque<CInv>& Slot(int64_t n) { return vSlots[n % vSlots.size()]; }
+    void EraseSlot(std::deque<CInv>& slot);
+    void Expire(int64_t nNow);
+    void Trim();
+
+public:
+    CRelayCache(size_t nMaxBytesIn);
+
+    DataRef Get(const CInv& inv);
+    /** Add an entry, if it is not there yet. Entries larger than the whole cache are not kept. */
+    void Insert(const CInv& inv, const DataRef& data);
+    void SetMaxBytes(size_t nMaxBytesIn);
+    void GetStats(CRelayCacheStats& stats) const;
+};
+
+
 extern bool fDiscover;
 extern bool fListen;
 extern uint64_t nLocalServices;
@@ -145,12 +244,14 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+extern SocketEventsMode nSocketEventsMode;
+/** Number of message worker threads; with none, all messages are handled by the message handler thread */
+extern int nMessageWorkers;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
+/** Serialized transactions recently relayed to peers */
+extern CRelayCache relayCache;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -192,7 +293,26 @@ public:
     std::string addrLocal;
 };
 
+/** Totals of the messages sent in one send class */
+struct CSendClassStats
+{
+    uint64_t nMessages;
+    uint64_t nBytes;
+    //! Time from queueing to the last byte being sent, in microseconds
+    int64_t nTotalWaitMicros;
+    int64_t nMaxWaitMicros;
 
+    CSendClassStats() : nMessages(0), nBytes(0), nTotalWaitMicros(0), nMaxWaitMicros(0) {}
+};
+
+/** A message waiting in a peer's send queue */
+struct CSendMessage
+{
+    CSerializeData data;
+    int64_t nTimeQueued; // time (in microseconds) the message was queued
+
+    CSendMessage() : nTimeQueued(0) {}
+};
 
 
 class CNetMessage {
@@ -203,34 +323,39 @@ public:
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
-    unsigned int nDataPos;
+    CRecvBuffer payload;            // received message data, in pooled slabs
+    int nType;
+    int nVersion;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
+    bool fPrechecked;               // checked by a message worker, left for the message handler thread
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), nType(nTypeIn), nVersion(nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
-        nDataPos = 0;
         nTime = 0;
+        fPrechecked = false;
     }
 
     bool complete() const
     {
         if (!in_data)
             return false;
-        return (hdr.nMessageSize == nDataPos);
+        return (hdr.nMessageSize == payload.size());
     }
 
     void SetVersion(int nVersionIn)
     {
         hdrbuf.SetVersion(nVersionIn);
-        vRecv.SetVersion(nVersionIn);
+        nVersion = nVersionIn;
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Room to receive the rest of the payload into directly, see CRecvBuffer::GetWindow */
+    char* GetDataWindow(unsigned int& nWindow);
 };
 
 
@@ -246,17 +371,30 @@ public:
     SOCKET hSocket;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendOffset; // offset inside the message being sent, see SelectSendClass
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg[SEND_CLASS_MAX]; // by send class
+    int nSendClass; // class whose turn it is to send
+    int64_t vSendDeficit[SEND_CLASS_MAX]; // bytes each class may still send in its turn
+    int nSendClassOverride; // class of the messages pushed in a CSendClassScope, or -1
+    int nSendClassQueued; // class of the message being built in ssSend
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Set while a message worker owns this node's received messages; the
+    // message handler thread neither processes nor sends for it meanwhile
+    std::atomic<bool> fOnMsgWorker;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Socket readiness last reported by epoll, which only reports changes;
+    // used by the socket handler thread only
+    bool fHasRecvData;
+    bool fCanSendData;
+    bool fHasSocketError;
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nTimeConnected;
@@ -315,9 +453,13 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay; vAddrToSend and addrKnown are guarded by cs_vSend
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    // Address refresh requested by the periodic rebroadcast, carried out by
+    // SendMessages for this node while it holds its own cs_vSend
+    std::atomic<bool> fResetAddrKnown;
+    std::atomic<bool> fAdvertizeLocal;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -349,6 +491,14 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CSendClassStats sendClassStats[SEND_CLASS_MAX];
+
+    // outbound limit & stats
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+    static uint64_t nRecentBlockSize;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -370,13 +520,23 @@ public:
     {
         unsigned int total = 0;
         BOOST_FOREACH(const CNetMessage &msg, vRecvMsg)
-            total += msg.vRecv.size() + 24;
+            total += msg.payload.Capacity() + 24;
         return total;
     }
 
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    /**
+     * Where to receive the rest of a large message being received straight
+     * into its payload slabs, or NULL to receive into a buffer and pass it
+     * to ReceiveMsgBytes. Tell ReceivedInPlace how many bytes were written.
+     */
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvWindow(unsigned int& nWindow);
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedInPlace(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -437,6 +597,14 @@ public:
 
     void AskFor(const CInv& inv);
 
+    /**
+     * The class of the next message to send: the one being sent, if it was
+     * only sent in part, otherwise the next class whose turn allows it to
+     * send the message at the head of its queue. There must be a message.
+     */
+    // requires LOCK(cs_vSend)
+    int SelectSendClass();
+
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
 
@@ -693,17 +861,72 @@ public:
 
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
-    static void RecordBytesSent(uint64_t bytes);
+    //! Bytes sent to whitelisted peers do not count towards the max outbound target
+    static void RecordBytesSent(uint64_t bytes, bool fWhitelisted);
+    //! Track the size of connected blocks, to size what OutboundTargetReached keeps for relaying new ones
+    static void RecordBlockSize(uint64_t nSize);
+    static void RecordMessageSent(int nClass, uint64_t nBytes, int64_t nWaitMicros);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+    static void GetSendClassStats(std::vector<CSendClassStats>& vStats);
+
+    //!set the max outbound target in bytes
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //!set the timeframe for the max outbound target
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //!check if the outbound target is reached
+    // if param historicalBlockServingLimit is set true, the function will
+    // response true if the limit for serving historical blocks has been reached,
+    // which keeps enough of the target back to relay each new block of the
+    // cycle once, at the recent average block size
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //!response the bytes left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //!response the time in second left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+};
+
+/**
+ * Queues the messages pushed to a peer while it exists in the given send
+ * class instead of the class of their command, for messages that must stay
+ * in order with each other, such as an old block and the inv following it.
+ * Holds the peer's cs_vSend.
+ */
+class CSendClassScope
+{
+private:
+    CNode* pnode;
+    int nPrevClass;
+
+public:
+    CSendClassScope(CNode* pnodeIn, SendClass sendClass) : pnode(pnodeIn)
+    {
+        ENTER_CRITICAL_SECTION(pnode->cs_vSend);
+        nPrevClass = pnode->nSendClassOverride;
+        pnode->nSendClassOverride = sendClass;
+    }
+
+    ~CSendClassScope()
+    {
+        pnode->nSendClassOverride = nPrevClass;
+        LEAVE_CRITICAL_SECTION(pnode->cs_vSend);
+    }
 };
 
 
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const CRelayCache::DataRef& data);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
@@ -86,6 +86,9 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    //! Set by the parallel reindex once the Equihash solution, proof of work
+    //! and merkle root have been checked, so that CheckBlock skips them
+    mutable bool fPreChecked;
 
     CBlock()
     {
@@ -112,6 +115,7 @@ public:
         vtx.clear();
         payee = CScript();
         vMerkleTree.clear();
+        fPreChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
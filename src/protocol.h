@@ -176,7 +176,28 @@ enum {
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
-    MSG_DSTX
+    MSG_DSTX,
+    // Requests a block as a "cmpctblock" in a getdata. BIP152 numbers this
+    // type 4, which is MSG_TXLOCK_REQUEST here, so it is appended instead.
+    MSG_CMPCT_BLOCK
+};
+
+/**
+ * Compact block relay (BIP152) messages. Other commands are still spelled
+ * out where they are sent and handled.
+ */
+namespace NetMsgType {
+/**
+ * Announces whether this node wants new blocks pushed as "cmpctblock"
+ * (high bandwidth mode) and which compact block version it speaks.
+ */
+extern const char* SENDCMPCT;
+/** A block as its header, short transaction ids and prefilled transactions. */
+extern const char* CMPCTBLOCK;
+/** Requests the transactions of a compact block that could not be rebuilt locally. */
+extern const char* GETBLOCKTXN;
+/** The transactions asked for by a "getblocktxn". */
+extern const char* BLOCKTXN;
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -0,0 +1,139 @@
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recvbuffer.h"
+
+#include "hash.h"
+
+#include <assert.h>
+
+CRecvBufferPool& GetRecvBufferPool()
+{
+    // Never destroyed: nodes, and the messages holding slabs, are still
+    // freed during static destruction
+    static CRecvBufferPool* pool = new CRecvBufferPool();
+    return *pool;
+}
+
+namespace {
+
+size_t SizeClass(size_t nBytes)
+{
+    size_t nClass = 0;
+    while ((RECV_SLAB_MIN_SIZE << nClass) < nBytes && (RECV_SLAB_MIN_SIZE << nClass) < RECV_SLAB_SIZE)
+        nClass++;
+    return nClass;
+}
+
+}
+
+CRecvBufferPool::CRecvBufferPool() :
+    vFree(SizeClass(RECV_SLAB_SIZE) + 1), nUsedBytes(0), nPeakUsedBytes(0), nFreeBytes(0), nAllocations(0), nReuses(0)
+{
+}
+
+CRecvBufferPool::~CRecvBufferPool()
+{
+    for (size_t i = 0; i < vFree.size(); i++)
+        for (size_t j = 0; j < vFree[i].size(); j++)
+            delete[] vFree[i][j];
+}
+
+CRecvBufferPool::SlabRef CRecvBufferPool::Get(size_t nBytes)
+{
+    size_t nClass = SizeClass(nBytes);
+    size_t nSize = RECV_SLAB_MIN_SIZE << nClass;
+    char* data = NULL;
+    {
+        LOCK(cs);
+        if (!vFree[nClass].empty()) {
+            data = vFree[nClass].back();
+            vFree[nClass].pop_back();
+            nFreeBytes -= nSize;
+            nReuses++;
+        } else {
+            nAllocations++;
+        }
+        nUsedBytes += nSize;
+        nPeakUsedBytes = std::max(nPeakUsedBytes, nUsedBytes);
+    }
+    if (data == NULL)
+        data = new char[nSize];
+    return SlabRef(new Slab(data, nSize), [this](Slab* slab) { Release(slab); });
+}
+
+void CRecvBufferPool::Release(Slab* slab)
+{
+    {
+        LOCK(cs);
+        nUsedBytes -= slab->nSize;
+        if (nFreeBytes + slab->nSize <= RECV_POOL_MAX_FREE) {
+            vFree[SizeClass(slab->nSize)].push_back(slab->data);
+            nFreeBytes += slab->nSize;
+            delete slab;
+            return;
+        }
+    }
+    delete[] slab->data;
+    delete slab;
+}
+
+void CRecvBufferPool::GetStats(CRecvBufferPoolStats& stats) const
+{
+    LOCK(cs);
+    stats.nUsedBytes = nUsedBytes;
+    stats.nPeakUsedBytes = nPeakUsedBytes;
+    stats.nFreeBytes = nFreeBytes;
+    stats.nAllocations = nAllocations;
+    stats.nReuses = nReuses;
+}
+
+size_t CRecvBuffer::Capacity() const
+{
+    size_t nCapacity = 0;
+    for (size_t i = 0; i < vSlabs.size(); i++)
+        nCapacity += vSlabs[i]->nSize;
+    return nCapacity;
+}
+
+char* CRecvBuffer::GetWindow(size_t nMax, size_t& nWindow)
+{
+    assert(nMax > 0);
+    if (vSlabs.empty() || nLastUsed == vSlabs.back()->nSize) {
+        vSlabs.push_back(pool->Get(nMax));
+        nLastUsed = 0;
+    }
+    const CRecvBufferPool::Slab& slab = *vSlabs.back();
+    nWindow = std::min(nMax, slab.nSize - nLastUsed);
+    return slab.data + nLastUsed;
+}
+
+void CRecvBuffer::Commit(size_t nBytes)
+{
+    assert(!vSlabs.empty() && nLastUsed + nBytes <= vSlabs.back()->nSize);
+    nLastUsed += nBytes;
+    nSize += nBytes;
+}
+
+void CRecvBuffer::Write(const char* pch, size_t nBytes)
+{
+    while (nBytes > 0) {
+        size_t nWindow;
+        char* pchWindow = GetWindow(nBytes, nWindow);
+        memcpy(pchWindow, pch, nWindow);
+        Commit(nWindow);
+        pch += nWindow;
+        nBytes -= nWindow;
+    }
+}
+
+uint256 CRecvBuffer::GetHash() const
+{
+    CHash256 hasher;
+    for (size_t i = 0; i < vSlabs.size(); i++)
+        hasher.Write((const unsigned char*)vSlabs[i]->data, i + 1 < vSlabs.size() ? vSlabs[i]->nSize : nLastUsed);
+    uint256 hash;
+    hasher.Finalize(hash.begin());
+    return hash;
+}
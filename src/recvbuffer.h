@@ -0,0 +1,200 @@
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RECVBUFFER_H
+#define BITCOIN_RECVBUFFER_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <ios>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/** Size of the largest receive slab; larger payloads take several */
+static const size_t RECV_SLAB_SIZE = 256 * 1024;
+/** Size of the smallest receive slab */
+static const size_t RECV_SLAB_MIN_SIZE = 1024;
+/** Bytes of free slabs kept for reuse */
+static const size_t RECV_POOL_MAX_FREE = 32 * 1024 * 1024;
+
+struct CRecvBufferPoolStats
+{
+    //! Bytes of the slabs holding received messages
+    size_t nUsedBytes;
+    //! Highest nUsedBytes since startup
+    size_t nPeakUsedBytes;
+    //! Bytes of free slabs kept for reuse
+    size_t nFreeBytes;
+    uint64_t nAllocations;
+    //! Slabs handed out again instead of being allocated
+    uint64_t nReuses;
+};
+
+/**
+ * Pool of the slabs that received message payloads are stored in. Slabs come
+ * in power of two sizes from RECV_SLAB_MIN_SIZE to RECV_SLAB_SIZE. Released
+ * slabs are kept for reuse up to RECV_POOL_MAX_FREE bytes, so that a stream
+ * of block downloads does not allocate megabytes for every block.
+ *
+ * The socket handler thread fills slabs and the message threads release
+ * them, so the pool is thread safe.
+ */
+class CRecvBufferPool
+{
+public:
+    class Slab
+    {
+    public:
+        char* const data;
+        const size_t nSize;
+
+        Slab(char* dataIn, size_t nSizeIn) : data(dataIn), nSize(nSizeIn) {}
+    };
+    typedef std::shared_ptr<Slab> SlabRef;
+
+private:
+    mutable CCriticalSection cs;
+    //! Free slabs by size class, the smallest first
+    std::vector<std::vector<char*> > vFree;
+    size_t nUsedBytes;
+    size_t nPeakUsedBytes;
+    size_t nFreeBytes;
+    uint64_t nAllocations;
+    uint64_t nReuses;
+
+    void Release(Slab* slab);
+
+    CRecvBufferPool(const CRecvBufferPool&);
+    CRecvBufferPool& operator=(const CRecvBufferPool&);
+
+public:
+    CRecvBufferPool();
+    ~CRecvBufferPool();
+
+    /** A slab for nBytes: the smallest size class that fits, up to RECV_SLAB_SIZE. */
+    SlabRef Get(size_t nBytes);
+    void GetStats(CRecvBufferPoolStats& stats) const;
+};
+
+/** Slabs of all received messages; outlives every CRecvBuffer */
+CRecvBufferPool& GetRecvBufferPool();
+
+/**
+ * A message payload received into a chain of pooled slabs. Copies share the
+ * slabs, which go back to the pool with the last reference.
+ */
+class CRecvBuffer
+{
+private:
+    CRecvBufferPool* pool;
+    std::vector<CRecvBufferPool::SlabRef> vSlabs;
+    size_t nSize;
+    //! Bytes used in the last slab; all the others are full
+    size_t nLastUsed;
+
+    friend class CRecvStream;
+
+public:
+    CRecvBuffer() : pool(&GetRecvBufferPool()), nSize(0), nLastUsed(0) {}
+    explicit CRecvBuffer(CRecvBufferPool& poolIn) : pool(&poolIn), nSize(0), nLastUsed(0) {}
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    /** Bytes of the slabs held */
+    size_t Capacity() const;
+
+    /**
+     * Where the next bytes go, to receive into directly: room for up to
+     * nMax bytes at the end of the last slab, or in a new slab sized for
+     * nMax if it is full. Commit the bytes actually written.
+     */
+    char* GetWindow(size_t nMax, size_t& nWindow);
+    void Commit(size_t nBytes);
+    /** Append a copy of the given bytes */
+    void Write(const char* pch, size_t nBytes);
+
+    /** Double-SHA256 of the contents */
+    uint256 GetHash() const;
+
+    /** Append the contents to a stream such as CDataStream */
+    template<typename Stream>
+    void CopyTo(Stream& s) const
+    {
+        for (size_t i = 0; i < vSlabs.size(); i++)
+            s.write(vSlabs[i]->data, i + 1 < vSlabs.size() ? vSlabs[i]->nSize : nLastUsed);
+    }
+};
+
+/**
+ * Read-only stream over a CRecvBuffer, to deserialize a payload straight
+ * from its slabs instead of from a contiguous copy.
+ */
+class CRecvStream
+{
+private:
+    const CRecvBuffer& buf;
+    int nType;
+    int nVersion;
+    size_t nSlab;
+    size_t nSlabPos;
+    size_t nRemaining;
+
+    template<typename F>
+    void Consume(size_t nBytes, F f)
+    {
+        if (nBytes > nRemaining)
+            throw std::ios_base::failure("CRecvStream::read(): end of data");
+        nRemaining -= nBytes;
+        while (nBytes > 0) {
+            const CRecvBufferPool::Slab& slab = *buf.vSlabs[nSlab];
+            size_t nChunk = std::min(nBytes, slab.nSize - nSlabPos);
+            f(slab.data + nSlabPos, nChunk);
+            nSlabPos += nChunk;
+            nBytes -= nChunk;
+            if (nSlabPos == slab.nSize) {
+                nSlab++;
+                nSlabPos = 0;
+            }
+        }
+    }
+
+public:
+    CRecvStream(const CRecvBuffer& bufIn, int nTypeIn, int nVersionIn) :
+        buf(bufIn), nType(nTypeIn), nVersion(nVersionIn), nSlab(0), nSlabPos(0), nRemaining(bufIn.size()) {}
+
+    int GetType() const          { return nType; }
+    int GetVersion() const       { return nVersion; }
+    void SetVersion(int n)       { nVersion = n; }
+    size_t size() const          { return nRemaining; }
+    bool empty() const           { return nRemaining == 0; }
+    int in_avail() const         { return nRemaining; }
+
+    void read(char* pch, size_t nSize)
+    {
+        Consume(nSize, [&pch](const char* pchSlab, size_t nChunk) {
+            memcpy(pch, pchSlab, nChunk);
+            pch += nChunk;
+        });
+    }
+
+    void ignore(size_t nSize)
+    {
+        Consume(nSize, [](const char*, size_t) {});
+    }
+
+    template<typename T>
+    CRecvStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+};
+
+#endif // BITCOIN_RECVBUFFER_H
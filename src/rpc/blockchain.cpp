@@ -11,6 +11,7 @@
 #include "consensus/validation.h"
 #include "key_io.h"
 #include "main.h"
+#include "net.h"
 #include "primitives/transaction.h"
 #include "pubkey.h"
 #include "rpc/server.h"
@@ -115,7 +116,7 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     result.push_back(Pair("finalsaplingroot", blockindex->hashFinalSaplingRoot.GetHex()));
     result.push_back(Pair("time", (int64_t)blockindex->nTime));
     result.push_back(Pair("nonce", blockindex->nNonce.GetHex()));
-    result.push_back(Pair("solution", HexStr(blockindex->nSolution)));
+    result.push_back(Pair("solution", HexStr(blockindex->GetBlockHeader().nSolution)));
     result.push_back(Pair("bits", strprintf("%08x", blockindex->nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
@@ -697,17 +698,18 @@ UniValue getblock(const UniValue& params, bool fHelp)
     if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
 
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
-
     if (verbosity == 0)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        // Blocks are stored in their network serialization
+        std::vector<unsigned char> vBlock;
+        if (!ReadRawBlockFromDisk(vBlock, pblockindex))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        return HexStr(vBlock.begin(), vBlock.end());
     }
 
+    if(!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
     return blockToJSON(block, pblockindex, verbosity >= 2);
 }
 
@@ -1130,6 +1132,15 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
 
+    CRelayCacheStats stats;
+    relayCache.GetStats(stats);
+    UniValue relayObj(UniValue::VOBJ);
+    relayObj.push_back(Pair("size", (int64_t) stats.nEntries));
+    relayObj.push_back(Pair("bytes", (int64_t) stats.nBytes));
+    relayObj.push_back(Pair("maxbytes", (int64_t) stats.nMaxBytes));
+    relayObj.push_back(Pair("evicted", stats.nEvicted));
+    ret.push_back(Pair("relaycache", relayObj));
+
     return ret;
 }
 
@@ -1144,6 +1155,12 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"relaycache\": {              (json object) Serialized transactions kept for serving to peers after relaying them\n"
+            "    \"size\": xxxxx              (numeric) Number of transactions in the cache\n"
+            "    \"bytes\": xxxxx             (numeric) Size of the cached transactions\n"
+            "    \"maxbytes\": xxxxx          (numeric) Maximum size of the cache, see -maxrelaycache\n"
+            "    \"evicted\": xxxxx           (numeric) Transactions dropped before expiring to stay within maxbytes\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
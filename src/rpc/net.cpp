@@ -364,7 +364,41 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"rawblockcache\": {      (json object) Recent serialized blocks kept for serving to peers\n"
+            "    \"hits\": n,           (numeric) Block requests answered from the cache\n"
+            "    \"misses\": n,         (numeric) Requests for recent blocks that had to read the disk\n"
+            "    \"hitrate\": x.xxx,    (numeric) Share of requests for recent blocks answered from the cache\n"
+            "    \"bytessaved\": n,     (numeric) Block bytes served without reading the disk\n"
+            "    \"blocks\": n,         (numeric) Number of blocks in the cache\n"
+            "    \"bytes\": n,          (numeric) Size of the cached blocks\n"
+            "    \"maxbytes\": n        (numeric) Maximum size of the cache, see -rawblockcache\n"
+            "  },\n"
+            "  \"recvbuffers\": {        (json object) Pooled slabs that received messages are stored in\n"
+            "    \"usedbytes\": n,      (numeric) Size of the slabs holding received messages\n"
+            "    \"peakusedbytes\": n,  (numeric) Highest usedbytes since startup\n"
+            "    \"freebytes\": n,      (numeric) Size of the free slabs kept for reuse\n"
+            "    \"allocations\": n,    (numeric) Number of slabs allocated\n"
+            "    \"reuses\": n          (numeric) Number of free slabs reused instead of allocating\n"
+            "  },\n"
+            "  \"uploadtarget\": {       (json object) The -maxuploadtarget accounting\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"sendclasses\": [        (json array) Messages sent by priority class, most urgent first\n"
+            "    {\n"
+            "      \"class\": \"name\",     (string) tip, masternode, tx or history\n"
+            "      \"quantum\": n,        (numeric) Bytes of the class sent to a peer per turn of its send queue\n"
+            "      \"messages\": n,       (numeric) Number of messages sent\n"
+            "      \"bytes\": n,          (numeric) Bytes sent\n"
+            "      \"avgwaitus\": n,      (numeric) Average time from queueing a message to having sent it, in microseconds\n"
+            "      \"maxwaitus\": n       (numeric) Longest such time\n"
+            "    }, ...\n"
+            "  ]\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -375,9 +409,115 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    CRawBlockCacheStats stats;
+    rawBlockCache.GetStats(stats);
+    UniValue cacheObj(UniValue::VOBJ);
+    cacheObj.push_back(Pair("hits", stats.nHits));
+    cacheObj.push_back(Pair("misses", stats.nMisses));
+    uint64_t nRequests = stats.nHits + stats.nMisses;
+    cacheObj.push_back(Pair("hitrate", nRequests ? (double)stats.nHits / nRequests : 0.0));
+    cacheObj.push_back(Pair("bytessaved", stats.nBytesSaved));
+    cacheObj.push_back(Pair("blocks", (uint64_t)stats.nBlocks));
+    cacheObj.push_back(Pair("bytes", (uint64_t)stats.nBytes));
+    cacheObj.push_back(Pair("maxbytes", (uint64_t)stats.nMaxBytes));
+    obj.push_back(Pair("rawblockcache", cacheObj));
+
+    CRecvBufferPoolStats recvStats;
+    GetRecvBufferPool().GetStats(recvStats);
+    UniValue recvObj(UniValue::VOBJ);
+    recvObj.push_back(Pair("usedbytes", (uint64_t)recvStats.nUsedBytes));
+    recvObj.push_back(Pair("peakusedbytes", (uint64_t)recvStats.nPeakUsedBytes));
+    recvObj.push_back(Pair("freebytes", (uint64_t)recvStats.nFreeBytes));
+    recvObj.push_back(Pair("allocations", recvStats.nAllocations));
+    recvObj.push_back(Pair("reuses", recvStats.nReuses));
+    obj.push_back(Pair("recvbuffers", recvObj));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    std::vector<CSendClassStats> vSendStats;
+    CNode::GetSendClassStats(vSendStats);
+    UniValue sendClasses(UniValue::VARR);
+    for (int i = 0; i < SEND_CLASS_MAX; i++) {
+        const CSendClassStats& stats = vSendStats[i];
+        UniValue classObj(UniValue::VOBJ);
+        classObj.push_back(Pair("class", GetSendClassName(i)));
+        classObj.push_back(Pair("quantum", GetSendClassQuantum(i)));
+        classObj.push_back(Pair("messages", stats.nMessages));
+        classObj.push_back(Pair("bytes", stats.nBytes));
+        classObj.push_back(Pair("avgwaitus", stats.nMessages ? stats.nTotalWaitMicros / (int64_t)stats.nMessages : 0));
+        classObj.push_back(Pair("maxwaitus", stats.nMaxWaitMicros));
+        sendClasses.push_back(classObj);
+    }
+    obj.push_back(Pair("sendclasses", sendClasses));
+    return obj;
+}
+
+static UniValue LatencyHistogramToJSON(const CLatencyHistogram& histogram)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("avgus", histogram.nCount ? histogram.nTotalMicros / (int64_t)histogram.nCount : 0));
+    obj.push_back(Pair("maxus", histogram.nMaxMicros));
+    int nBuckets = CLatencyHistogram::BUCKETS;
+    while (nBuckets > 0 && histogram.vBuckets[nBuckets - 1] == 0)
+        nBuckets--;
+    UniValue buckets(UniValue::VARR);
+    for (int i = 0; i < nBuckets; i++)
+        buckets.push_back(histogram.vBuckets[i]);
+    obj.push_back(Pair("histogram", buckets));
     return obj;
 }
 
+UniValue getmessagelatency(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagelatency\n"
+            "\nReturns how long received messages waited and took to process, by command and\n"
+            "by the thread that handled them (see -msgworkers).\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"command\": \"name\",     (string) The message command, \"other\" for commands past the first 64 seen\n"
+            "    \"thread\": \"name\",      (string) \"worker\" for the message workers, \"handler\" for the message handler thread\n"
+            "    \"count\": n,            (numeric) Number of messages processed\n"
+            "    \"queue\": {             (json object) Time from receipt to the start of processing\n"
+            "      \"avgus\": n,          (numeric) Average, in microseconds\n"
+            "      \"maxus\": n,          (numeric) Maximum, in microseconds\n"
+            "      \"histogram\": [ n, ... ] (json array) Element i counts times from 2^i up to 2^(i+1) microseconds\n"
+            "    },\n"
+            "    \"process\": { ... }     (json object) Time spent processing, as for queue\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagelatency", "")
+            + HelpExampleRpc("getmessagelatency", "")
+       );
+
+    std::map<CMessageLatencyStats::Key, CMessageLatency> mapLatency;
+    messageLatencyStats.GetStats(mapLatency);
+
+    UniValue ret(UniValue::VARR);
+    for (std::map<CMessageLatencyStats::Key, CMessageLatency>::const_iterator it = mapLatency.begin(); it != mapLatency.end(); ++it) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("command", it->first.first));
+        obj.push_back(Pair("thread", it->first.second ? "worker" : "handler"));
+        obj.push_back(Pair("count", it->second.process.nCount));
+        obj.push_back(Pair("queue", LatencyHistogramToJSON(it->second.queue)));
+        obj.push_back(Pair("process", LatencyHistogramToJSON(it->second.process)));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -610,6 +750,7 @@ static const CRPCCommand commands[] =
     { "network",            "disconnectnode",         &disconnectnode,         true  },
     { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
+    { "network",            "getmessagelatency",      &getmessagelatency,      true  },
     { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
     { "network",            "setban",                 &setban,                 true  },
     { "network",            "listbanned",             &listbanned,             true  },
@@ -94,6 +94,8 @@ struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs, hashJoinSplits, hashShieldedSpends, hashShieldedOutputs;
 
+    //! Placeholder for a transaction whose signatures will not be checked
+    PrecomputedTransactionData() {}
     PrecomputedTransactionData(const CTransaction& tx);
 };
 
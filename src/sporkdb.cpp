@@ -5,7 +5,7 @@
 #include "sporkdb.h"
 #include "spork.h"
 
-CSporkDB::CSporkDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "sporks", nCacheSize, fMemory, fWipe) {}
+CSporkDB::CSporkDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "sporks", nCacheSize, fMemory, fWipe, DBPROFILE_SMALL) {}
 
 bool CSporkDB::WriteSpork(const int nSporkId, const CSporkMessage& spork)
 {
@@ -498,6 +498,50 @@ public:
     }
 };
 
+/** Read-only stream over memory owned by someone else, such as a mapped file.
+ *  Unlike CDataStream, the data is not copied.
+ */
+class CBufferReader
+{
+private:
+    const int nType;
+    const int nVersion;
+
+    const char* pcur;
+    const char* pend;
+
+public:
+    CBufferReader(const unsigned char* pbegin, size_t nSize, int nTypeIn, int nVersionIn) :
+        nType(nTypeIn), nVersion(nVersionIn), pcur((const char*)pbegin), pend((const char*)pbegin + nSize) {}
+
+    int GetType() const          { return nType; }
+    int GetVersion() const       { return nVersion; }
+    size_t size() const          { return pend - pcur; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CBufferReader::read: end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CBufferReader::ignore: end of data");
+        pcur += nSize;
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper around a FILE* that implements a ring buffer to
  *  deserialize from. It guarantees the ability to rewind a given number of bytes.
  *
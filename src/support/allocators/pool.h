@@ -0,0 +1,198 @@
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <stddef.h>
+
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Hands out small blocks of memory carved from large chunks.
+ *
+ * Blocks are grouped in size classes of BLOCK_ALIGN bytes. A freed block is
+ * put on the free list of its size class and reused by the next allocation of
+ * that class, so entries erased from a node-based container make room for
+ * later ones without calling malloc. Chunks are only returned to the system
+ * when the resource is destroyed. Requests larger than MAX_BLOCK_SIZE, or
+ * needing a stricter alignment, go to ::operator new directly.
+ *
+ * Not thread safe; a resource belongs to the container(s) using it.
+ */
+class CPoolResource
+{
+public:
+    static const size_t BLOCK_ALIGN = sizeof(void*);
+    static const size_t MAX_BLOCK_SIZE = 256;
+    static const size_t CHUNK_SIZE = 256 * 1024;
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    std::vector<FreeBlock*> vFreeLists;
+    std::vector<char*> vChunks;
+    char* pChunkPos;
+    char* pChunkEnd;
+
+    //! Bytes of the blocks currently handed out, rounded up to their size class
+    size_t nUsedBytes;
+    //! Bytes currently handed out through ::operator new
+    size_t nLargeBytes;
+
+    static size_t SizeClass(size_t nBytes)
+    {
+        return (nBytes + BLOCK_ALIGN - 1) / BLOCK_ALIGN;
+    }
+
+    static bool IsPooled(size_t nBytes, size_t nAlign)
+    {
+        return nBytes <= MAX_BLOCK_SIZE && nAlign <= BLOCK_ALIGN;
+    }
+
+    void AllocateChunk()
+    {
+        // The tail of the previous chunk, if any, is too small for the
+        // current request and is left unused.
+        vChunks.push_back(static_cast<char*>(::operator new(CHUNK_SIZE)));
+        pChunkPos = vChunks.back();
+        pChunkEnd = pChunkPos + CHUNK_SIZE;
+    }
+
+    CPoolResource(const CPoolResource&);
+    CPoolResource& operator=(const CPoolResource&);
+
+public:
+    CPoolResource() : vFreeLists(MAX_BLOCK_SIZE / BLOCK_ALIGN + 1, NULL), pChunkPos(NULL), pChunkEnd(NULL), nUsedBytes(0), nLargeBytes(0) {}
+
+    ~CPoolResource()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+    }
+
+    void* Allocate(size_t nBytes, size_t nAlign)
+    {
+        if (!IsPooled(nBytes, nAlign)) {
+            nLargeBytes += nBytes;
+            return ::operator new(nBytes);
+        }
+        const size_t nClass = SizeClass(nBytes);
+        const size_t nBlockSize = nClass * BLOCK_ALIGN;
+        nUsedBytes += nBlockSize;
+        if (vFreeLists[nClass] != NULL) {
+            FreeBlock* block = vFreeLists[nClass];
+            vFreeLists[nClass] = block->next;
+            return block;
+        }
+        if ((size_t)(pChunkEnd - pChunkPos) < nBlockSize)
+            AllocateChunk();
+        void* p = pChunkPos;
+        pChunkPos += nBlockSize;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nAlign)
+    {
+        if (!IsPooled(nBytes, nAlign)) {
+            nLargeBytes -= nBytes;
+            ::operator delete(p);
+            return;
+        }
+        const size_t nClass = SizeClass(nBytes);
+        nUsedBytes -= nClass * BLOCK_ALIGN;
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = vFreeLists[nClass];
+        vFreeLists[nClass] = block;
+    }
+
+    /** Bytes of pooled blocks in use. Free blocks kept for reuse are not counted. */
+    size_t UsedBytes() const { return nUsedBytes; }
+    /** Bytes of the allocations too large for the pool that are in use. */
+    size_t LargeBytes() const { return nLargeBytes; }
+    /** Bytes held in chunks, whether in use or not. */
+    size_t ChunkBytes() const { return vChunks.size() * CHUNK_SIZE; }
+};
+
+/**
+ * Allocator drawing from a CPoolResource, for node-based containers.
+ *
+ * An allocator constructed with a resource shares it with its copies and
+ * rebinds (a container's node and bucket allocators), and the resource lives
+ * as long as any of them. Swapping or moving a container moves its resource
+ * along; a copied container gets a resource of its own. A default
+ * constructed allocator has no resource and uses ::operator new, so a
+ * short-lived container pays nothing for the pool.
+ */
+template <typename T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    pool_allocator() {}
+    explicit pool_allocator(const std::shared_ptr<CPoolResource>& resourceIn) : resource(resourceIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& other) : resource(other.resource) {}
+
+    T* allocate(size_type n)
+    {
+        if (!resource)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(resource->Allocate(n * sizeof(T), std::alignment_of<T>::value));
+    }
+
+    void deallocate(T* p, size_type n)
+    {
+        if (!resource) {
+            ::operator delete(p);
+            return;
+        }
+        resource->Deallocate(p, n * sizeof(T), std::alignment_of<T>::value);
+    }
+
+    pool_allocator select_on_container_copy_construction() const
+    {
+        if (!resource)
+            return pool_allocator();
+        return pool_allocator(std::make_shared<CPoolResource>());
+    }
+
+    /** The resource in use, or NULL if allocations go to ::operator new. */
+    const CPoolResource* GetResource() const { return resource.get(); }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& other) const { return resource == other.resource; }
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& other) const { return resource != other.resource; }
+
+private:
+    template <typename U>
+    friend class pool_allocator;
+
+    std::shared_ptr<CPoolResource> resource;
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
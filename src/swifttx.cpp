@@ -27,6 +27,7 @@ std::map<uint256, CTransactionLock> mapTxLocks;
 std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
+std::atomic<unsigned int> nTransactionLockUpdates(0);
 
 //txlock - Locks transaction
 //
@@ -244,6 +245,7 @@ int64_t CreateNewLock(CTransaction tx)
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
     }
+    nTransactionLockUpdates++;
 
 
     return nBlockHeight;
@@ -444,6 +446,7 @@ void CleanTransactionLocksList()
             }
 
             mapTxLocks.erase(it++);
+            nTransactionLockUpdates++;
         } else {
             it++;
         }
@@ -534,6 +537,7 @@ bool CTransactionLock::SignaturesValid()
 void CTransactionLock::AddSignature(CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
+    nTransactionLockUpdates++;
 }
 
 int CTransactionLock::CountSignatures()
@@ -15,6 +15,8 @@
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of SwiftX
@@ -42,6 +44,8 @@ extern map<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
 extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
+/** Bumped whenever the signature count of a transaction lock may have changed */
+extern std::atomic<unsigned int> nTransactionLockUpdates;
 
 
 int64_t CreateNewLock(CTransaction tx);
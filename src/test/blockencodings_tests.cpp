@@ -0,0 +1,172 @@
+// Copyright (c) 2011-2016 The Bitcoin Core developers
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase() {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = tx;
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = tx;
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = tx;
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    CMutableTransaction tx2(block.vtx[2]);
+    pool.addUnchecked(block.vtx[2].GetHash(), entry.FromTx(tx2));
+
+    // Do a simple ShortTxIDs RT
+    {
+        CBlockHeaderAndShortTxIDs shortIDs(block);
+
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << shortIDs;
+
+        CBlockHeaderAndShortTxIDs shortIDs2;
+        stream >> shortIDs2;
+        BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), 3U);
+        BOOST_CHECK_EQUAL(shortIDs2.GetShortID(block.vtx[1].GetHash()), shortIDs.GetShortID(block.vtx[1].GetHash()));
+
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK(partialBlock.InitData(shortIDs2, std::vector<CTransaction>()) == READ_STATUS_OK);
+        BOOST_CHECK( partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+        BOOST_CHECK( partialBlock.IsTxAvailable(2));
+        BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+        BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+
+        // A wrong transaction gives a block with a bad merkle root
+        {
+            PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+            CBlock block2;
+            BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_FAILED);
+        }
+
+        // Missing transactions are the peer's fault
+        {
+            PartiallyDownloadedBlock partialBlockCopy = partialBlock;
+            CBlock block2;
+            BOOST_CHECK(partialBlockCopy.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_INVALID);
+        }
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+        BOOST_CHECK_EQUAL(block.BuildMerkleTree().ToString(), block2.BuildMerkleTree().ToString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ExtraTxnTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+
+    // Transactions from the orphan pool count as available too
+    PartiallyDownloadedBlock partialBlock(&pool);
+    std::vector<CTransaction> vExtraTxn(1, block.vtx[1]);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, vExtraTxn) == READ_STATUS_OK);
+    BOOST_CHECK( partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetExtraCount(), 1U);
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+}
+
+class CollidingShortTxIDs : public CBlockHeaderAndShortTxIDs
+{
+public:
+    CollidingShortTxIDs(const CBlock& block) : CBlockHeaderAndShortTxIDs(block) {
+        shorttxids[1] = shorttxids[0];
+    }
+};
+
+BOOST_AUTO_TEST_CASE(ShortIDCollisionTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    CMutableTransaction tx1(block.vtx[1]);
+    pool.addUnchecked(block.vtx[1].GetHash(), entry.FromTx(tx1));
+
+    // Both transactions sharing a short ID are requested, even the one in the mempool
+    CollidingShortTxIDs shortIDs(block);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(shortIDs, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK( partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 0U);
+
+    std::vector<CTransaction> vtx_missing;
+    vtx_missing.push_back(block.vtx[1]);
+    vtx_missing.push_back(block.vtx[2]);
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest) {
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req1.indexes.size(), req2.indexes.size());
+    BOOST_CHECK_EQUAL(req1.indexes[0], req2.indexes[0]);
+    BOOST_CHECK_EQUAL(req1.indexes[1], req2.indexes[1]);
+    BOOST_CHECK_EQUAL(req1.indexes[2], req2.indexes[2]);
+    BOOST_CHECK_EQUAL(req1.indexes[3], req2.indexes[3]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,7 @@
 #include "test/test_bitcoin.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "txdb.h"
 #include "undo.h"
 #include "primitives/transaction.h"
 #include "pubkey.h"
@@ -982,4 +983,43 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+BOOST_AUTO_TEST_CASE(background_flush)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewBackgroundFlush writer(&db);
+    CCoinsViewCache cache(&writer);
+
+    uint256 txid = GetRandHash();
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txid);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 1234;
+        coins->nHeight = 1;
+    }
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    // The flushed entries are answered before and after they reach the database
+    CCoins coins;
+    BOOST_CHECK(writer.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, 1234);
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+
+    BOOST_CHECK(writer.WaitForFlush());
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, 1234);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+
+    // Spending it in a later flush removes it once written
+    cache.ModifyCoins(txid)->Clear();
+    uint256 hashBlock2 = GetRandHash();
+    cache.SetBestBlock(hashBlock2);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!writer.HaveCoins(txid));
+    BOOST_CHECK(writer.WaitForFlush());
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+// Copyright (c) 2016 Jeremy Rubin
+// Copyright (c) 2018 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+static std::vector<uint256> RandomEntries(size_t n)
+{
+    std::vector<uint256> entries(n);
+    for (uint256& entry : entries)
+        entry = GetRandHash();
+    return entries;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_no_false_positives)
+{
+    CCuckooCache cache;
+    cache.Setup(10000);
+    std::vector<uint256> entries = RandomEntries(10000);
+    for (size_t i = 0; i < entries.size(); i += 2)
+        cache.Insert(entries[i]);
+    for (size_t i = 1; i < entries.size(); i += 2)
+        BOOST_CHECK(!cache.Contains(entries[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    // A half-full table keeps everything that was inserted
+    CCuckooCache cache;
+    cache.Setup(10000);
+    std::vector<uint256> entries = RandomEntries(5000);
+    for (const uint256& entry : entries)
+        cache.Insert(entry);
+    size_t nHits = 0;
+    for (const uint256& entry : entries)
+        nHits += cache.Contains(entry, false);
+    BOOST_CHECK_EQUAL(nHits, entries.size());
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_generations)
+{
+    // After overfilling the table the most recent entries survive and the
+    // oldest generation has been reclaimed.
+    CCuckooCache cache;
+    cache.Setup(10000);
+    std::vector<uint256> entries = RandomEntries(40000);
+    for (const uint256& entry : entries)
+        cache.Insert(entry);
+
+    size_t nRecent = 0, nOld = 0;
+    for (size_t i = 0; i < 4000; i++) {
+        nRecent += cache.Contains(entries[entries.size() - 1 - i], false);
+        nOld += cache.Contains(entries[i], false);
+    }
+    BOOST_CHECK(nRecent >= 3900);
+    BOOST_CHECK(nOld <= 100);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_erase)
+{
+    // Erased entries are still found until their slot is reused, and
+    // reusing them doesn't push out live entries.
+    CCuckooCache cache;
+    cache.Setup(10000);
+    std::vector<uint256> entries = RandomEntries(6000);
+    for (size_t i = 0; i < 4000; i++)
+        cache.Insert(entries[i]);
+    for (size_t i = 0; i < 2000; i++)
+        BOOST_CHECK(cache.Contains(entries[i], true));
+    for (size_t i = 0; i < 2000; i++)
+        BOOST_CHECK(cache.Contains(entries[i], false));
+    for (size_t i = 4000; i < 6000; i++)
+        cache.Insert(entries[i]);
+    for (size_t i = 2000; i < 6000; i++)
+        BOOST_CHECK(cache.Contains(entries[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_concurrent_reads)
+{
+    CCuckooCache cache;
+    cache.Setup(40000);
+    std::vector<uint256> entries = RandomEntries(20000);
+    for (size_t i = 0; i < 10000; i++)
+        cache.Insert(entries[i]);
+
+    // Readers don't lock, so they can run while the second half is inserted
+    std::vector<size_t> vHits(4, 0);
+    boost::thread_group threads;
+    for (size_t t = 0; t < vHits.size(); t++) {
+        threads.create_thread([&cache, &entries, &vHits, t]() {
+            for (size_t i = 0; i < 10000; i++)
+                vHits[t] += cache.Contains(entries[i], false);
+        });
+    }
+    for (size_t i = 10000; i < entries.size(); i++)
+        cache.Insert(entries[i]);
+    threads.join_all();
+
+    for (size_t nHits : vHits)
+        BOOST_CHECK(nHits >= 9900);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 #include "dbwrapper.h"
 #include "uint256.h"
 #include "random.h"
+#include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/assign/std/vector.hpp> // for 'operator+=()'
@@ -43,6 +44,34 @@ BOOST_AUTO_TEST_CASE(dbwrapper)
     }
 }
 
+// Test each profile on disk, where its options take effect
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    BOOST_CHECK(GetDBProfile("chainstate") == &DBPROFILE_CHAINSTATE);
+    BOOST_CHECK(GetDBProfile("blockindex") == &DBPROFILE_BLOCK_INDEX);
+    BOOST_CHECK(GetDBProfile("unknown") == NULL);
+
+    const CDBProfile* profiles[] = {&DBPROFILE_DEFAULT, &DBPROFILE_CHAINSTATE, &DBPROFILE_BLOCK_INDEX, &DBPROFILE_SMALL};
+    for (size_t i = 0; i < ARRAYLEN(profiles); i++) {
+        path ph = temp_directory_path() / unique_path();
+        {
+            CDBWrapper dbw(ph, (1 << 20), false, false, *profiles[i]);
+            char key = 'k';
+            uint256 in = GetRandHash();
+            uint256 res;
+
+            BOOST_CHECK(dbw.Write(key, in));
+            BOOST_CHECK(dbw.Read(key, res));
+            BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+
+            std::string strStats;
+            BOOST_CHECK(dbw.GetProperty("leveldb.stats", strStats));
+            BOOST_CHECK(!dbw.GetProperty("leveldb.unknown", strStats));
+        }
+        boost::filesystem::remove_all(ph);
+    }
+}
+
 // Test batch operations
 BOOST_AUTO_TEST_CASE(dbwrapper_batch)
 {
@@ -4,6 +4,9 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "net.h"
+#include "random.h"
+#include "txdb.h"
 
 #include "test/test_bitcoin.h"
 
@@ -29,4 +32,216 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(trimmed_solution_loaded_from_block_tree)
+{
+    LOCK(cs_main);
+    CBlockHeader header;
+    header.nTime = 1234;
+    header.nSolution = std::vector<unsigned char>(1344, 0x5a);
+    uint256 hash = header.GetHash();
+    CBlockIndex index(header);
+    index.phashBlock = &hash;
+
+    std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+    std::vector<const CBlockIndex*> vBlocks(1, &index);
+    BOOST_CHECK(pblocktree->WriteBatchSync(vFiles, 0, vBlocks));
+
+    // Only entries that are done changing give up their solution on flush
+    BOOST_CHECK(!index.IsSettled());
+    index.nStatus |= BLOCK_VALID_SCRIPTS;
+    BOOST_CHECK(index.IsSettled());
+    index.nStatus &= ~BLOCK_VALID_MASK;
+
+    index.TrimSolution();
+    BOOST_CHECK(!index.HasSolution());
+    CBlockHeader partial;
+    BOOST_CHECK(!index.GetBlockHeaderInMemory(partial));
+    BOOST_CHECK(partial.nSolution.empty() && partial.nTime == header.nTime);
+    BOOST_CHECK(index.GetBlockHeader().GetHash() == hash);
+
+    // Rewriting a trimmed entry keeps the solution on disk
+    index.nStatus |= BLOCK_VALID_TREE;
+    BOOST_CHECK(pblocktree->WriteBatchSync(vFiles, 0, vBlocks));
+    std::vector<unsigned char> nSolution;
+    BOOST_CHECK(pblocktree->ReadBlockSolution(hash, nSolution));
+    BOOST_CHECK(nSolution == header.nSolution);
+}
+
+BOOST_AUTO_TEST_CASE(raw_block_cache_lru)
+{
+    CRawBlockCache cache(250);
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hash3 = GetRandHash();
+    CRawBlockCache::RawBlockRef block100 = std::make_shared<const std::vector<unsigned char> >(100, 0x01);
+
+    BOOST_CHECK(!cache.Get(hash1));
+    cache.Insert(hash1, block100);
+    cache.Insert(hash2, block100);
+    BOOST_CHECK(cache.Get(hash1) == block100);
+
+    // hash2 is now the least recently used and makes room for hash3
+    cache.Insert(hash3, block100);
+    BOOST_CHECK(!cache.Get(hash2));
+    BOOST_CHECK(cache.Get(hash1));
+    BOOST_CHECK(cache.Get(hash3));
+
+    // Blocks larger than the cache are not kept
+    cache.Insert(GetRandHash(), std::make_shared<const std::vector<unsigned char> >(251, 0x02));
+
+    CRawBlockCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits, 3U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 2U);
+    BOOST_CHECK_EQUAL(stats.nBytesSaved, 300U);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 2U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 200U);
+
+    cache.SetMaxBytes(100);
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 1U);
+    BOOST_CHECK(cache.Get(hash3));
+}
+
+BOOST_AUTO_TEST_CASE(relay_cache_expiry_and_size)
+{
+    CRelayCache cache(250);
+    CInv inv1(MSG_TX, GetRandHash()), inv2(MSG_TX, GetRandHash()), inv3(MSG_TX, GetRandHash());
+    CRelayCache::DataRef tx100 = std::make_shared<const CDataStream>(std::vector<unsigned char>(100, 0x01), SER_NETWORK, PROTOCOL_VERSION);
+    int64_t nStart = 1500000000;
+
+    SetMockTime(nStart);
+    cache.Insert(inv1, tx100);
+    SetMockTime(nStart + RELAY_CACHE_SLOT_SECONDS);
+    cache.Insert(inv2, tx100);
+    BOOST_CHECK(cache.Get(inv1) == tx100);
+
+    // The oldest entry makes room for inv3
+    cache.Insert(inv3, tx100);
+    BOOST_CHECK(!cache.Get(inv1));
+    BOOST_CHECK(cache.Get(inv2));
+    BOOST_CHECK(cache.Get(inv3));
+
+    // Entries larger than the cache are not kept
+    cache.Insert(CInv(MSG_TX, GetRandHash()), std::make_shared<const CDataStream>(std::vector<unsigned char>(251, 0x02), SER_NETWORK, PROTOCOL_VERSION));
+
+    CRelayCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 2U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 200U);
+    BOOST_CHECK_EQUAL(stats.nEvicted, 1U);
+
+    // Entries expire with their slot, whatever is left of the cache
+    SetMockTime(nStart + RELAY_CACHE_SLOT_SECONDS + RELAY_CACHE_EXPIRY - 1);
+    BOOST_CHECK(cache.Get(inv2));
+    SetMockTime(nStart + 2 * RELAY_CACHE_SLOT_SECONDS + RELAY_CACHE_EXPIRY);
+    BOOST_CHECK(!cache.Get(inv2));
+    BOOST_CHECK(!cache.Get(inv3));
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 0U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 0U);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(message_latency_stats)
+{
+    CLatencyHistogram histogram;
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(2);
+    histogram.Add(3);
+    histogram.Add(1000);
+    histogram.Add(-5);
+    histogram.Add(std::numeric_limits<int64_t>::max() / 2);
+    BOOST_CHECK_EQUAL(histogram.nCount, 7U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[0], 3U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[1], 2U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[9], 1U);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[CLatencyHistogram::BUCKETS - 1], 1U);
+
+    // Commands past the limit are counted together
+    CMessageLatencyStats stats;
+    for (size_t i = 0; i < CMessageLatencyStats::MAX_COMMANDS + 10; i++)
+        stats.Record(strprintf("cmd%u", i), false, 10, 20);
+    stats.Record("cmd0", true, 10, 20);
+    std::map<CMessageLatencyStats::Key, CMessageLatency> mapLatency;
+    stats.GetStats(mapLatency);
+    BOOST_CHECK_EQUAL(mapLatency.size(), CMessageLatencyStats::MAX_COMMANDS + 2);
+    BOOST_CHECK_EQUAL(mapLatency[std::make_pair(std::string("other"), false)].process.nCount, 10U);
+    BOOST_CHECK_EQUAL(mapLatency[std::make_pair(std::string("other"), true)].process.nCount, 1U);
+    BOOST_CHECK_EQUAL(mapLatency[std::make_pair(std::string("cmd0"), false)].queue.nTotalMicros, 10);
+}
+
+static void ReceiveTestMessage(CNode& node, const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::vector<char> vch(ss.begin(), ss.end());
+    vch.insert(vch.end(), ssPayload.begin(), ssPayload.end());
+    BOOST_CHECK(node.ReceiveMsgBytes(&vch[0], vch.size()));
+}
+
+static uint64_t QueuedPongNonce(CNode& node, size_t nFromBack)
+{
+    const std::deque<CSendMessage>& vQueue = node.vSendMsg[GetSendClass("pong")];
+    BOOST_REQUIRE(vQueue.size() > nFromBack);
+    const CSerializeData& data = vQueue[vQueue.size() - 1 - nFromBack].data;
+    uint64_t nonce;
+    memcpy(&nonce, &data[data.size() - sizeof(nonce)], sizeof(nonce));
+    return nonce;
+}
+
+BOOST_AUTO_TEST_CASE(message_workers_keep_peer_order)
+{
+    int nMessageWorkersSaved = nMessageWorkers;
+    nMessageWorkers = 2;
+
+    CAddress addr(CService(CNetAddr("10.0.0.2"), Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = PROTOCOL_VERSION;
+    LOCK(node.cs_vRecvMsg);
+
+    CDataStream ssEmpty(SER_NETWORK, PROTOCOL_VERSION);
+    CDataStream ssPing1(SER_NETWORK, PROTOCOL_VERSION), ssPing2(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing1 << (uint64_t)1;
+    ssPing2 << (uint64_t)2;
+    ReceiveTestMessage(node, "verack", ssEmpty);
+    ReceiveTestMessage(node, "ping", ssPing1);
+    ReceiveTestMessage(node, "ping", ssPing2);
+    ReceiveTestMessage(node, "verack", ssEmpty);
+    ReceiveTestMessage(node, "ping", ssPing1);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 5U);
+
+    // The handler thread processes the first message and stops at the pings
+    BOOST_CHECK(ProcessMessages(&node, false));
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 4U);
+    BOOST_CHECK(!node.fOnMsgWorker);
+    BOOST_CHECK(ProcessMessages(&node, false));
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 4U);
+    BOOST_CHECK(node.fOnMsgWorker);
+
+    // A worker answers both pings in order and leaves the verack after them
+    BOOST_CHECK(ProcessMessages(&node, true));
+    node.fOnMsgWorker = false;
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.front().hdr.GetCommand(), "verack");
+    BOOST_CHECK_EQUAL(QueuedPongNonce(node, 1), 1U);
+    BOOST_CHECK_EQUAL(QueuedPongNonce(node, 0), 2U);
+
+    // The worker does not process it either
+    BOOST_CHECK(ProcessMessages(&node, true));
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+
+    BOOST_CHECK(ProcessMessages(&node, false));
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(ProcessMessages(&node, false));
+    BOOST_CHECK(node.fOnMsgWorker);
+    BOOST_CHECK(ProcessMessages(&node, true));
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK_EQUAL(QueuedPongNonce(node, 0), 1U);
+
+    nMessageWorkers = nMessageWorkersSaved;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
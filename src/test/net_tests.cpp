@@ -0,0 +1,101 @@
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "net.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+static void QueueMessage(CNode& node, int nClass, size_t nSize)
+{
+    node.vSendMsg[nClass].push_back(CSendMessage());
+    node.vSendMsg[nClass].back().data.resize(nSize);
+    node.nSendSize += nSize;
+}
+
+// What SocketSendData does once a message is sent in full
+static int SendNextMessage(CNode& node)
+{
+    int nClass = node.SelectSendClass();
+    size_t nSize = node.vSendMsg[nClass].front().data.size();
+    node.nSendSize -= nSize;
+    node.vSendDeficit[nClass] -= nSize;
+    node.vSendMsg[nClass].pop_front();
+    return nClass;
+}
+
+BOOST_AUTO_TEST_CASE(send_class_of_commands)
+{
+    BOOST_CHECK_EQUAL(GetSendClass("block"), SEND_CLASS_TIP);
+    BOOST_CHECK_EQUAL(GetSendClass("headers"), SEND_CLASS_TIP);
+    BOOST_CHECK_EQUAL(GetSendClass("ping"), SEND_CLASS_TIP);
+    BOOST_CHECK_EQUAL(GetSendClass("mnw"), SEND_CLASS_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetSendClass("mvote"), SEND_CLASS_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetSendClass("txlvote"), SEND_CLASS_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetSendClass("tx"), SEND_CLASS_TX);
+    BOOST_CHECK_EQUAL(std::string(GetSendClassName(SEND_CLASS_HISTORY)), "history");
+}
+
+BOOST_AUTO_TEST_CASE(send_class_scheduler)
+{
+    CAddress addr(CService(CNetAddr("10.0.0.1"), Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    LOCK(node.cs_vSend);
+
+    // Votes and transactions go before an old block queued ahead of them
+    QueueMessage(node, SEND_CLASS_HISTORY, 1000000);
+    QueueMessage(node, SEND_CLASS_MASTERNODE, 200);
+    QueueMessage(node, SEND_CLASS_TX, 300);
+    BOOST_CHECK_EQUAL(SendNextMessage(node), SEND_CLASS_MASTERNODE);
+    BOOST_CHECK_EQUAL(SendNextMessage(node), SEND_CLASS_TX);
+
+    // A message sent in part is finished first
+    BOOST_CHECK_EQUAL(node.SelectSendClass(), SEND_CLASS_HISTORY);
+    node.nSendOffset = 1;
+    QueueMessage(node, SEND_CLASS_TIP, 100);
+    BOOST_CHECK_EQUAL(node.SelectSendClass(), SEND_CLASS_HISTORY);
+    node.nSendOffset = 0;
+    BOOST_CHECK_EQUAL(SendNextMessage(node), SEND_CLASS_HISTORY);
+    BOOST_CHECK_EQUAL(SendNextMessage(node), SEND_CLASS_TIP);
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+
+    // Old blocks still get their turns while transactions keep coming
+    for (int i = 0; i < 10; i++)
+        QueueMessage(node, SEND_CLASS_TX, 100000);
+    QueueMessage(node, SEND_CLASS_HISTORY, 100000);
+    int nSentBefore = 0;
+    while (SendNextMessage(node) != SEND_CLASS_HISTORY)
+        nSentBefore++;
+    BOOST_CHECK(nSentBefore < 10);
+}
+
+BOOST_AUTO_TEST_CASE(upload_target_block_reserve)
+{
+    CNode::SetMaxOutboundTarget(100 * 1024 * 1024);
+    // Settle the moving average whatever blocks other tests connected
+    for (int i = 0; i < 1000; i++)
+        CNode::RecordBlockSize(20000);
+
+    // A day of 20 KB blocks fits well within the target
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    uint64_t nBytesLeft = CNode::GetOutboundTargetBytesLeft();
+
+    // Whitelisted peers do not use up the target
+    CNode::RecordBytesSent(50 * 1024 * 1024, true);
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nBytesLeft);
+
+    // Historical blocks stop once only the reserve for new blocks is left
+    CNode::RecordBytesSent(nBytesLeft - 10 * 1024 * 1024, false);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    CNode::SetMaxOutboundTarget(0);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,110 @@
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "memusage.h"
+#include "random.h"
+#include "support/allocators/pool.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(pool_resource_reuses_blocks)
+{
+    CPoolResource resource;
+    void* a = resource.Allocate(20, 8);
+    void* b = resource.Allocate(24, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 48U);
+    BOOST_CHECK_EQUAL(resource.ChunkBytes(), CPoolResource::CHUNK_SIZE);
+
+    // A freed block is handed out again for the same size class
+    resource.Deallocate(a, 20, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 24U);
+    BOOST_CHECK(resource.Allocate(17, 8) == a);
+    resource.Deallocate(a, 17, 8);
+    resource.Deallocate(b, 24, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 0U);
+
+    // Large requests bypass the pool
+    void* c = resource.Allocate(CPoolResource::MAX_BLOCK_SIZE + 1, 8);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), 0U);
+    BOOST_CHECK_EQUAL(resource.LargeBytes(), CPoolResource::MAX_BLOCK_SIZE + 1);
+    resource.Deallocate(c, CPoolResource::MAX_BLOCK_SIZE + 1, 8);
+    BOOST_CHECK_EQUAL(resource.LargeBytes(), 0U);
+    BOOST_CHECK_EQUAL(resource.ChunkBytes(), CPoolResource::CHUNK_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(pool_resource_grows_in_chunks)
+{
+    CPoolResource resource;
+    std::vector<void*> blocks;
+    size_t nBlocks = CPoolResource::CHUNK_SIZE / 64 + 1;
+    for (size_t i = 0; i < nBlocks; i++)
+        blocks.push_back(resource.Allocate(64, 8));
+    BOOST_CHECK_EQUAL(resource.ChunkBytes(), 2 * CPoolResource::CHUNK_SIZE);
+    BOOST_CHECK_EQUAL(resource.UsedBytes(), nBlocks * 64);
+    for (size_t i = 0; i < nBlocks; i++)
+        resource.Deallocate(blocks[i], 64, 8);
+    for (size_t i = 0; i < nBlocks; i++)
+        resource.Allocate(64, 8);
+    BOOST_CHECK_EQUAL(resource.ChunkBytes(), 2 * CPoolResource::CHUNK_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(pooled_coins_map)
+{
+    // Maps only use a pool when given one
+    BOOST_CHECK(CCoinsMap().get_allocator().GetResource() == NULL);
+
+    CCoinsMap map(0, CCoinsMap::hasher(), CCoinsMap::key_equal(), CCoinsMap::allocator_type(std::make_shared<CPoolResource>()));
+    for (int i = 0; i < 1000; i++) {
+        CCoinsCacheEntry& entry = map[GetRandHash()];
+        entry.coins.vout.resize(1);
+    }
+    size_t nNodeBytes = map.get_allocator().GetResource()->UsedBytes();
+    BOOST_CHECK(nNodeBytes >= 1000 * sizeof(std::pair<const uint256, CCoinsCacheEntry>));
+
+    // The whole chunk counts, not only the blocks in use
+    size_t nChunkBytes = map.get_allocator().GetResource()->ChunkBytes();
+    BOOST_CHECK(memusage::DynamicUsage(map) >= nChunkBytes);
+
+    // Swapping moves the pool along with the entries
+    CCoinsMap other;
+    other.swap(map);
+    BOOST_CHECK_EQUAL(other.get_allocator().GetResource()->UsedBytes(), nNodeBytes);
+    BOOST_CHECK(map.get_allocator().GetResource() == NULL);
+
+    // A copy gets a pool of its own
+    CCoinsMap copy(other);
+    BOOST_CHECK(copy.get_allocator().GetResource() != NULL);
+    BOOST_CHECK(copy.get_allocator() != other.get_allocator());
+    BOOST_CHECK_EQUAL(copy.size(), other.size());
+
+    // Erased entries make room for new ones
+    other.clear();
+    BOOST_CHECK_EQUAL(other.get_allocator().GetResource()->UsedBytes(), 0U);
+    BOOST_CHECK(memusage::DynamicUsage(other) >= nChunkBytes);
+    for (int i = 0; i < 1000; i++)
+        other[GetRandHash()];
+    BOOST_CHECK_EQUAL(other.get_allocator().GetResource()->ChunkBytes(), nChunkBytes);
+}
+
+BOOST_AUTO_TEST_CASE(pooled_cache_releases_on_flush)
+{
+    CCoinsView base;
+    CCoinsViewCache cache(&base, true);
+    for (int i = 0; i < 1000; i++) {
+        CCoinsModifier coins = cache.ModifyCoins(GetRandHash());
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i + 1;
+    }
+    size_t nFilled = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nFilled >= CPoolResource::CHUNK_SIZE);
+    cache.Flush();
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nFilled);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,119 @@
+// Copyright (c) 2026 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recvbuffer.h"
+
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(recvbuffer_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(recvbuffer_pool_reuse)
+{
+    CRecvBufferPool pool;
+    CRecvBufferPoolStats stats;
+    {
+        CRecvBuffer buf(pool);
+        std::vector<char> vch(3000, 'x');
+        buf.Write(&vch[0], vch.size());
+        BOOST_CHECK_EQUAL(buf.size(), 3000U);
+        // A single slab of the smallest size class that fits
+        BOOST_CHECK_EQUAL(buf.Capacity(), 4096U);
+
+        pool.GetStats(stats);
+        BOOST_CHECK_EQUAL(stats.nUsedBytes, 4096U);
+        BOOST_CHECK_EQUAL(stats.nAllocations, 1U);
+    }
+    pool.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nUsedBytes, 0U);
+    BOOST_CHECK_EQUAL(stats.nPeakUsedBytes, 4096U);
+    BOOST_CHECK_EQUAL(stats.nFreeBytes, 4096U);
+
+    // The released slab is handed out again
+    {
+        CRecvBuffer buf(pool);
+        std::vector<char> vch(4000, 'y');
+        buf.Write(&vch[0], vch.size());
+    }
+    pool.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nAllocations, 1U);
+    BOOST_CHECK_EQUAL(stats.nReuses, 1U);
+}
+
+BOOST_AUTO_TEST_CASE(recvbuffer_slabs)
+{
+    CRecvBufferPool pool;
+    CRecvBuffer buf(pool);
+    std::vector<char> vch(RECV_SLAB_SIZE * 2 + 1000);
+    for (size_t i = 0; i < vch.size(); i++)
+        vch[i] = (char)(i * 7);
+
+    // Receive it in pieces, the way the socket thread does
+    size_t nPos = 0;
+    while (nPos < vch.size()) {
+        size_t nWindow;
+        char* pch = buf.GetWindow(vch.size() - nPos, nWindow);
+        nWindow = std::min(nWindow, (size_t)50000);
+        memcpy(pch, &vch[nPos], nWindow);
+        buf.Commit(nWindow);
+        nPos += nWindow;
+    }
+    BOOST_CHECK_EQUAL(buf.size(), vch.size());
+    // The tail only takes a slab of the size it needs
+    BOOST_CHECK_EQUAL(buf.Capacity(), RECV_SLAB_SIZE * 2 + 1024);
+    BOOST_CHECK(buf.GetHash() == Hash(vch.begin(), vch.end()));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    buf.CopyTo(ss);
+    BOOST_CHECK(std::vector<char>(ss.begin(), ss.end()) == vch);
+
+    // Reads and skips across the slab boundaries
+    CRecvStream stream(buf, SER_NETWORK, PROTOCOL_VERSION);
+    std::vector<char> vchRead(RECV_SLAB_SIZE + 10);
+    stream.ignore(RECV_SLAB_SIZE - 5);
+    stream.read(&vchRead[0], vchRead.size());
+    BOOST_CHECK(std::equal(vchRead.begin(), vchRead.end(), vch.begin() + RECV_SLAB_SIZE - 5));
+    BOOST_CHECK_EQUAL(stream.size(), vch.size() - (RECV_SLAB_SIZE * 2 + 5));
+    BOOST_CHECK_THROW(stream.ignore(stream.size() + 1), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(recvbuffer_deserialize)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].scriptSig.resize(RECV_SLAB_MIN_SIZE * 3);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 42;
+    CTransaction tx(mtx);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+
+    // Small writes leave the transaction spread over several slabs
+    CRecvBufferPool pool;
+    CRecvBuffer buf(pool);
+    for (size_t i = 0; i < ss.size(); i += 100)
+        buf.Write(&ss[i], std::min((size_t)100, ss.size() - i));
+    BOOST_CHECK(buf.Capacity() > RECV_SLAB_MIN_SIZE);
+
+    CRecvStream stream(buf, SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction tx2;
+    stream >> tx2;
+    BOOST_CHECK(tx2.GetHash() == tx.GetHash());
+    BOOST_CHECK(stream.empty());
+
+    // A truncated payload fails like a short CDataStream
+    CRecvBuffer truncated(pool);
+    truncated.Write(&ss[0], ss.size() - 1);
+    CRecvStream stream2(truncated, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_THROW(stream2 >> tx2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
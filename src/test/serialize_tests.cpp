@@ -417,4 +417,24 @@ BOOST_AUTO_TEST_CASE(class_methods)
     BOOST_CHECK(methodtest3 == methodtest4);
 }
 
+BOOST_AUTO_TEST_CASE(buffer_reader)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << std::string("testing") << (uint32_t)0x01020304;
+    std::vector<unsigned char> vch(ss.begin(), ss.end());
+
+    CBufferReader reader(&vch[0], vch.size(), SER_DISK, PROTOCOL_VERSION);
+    std::string str;
+    uint32_t n;
+    reader >> str >> n;
+    BOOST_CHECK_EQUAL(str, "testing");
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK_EQUAL(reader.size(), 0U);
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+
+    // Reading past the end does not touch memory beyond the buffer
+    CBufferReader shortReader(&vch[0], 3, SER_DISK, PROTOCOL_VERSION);
+    BOOST_CHECK_THROW(shortReader >> str, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
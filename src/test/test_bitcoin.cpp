@@ -103,7 +103,7 @@ TestingSetup::TestingSetup()
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview, true);
         InitBlockIndex();
 #ifdef ENABLE_WALLET
         bool fFirstRun;
@@ -0,0 +1,61 @@
+// Copyright (c) 2018 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txvalidationcache.h"
+
+#include "random.h"
+#include "script/interpreter.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txvalidationcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(txvalidationcache_get_set)
+{
+    CTxValidationCache cache;
+    uint256 txid = GetRandHash();
+    const uint32_t branchId = 0x76b809bb;
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+
+    BOOST_CHECK(!cache.Get(txid, branchId, flags, CTxValidationCache::CHECK_ALL));
+
+    cache.Set(txid, branchId, flags | SCRIPT_VERIFY_LOW_S, CTxValidationCache::CHECK_ALL);
+    BOOST_CHECK(cache.Get(txid, branchId, flags, CTxValidationCache::CHECK_ALL));
+    BOOST_CHECK(cache.Get(txid, branchId, flags, CTxValidationCache::CHECK_SAPLING));
+
+    // Different branch or stricter script flags are not covered
+    BOOST_CHECK(!cache.Get(txid, branchId + 1, flags, CTxValidationCache::CHECK_ALL));
+    BOOST_CHECK(!cache.Get(txid, branchId, flags | SCRIPT_VERIFY_CLEANSTACK, CTxValidationCache::CHECK_ALL));
+    BOOST_CHECK(cache.Get(txid, branchId, flags | SCRIPT_VERIFY_CLEANSTACK, CTxValidationCache::CHECK_JOINSPLIT));
+
+    // Partially verified transactions only satisfy the recorded checks
+    uint256 txid2 = GetRandHash();
+    cache.Set(txid2, branchId, flags, CTxValidationCache::CHECK_SCRIPTS);
+    BOOST_CHECK(cache.Get(txid2, branchId, flags, CTxValidationCache::CHECK_SCRIPTS));
+    BOOST_CHECK(!cache.Get(txid2, branchId, flags, CTxValidationCache::CHECK_ALL));
+
+    // Erasing on a hit
+    BOOST_CHECK(cache.Get(txid, branchId, flags, CTxValidationCache::CHECK_ALL, true));
+    BOOST_CHECK(!cache.Get(txid, branchId, flags, CTxValidationCache::CHECK_ALL));
+    BOOST_CHECK_EQUAL(cache.Size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(txvalidationcache_bounded)
+{
+    mapArgs["-txvalidationcachesize"] = "100";
+    CTxValidationCache cache;
+    for (int i = 0; i < 1000; i++)
+        cache.Set(GetRandHash(), 0, 0, CTxValidationCache::CHECK_ALL);
+    BOOST_CHECK_EQUAL(cache.Size(), 100U);
+
+    mapArgs["-txvalidationcachesize"] = "0";
+    cache.Clear();
+    cache.Set(GetRandHash(), 0, 0, CTxValidationCache::CHECK_ALL);
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+    mapArgs.erase("-txvalidationcachesize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
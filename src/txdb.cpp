@@ -41,11 +41,17 @@ static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+/** The profile named by -<strArg>, falling back to defaultProfile. Names are checked at startup. */
+static const CDBProfile& GetDBProfileArg(const std::string& strArg, const CDBProfile& defaultProfile)
+{
+    const CDBProfile* profile = GetDBProfile(GetArg(strArg, defaultProfile.name));
+    return profile ? *profile : defaultProfile;
+}
 
 CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) 
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, GetDBProfileArg("-chainstatedbprofile", DBPROFILE_CHAINSTATE))
 {
 }
 
@@ -124,7 +130,7 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     return hashBestAnchor;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar, bool fErase)
 {
     for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
@@ -135,12 +141,13 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
         CNullifiersMap::iterator itOld = it++;
-        mapToUse.erase(itOld);
+        if (fErase)
+            mapToUse.erase(itOld);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar, bool fErase)
 {
     for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
         if (it->second.flags & MapEntry::DIRTY) {
@@ -154,7 +161,8 @@ void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
             // TODO: changed++?
         }
         MapIterator itOld = it++;
-        mapToUse.erase(itOld);
+        if (fErase)
+            mapToUse.erase(itOld);
     }
 }
 
@@ -166,6 +174,31 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               CAnchorsSaplingMap &mapSaplingAnchors,
                               CNullifiersMap &mapSproutNullifiers,
                               CNullifiersMap &mapSaplingNullifiers) {
+    return WriteMaps(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor,
+                     mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers, true);
+}
+
+bool CCoinsViewDB::WriteSnapshot(CCoinsMap &mapCoins,
+                                 const uint256 &hashBlock,
+                                 const uint256 &hashSproutAnchor,
+                                 const uint256 &hashSaplingAnchor,
+                                 CAnchorsSproutMap &mapSproutAnchors,
+                                 CAnchorsSaplingMap &mapSaplingAnchors,
+                                 CNullifiersMap &mapSproutNullifiers,
+                                 CNullifiersMap &mapSaplingNullifiers) {
+    return WriteMaps(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor,
+                     mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers, false);
+}
+
+bool CCoinsViewDB::WriteMaps(CCoinsMap &mapCoins,
+                             const uint256 &hashBlock,
+                             const uint256 &hashSproutAnchor,
+                             const uint256 &hashSaplingAnchor,
+                             CAnchorsSproutMap &mapSproutAnchors,
+                             CAnchorsSaplingMap &mapSaplingAnchors,
+                             CNullifiersMap &mapSproutNullifiers,
+                             CNullifiersMap &mapSaplingNullifiers,
+                             bool fErase) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
@@ -179,14 +212,15 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
         }
         count++;
         CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (fErase)
+            mapCoins.erase(itOld);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR, fErase);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR, fErase);
 
-    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
+    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER, fErase);
+    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER, fErase);
 
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
@@ -199,7 +233,189 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsViewDB *dbIn) : CCoinsViewBacked(dbIn), db(dbIn), fWriting(false), fWriteFailed(false) {
+}
+
+CCoinsViewBackgroundFlush::~CCoinsViewBackgroundFlush() {
+    WaitForFlush();
+}
+
+bool CCoinsViewBackgroundFlush::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CAnchorsSproutMap::const_iterator it = mapSproutAnchors.find(rt);
+        if (it != mapSproutAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+    return base->GetSproutAnchorAt(rt, tree);
+}
+
+bool CCoinsViewBackgroundFlush::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CAnchorsSaplingMap::const_iterator it = mapSaplingAnchors.find(rt);
+        if (it != mapSaplingAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+    return base->GetSaplingAnchorAt(rt, tree);
+}
+
+bool CCoinsViewBackgroundFlush::GetNullifier(const uint256 &nf, ShieldedType type) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        const CNullifiersMap* mapToUse;
+        switch (type) {
+            case SPROUT:
+                mapToUse = &mapSproutNullifiers;
+                break;
+            case SAPLING:
+                mapToUse = &mapSaplingNullifiers;
+                break;
+            default:
+                throw runtime_error("Unknown shielded type");
+        }
+        CNullifiersMap::const_iterator it = mapToUse->find(nf);
+        if (it != mapToUse->end())
+            return it->second.entered;
+    }
+    return base->GetNullifier(nf, type);
+}
+
+bool CCoinsViewBackgroundFlush::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapCoins.find(txid);
+        if (it != mapCoins.end()) {
+            // Pruned entries are passed on, as a CCoinsViewCache would
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsMap::const_iterator it = mapCoins.find(txid);
+        if (it != mapCoins.end())
+            return !it->second.coins.vout.empty();
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!hashBlock.IsNull())
+            return hashBlock;
+    }
+    return base->GetBestBlock();
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestAnchor(ShieldedType type) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        switch (type) {
+            case SPROUT:
+                if (!hashSproutAnchor.IsNull())
+                    return hashSproutAnchor;
+                break;
+            case SAPLING:
+                if (!hashSaplingAnchor.IsNull())
+                    return hashSaplingAnchor;
+                break;
+            default:
+                throw runtime_error("Unknown shielded type");
+        }
+    }
+    return base->GetBestAnchor(type);
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap &mapCoinsIn,
+                                           const uint256 &hashBlockIn,
+                                           const uint256 &hashSproutAnchorIn,
+                                           const uint256 &hashSaplingAnchorIn,
+                                           CAnchorsSproutMap &mapSproutAnchorsIn,
+                                           CAnchorsSaplingMap &mapSaplingAnchorsIn,
+                                           CNullifiersMap &mapSproutNullifiersIn,
+                                           CNullifiersMap &mapSaplingNullifiersIn) {
+    // Flushes are written in order, so the previous one must be on disk first
+    if (!WaitForFlush())
+        return false;
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    mapCoins.swap(mapCoinsIn);
+    mapSproutAnchors.swap(mapSproutAnchorsIn);
+    mapSaplingAnchors.swap(mapSaplingAnchorsIn);
+    mapSproutNullifiers.swap(mapSproutNullifiersIn);
+    mapSaplingNullifiers.swap(mapSaplingNullifiersIn);
+    hashBlock = hashBlockIn;
+    hashSproutAnchor = hashSproutAnchorIn;
+    hashSaplingAnchor = hashSaplingAnchorIn;
+    fWriting = true;
+    writer = boost::thread(&CCoinsViewBackgroundFlush::WriteSnapshot, this);
+    return true;
+}
+
+bool CCoinsViewBackgroundFlush::GetStats(CCoinsStats &stats) const {
+    if (!const_cast<CCoinsViewBackgroundFlush*>(this)->WaitForFlush())
+        return false;
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewBackgroundFlush::WaitForFlush() {
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fWriting)
+        condWritten.wait(lock);
+    if (writer.joinable())
+        writer.join();
+    return !fWriteFailed;
+}
+
+void CCoinsViewBackgroundFlush::WriteSnapshot() {
+    RenameThread("vidulum-coinsflush");
+    int64_t nStart = GetTimeMicros();
+    // The snapshot is left alone until fWriting is cleared, so it can be read
+    // here without holding cs.
+    bool fOk = false;
+    try {
+        fOk = db->WriteSnapshot(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor,
+                                mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: error writing coin database: %s\n", __func__, e.what());
+    }
+    LogPrint("coindb", "%s: wrote flush of block %s in %.2fms\n", __func__, hashBlock.ToString(), (GetTimeMicros() - nStart) * 0.001);
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fOk) {
+        // The database answers for these entries now
+        CCoinsMap().swap(mapCoins);
+        CAnchorsSproutMap().swap(mapSproutAnchors);
+        CAnchorsSaplingMap().swap(mapSaplingAnchors);
+        CNullifiersMap().swap(mapSproutNullifiers);
+        CNullifiersMap().swap(mapSaplingNullifiers);
+        hashBlock.SetNull();
+        hashSproutAnchor.SetNull();
+        hashSaplingAnchor.SetNull();
+    } else {
+        // Keep answering reads from the unwritten entries; the node shuts
+        // down once the failure is seen by the next flush
+        fWriteFailed = true;
+    }
+    fWriting = false;
+    condWritten.notify_all();
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, GetDBProfileArg("-blockindexdbprofile", DBPROFILE_BLOCK_INDEX)) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -275,11 +491,28 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     }
     batch.Write(DB_LAST_BLOCK, nLastFile);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
-        batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+        CDiskBlockIndex diskindex(*it);
+        if (!diskindex.HasSolution()) {
+            // A settled entry changed again, as when its block is pruned
+            // or invalidated, which is rare enough to read the old entry
+            std::vector<unsigned char> nSolution;
+            if (!ReadBlockSolution((*it)->GetBlockHash(), nSolution))
+                return error("%s: failed to read solution of block %s", __func__, (*it)->GetBlockHash().ToString());
+            diskindex.SetSolution(nSolution);
+        }
+        batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), diskindex);
     }
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadBlockSolution(const uint256 &hash, std::vector<unsigned char> &nSolution) {
+    CDiskBlockIndex diskindex;
+    if (!Read(make_pair(DB_BLOCK_INDEX, hash), diskindex))
+        return false;
+    nSolution = diskindex.GetSolution();
+    return true;
+}
+
 bool CBlockTreeDB::EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
@@ -473,56 +706,107 @@ bool CBlockTreeDB::blockOnchainActive(const uint256 &hash) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+bool CBlockTreeDB::LoadBlockIndexGuts(bool fTrustEntries)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-                pindexNew->nSaplingValue  = diskindex.nSaplingValue;
-
-                // Consistency checks
-                auto header = pindexNew->GetBlockHeader();
-                if (header.GetHash() != pindexNew->GetBlockHash())
-                    return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, in-memory = %s",
-                       diskindex.ToString(),  pindexNew->ToString());
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    const size_t nThreads = std::max(1, std::min(GetNumCores(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    int64_t nTimeRead = 0, nTimeDecode = 0, nTimeInsert = 0;
+    size_t nEntries = 0;
+    bool fDone = false;
+    while (!fDone) {
+        // Read a batch of raw entries, so that they can be decoded in parallel
+        int64_t nStart = GetTimeMicros();
+        std::vector<uint256> vHashes;
+        std::vector<std::string> vValues;
+        while (vHashes.size() < BLOCK_INDEX_LOAD_BATCH) {
+            boost::this_thread::interruption_point();
+            std::pair<char, uint256> key;
+            if (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+                vHashes.push_back(key.second);
+                vValues.push_back(pcursor->GetValueRaw());
                 pcursor->Next();
             } else {
-                return error("LoadBlockIndex() : failed to read value");
+                fDone = true;
+                break;
             }
-        } else {
-            break;
         }
+        int64_t nRead = GetTimeMicros();
+        nTimeRead += nRead - nStart;
+
+        // Decode the entries, and unless they were verified at an earlier
+        // start, check that they hash to their key and meet their target
+        std::vector<CDiskBlockIndex> vDiskIndex(vHashes.size());
+        std::vector<std::string> vErrors(vHashes.size());
+        size_t nChunk = (vHashes.size() + nThreads - 1) / nThreads;
+        boost::thread_group threadGroup;
+        for (size_t nBegin = 0; nBegin < vHashes.size(); nBegin += nChunk) {
+            size_t nEnd = std::min(nBegin + nChunk, vHashes.size());
+            threadGroup.create_thread([&, nBegin, nEnd]() {
+                for (size_t i = nBegin; i < nEnd; i++) {
+                    try {
+                        CDataStream ssValue(vValues[i].data(), vValues[i].data() + vValues[i].size(), SER_DISK, CLIENT_VERSION);
+                        ssValue >> vDiskIndex[i];
+                    } catch (const std::exception& e) {
+                        vErrors[i] = "failed to read value";
+                        continue;
+                    }
+                    if (fTrustEntries)
+                        continue;
+                    if (vDiskIndex[i].GetBlockHash() != vHashes[i])
+                        vErrors[i] = strprintf("block header inconsistency detected: on-disk = %s, key = %s",
+                            vDiskIndex[i].ToString(), vHashes[i].ToString());
+                    else if (!CheckProofOfWork(vHashes[i], vDiskIndex[i].nBits, consensusParams))
+                        vErrors[i] = strprintf("CheckProofOfWork failed: %s", vDiskIndex[i].ToString());
+                }
+            });
+        }
+        threadGroup.join_all();
+        for (const std::string& strError : vErrors) {
+            if (!strError.empty())
+                return error("LoadBlockIndex(): %s", strError);
+        }
+        int64_t nDecode = GetTimeMicros();
+        nTimeDecode += nDecode - nRead;
+
+        // Load mapBlockIndex
+        for (size_t i = 0; i < vDiskIndex.size(); i++) {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vHashes[i]);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nSproutValue   = diskindex.nSproutValue;
+            pindexNew->nSaplingValue  = diskindex.nSaplingValue;
+
+            // Settled entries leave the solution on disk, see CBlockIndex::IsSettled()
+            if (pindexNew->IsSettled())
+                pindexNew->TrimSolution();
+            else
+                pindexNew->SetSolution(diskindex.GetSolution());
+        }
+        nEntries += vDiskIndex.size();
+        nTimeInsert += GetTimeMicros() - nDecode;
     }
 
+    LogPrintf("%s: %u entries (%s): read %.2fms, decode %.2fms on %u threads, insert %.2fms\n", __func__,
+        nEntries, fTrustEntries ? "verified at an earlier start" : "verified",
+        nTimeRead * 0.001, nTimeDecode * 0.001, nThreads, nTimeInsert * 0.001);
     return true;
 }
@@ -14,6 +14,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
@@ -36,6 +38,10 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! max. threads decoding the block index at startup
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
+//! block index entries decoded together at startup
+static const size_t BLOCK_INDEX_LOAD_BATCH = 16384;
 
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -61,7 +67,87 @@ public:
                     CAnchorsSaplingMap &mapSaplingAnchors,
                     CNullifiersMap &mapSproutNullifiers,
                     CNullifiersMap &mapSaplingNullifiers);
+    //! Like BatchWrite, but leaves the maps untouched
+    bool WriteSnapshot(CCoinsMap &mapCoins,
+                       const uint256 &hashBlock,
+                       const uint256 &hashSproutAnchor,
+                       const uint256 &hashSaplingAnchor,
+                       CAnchorsSproutMap &mapSproutAnchors,
+                       CAnchorsSaplingMap &mapSaplingAnchors,
+                       CNullifiersMap &mapSproutNullifiers,
+                       CNullifiersMap &mapSaplingNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+private:
+    bool WriteMaps(CCoinsMap &mapCoins,
+                   const uint256 &hashBlock,
+                   const uint256 &hashSproutAnchor,
+                   const uint256 &hashSaplingAnchor,
+                   CAnchorsSproutMap &mapSproutAnchors,
+                   CAnchorsSaplingMap &mapSaplingAnchors,
+                   CNullifiersMap &mapSproutNullifiers,
+                   CNullifiersMap &mapSaplingNullifiers,
+                   bool fErase);
+};
+
+/**
+ * Writes coins cache flushes to a CCoinsViewDB on a background thread.
+ *
+ * BatchWrite takes over the flushed entries as a snapshot and returns at once;
+ * the snapshot is then written as a single batch together with its best block
+ * and anchors, so the database always holds one complete flush. Until the
+ * write has finished, reads are answered from the snapshot first. A new flush
+ * waits for the previous one to be written.
+ */
+class CCoinsViewBackgroundFlush : public CCoinsViewBacked
+{
+protected:
+    CCoinsViewDB *db;
+
+    mutable boost::mutex cs;
+    boost::condition_variable condWritten;
+    boost::thread writer;
+    bool fWriting;
+    bool fWriteFailed;
+
+    /* The snapshot being written */
+    CCoinsMap mapCoins;
+    uint256 hashBlock;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+    CAnchorsSproutMap mapSproutAnchors;
+    CAnchorsSaplingMap mapSaplingAnchors;
+    CNullifiersMap mapSproutNullifiers;
+    CNullifiersMap mapSaplingNullifiers;
+
+public:
+    CCoinsViewBackgroundFlush(CCoinsViewDB *dbIn);
+    ~CCoinsViewBackgroundFlush();
+
+    bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
+    bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
+    bool GetNullifier(const uint256 &nf, ShieldedType type) const;
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor(ShieldedType type) const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashSproutAnchor,
+                    const uint256 &hashSaplingAnchor,
+                    CAnchorsSproutMap &mapSproutAnchors,
+                    CAnchorsSaplingMap &mapSaplingAnchors,
+                    CNullifiersMap &mapSproutNullifiers,
+                    CNullifiersMap &mapSaplingNullifiers);
+    bool GetStats(CCoinsStats &stats) const;
+
+    //! Wait until the last flush is on disk. Returns false if writing it failed.
+    bool WaitForFlush();
+
+private:
+    void WriteSnapshot();
+
+    CCoinsViewBackgroundFlush(const CCoinsViewBackgroundFlush&);
+    void operator=(const CCoinsViewBackgroundFlush&);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -75,6 +161,7 @@ private:
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
+    bool ReadBlockSolution(const uint256 &hash, std::vector<unsigned char> &nSolution);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
@@ -97,7 +184,7 @@ public:
     bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts();
+    bool LoadBlockIndexGuts(bool fTrustEntries);
     bool blockOnchainActive(const uint256 &hash);
 };
 
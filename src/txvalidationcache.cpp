@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txvalidationcache.h"
+
+#include "crypto/sha256.h"
+#include "random.h"
+#include "util.h"
+
+CTxValidationCache::CTxValidationCache() : salt(GetRandHash())
+{
+}
+
+uint256 CTxValidationCache::GetKey(const uint256& txid, uint32_t consensusBranchId) const
+{
+    uint256 key;
+    CSHA256()
+        .Write(salt.begin(), 32)
+        .Write(txid.begin(), 32)
+        .Write((const unsigned char*)&consensusBranchId, sizeof(consensusBranchId))
+        .Finalize(key.begin());
+    return key;
+}
+
+void CTxValidationCache::Set(const uint256& txid, uint32_t consensusBranchId, unsigned int nScriptFlags, unsigned int nChecks)
+{
+    int64_t nMaxCacheSize = GetArg("-txvalidationcachesize", DEFAULT_TX_VALIDATION_CACHE_SIZE);
+    if (nMaxCacheSize <= 0) return;
+
+    LOCK(cs);
+
+    while (static_cast<int64_t>(mapEntries.size()) >= nMaxCacheSize)
+    {
+        // Evict a random entry; keys are salted hashes, so this is
+        // uniform over the cached transactions.
+        std::map<uint256, CEntry>::iterator it = mapEntries.lower_bound(GetRandHash());
+        if (it == mapEntries.end())
+            it = mapEntries.begin();
+        mapEntries.erase(it);
+    }
+
+    CEntry entry;
+    entry.nScriptFlags = nScriptFlags;
+    entry.nChecks = nChecks;
+    mapEntries[GetKey(txid, consensusBranchId)] = entry;
+}
+
+bool CTxValidationCache::Get(const uint256& txid, uint32_t consensusBranchId, unsigned int nScriptFlags, unsigned int nChecks, bool fErase)
+{
+    LOCK(cs);
+
+    std::map<uint256, CEntry>::iterator it = mapEntries.find(GetKey(txid, consensusBranchId));
+    if (it == mapEntries.end())
+        return false;
+
+    const CEntry& entry = it->second;
+    if ((entry.nChecks & nChecks) != nChecks)
+        return false;
+    if ((nChecks & CHECK_SCRIPTS) && (entry.nScriptFlags & nScriptFlags) != nScriptFlags)
+        return false;
+
+    if (fErase)
+        mapEntries.erase(it);
+    return true;
+}
+
+size_t CTxValidationCache::Size() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+void CTxValidationCache::Clear()
+{
+    LOCK(cs);
+    mapEntries.clear();
+}
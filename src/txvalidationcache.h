@@ -0,0 +1,71 @@
+// Copyright (c) 2018 The Vidulum developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXVALIDATIONCACHE_H
+#define BITCOIN_TXVALIDATIONCACHE_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <stdint.h>
+
+/** Default for -txvalidationcachesize, the maximum number of cached transactions */
+static const int64_t DEFAULT_TX_VALIDATION_CACHE_SIZE = 50000;
+
+/**
+ * Cache of transactions whose expensive checks already passed when they
+ * were accepted to the memory pool, so that ConnectBlock can skip
+ * verifying them a second time.
+ *
+ * Entries are keyed by a salted hash of (txid, consensus branch ID); the
+ * salt keeps peers from predicting which entries collide or get evicted.
+ * Scripts are only treated as verified if they were checked with at least
+ * the script flags the caller asks for.
+ */
+class CTxValidationCache
+{
+public:
+    //! Checks that can be recorded for a transaction
+    enum {
+        //! Input scripts and signatures
+        CHECK_SCRIPTS   = (1U << 0),
+        //! JoinSplit proofs and joinSplitSig
+        CHECK_JOINSPLIT = (1U << 1),
+        //! Sapling spend and output proofs and the binding signature
+        CHECK_SAPLING   = (1U << 2),
+
+        CHECK_ALL = CHECK_SCRIPTS | CHECK_JOINSPLIT | CHECK_SAPLING,
+    };
+
+private:
+    struct CEntry {
+        unsigned int nScriptFlags;
+        unsigned int nChecks;
+    };
+
+    mutable CCriticalSection cs;
+    uint256 salt;
+    std::map<uint256, CEntry> mapEntries;
+
+    uint256 GetKey(const uint256& txid, uint32_t consensusBranchId) const;
+
+public:
+    CTxValidationCache();
+
+    /** Record that the given checks passed, scripts having been verified with nScriptFlags */
+    void Set(const uint256& txid, uint32_t consensusBranchId, unsigned int nScriptFlags, unsigned int nChecks);
+
+    /**
+     * Return true if all of nChecks are recorded for the transaction, with
+     * scripts verified under (at least) nScriptFlags. If fErase is set, a
+     * matching entry is removed as it is no longer needed.
+     */
+    bool Get(const uint256& txid, uint32_t consensusBranchId, unsigned int nScriptFlags, unsigned int nChecks, bool fErase = false);
+
+    size_t Size() const;
+    void Clear();
+};
+
+#endif // BITCOIN_TXVALIDATIONCACHE_H
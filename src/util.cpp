@@ -38,6 +38,7 @@
 
 #include <algorithm>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 
@@ -803,6 +804,29 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+const unsigned char* MapFileReadOnly(FILE *file, size_t& nSize)
+{
+#if defined(WIN32)
+    return NULL;
+#else
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size <= 0)
+        return NULL;
+    void* pData = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (pData == MAP_FAILED)
+        return NULL;
+    nSize = st.st_size;
+    return static_cast<const unsigned char*>(pData);
+#endif
+}
+
+void UnmapFile(const unsigned char* pData, size_t nSize)
+{
+#if !defined(WIN32)
+    munmap(const_cast<unsigned char*>(pData), nSize);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
@@ -134,6 +134,13 @@ void FileCommit(FILE *fileout);
 bool TruncateFile(FILE *file, unsigned int length);
 int RaiseFileDescriptorLimit(int nMinFD);
 void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length);
+/**
+ * Map a whole file read-only into memory. The mapping stays valid after the
+ * file is closed. Returns NULL if the file cannot be mapped, and always on
+ * Windows.
+ */
+const unsigned char* MapFileReadOnly(FILE *file, size_t& nSize);
+void UnmapFile(const unsigned char* pData, size_t nSize);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 bool TryCreateDirectory(const boost::filesystem::path& p);
 boost::filesystem::path GetDefaultDataDir();
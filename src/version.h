@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 170011;
+static const int PROTOCOL_VERSION = 170012;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -39,5 +39,8 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "headers" replies of up to MAX_HEADERS_RESULTS_LARGE headers start with this version
+static const int LARGE_HEADERS_VERSION = 170012;
+
 
 #endif // BITCOIN_VERSION_H
@@ -130,6 +130,11 @@ size_t IncrementalMerkleTree<Depth, Hash>::size() const {
 
 template<size_t Depth, typename Hash>
 void IncrementalMerkleTree<Depth, Hash>::append(Hash obj) {
+    append(obj, nullptr);
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalMerkleTree<Depth, Hash>::append(Hash obj, std::map<std::pair<size_t, uint64_t>, Hash>* completed) {
     if (is_complete(Depth)) {
         throw std::runtime_error("tree is full");
     }
@@ -142,7 +147,11 @@ void IncrementalMerkleTree<Depth, Hash>::append(Hash obj) {
         right = obj;
     } else {
         // Combine the leaves and propagate it up the tree
+        uint64_t end = completed ? size() : 0;
         boost::optional<Hash> combined = Hash::combine(*left, *right, 0);
+        if (completed) {
+            (*completed)[std::make_pair(1, end - 2)] = *combined;
+        }
 
         // Set the "left" leaf to the object and make the "right" leaf none
         left = obj;
@@ -153,6 +162,9 @@ void IncrementalMerkleTree<Depth, Hash>::append(Hash obj) {
                 if (parents[i]) {
                     combined = Hash::combine(*parents[i], *combined, i+1);
                     parents[i] = boost::none;
+                    if (completed) {
+                        (*completed)[std::make_pair(i+2, end - (uint64_t(1) << (i+2)))] = *combined;
+                    }
                 } else {
                     parents[i] = *combined;
                     break;
@@ -312,6 +324,21 @@ MerklePath IncrementalMerkleTree<Depth, Hash>::path(std::deque<Hash> filler_hash
     return MerklePath(merkle_path, index);
 }
 
+template<size_t Depth, typename Hash>
+IncrementalMerkleTree<Depth, Hash> IncrementalMerkleTree<Depth, Hash>::last_subtree(size_t depth) const {
+    // Below the given depth, the subtree holding the last leaf has the same
+    // frontier as the whole tree.
+    IncrementalMerkleTree<Depth, Hash> subtree;
+    subtree.left = left;
+    subtree.right = right;
+    size_t nParents = std::min(parents.size(), depth - 1);
+    subtree.parents.assign(parents.begin(), parents.begin() + nParents);
+    while (!subtree.parents.empty() && !subtree.parents.back()) {
+        subtree.parents.pop_back();
+    }
+    return subtree;
+}
+
 template<size_t Depth, typename Hash>
 std::deque<Hash> IncrementalWitness<Depth, Hash>::partial_path() const {
     std::deque<Hash> uncles(filled.begin(), filled.end());
@@ -323,6 +350,47 @@ std::deque<Hash> IncrementalWitness<Depth, Hash>::partial_path() const {
     return uncles;
 }
 
+template<size_t Depth, typename Hash>
+bool IncrementalWitness<Depth, Hash>::rewind(const IncrementalMerkleTree<Depth, Hash>& frontier) {
+    uint64_t pos = position();
+    uint64_t end = frontier.size();
+    if (end <= pos) {
+        // The frontier does not contain the witnessed leaf
+        return false;
+    }
+
+    // The uncle subtrees the frontier has completed keep their filled roots;
+    // the first incomplete one is rebuilt from the frontier as the cursor.
+    size_t nFilled = 0;
+    boost::optional<IncrementalMerkleTree<Depth, Hash>> new_cursor;
+    size_t new_cursor_depth = 0;
+    while (true) {
+        size_t depth = tree.next_depth(nFilled);
+        if (depth >= Depth) {
+            break;
+        }
+        uint64_t first = ((pos >> depth) + 1) << depth;
+        if (first >= end) {
+            break;
+        }
+        new_cursor_depth = depth;
+        if (first + (uint64_t(1) << depth) <= end) {
+            if (nFilled == filled.size()) {
+                // The witness is behind the frontier
+                return false;
+            }
+            nFilled++;
+        } else {
+            new_cursor = frontier.last_subtree(depth);
+            break;
+        }
+    }
+    filled.resize(nFilled);
+    cursor = new_cursor;
+    cursor_depth = new_cursor_depth;
+    return true;
+}
+
 template<size_t Depth, typename Hash>
 void IncrementalWitness<Depth, Hash>::append(Hash obj) {
     if (cursor) {
@@ -348,6 +416,58 @@ void IncrementalWitness<Depth, Hash>::append(Hash obj) {
     }
 }
 
+template<size_t Depth, typename Hash>
+void IncrementalWitness<Depth, Hash>::append_batch(MerkleSubtreeCache<Depth, Hash>& batch) {
+    uint64_t pos = position();
+    uint64_t end = batch.tree.size();
+
+    // The witness still needs the uncle subtrees at the depths where pos
+    // has a zero bit, in increasing order of depth. Those the batch has
+    // completed are looked up; the first incomplete one becomes the cursor.
+    cursor = boost::none;
+    while (true) {
+        size_t depth = tree.next_depth(filled.size());
+        if (depth >= Depth) {
+            break;
+        }
+        uint64_t first = ((pos >> depth) + 1) << depth;
+        if (first >= end) {
+            break;
+        }
+        cursor_depth = depth;
+        if (first + (uint64_t(1) << depth) <= end) {
+            filled.push_back(batch.subtree_root(depth, first));
+        } else {
+            cursor = batch.tree.last_subtree(depth);
+            break;
+        }
+    }
+}
+
+template<size_t Depth, typename Hash>
+void MerkleSubtreeCache<Depth, Hash>::append(Hash obj) {
+    uint64_t index = tree.size();
+    tree.append(obj, &roots);
+    roots[std::make_pair(0, index)] = obj;
+}
+
+template<size_t Depth, typename Hash>
+Hash MerkleSubtreeCache<Depth, Hash>::subtree_root(size_t depth, uint64_t index) {
+    auto it = roots.find(std::make_pair(depth, index));
+    if (it != roots.end()) {
+        return it->second;
+    }
+
+    // A subtree ending at the last leaf is only hashed by the next append.
+    IncrementalMerkleTree<Depth, Hash> subtree = tree.last_subtree(depth);
+    if (!subtree.is_complete(depth)) {
+        throw std::runtime_error("subtree is not complete");
+    }
+    Hash root = subtree.root(depth);
+    roots[std::make_pair(depth, index)] = root;
+    return root;
+}
+
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
 template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
 
@@ -360,4 +480,10 @@ template class IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, Pede
 template class IncrementalWitness<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, PedersenHash>;
 template class IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, PedersenHash>;
 
+template class MerkleSubtreeCache<INCREMENTAL_MERKLE_TREE_DEPTH, SHA256Compress>;
+template class MerkleSubtreeCache<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, SHA256Compress>;
+
+template class MerkleSubtreeCache<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, PedersenHash>;
+template class MerkleSubtreeCache<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, PedersenHash>;
+
 } // end namespace `libzcash`
@@ -3,6 +3,7 @@
 
 #include <array>
 #include <deque>
+#include <map>
 #include <boost/optional.hpp>
 #include <boost/static_assert.hpp>
 
@@ -82,10 +83,14 @@ bool operator==(const EmptyMerkleRoots<Depth, Hash>& a,
 template<size_t Depth, typename Hash>
 class IncrementalWitness;
 
+template<size_t Depth, typename Hash>
+class MerkleSubtreeCache;
+
 template<size_t Depth, typename Hash>
 class IncrementalMerkleTree {
 
 friend class IncrementalWitness<Depth, Hash>;
+friend class MerkleSubtreeCache<Depth, Hash>;
 
 public:
     BOOST_STATIC_ASSERT(Depth >= 1);
@@ -136,10 +141,15 @@ private:
 
     // Collapsed "left" subtrees ordered toward the root of the tree.
     std::vector<boost::optional<Hash>> parents;
+    // Appends obj; if completed is set, the root of every subtree hashed
+    // along the way is added to it, keyed by (depth, index of first leaf).
+    void append(Hash obj, std::map<std::pair<size_t, uint64_t>, Hash>* completed);
     MerklePath path(std::deque<Hash> filler_hashes = std::deque<Hash>()) const;
     Hash root(size_t depth, std::deque<Hash> filler_hashes = std::deque<Hash>()) const;
     bool is_complete(size_t depth = Depth) const;
     size_t next_depth(size_t skip) const;
+    // The incomplete subtree of the given depth that holds the last leaf
+    IncrementalMerkleTree<Depth, Hash> last_subtree(size_t depth) const;
     void wfcheck() const;
 };
 
@@ -180,6 +190,17 @@ public:
 
     void append(Hash obj);
 
+    // Brings the witness up to date with every leaf appended to batch. The
+    // witness must already include the leaves the batch started from, or
+    // have been taken from batch.current() while the batch was appended.
+    void append_batch(MerkleSubtreeCache<Depth, Hash>& batch);
+
+    // Moves the witness back to an earlier state of the tree, given by its
+    // frontier. Returns false, leaving the witness unchanged, unless the
+    // frontier holds the witnessed leaf and is no larger than the tree the
+    // witness has been brought up to.
+    bool rewind(const IncrementalMerkleTree<Depth, Hash>& frontier);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -213,6 +234,33 @@ bool operator==(const IncrementalWitness<Depth, Hash>& a,
             a.cursor_depth == b.cursor_depth);
 }
 
+// Appends a batch of leaves (e.g. the note commitments of a block) to a tree
+// and keeps the root of every subtree the batch completes. Any number of
+// witnesses can then be updated with IncrementalWitness::append_batch, which
+// looks those roots up instead of hashing each leaf into each witness.
+template<size_t Depth, typename Hash>
+class MerkleSubtreeCache {
+
+friend class IncrementalWitness<Depth, Hash>;
+
+public:
+    MerkleSubtreeCache(const IncrementalMerkleTree<Depth, Hash>& tree) : tree(tree) { }
+
+    void append(Hash obj);
+
+    // The tree with every leaf of the batch appended so far
+    const IncrementalMerkleTree<Depth, Hash>& current() const {
+        return tree;
+    }
+
+private:
+    IncrementalMerkleTree<Depth, Hash> tree;
+    std::map<std::pair<size_t, uint64_t>, Hash> roots;
+
+    // Root of the complete subtree of the given depth starting at leaf index
+    Hash subtree_root(size_t depth, uint64_t index);
+};
+
 class SHA256Compress : public uint256 {
 public:
     SHA256Compress() : uint256() {}
@@ -260,4 +308,7 @@ typedef libzcash::IncrementalMerkleTree<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, l
 typedef libzcash::IncrementalWitness<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::PedersenHash> SaplingWitness;
 typedef libzcash::IncrementalWitness<INCREMENTAL_MERKLE_TREE_DEPTH_TESTING, libzcash::PedersenHash> SaplingTestingWitness;
 
+typedef libzcash::MerkleSubtreeCache<INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::SHA256Compress> SproutSubtreeCache;
+typedef libzcash::MerkleSubtreeCache<SAPLING_INCREMENTAL_MERKLE_TREE_DEPTH, libzcash::PedersenHash> SaplingSubtreeCache;
+
 #endif /* ZC_INCREMENTALMERKLETREE_H_ */
@@ -35,6 +35,8 @@ public:
 
     MOCK_METHOD2(WriteTx, bool(uint256 hash, const CWalletTx& wtx));
     MOCK_METHOD1(WriteWitnessCacheSize, bool(int64_t nWitnessCacheSize));
+    MOCK_METHOD1(WriteNoteCommitmentCheckpoint, bool(const CNoteCommitmentCheckpoint& checkpoint));
+    MOCK_METHOD1(EraseNoteCommitmentCheckpoint, bool(int nHeight));
     MOCK_METHOD1(WriteBestBlock, bool(const CBlockLocator& loc));
 };
 
@@ -526,6 +528,59 @@ TEST(WalletTests, FindMySaplingNotes) {
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
 }
 
+TEST(WalletTests, FindMySaplingNotesParallel) {
+    TestWallet wallet;
+
+    std::vector<unsigned char, secure_allocator<unsigned char>> rawSeed(32);
+    HDSeed seed(rawSeed);
+    auto m = libzcash::SaplingExtendedSpendingKey::Master(seed);
+    std::vector<libzcash::SaplingExtendedSpendingKey> keys;
+    for (uint32_t i = 0; i < 40; i++) {
+        auto sk = m.Derive(i | ZIP32_HARDENED_KEY_LIMIT);
+        ASSERT_TRUE(wallet.AddSaplingZKey(sk, sk.DefaultAddress()));
+        keys.push_back(sk);
+    }
+
+    // Outputs to three of the wallet's keys and one to a stranger
+    auto stranger = libzcash::SaplingSpendingKey::random().default_address();
+    std::vector<libzcash::SaplingPaymentAddress> recipients {
+        keys[3].DefaultAddress(), stranger, keys[17].DefaultAddress(), keys[39].DefaultAddress()
+    };
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    for (auto pa : recipients) {
+        libzcash::SaplingNote note(pa, 10000);
+        std::array<unsigned char, ZC_MEMO_SIZE> memo;
+        libzcash::SaplingNotePlaintext pt(note, memo);
+        auto res = pt.encrypt(note.pk_d);
+        ASSERT_TRUE(static_cast<bool>(res));
+        OutputDescription odesc;
+        odesc.cm = note.cm().get();
+        odesc.ephemeralKey = res.get().second.get_epk();
+        odesc.encCiphertext = res.get().first;
+        mtx.vShieldedOutput.push_back(odesc);
+    }
+    CTransaction tx(mtx);
+
+    int nOldThreads = nSaplingDecryptThreads;
+    nSaplingDecryptThreads = 1;
+    auto serial = wallet.FindMySaplingNotes(tx).first;
+    nSaplingDecryptThreads = 4;
+    auto parallel = wallet.FindMySaplingNotes(tx).first;
+    nSaplingDecryptThreads = nOldThreads;
+
+    EXPECT_EQ(3, serial.size());
+    EXPECT_EQ(serial, parallel);
+    EXPECT_EQ(1, parallel.count(SaplingOutPoint(tx.GetHash(), 0)));
+    EXPECT_EQ(0, parallel.count(SaplingOutPoint(tx.GetHash(), 1)));
+    EXPECT_EQ(keys[17].expsk.full_viewing_key().in_viewing_key(),
+              parallel[SaplingOutPoint(tx.GetHash(), 2)].ivk);
+    EXPECT_EQ(keys[39].expsk.full_viewing_key().in_viewing_key(),
+              parallel[SaplingOutPoint(tx.GetHash(), 3)].ivk);
+}
+
 TEST(WalletTests, FindMySproutNotes) {
     CWallet wallet;
 
@@ -1405,6 +1460,101 @@ TEST(WalletTests, CachedWitnessesDecrementFirst) {
     }
 }
 
+TEST(WalletTests, CachedWitnessesRewindToCheckpoint) {
+    TestWallet wallet;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    std::vector<JSOutPoint> sproutNotes;
+    std::vector<SaplingOutPoint> saplingNotes;
+    std::vector<boost::optional<SproutWitness>> sproutWitnesses;
+    std::vector<boost::optional<SaplingWitness>> saplingWitnesses;
+
+    // First block, with a note that outlives the reorg
+    CBlock block1;
+    CBlockIndex index1(block1);
+    index1.nHeight = 1;
+    auto outpts = CreateValidBlock(wallet, sk, index1, block1, sproutTree, saplingTree);
+    sproutNotes.push_back(outpts.first);
+    saplingNotes.push_back(outpts.second);
+    auto anchors1 = GetWitnessesAndAnchors(wallet, sproutNotes, saplingNotes, sproutWitnesses, saplingWitnesses);
+    auto sproutWitness1 = sproutWitnesses[0];
+    auto saplingWitness1 = saplingWitnesses[0];
+
+    // Two more blocks
+    CBlock block2;
+    CBlockIndex index2(block2);
+    index2.nHeight = 2;
+    CreateValidBlock(wallet, sk, index2, block2, sproutTree, saplingTree);
+    CBlock block3;
+    CBlockIndex index3(block3);
+    index3.nHeight = 3;
+    CreateValidBlock(wallet, sk, index3, block3, sproutTree, saplingTree);
+
+    // Only the witness for the tip is cached, with a checkpoint per block
+    auto hash = outpts.first.hash;
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnesses.size());
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSaplingNoteData[outpts.second].witnesses.size());
+    EXPECT_EQ(3, wallet.noteCommitmentCheckpoints.size());
+    EXPECT_EQ(3, wallet.noteCommitmentCheckpoints.front().nHeight);
+
+    // Disconnecting both blocks rewinds the witness to the first one
+    wallet.DecrementNoteWitnesses(&index3);
+    wallet.DecrementNoteWitnesses(&index2);
+    auto anchors2 = GetWitnessesAndAnchors(wallet, sproutNotes, saplingNotes, sproutWitnesses, saplingWitnesses);
+    EXPECT_EQ(anchors1.first, anchors2.first);
+    EXPECT_EQ(anchors1.second, anchors2.second);
+    EXPECT_EQ(sproutWitness1->path().authentication_path, sproutWitnesses[0]->path().authentication_path);
+    EXPECT_EQ(saplingWitness1->path().authentication_path, saplingWitnesses[0]->path().authentication_path);
+    EXPECT_EQ(1, wallet.noteCommitmentCheckpoints.size());
+    EXPECT_EQ(1, wallet.mapWallet[hash].mapSproutNoteData[outpts.first].witnessHeight);
+}
+
+TEST(WalletTests, CachedWitnessesDroppedWhenRewindFails) {
+    TestWallet wallet;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+
+    std::vector<JSOutPoint> sproutNotes;
+    std::vector<SaplingOutPoint> saplingNotes;
+    std::vector<boost::optional<SproutWitness>> sproutWitnesses;
+    std::vector<boost::optional<SaplingWitness>> saplingWitnesses;
+
+    CBlock block1;
+    CBlockIndex index1(block1);
+    index1.nHeight = 1;
+    auto outpts = CreateValidBlock(wallet, sk, index1, block1, sproutTree, saplingTree);
+    sproutNotes.push_back(outpts.first);
+    saplingNotes.push_back(outpts.second);
+    CBlock block2;
+    CBlockIndex index2(block2);
+    index2.nHeight = 2;
+    CreateValidBlock(wallet, sk, index2, block2, sproutTree, saplingTree);
+    EXPECT_EQ(-1, wallet.nWitnessRescanHeight);
+
+    // A checkpoint the witnesses were never brought up to
+    CNoteCommitmentCheckpoint& checkpoint = *std::next(wallet.noteCommitmentCheckpoints.begin());
+    EXPECT_EQ(1, checkpoint.nHeight);
+    for (int i = 0; i < 64; i++) {
+        checkpoint.sproutTree.append(GetRandHash());
+        checkpoint.saplingTree.append(GetRandHash());
+    }
+
+    // Disconnecting the second block drops the witnesses rather than
+    // throwing, and asks for a rescan
+    wallet.DecrementNoteWitnesses(&index2);
+    GetWitnessesAndAnchors(wallet, sproutNotes, saplingNotes, sproutWitnesses, saplingWitnesses);
+    EXPECT_FALSE((bool) sproutWitnesses[0]);
+    EXPECT_FALSE((bool) saplingWitnesses[0]);
+    EXPECT_EQ(0, wallet.nWitnessRescanHeight);
+}
+
 TEST(WalletTests, CachedWitnessesCleanIndex) {
     TestWallet wallet;
     std::vector<CBlock> blocks;
@@ -1561,6 +1711,13 @@ TEST(WalletTests, WriteWitnessCache) {
     auto wtx = GetValidReceive(sk, 10, true);
     wallet.AddToWallet(wtx, true, NULL);
 
+    // A checkpoint to write, and one to erase
+    wallet.noteCommitmentCheckpoints.push_front(CNoteCommitmentCheckpoint(1, SproutMerkleTree(), SaplingMerkleTree()));
+    wallet.setDirtyNoteCommitmentCheckpoints.insert(1);
+    wallet.setDirtyNoteCommitmentCheckpoints.insert(2);
+    EXPECT_CALL(walletdb, EraseNoteCommitmentCheckpoint(2))
+        .WillRepeatedly(Return(true));
+
     // TxnBegin fails
     EXPECT_CALL(walletdb, TxnBegin())
         .WillOnce(Return(false));
@@ -1600,6 +1757,31 @@ TEST(WalletTests, WriteWitnessCache) {
     EXPECT_CALL(walletdb, WriteWitnessCacheSize(0))
         .WillRepeatedly(Return(true));
 
+    // WriteNoteCommitmentCheckpoint fails
+    EXPECT_CALL(walletdb, WriteNoteCommitmentCheckpoint(::testing::_))
+        .WillOnce(Return(false));
+    EXPECT_CALL(walletdb, TxnAbort())
+        .Times(1);
+    wallet.SetBestChain(walletdb, loc);
+
+    // WriteNoteCommitmentCheckpoint throws
+    EXPECT_CALL(walletdb, WriteNoteCommitmentCheckpoint(::testing::_))
+        .WillOnce(ThrowLogicError());
+    EXPECT_CALL(walletdb, TxnAbort())
+        .Times(1);
+    wallet.SetBestChain(walletdb, loc);
+    EXPECT_CALL(walletdb, WriteNoteCommitmentCheckpoint(::testing::_))
+        .WillRepeatedly(Return(true));
+
+    // EraseNoteCommitmentCheckpoint fails
+    EXPECT_CALL(walletdb, EraseNoteCommitmentCheckpoint(2))
+        .WillOnce(Return(false));
+    EXPECT_CALL(walletdb, TxnAbort())
+        .Times(1);
+    wallet.SetBestChain(walletdb, loc);
+    EXPECT_CALL(walletdb, EraseNoteCommitmentCheckpoint(2))
+        .WillRepeatedly(Return(true));
+
     // WriteBestBlock fails
     EXPECT_CALL(walletdb, WriteBestBlock(loc))
         .WillOnce(Return(false));
@@ -1625,6 +1807,157 @@ TEST(WalletTests, WriteWitnessCache) {
 
     // Everything succeeds
     wallet.SetBestChain(walletdb, loc);
+    EXPECT_TRUE(wallet.setDirtyNoteCommitmentCheckpoints.empty());
+
+    // Checkpoints already written are not written again
+    EXPECT_CALL(walletdb, WriteNoteCommitmentCheckpoint(::testing::_))
+        .Times(0);
+    EXPECT_CALL(walletdb, EraseNoteCommitmentCheckpoint(::testing::_))
+        .Times(0);
+    wallet.SetBestChain(walletdb, loc);
+}
+
+TEST(WalletTests, CachedBalanceInvalidatedByWalletChanges) {
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CAmount nBalance;
+    EXPECT_FALSE(wallet.GetCachedBalance("balance", nBalance));
+    wallet.CacheBalance("balance", 5);
+    EXPECT_TRUE(wallet.GetCachedBalance("balance", nBalance));
+    EXPECT_EQ(5, nBalance);
+    EXPECT_FALSE(wallet.GetCachedBalance("unconfirmed", nBalance));
+
+    // A new transaction may change any balance
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+    auto wtx = GetValidReceive(sk, 10, true);
+    wallet.AddToWallet(wtx, true, NULL);
+    EXPECT_FALSE(wallet.GetCachedBalance("balance", nBalance));
+
+    wallet.CacheBalance("balance", 15);
+    EXPECT_TRUE(wallet.GetCachedBalance("balance", nBalance));
+    EXPECT_EQ(15, nBalance);
+
+    // So may importing keys, which marks the wallet dirty
+    wallet.MarkDirty();
+    EXPECT_FALSE(wallet.GetCachedBalance("balance", nBalance));
+}
+
+TEST(WalletTests, CachedCreditKeepsConfirmedPartOnMempoolChange) {
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    auto sk = libzcash::SproutSpendingKey::random();
+    wallet.AddSproutSpendingKey(sk);
+    auto wtxConfirmed = GetValidReceive(sk, 10, true);
+    auto wtxUnconfirmed = GetValidReceive(sk, 5, true);
+
+    // Fake-mine the first transaction
+    CBlock block;
+    block.vtx.push_back(wtxConfirmed);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    auto blockHash = block.GetHash();
+    CBlockIndex fakeIndex {block};
+    mapBlockIndex.insert(std::make_pair(blockHash, &fakeIndex));
+    chainActive.SetTip(&fakeIndex);
+    wtxConfirmed.SetMerkleBranch(block);
+    wallet.AddToWallet(wtxConfirmed, true, NULL);
+    wallet.AddToWallet(wtxUnconfirmed, true, NULL);
+
+    std::set<uint256> visited;
+    auto credit = [&visited](const CWalletTx& wtx) {
+        visited.insert(wtx.GetHash());
+        return CAmount(1);
+    };
+    EXPECT_EQ(2, wallet.GetCachedCredit("test", credit));
+    EXPECT_EQ(2, visited.size());
+
+    // Answered from the cache
+    visited.clear();
+    EXPECT_EQ(2, wallet.GetCachedCredit("test", credit));
+    EXPECT_EQ(0, visited.size());
+
+    // A mempool change only revisits the transaction outside the chain
+    mempool.AddTransactionsUpdated(1);
+    EXPECT_EQ(2, wallet.GetCachedCredit("test", credit));
+    EXPECT_EQ(1, visited.size());
+    EXPECT_EQ(1, visited.count(wtxUnconfirmed.GetHash()));
+
+    // Revert to default
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blockHash);
+}
+
+TEST(WalletTests, AvailableCoinsFromCoinIndex) {
+    TestWallet wallet;
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    wallet.AddKeyPubKey(key, key.GetPubKey());
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey other;
+    other.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(other.GetPubKey().GetID());
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.push_back(CTxOut(15000 * COIN, scriptMine));
+    mtx.vout.push_back(CTxOut(7 * COIN, scriptMine));
+    mtx.vout.push_back(CTxOut(3 * COIN, scriptOther));
+    CWalletTx wtx(&wallet, mtx);
+    wallet.AddToWallet(wtx, true, NULL);
+
+    std::vector<COutput> vCoins;
+    wallet.AvailableCoins(vCoins, false);
+    ASSERT_EQ(2, vCoins.size());
+    EXPECT_EQ(0, vCoins[0].i);
+    EXPECT_EQ(1, vCoins[1].i);
+
+    wallet.AvailableCoins(vCoins, false, NULL, false, true, ONLY_15000);
+    ASSERT_EQ(1, vCoins.size());
+    EXPECT_EQ(15000 * COIN, vCoins[0].Value());
+
+    wallet.AvailableCoins(vCoins, false, NULL, false, true, ONLY_DENOMINATED);
+    EXPECT_EQ(0, vCoins.size());
+
+    // Spending an output removes it from the selection
+    CMutableTransaction mtxSpend;
+    mtxSpend.vin.resize(1);
+    mtxSpend.vin[0].prevout = COutPoint(wtx.GetHash(), 1);
+    mtxSpend.vout.push_back(CTxOut(6 * COIN, scriptOther));
+    CWalletTx wtxSpend(&wallet, mtxSpend);
+    wallet.AddToWallet(wtxSpend, true, NULL);
+
+    wallet.AvailableCoins(vCoins, false);
+    ASSERT_EQ(1, vCoins.size());
+    EXPECT_EQ(0, vCoins[0].i);
+
+    // Rebuilding the index after MarkDirty gives the same coins
+    wallet.MarkDirty();
+    wallet.AvailableCoins(vCoins, false);
+    ASSERT_EQ(1, vCoins.size());
+    EXPECT_EQ(0, vCoins[0].i);
+
+    // Outputs indexed before the denominations were set are bucketed again
+    std::vector<int64_t> vOldDenominations = obfuScationDenominations;
+    obfuScationDenominations.clear();
+    CMutableTransaction mtxDenom;
+    mtxDenom.vin.resize(1);
+    mtxDenom.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtxDenom.vout.push_back(CTxOut((1 * COIN) + 1000, scriptMine));
+    CWalletTx wtxDenom(&wallet, mtxDenom);
+    wallet.AddToWallet(wtxDenom, true, NULL);
+    wallet.AvailableCoins(vCoins, false, NULL, false, true, ONLY_DENOMINATED);
+    EXPECT_EQ(0, vCoins.size());
+
+    obfuScationDenominations.push_back((1 * COIN) + 1000);
+    wallet.AvailableCoins(vCoins, false, NULL, false, true, ONLY_DENOMINATED);
+    ASSERT_EQ(1, vCoins.size());
+    EXPECT_EQ(wtxDenom.GetHash(), vCoins[0].tx->GetHash());
+    obfuScationDenominations = vOldDenominations;
 }
 
 TEST(WalletTests, UpdateSproutNullifierNoteMap) {
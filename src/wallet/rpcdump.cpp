@@ -137,7 +137,8 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
 
         if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+            if (pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true) < 0)
+                throw JSONRPCError(RPC_WALLET_ERROR, "Rescan failed: a block could not be read from disk");
         }
     }
 
@@ -209,7 +210,8 @@ UniValue importaddress(const UniValue& params, bool fHelp)
 
         if (fRescan)
         {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+            if (pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true) < 0)
+                throw JSONRPCError(RPC_WALLET_ERROR, "Rescan failed: a block could not be read from disk");
             pwalletMain->ReacceptWalletTransactions();
         }
     }
@@ -363,9 +365,12 @@ UniValue importwallet_impl(const UniValue& params, bool fHelp, bool fImportZKeys
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
     LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    int nFound = pwalletMain->ScanForWalletTransactions(pindex);
     pwalletMain->MarkDirty();
 
+    if (nFound < 0)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan failed: a block could not be read from disk");
+
     if (!fGood)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
 
@@ -657,7 +662,8 @@ UniValue z_importkey(const UniValue& params, bool fHelp)
     
     // We want to scan for transactions and notes
     if (fRescan) {
-        pwalletMain->ScanForWalletTransactions(chainActive[nRescanHeight], true);
+        if (pwalletMain->ScanForWalletTransactions(chainActive[nRescanHeight], true) < 0)
+            throw JSONRPCError(RPC_WALLET_ERROR, "Rescan failed: a block could not be read from disk");
     }
 
     return NullUniValue;
@@ -752,7 +758,8 @@ UniValue z_importviewingkey(const UniValue& params, bool fHelp)
 
         // We want to scan for transactions and notes
         if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive[nRescanHeight], true);
+            if (pwalletMain->ScanForWalletTransactions(chainActive[nRescanHeight], true) < 0)
+                throw JSONRPCError(RPC_WALLET_ERROR, "Rescan failed: a block could not be read from disk");
         }
     }
 
@@ -2708,7 +2708,15 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             "zcbenchmark benchmarktype samplecount\n"
             "\n"
             "Runs a benchmark of the selected type samplecount times,\n"
-            "returning the running times of each sample.\n"
+            "returning the running times of each sample. Benchmarks that\n"
+            "measure scaling (trydecryptsaplingnotes) return one sample per\n"
+            "thread count, with the number of threads used. The dbprofiles\n"
+            "benchmark replays the last samplecount blocks once for each\n"
+            "LevelDB profile and adds its I/O and compaction figures. The\n"
+            "loopbackpeers benchmark opens the given number of connections\n"
+            "(default 100) to this node's own P2P port and times their\n"
+            "handshake and a ping round; run it with -maxconnections above\n"
+            "the peer count.\n"
             "\n"
             "Output: [\n"
             "  {\n"
@@ -2722,8 +2730,6 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             );
     }
 
-    LOCK(cs_main);
-
     std::string benchmarktype = params[0].get_str();
     int samplecount = params[1].get_int();
 
@@ -2732,6 +2738,33 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
     }
 
     std::vector<double> sample_times;
+    // Thread count of each sample, for benchmarks that report scaling
+    std::vector<int> sample_threads;
+    // Extra figures of each sample, for benchmarks that report them
+    std::vector<UniValue> sample_info;
+
+    if (benchmarktype == "loopbackpeers") {
+        // Runs without cs_main, which the node needs to answer the peers
+        if (!fListen) {
+            throw JSONRPCError(RPC_MISC_ERROR, "loopbackpeers needs the node to be listening");
+        }
+        int nPeers = 100;
+        if (params.size() >= 3) {
+            nPeers = params[2].get_int();
+        }
+        if (nPeers <= 0) {
+            throw JSONRPCError(RPC_TYPE_ERROR, "Invalid peer count");
+        }
+        for (int i = 0; i < samplecount; i++) {
+            UniValue info(UniValue::VOBJ);
+            info.push_back(Pair("peers", nPeers));
+            sample_times.push_back(benchmark_loopback_peers(nPeers));
+            sample_info.push_back(info);
+        }
+        samplecount = 0;
+    }
+
+    LOCK(cs_main);
 
     JSDescription samplejoinsplit;
 
@@ -2740,6 +2773,23 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
         ss >> samplejoinsplit;
     }
 
+    if (benchmarktype == "dbprofiles") {
+        // The block range is given by samplecount, so this runs once
+        BOOST_FOREACH(const DBProfileBenchmark& sample, benchmark_db_profiles(samplecount)) {
+            UniValue info(UniValue::VOBJ);
+            info.push_back(Pair("profile", sample.profile));
+            info.push_back(Pair("writetime", sample.writetime));
+            info.push_back(Pair("stalls", sample.nStalls));
+            info.push_back(Pair("compactiontime", sample.compactiontime));
+            info.push_back(Pair("compactionreadmb", sample.compactionreadmb));
+            info.push_back(Pair("compactionwritemb", sample.compactionwritemb));
+            info.push_back(Pair("diskbytes", (uint64_t)sample.nDiskBytes));
+            sample_times.push_back(sample.runningtime);
+            sample_info.push_back(info);
+        }
+        samplecount = 0;
+    }
+
     for (int i = 0; i < samplecount; i++) {
         if (benchmarktype == "sleep") {
             sample_times.push_back(benchmark_sleep());
@@ -2776,9 +2826,25 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 nInputs = params[2].get_int();
             }
             sample_times.push_back(benchmark_large_tx(nInputs));
+        } else if (benchmarktype == "sigcache" || benchmarktype == "sigcacheset") {
+            int nThreads = 1;
+            if (params.size() >= 3) {
+                nThreads = params[2].get_int();
+            }
+            if (nThreads < 1) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of threads");
+            }
+            sample_times.push_back(benchmark_sigcache(benchmarktype == "sigcache", nThreads));
         } else if (benchmarktype == "trydecryptnotes") {
             int nAddrs = params[2].get_int();
             sample_times.push_back(benchmark_try_decrypt_notes(nAddrs));
+        } else if (benchmarktype == "trydecryptsaplingnotes") {
+            int nAddrs = params[2].get_int();
+            int nMaxThreads = std::max(1, nSaplingDecryptThreads);
+            for (auto sample : benchmark_try_decrypt_sapling_notes(nAddrs, nMaxThreads)) {
+                sample_threads.push_back(sample.first);
+                sample_times.push_back(sample.second);
+            }
         } else if (benchmarktype == "incnotewitnesses") {
             int nTxs = params[2].get_int();
             sample_times.push_back(benchmark_increment_note_witnesses(nTxs));
@@ -2814,9 +2880,15 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
     }
 
     UniValue results(UniValue::VARR);
-    for (auto time : sample_times) {
+    for (size_t i = 0; i < sample_times.size(); i++) {
         UniValue result(UniValue::VOBJ);
-        result.push_back(Pair("runningtime", time));
+        result.push_back(Pair("runningtime", sample_times[i]));
+        if (i < sample_threads.size()) {
+            result.push_back(Pair("threads", sample_threads[i]));
+        }
+        if (i < sample_info.size()) {
+            result.pushKVs(sample_info[i]);
+        }
         results.push_back(result);
     }
 
@@ -3499,8 +3571,20 @@ UniValue z_gettotalbalance(const UniValue& params, bool fHelp)
     // but they don't because wtx.GetAmounts() does not handle tx where there are no outputs
     // pwalletMain->GetBalance() does not accept min depth parameter
     // so we use our own method to get balance of utxos.
-    CAmount nBalance = getBalanceTaddr("", nMinDepth, !fIncludeWatchonly);
-    CAmount nPrivateBalance = getBalanceZaddr("", nMinDepth, !fIncludeWatchonly);
+    // Monitoring polls this often; the wallet caches the result until a
+    // transaction, block or mempool change could alter it.
+    CAmount nBalance;
+    std::string strTransparent = strprintf("ztotal-transparent-%d-%d", nMinDepth, fIncludeWatchonly);
+    if (!pwalletMain->GetCachedBalance(strTransparent, nBalance)) {
+        nBalance = getBalanceTaddr("", nMinDepth, !fIncludeWatchonly);
+        pwalletMain->CacheBalance(strTransparent, nBalance);
+    }
+    CAmount nPrivateBalance;
+    std::string strPrivate = strprintf("ztotal-private-%d-%d", nMinDepth, fIncludeWatchonly);
+    if (!pwalletMain->GetCachedBalance(strPrivate, nPrivateBalance)) {
+        nPrivateBalance = getBalanceZaddr("", nMinDepth, !fIncludeWatchonly);
+        pwalletMain->CacheBalance(strPrivate, nPrivateBalance);
+    }
     CAmount nTotalBalance = nBalance + nPrivateBalance;
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("transparent", FormatMoney(nBalance)));
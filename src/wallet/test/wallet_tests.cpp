@@ -4,6 +4,13 @@
 
 #include "wallet/wallet.h"
 
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "crypto/equihash.h"
+#include "main.h"
+#include "pow.h"
+#include "script/standard.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -307,4 +314,126 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+// Mine a regtest block with a coinbase paying to scriptPubKey, so that it
+// passes the header checks in ReadBlockFromDisk.
+static CBlock MineRescanBlock(const uint256& hashPrev, int nHeight, const CScript& scriptPubKey)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = hashPrev;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nTime = Params().GenesisBlock().nTime + nHeight * 60;
+    block.nBits = Params().GenesisBlock().nBits;
+
+    EHparameters ehparams = Params().eh_epoch_1_params();
+    crypto_generichash_blake2b_state eh_state;
+    EhInitialiseState(ehparams.n, ehparams.k, eh_state);
+    CEquihashInput I{block};
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << I;
+    crypto_generichash_blake2b_update(&eh_state, (unsigned char*)&ss[0], ss.size());
+
+    while (true) {
+        block.nNonce = ArithToUint256(UintToArith256(block.nNonce) + 1);
+        crypto_generichash_blake2b_state curr_state = eh_state;
+        crypto_generichash_blake2b_update(&curr_state, block.nNonce.begin(), block.nNonce.size());
+        std::function<bool(std::vector<unsigned char>)> validBlock =
+                [&block](std::vector<unsigned char> soln) {
+            block.nSolution = soln;
+            return CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus());
+        };
+        if (EhBasicSolveUncancellable(ehparams.n, ehparams.k, curr_state, validBlock))
+            return block;
+    }
+}
+
+static void CheckSameWalletTxs(const CWallet& a, const CWallet& b)
+{
+    BOOST_CHECK_EQUAL(a.mapWallet.size(), b.mapWallet.size());
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, a.mapWallet)
+    {
+        map<uint256, CWalletTx>::const_iterator it = b.mapWallet.find(item.first);
+        BOOST_REQUIRE(it != b.mapWallet.end());
+        BOOST_CHECK(it->second.hashBlock == item.second.hashBlock);
+        BOOST_CHECK_EQUAL(it->second.nIndex, item.second.nIndex);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rescan_matches_serial_scan)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = CScript() << OP_TRUE;
+
+    // More blocks than the rescan reads ahead, every third one paying to us,
+    // in a block file of their own
+    const int nBlocks = WALLET_RESCAN_PREFETCH_BLOCKS + 8;
+    vector<CBlock> vBlocks;
+    vector<uint256> vHashes;
+    vector<CBlockIndex> vIndex(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        vBlocks.push_back(MineRescanBlock(i ? vHashes.back() : uint256(), i, i % 3 == 1 ? scriptMine : scriptOther));
+        vHashes.push_back(vBlocks.back().GetHash());
+        CDiskBlockPos pos(1000, 0);
+        BOOST_REQUIRE(WriteBlockToDisk(vBlocks.back(), pos, Params().MessageStart()));
+
+        vIndex[i] = CBlockIndex(vBlocks.back());
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nFile = pos.nFile;
+        vIndex[i].nDataPos = pos.nPos;
+        vIndex[i].nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+        vIndex[i].hashSproutAnchor = SproutMerkleTree::empty_root();
+        vIndex[i].BuildSkip();
+    }
+    for (int i = 0; i < nBlocks; i++) {
+        vIndex[i].phashBlock = &vHashes[i];
+        mapBlockIndex.insert(make_pair(vHashes[i], &vIndex[i]));
+    }
+    chainActive.SetTip(&vIndex[nBlocks - 1]);
+
+    CWallet walletRescan, walletSerial, walletFailed;
+    for (CWallet* pwallet : {&walletRescan, &walletSerial, &walletFailed}) {
+        LOCK(pwallet->cs_wallet);
+        BOOST_REQUIRE(pwallet->AddKey(key));
+        pwallet->nTimeFirstKey = 1;
+    }
+
+    // The pipelined rescan finds the same transactions as scanning the
+    // blocks one by one
+    BOOST_CHECK_EQUAL(walletRescan.ScanForWalletTransactions(&vIndex[0], true), (nBlocks + 1) / 3);
+    for (int i = 0; i < nBlocks; i++) {
+        LOCK2(cs_main, walletSerial.cs_wallet);
+        BOOST_FOREACH(const CTransaction& tx, vBlocks[i].vtx)
+            walletSerial.AddToWalletIfInvolvingMe(tx, &vBlocks[i], true);
+    }
+    CheckSameWalletTxs(walletRescan, walletSerial);
+
+    // A block that is not on disk, or not where the index says, fails the
+    // rescan rather than being skipped
+    vIndex[20].nStatus &= ~BLOCK_HAVE_DATA;
+    BOOST_CHECK_EQUAL(walletFailed.ScanForWalletTransactions(&vIndex[0], true), -1);
+    vIndex[20].nStatus |= BLOCK_HAVE_DATA;
+    vIndex[20].nDataPos = vIndex[21].nDataPos;
+    BOOST_CHECK_EQUAL(walletFailed.ScanForWalletTransactions(&vIndex[0], true), -1);
+
+    chainActive.SetTip(pindexOldTip);
+    for (int i = 0; i < nBlocks; i++)
+        mapBlockIndex.erase(vHashes[i]);
+    SelectParams(CBaseChainParams::MAIN);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 #include "wallet/wallet.h"
 
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
@@ -27,6 +28,7 @@
 #include "vidulum/zip32.h"
 
 #include <assert.h>
+#include <atomic>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -44,6 +46,7 @@ unsigned int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
 bool bSpendZeroConfChange = true;
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+int nSaplingDecryptThreads = DEFAULT_SAPLING_DECRYPT_THREADS;
 
 /**
  * Fees smaller than this (in satoshi) are considered zero fee (for transaction creation)
@@ -56,12 +59,19 @@ CFeeRate CWallet::minTxFee = CFeeRate(1000);
  * @{
  */
 
-struct CompareValueOnly
+struct CompareOutputValue
 {
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
+    bool operator()(const COutput& t1, const COutput& t2) const
     {
-        return t1.first < t2.first;
+        return t1.Value() < t2.Value();
+    }
+};
+
+struct CompareByOutPoint
+{
+    bool operator()(const COutput& t1, const COutput& t2) const
+    {
+        return COutPoint(t1.tx->GetHash(), t1.i) < COutPoint(t2.tx->GetHash(), t2.i);
     }
 };
 
@@ -555,6 +565,68 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
     return false;
 }
 
+/**
+ * Adds the checkpoint for a newly connected block, replacing any left at or
+ * above its height (e.g. when blocks are connected again on a reindex). The
+ * heights of the checkpoints added or dropped go into pDirty, if given.
+ */
+void AddNoteCommitmentCheckpoint(NoteCommitmentCheckpoints& checkpoints, const CNoteCommitmentCheckpoint& checkpoint,
+                                 std::set<int>* pDirty = nullptr)
+{
+    while (!checkpoints.empty() && checkpoints.front().nHeight >= checkpoint.nHeight) {
+        if (pDirty) pDirty->insert(checkpoints.front().nHeight);
+        checkpoints.pop_front();
+    }
+    checkpoints.push_front(checkpoint);
+    if (pDirty) pDirty->insert(checkpoint.nHeight);
+    if (checkpoints.size() > WITNESS_CACHE_SIZE) {
+        if (pDirty) pDirty->insert(checkpoints.back().nHeight);
+        checkpoints.pop_back();
+    }
+}
+
+/**
+ * Drops the checkpoint for the block being disconnected, and returns the one
+ * below it to rewind to, if there is one.
+ */
+const CNoteCommitmentCheckpoint* RemoveNoteCommitmentCheckpoint(NoteCommitmentCheckpoints& checkpoints, int nHeight,
+                                                                std::set<int>* pDirty = nullptr)
+{
+    while (!checkpoints.empty() && checkpoints.front().nHeight >= nHeight) {
+        if (pDirty) pDirty->insert(checkpoints.front().nHeight);
+        checkpoints.pop_front();
+    }
+    if (!checkpoints.empty() && checkpoints.front().nHeight == nHeight - 1) {
+        return &checkpoints.front();
+    }
+    return nullptr;
+}
+
+/**
+ * Adds checkpoints taken for the same chain elsewhere, which replace ours at
+ * the same height.
+ */
+void MergeNoteCommitmentCheckpoints(NoteCommitmentCheckpoints& checkpoints, const NoteCommitmentCheckpoints& other,
+                                    std::set<int>* pDirty = nullptr)
+{
+    auto it = checkpoints.begin();
+    for (const CNoteCommitmentCheckpoint& checkpoint : other) {
+        while (it != checkpoints.end() && it->nHeight > checkpoint.nHeight) {
+            ++it;
+        }
+        if (it != checkpoints.end() && it->nHeight == checkpoint.nHeight) {
+            *it = checkpoint;
+        } else {
+            checkpoints.insert(it, checkpoint);
+        }
+        if (pDirty) pDirty->insert(checkpoint.nHeight);
+    }
+    while (checkpoints.size() > WITNESS_CACHE_SIZE) {
+        if (pDirty) pDirty->insert(checkpoints.back().nHeight);
+        checkpoints.pop_back();
+    }
+}
+
 void CWallet::ChainTip(const CBlockIndex *pindex, 
                        const CBlock *pblock,
                        SproutMerkleTree sproutTree,
@@ -563,15 +635,53 @@ void CWallet::ChainTip(const CBlockIndex *pindex,
 {
     if (added) {
         IncrementNoteWitnesses(pindex, pblock, sproutTree, saplingTree);
+        RescanDroppedWitnesses();
     } else {
+        {
+            // Wallets written by earlier versions have no checkpoints for
+            // the blocks they connected; the trees the chain is being
+            // rewound to serve as one.
+            LOCK(cs_wallet);
+            NoteCommitmentCheckpoints chainCheckpoint {CNoteCommitmentCheckpoint(pindex->nHeight - 1, sproutTree, saplingTree)};
+            ::MergeNoteCommitmentCheckpoints(noteCommitmentCheckpoints, chainCheckpoint, &setDirtyNoteCommitmentCheckpoints);
+        }
         DecrementNoteWitnesses(pindex);
     }
     UpdateSaplingNullifierNoteMapForBlock(pblock);
 }
 
+void CWallet::RescanDroppedWitnesses()
+{
+    AssertLockHeld(cs_main);
+    int nHeight;
+    {
+        LOCK(cs_wallet);
+        nHeight = nWitnessRescanHeight;
+    }
+    if (nHeight < 0 || nHeight > chainActive.Height()) {
+        return;
+    }
+    LogPrintf("%s: rescanning from height %d for the note witnesses a reorg dropped\n", __func__, nHeight);
+    if (ScanForWalletTransactions(chainActive[nHeight]) < 0) {
+        // Tried again with the next block, or on startup
+        return;
+    }
+    LOCK(cs_wallet);
+    if (nWitnessRescanHeight == nHeight) {
+        nWitnessRescanHeight = -1;
+    }
+}
+
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
     CWalletDB walletdb(strWalletFile);
+    LOCK2(cs_main, cs_wallet);
+    if (nWitnessRescanHeight >= 0 && chainActive.Height() >= 0) {
+        // Should the node stop before the rescan has run, the wallet is
+        // rescanned from there on startup.
+        SetBestChainINTERNAL(walletdb, chainActive.GetLocator(chainActive[std::min(nWitnessRescanHeight, chainActive.Height())]));
+        return;
+    }
     SetBestChainINTERNAL(walletdb, loc);
 }
 
@@ -936,6 +1046,7 @@ void CWallet::AddToSpends(const uint256& wtxid)
     for (const SpendDescription &spend : thisTx.vShieldedSpend) {
         AddToSaplingSpends(spend.nullifier, wtxid);
     }
+    InvalidateBalanceCache();
 }
 
 bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash, std::string strOutputIndex)
@@ -1005,56 +1116,54 @@ bool CWallet::GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubK
 void CWallet::ClearNoteWitnessCache()
 {
     LOCK(cs_wallet);
-    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-        for (mapSproutNoteData_t::value_type& item : wtxItem.second.mapSproutNoteData) {
+    for (const uint256& hash : setShieldedWalletTxs) {
+        CWalletTx& wtx = mapWallet.at(hash);
+        for (mapSproutNoteData_t::value_type& item : wtx.mapSproutNoteData) {
             item.second.witnesses.clear();
             item.second.witnessHeight = -1;
         }
-        for (mapSaplingNoteData_t::value_type& item : wtxItem.second.mapSaplingNoteData) {
+        for (mapSaplingNoteData_t::value_type& item : wtx.mapSaplingNoteData) {
             item.second.witnesses.clear();
             item.second.witnessHeight = -1;
         }
     }
     nWitnessCacheSize = 0;
+    for (const CNoteCommitmentCheckpoint& checkpoint : noteCommitmentCheckpoints) {
+        setDirtyNoteCommitmentCheckpoints.insert(checkpoint.nHeight);
+    }
+    noteCommitmentCheckpoints.clear();
+}
+
+void CWallet::LoadNoteCommitmentCheckpoint(const CNoteCommitmentCheckpoint& checkpoint)
+{
+    NoteCommitmentCheckpoints checkpoints {checkpoint};
+    ::MergeNoteCommitmentCheckpoints(noteCommitmentCheckpoints, checkpoints);
 }
 
+/**
+ * Wallets written by earlier versions cached a witness per block for each
+ * note; only the most recent one is used now.
+ */
 template<typename NoteDataMap>
-void CopyPreviousWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
+void DropPreviousWitnesses(NoteDataMap& noteDataMap)
 {
     for (auto& item : noteDataMap) {
-        auto* nd = &(item.second);
-        // Only increment witnesses that are behind the current height
-        if (nd->witnessHeight < indexHeight) {
-            // Check the validity of the cache
-            // The only time a note witnessed above the current height
-            // would be invalid here is during a reindex when blocks
-            // have been decremented, and we are incrementing the blocks
-            // immediately after.
-            assert(nWitnessCacheSize >= nd->witnesses.size());
-            // Witnesses being incremented should always be either -1
-            // (never incremented or decremented) or one below indexHeight
-            assert((nd->witnessHeight == -1) || (nd->witnessHeight == indexHeight - 1));
-            // Copy the witness for the previous block if we have one
-            if (nd->witnesses.size() > 0) {
-                nd->witnesses.push_front(nd->witnesses.front());
-            }
-            if (nd->witnesses.size() > WITNESS_CACHE_SIZE) {
-                nd->witnesses.pop_back();
-            }
+        if (item.second.witnesses.size() > 1) {
+            item.second.witnesses.resize(1);
         }
     }
 }
 
-template<typename NoteDataMap>
-void AppendNoteCommitment(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const uint256& note_commitment)
+template<typename NoteDataMap, typename SubtreeCache>
+void AppendNoteCommitments(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, SubtreeCache& subtrees)
 {
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
         if (nd->witnessHeight < indexHeight && nd->witnesses.size() > 0) {
             // Check the validity of the cache
-            // See comment in CopyPreviousWitnesses about validity.
+            // See comment in UpdateWitnessHeights about validity.
             assert(nWitnessCacheSize >= nd->witnesses.size());
-            nd->witnesses.front().append(note_commitment);
+            nd->witnesses.front().append_batch(subtrees);
         }
     }
 }
@@ -1095,11 +1204,18 @@ void UpdateWitnessHeights(NoteDataMap& noteDataMap, int indexHeight, int64_t nWi
 {
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
+        // Only increment witnesses that are behind the current height
         if (nd->witnessHeight < indexHeight) {
-            nd->witnessHeight = indexHeight;
             // Check the validity of the cache
-            // See comment in CopyPreviousWitnesses about validity.
+            // The only time a note witnessed above the current height
+            // would be invalid here is during a reindex when blocks
+            // have been decremented, and we are incrementing the blocks
+            // immediately after.
             assert(nWitnessCacheSize >= nd->witnesses.size());
+            // Witnesses being incremented should always be either -1
+            // (never incremented or decremented) or one below indexHeight
+            assert((nd->witnessHeight == -1) || (nd->witnessHeight == indexHeight - 1));
+            nd->witnessHeight = indexHeight;
         }
     }
 }
@@ -1110,11 +1226,6 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                                      SaplingMerkleTree& saplingTree)
 {
     LOCK(cs_wallet);
-    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-       ::CopyPreviousWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
-       ::CopyPreviousWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
-    }
-
     if (nWitnessCacheSize < WITNESS_CACHE_SIZE) {
         nWitnessCacheSize += 1;
     }
@@ -1126,6 +1237,14 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
         pblock = &block;
     }
 
+    // Append the block's note commitments to the trees once, witnessing our
+    // new notes on the way. The subtree roots this computes are then used
+    // to bring every witness up to date in one step.
+    SproutSubtreeCache sproutSubtrees(sproutTree);
+    SaplingSubtreeCache saplingSubtrees(saplingTree);
+    bool fSproutCommitments = false;
+    bool fSaplingCommitments = false;
+
     for (const CTransaction& tx : pblock->vtx) {
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
@@ -1134,42 +1253,51 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
             const JSDescription& jsdesc = tx.vjoinsplit[i];
             for (uint8_t j = 0; j < jsdesc.commitments.size(); j++) {
                 const uint256& note_commitment = jsdesc.commitments[j];
-                sproutTree.append(note_commitment);
-
-                // Increment existing witnesses
-                for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                    ::AppendNoteCommitment(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, note_commitment);
-                }
+                sproutSubtrees.append(note_commitment);
+                fSproutCommitments = true;
 
                 // If this is our note, witness it
                 if (txIsOurs) {
                     JSOutPoint jsoutpt {hash, i, j};
-                    ::WitnessNoteIfMine(mapWallet[hash].mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, jsoutpt, sproutTree.witness());
+                    ::WitnessNoteIfMine(mapWallet[hash].mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, jsoutpt, sproutSubtrees.current().witness());
                 }
             }
         }
         // Sapling
         for (uint32_t i = 0; i < tx.vShieldedOutput.size(); i++) {
             const uint256& note_commitment = tx.vShieldedOutput[i].cm;
-            saplingTree.append(note_commitment);
-
-            // Increment existing witnesses
-            for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                ::AppendNoteCommitment(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, note_commitment);
-            }
+            saplingSubtrees.append(note_commitment);
+            fSaplingCommitments = true;
 
             // If this is our note, witness it
             if (txIsOurs) {
                 SaplingOutPoint outPoint {hash, i};
-                ::WitnessNoteIfMine(mapWallet[hash].mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, outPoint, saplingTree.witness());
+                ::WitnessNoteIfMine(mapWallet[hash].mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, outPoint, saplingSubtrees.current().witness());
             }
         }
     }
+    sproutTree = sproutSubtrees.current();
+    saplingTree = saplingSubtrees.current();
+    ::AddNoteCommitmentCheckpoint(noteCommitmentCheckpoints, CNoteCommitmentCheckpoint(pindex->nHeight, sproutTree, saplingTree),
+                                  &setDirtyNoteCommitmentCheckpoints);
 
-    // Update witness heights
-    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-        ::UpdateWitnessHeights(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
-        ::UpdateWitnessHeights(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+    // Increment existing witnesses and update witness heights
+    for (std::set<uint256>::iterator it = setShieldedWalletTxs.begin(); it != setShieldedWalletTxs.end(); ) {
+        CWalletTx& wtx = mapWallet.at(*it);
+        // Notes spent irreversibly are never witnessed again
+        if (AreNotesSpentIrreversibly(wtx)) {
+            setShieldedWalletTxs.erase(it++);
+            continue;
+        }
+        ++it;
+        if (fSproutCommitments) {
+            ::AppendNoteCommitments(wtx.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, sproutSubtrees);
+        }
+        if (fSaplingCommitments) {
+            ::AppendNoteCommitments(wtx.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, saplingSubtrees);
+        }
+        ::UpdateWitnessHeights(wtx.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
+        ::UpdateWitnessHeights(wtx.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
     }
 
     // For performance reasons, we write out the witness cache in
@@ -1177,9 +1305,14 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
     // of the wallet.dat is maintained).
 }
 
-template<typename NoteDataMap>
-void DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize)
+/**
+ * Returns true if it dropped the witness of a note that is not in the block
+ * being removed, which only a rescan can witness again.
+ */
+template<typename NoteDataMap, typename Tree>
+bool DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const Tree* frontier)
 {
+    bool fDropped = false;
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
         // Only decrement witnesses that are not above the current height
@@ -1193,7 +1326,23 @@ void DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t n
             // of the block being removed (indexHeight)
             assert((nd->witnessHeight == -1) || (nd->witnessHeight == indexHeight));
             if (nd->witnesses.size() > 0) {
-                nd->witnesses.pop_front();
+                if (frontier && nd->witnesses.front().position() < frontier->size()) {
+                    if (!nd->witnesses.front().rewind(*frontier)) {
+                        LogPrintf("Cannot rewind witness for %s below height %d, dropping it\n",
+                                  item.first.ToString(), indexHeight);
+                        nd->witnesses.clear();
+                        fDropped = true;
+                    }
+                } else {
+                    // Either the note was in the block being removed, or
+                    // there is no checkpoint to rewind its witness to.
+                    if (!frontier) {
+                        LogPrintf("No note commitment checkpoint below height %d, dropping witness for %s\n",
+                                  indexHeight, item.first.ToString());
+                        fDropped = true;
+                    }
+                    nd->witnesses.clear();
+                }
             }
             // indexHeight is the height of the block being removed, so 
             // the new witness cache height is one below it.
@@ -1215,14 +1364,32 @@ void DecrementNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t n
             assert((nWitnessCacheSize - 1) >= nd->witnesses.size());
         }
     }
+    return fDropped;
 }
 
 void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
 {
     LOCK(cs_wallet);
-    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-        ::DecrementNoteWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize);
-        ::DecrementNoteWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize);
+    const CNoteCommitmentCheckpoint* checkpoint = ::RemoveNoteCommitmentCheckpoint(noteCommitmentCheckpoints, pindex->nHeight,
+                                                                                   &setDirtyNoteCommitmentCheckpoints);
+    const SproutMerkleTree* sproutFrontier = checkpoint ? &checkpoint->sproutTree : nullptr;
+    const SaplingMerkleTree* saplingFrontier = checkpoint ? &checkpoint->saplingTree : nullptr;
+    for (const uint256& hash : setShieldedWalletTxs) {
+        CWalletTx& wtx = mapWallet.at(hash);
+        bool fDropped = ::DecrementNoteWitnesses(wtx.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, sproutFrontier);
+        fDropped |= ::DecrementNoteWitnesses(wtx.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, saplingFrontier);
+        if (fDropped) {
+            // The next block connected has the notes witnessed again by a
+            // rescan from the block they are in.
+            BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+            if (mi != mapBlockIndex.end() && mi->second->nHeight >= pindex->nHeight) {
+                continue;
+            }
+            int nHeight = mi != mapBlockIndex.end() ? mi->second->nHeight : 0;
+            if (nWitnessRescanHeight < 0 || nHeight < nWitnessRescanHeight) {
+                nWitnessRescanHeight = nHeight;
+            }
+        }
     }
     nWitnessCacheSize -= 1;
     // TODO: If nWitnessCache is zero, we need to regenerate the caches (#1302)
@@ -1233,6 +1400,196 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
     // of the wallet.dat is maintained).
 }
 
+template<typename RescanWitnessMap, typename SubtreeCache>
+void AppendRescanNoteCommitments(RescanWitnessMap& witnessMap, SubtreeCache& subtrees)
+{
+    for (auto& item : witnessMap) {
+        item.second.witness.append_batch(subtrees);
+    }
+}
+
+/**
+ * Only notes that mapWallet has no witnesses for are witnessed by the rescan;
+ * the others were found earlier and are kept up to date by ChainTip.
+ */
+template<typename OutPoint, typename NoteData, typename Witness>
+bool WitnessRescanNoteIfMine(std::map<OutPoint, RescanNoteWitnesses<Witness>>& witnessMap,
+                             std::map<OutPoint, NoteData>& noteDataMap,
+                             int indexHeight, const OutPoint& key, const Witness& witness)
+{
+    auto nd = noteDataMap.find(key);
+    if (nd == noteDataMap.end() || !nd->second.witnesses.empty() || witnessMap.count(key)) {
+        return false;
+    }
+    RescanNoteWitnesses<Witness>& entry = witnessMap[key];
+    entry.nHeight = indexHeight;
+    entry.witness = witness;
+    return true;
+}
+
+void CWallet::IncrementRescanWitnesses(CRescanWitnessCache& cache,
+                                       const CBlockIndex* pindex,
+                                       const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    UpdateSaplingNullifierNoteMapForBlock(&block);
+
+    bool fHasCommitments = false;
+    for (const CTransaction& tx : block.vtx) {
+        if (!tx.vjoinsplit.empty() || !tx.vShieldedOutput.empty()) {
+            fHasCommitments = true;
+            break;
+        }
+    }
+    if (!fHasCommitments && !cache.checkpoints.empty() &&
+            cache.checkpoints.front().nHeight == pindex->nHeight - 1) {
+        // The trees are the same as after the previous block
+        CNoteCommitmentCheckpoint checkpoint = cache.checkpoints.front();
+        checkpoint.nHeight = pindex->nHeight;
+        ::AddNoteCommitmentCheckpoint(cache.checkpoints, checkpoint);
+        return;
+    }
+
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+    // This should never fail: we should always be able to get the tree
+    // state on the path to the tip of our chain
+    assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
+    if (pindex->pprev) {
+        if (NetworkUpgradeActive(pindex->pprev->nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
+            assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+        }
+    }
+
+    SproutSubtreeCache sproutSubtrees(sproutTree);
+    SaplingSubtreeCache saplingSubtrees(saplingTree);
+    for (const CTransaction& tx : block.vtx) {
+        auto hash = tx.GetHash();
+        auto wtxIt = mapWallet.find(hash);
+        CWalletTx* pwtx = wtxIt == mapWallet.end() ? nullptr : &wtxIt->second;
+        // Sprout
+        for (size_t i = 0; i < tx.vjoinsplit.size(); i++) {
+            const JSDescription& jsdesc = tx.vjoinsplit[i];
+            for (uint8_t j = 0; j < jsdesc.commitments.size(); j++) {
+                const uint256& note_commitment = jsdesc.commitments[j];
+                sproutSubtrees.append(note_commitment);
+                if (pwtx) {
+                    JSOutPoint jsoutpt {hash, i, j};
+                    ::WitnessRescanNoteIfMine(cache.sprout, pwtx->mapSproutNoteData, pindex->nHeight, jsoutpt, sproutSubtrees.current().witness());
+                }
+            }
+        }
+        // Sapling
+        for (uint32_t i = 0; i < tx.vShieldedOutput.size(); i++) {
+            const uint256& note_commitment = tx.vShieldedOutput[i].cm;
+            saplingSubtrees.append(note_commitment);
+            if (pwtx) {
+                SaplingOutPoint outPoint {hash, i};
+                SaplingWitness witness = saplingSubtrees.current().witness();
+                if (::WitnessRescanNoteIfMine(cache.sapling, pwtx->mapSaplingNoteData, pindex->nHeight, outPoint, witness)) {
+                    // Later blocks may spend this note, so its nullifier
+                    // must be known before they are scanned.
+                    SaplingNoteData& nd = pwtx->mapSaplingNoteData[outPoint];
+                    uint256 nullifier = GetSaplingNoteNullifier(*pwtx, outPoint, nd.ivk, witness.position());
+                    mapSaplingNullifiersToNotes[nullifier] = outPoint;
+                    nd.nullifier = nullifier;
+                    InvalidateBalanceCache();
+                }
+            }
+        }
+    }
+
+    ::AppendRescanNoteCommitments(cache.sprout, sproutSubtrees);
+    ::AppendRescanNoteCommitments(cache.sapling, saplingSubtrees);
+    ::AddNoteCommitmentCheckpoint(cache.checkpoints,
+        CNoteCommitmentCheckpoint(pindex->nHeight, sproutSubtrees.current(), saplingSubtrees.current()));
+}
+
+void CWallet::DecrementRescanWitnesses(CRescanWitnessCache& cache, const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_wallet);
+
+    const CNoteCommitmentCheckpoint* checkpoint = ::RemoveNoteCommitmentCheckpoint(cache.checkpoints, pindex->nHeight);
+
+    // A note left in the chain without a witness has it rebuilt by a later
+    // rescan, as in DecrementNoteWitnesses.
+    auto fnDropped = [this, pindex](int nHeight) {
+        if (nHeight < pindex->nHeight && (nWitnessRescanHeight < 0 || nHeight < nWitnessRescanHeight)) {
+            nWitnessRescanHeight = nHeight;
+        }
+    };
+    for (auto it = cache.sprout.begin(); it != cache.sprout.end(); ) {
+        if (it->second.nHeight >= pindex->nHeight || !checkpoint || !it->second.witness.rewind(checkpoint->sproutTree)) {
+            fnDropped(it->second.nHeight);
+            it = cache.sprout.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = cache.sapling.begin(); it != cache.sapling.end(); ) {
+        if (it->second.nHeight >= pindex->nHeight || !checkpoint || !it->second.witness.rewind(checkpoint->saplingTree)) {
+            // The note's position is no longer known, so neither is its nullifier.
+            auto wtxIt = mapWallet.find(it->first.hash);
+            if (wtxIt != mapWallet.end() && wtxIt->second.mapSaplingNoteData.count(it->first)) {
+                SaplingNoteData& nd = wtxIt->second.mapSaplingNoteData[it->first];
+                if (nd.witnesses.empty() && nd.nullifier) {
+                    mapSaplingNullifiersToNotes.erase(nd.nullifier.get());
+                    nd.nullifier = boost::none;
+                    InvalidateBalanceCache();
+                }
+            }
+            fnDropped(it->second.nHeight);
+            it = cache.sapling.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+template<typename OutPoint, typename NoteData, typename Witness>
+void MergeRescanWitnesses(std::map<OutPoint, NoteData>& noteDataMap, const OutPoint& key,
+                          const RescanNoteWitnesses<Witness>& entry, int nHeight)
+{
+    auto nd = noteDataMap.find(key);
+    if (nd == noteDataMap.end() || !nd->second.witnesses.empty()) {
+        return;
+    }
+    nd->second.witnesses.push_front(entry.witness);
+    nd->second.witnessHeight = nHeight;
+}
+
+void CWallet::MergeRescanWitnesses(CRescanWitnessCache& cache, int nHeight)
+{
+    AssertLockHeld(cs_wallet);
+
+    for (auto it = cache.sprout.begin(); it != cache.sprout.end(); ++it) {
+        auto wtxIt = mapWallet.find(it->first.hash);
+        if (wtxIt != mapWallet.end()) {
+            ::MergeRescanWitnesses(wtxIt->second.mapSproutNoteData, it->first, it->second, nHeight);
+        }
+    }
+    for (auto it = cache.sapling.begin(); it != cache.sapling.end(); ++it) {
+        auto wtxIt = mapWallet.find(it->first.hash);
+        if (wtxIt != mapWallet.end()) {
+            ::MergeRescanWitnesses(wtxIt->second.mapSaplingNoteData, it->first, it->second, nHeight);
+        }
+    }
+    cache.sprout.clear();
+    cache.sapling.clear();
+    ::MergeNoteCommitmentCheckpoints(noteCommitmentCheckpoints, cache.checkpoints, &setDirtyNoteCommitmentCheckpoints);
+    cache.checkpoints.clear();
+
+    // There is a checkpoint for each block the witnesses can be rewound
+    // over, counting blocks the rescan went over again only once.
+    nWitnessCacheSize = std::min<int64_t>(WITNESS_CACHE_SIZE, std::max<int64_t>(nWitnessCacheSize, noteCommitmentCheckpoints.size()));
+
+    // For performance reasons, we write out the witness cache in
+    // CWallet::SetBestChain() (which also ensures that overall consistency
+    // of the wallet.dat is maintained).
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -1367,6 +1724,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        InvalidateBalanceCache();
+        fCoinIndexDirty = true;
     }
 }
 
@@ -1428,9 +1787,233 @@ void CWallet::UpdateNullifierNoteMapWithTx(const CWalletTx& wtx)
                 mapSaplingNullifiersToNotes[*item.second.nullifier] = item.first;
             }
         }
+        InvalidateBalanceCache();
+    }
+}
+
+/**
+ * Only transactions with JoinSplits or Sapling outputs can have note data, so
+ * only those are visited when the note witnesses are updated.
+ * IncrementNoteWitnesses drops them again once all their notes are spent
+ * irreversibly.
+ */
+void CWallet::AddToShieldedTxs(const CWalletTx& wtx)
+{
+    LOCK(cs_wallet);
+    if (!wtx.vjoinsplit.empty() || !wtx.vShieldedOutput.empty()) {
+        setShieldedWalletTxs.insert(wtx.GetHash());
+    }
+}
+
+/**
+ * Whether a transaction with a time-based lock time is final depends on the
+ * clock, so balances are not cached while any of these is not final.
+ */
+void CWallet::AddToTimeLockedTxs(const CWalletTx& wtx)
+{
+    LOCK(cs_wallet);
+    if (wtx.nLockTime >= LOCKTIME_THRESHOLD) {
+        setTimeLockedWalletTxs.insert(wtx.GetHash());
+    }
+    InvalidateBalanceCache();
+}
+
+void CWallet::InvalidateBalanceCache()
+{
+    nBalanceUpdates++;
+}
+
+bool CWallet::PrepareBalanceCache() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    for (const uint256& hash : setTimeLockedWalletTxs) {
+        if (!CheckFinalTx(mapWallet.at(hash))) {
+            return false;
+        }
+    }
+    unsigned int nMempoolUpdates = mempool.GetTransactionsUpdated();
+    // Same conditions as CMerkleTx::GetTransactionLockSignatures; the spork
+    // may be a time, so it can turn on without any event
+    bool fSwiftTX = !fLargeWorkForkFound && !fLargeWorkInvalidChainFound &&
+        fEnableSwiftTX && IsSporkActive(SPORK_2_SWIFTTX);
+    unsigned int nLockUpdates = nTransactionLockUpdates;
+    if (nBalanceCacheUpdates != nBalanceUpdates ||
+            pindexBalanceCacheTip != chainActive.Tip() ||
+            fBalanceCacheSwiftTX != fSwiftTX ||
+            (fSwiftTX && nBalanceCacheLockUpdates != nLockUpdates)) {
+        mapBalanceCache.clear();
+        mapConfirmedBalanceCache.clear();
+        // A transaction in the active chain is trusted and its outputs spent
+        // by other transactions in the chain regardless of the mempool
+        setBalanceCacheMempoolTxs.clear();
+        for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+            if (item.second.IsInMainChain())
+                continue;
+            setBalanceCacheMempoolTxs.insert(item.first);
+            for (const CTxIn& txin : item.second.vin) {
+                if (mapWallet.count(txin.prevout.hash))
+                    setBalanceCacheMempoolTxs.insert(txin.prevout.hash);
+            }
+        }
+        nBalanceCacheUpdates = nBalanceUpdates;
+        pindexBalanceCacheTip = chainActive.Tip();
+        nBalanceCacheMempoolUpdates = nMempoolUpdates;
+        fBalanceCacheSwiftTX = fSwiftTX;
+        nBalanceCacheLockUpdates = nLockUpdates;
+    } else if (nBalanceCacheMempoolUpdates != nMempoolUpdates) {
+        mapBalanceCache.clear();
+        nBalanceCacheMempoolUpdates = nMempoolUpdates;
+    }
+    return true;
+}
+
+CAmount CWallet::GetCachedCredit(const std::string& strName, const std::function<CAmount(const CWalletTx&)>& credit) const
+{
+    CAmount nTotal = 0;
+    if (!PrepareBalanceCache()) {
+        for (const std::pair<const uint256, CWalletTx>& item : mapWallet)
+            nTotal += credit(item.second);
+        return nTotal;
+    }
+    std::map<std::string, CAmount>::const_iterator it = mapBalanceCache.find(strName);
+    if (it != mapBalanceCache.end())
+        return it->second;
+
+    it = mapConfirmedBalanceCache.find(strName);
+    if (it != mapConfirmedBalanceCache.end()) {
+        nTotal = it->second;
+    } else {
+        for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+            if (!setBalanceCacheMempoolTxs.count(item.first))
+                nTotal += credit(item.second);
+        }
+        mapConfirmedBalanceCache[strName] = nTotal;
+    }
+    for (const uint256& hash : setBalanceCacheMempoolTxs)
+        nTotal += credit(mapWallet.at(hash));
+    mapBalanceCache[strName] = nTotal;
+    return nTotal;
+}
+
+bool CWallet::GetCachedBalance(const std::string& strName, CAmount& nBalance) const
+{
+    if (!PrepareBalanceCache()) {
+        return false;
+    }
+    std::map<std::string, CAmount>::const_iterator it = mapBalanceCache.find(strName);
+    if (it == mapBalanceCache.end()) {
+        return false;
+    }
+    nBalance = it->second;
+    return true;
+}
+
+void CWallet::CacheBalance(const std::string& strName, CAmount nBalance) const
+{
+    if (PrepareBalanceCache()) {
+        mapBalanceCache[strName] = nBalance;
+    }
+}
+
+WalletCoinBucket CWallet::GetCoinBucket(CAmount nValue) const
+{
+    if (nValue == 15000 * COIN)
+        return COIN_BUCKET_15000;
+    if (IsDenominatedAmount(nValue))
+        return COIN_BUCKET_DENOMINATED;
+    if (IsCollateralAmount(nValue))
+        return COIN_BUCKET_COLLATERAL;
+    return COIN_BUCKET_OTHER;
+}
+
+void CWallet::AddToCoinIndex(const CWalletTx& wtx) const
+{
+    LOCK(cs_wallet);
+    if (fCoinIndexDirty)
+        return;
+
+    const uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        CoinBucket& bucket = coinIndex[wtx.IsCoinBase()][GetCoinBucket(wtx.vout[i].nValue)];
+        bucket.insert(std::make_pair(wtx.vout[i].nValue, COutPoint(hash, i)));
     }
 }
 
+void CWallet::EraseFromCoinIndex(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet);
+    const uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        CoinBucket& bucket = coinIndex[wtx.IsCoinBase()][GetCoinBucket(wtx.vout[i].nValue)];
+        bucket.erase(std::make_pair(wtx.vout[i].nValue, COutPoint(hash, i)));
+    }
+}
+
+void CWallet::RebuildCoinIndex() const
+{
+    AssertLockHeld(cs_wallet);
+    for (int fCoinBase = 0; fCoinBase < 2; fCoinBase++)
+        for (int nBucket = 0; nBucket < COIN_BUCKET_COUNT; nBucket++)
+            coinIndex[fCoinBase][nBucket].clear();
+
+    fCoinIndexDirty = false;
+    nCoinIndexDenominations = obfuScationDenominations.size();
+    for (const std::pair<const uint256, CWalletTx>& item : mapWallet) {
+        AddToCoinIndex(item.second);
+    }
+}
+
+/**
+ * An output spent by a transaction buried deeper than the longest reorg we
+ * accept can never become available again.
+ */
+bool CWallet::IsSpentIrreversibly(const uint256& hash, unsigned int n) const
+{
+    std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(COutPoint(hash, n));
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > (int)MAX_REORG_LENGTH)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * A note spent by a transaction buried deeper than the longest reorg we
+ * accept can never be spent again, so it needs no witness.
+ */
+bool CWallet::IsNullifierSpentIrreversibly(const TxNullifiers& mapTxNullifiers, const uint256& nullifier) const
+{
+    std::pair<TxNullifiers::const_iterator, TxNullifiers::const_iterator> range;
+    range = mapTxNullifiers.equal_range(nullifier);
+
+    for (TxNullifiers::const_iterator it = range.first; it != range.second; ++it) {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > (int)MAX_REORG_LENGTH)
+            return true;
+    }
+    return false;
+}
+
+bool CWallet::AreNotesSpentIrreversibly(const CWalletTx& wtx) const
+{
+    for (const mapSproutNoteData_t::value_type& item : wtx.mapSproutNoteData) {
+        if (!item.second.nullifier || !IsNullifierSpentIrreversibly(mapTxSproutNullifiers, *item.second.nullifier))
+            return false;
+    }
+    for (const mapSaplingNoteData_t::value_type& item : wtx.mapSaplingNoteData) {
+        if (!item.second.nullifier || !IsNullifierSpentIrreversibly(mapTxSaplingNullifiers, *item.second.nullifier))
+            return false;
+    }
+    return true;
+}
+
 /**
  * Update mapSaplingNullifiersToNotes, computing the nullifier from a cached witness if necessary.
  */
@@ -1450,28 +2033,39 @@ void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
         }
         else {
             uint64_t position = nd.witnesses.front().position();
-            SaplingFullViewingKey fvk = mapSaplingFullViewingKeys.at(nd.ivk);
-            OutputDescription output = wtx.vShieldedOutput[op.n];
-            auto optPlaintext = SaplingNotePlaintext::decrypt(output.encCiphertext, nd.ivk, output.ephemeralKey, output.cm);
-            if (!optPlaintext) {
-                // An item in mapSaplingNoteData must have already been successfully decrypted,
-                // otherwise the item would not exist in the first place.
-                assert(false);
-            }
-            auto optNote = optPlaintext.get().note(nd.ivk);
-            if (!optNote) {
-                assert(false);
-            }
-            auto optNullifier = optNote.get().nullifier(fvk, position);
-            if (!optNullifier) {
-                // This should not happen.  If it does, maybe the position has been corrupted or miscalculated?
-                assert(false);
-            }
-            uint256 nullifier = optNullifier.get();
+            uint256 nullifier = GetSaplingNoteNullifier(wtx, op, nd.ivk, position);
             mapSaplingNullifiersToNotes[nullifier] = op;
             item.second.nullifier = nullifier;
         }
     }
+    InvalidateBalanceCache();
+}
+
+/**
+ * Derive the nullifier of a Sapling note in wtx, given its position in the
+ * note commitment tree.
+ */
+uint256 CWallet::GetSaplingNoteNullifier(const CWalletTx& wtx, const SaplingOutPoint& op,
+                                         const SaplingIncomingViewingKey& ivk, uint64_t position) const
+{
+    SaplingFullViewingKey fvk = mapSaplingFullViewingKeys.at(ivk);
+    OutputDescription output = wtx.vShieldedOutput[op.n];
+    auto optPlaintext = SaplingNotePlaintext::decrypt(output.encCiphertext, ivk, output.ephemeralKey, output.cm);
+    if (!optPlaintext) {
+        // An item in mapSaplingNoteData must have already been successfully decrypted,
+        // otherwise the item would not exist in the first place.
+        assert(false);
+    }
+    auto optNote = optPlaintext.get().note(ivk);
+    if (!optNote) {
+        assert(false);
+    }
+    auto optNullifier = optNote.get().nullifier(fvk, position);
+    if (!optNullifier) {
+        // This should not happen.  If it does, maybe the position has been corrupted or miscalculated?
+        assert(false);
+    }
+    return optNullifier.get();
 }
 
 /**
@@ -1498,7 +2092,12 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
     {
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
+        ::DropPreviousWitnesses(mapWallet[hash].mapSproutNoteData);
+        ::DropPreviousWitnesses(mapWallet[hash].mapSaplingNoteData);
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
+        AddToShieldedTxs(mapWallet[hash]);
+        AddToTimeLockedTxs(mapWallet[hash]);
+        AddToCoinIndex(mapWallet[hash]);
         AddToSpends(hash);
     }
     else
@@ -1509,6 +2108,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         CWalletTx& wtx = (*ret.first).second;
         wtx.BindWallet(this);
         UpdateNullifierNoteMapWithTx(wtx);
+        AddToShieldedTxs(wtx);
+        AddToTimeLockedTxs(wtx);
+        AddToCoinIndex(wtx);
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
@@ -1658,13 +2260,25 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
  * If fUpdate is true, existing transactions will be updated.
  */
 bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+{
+    AssertLockHeld(cs_wallet);
+    if (!fUpdate && mapWallet.count(tx.GetHash()) != 0) return false;
+    return AddToWalletIfInvolvingMe(tx, pblock, fUpdate, FindMySproutNotes(tx), FindMySaplingNotes(tx), IsMine(tx));
+}
+
+/**
+ * As above, with the trial decryption and IsMine results already computed
+ * (possibly without holding cs_wallet), as ScanForWalletTransactions does.
+ */
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                       const mapSproutNoteData_t& sproutNoteData,
+                                       const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>& saplingNoteDataAndAddressesToAdd,
+                                       bool fIsMine)
 {
     {
         AssertLockHeld(cs_wallet);
         bool fExisted = mapWallet.count(tx.GetHash()) != 0;
         if (fExisted && !fUpdate) return false;
-        auto sproutNoteData = FindMySproutNotes(tx);
-        auto saplingNoteDataAndAddressesToAdd = FindMySaplingNotes(tx);
         auto saplingNoteData = saplingNoteDataAndAddressesToAdd.first;
         auto addressesToAdd = saplingNoteDataAndAddressesToAdd.second;
         for (const auto &addressToAdd : addressesToAdd) {
@@ -1672,7 +2286,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
                 return false;
             }
         }
-        if (fExisted || IsMine(tx) || IsFromMe(tx) || sproutNoteData.size() > 0 || saplingNoteData.size() > 0)
+        if (fExisted || fIsMine || IsFromMe(tx) || sproutNoteData.size() > 0 || saplingNoteData.size() > 0)
         {
             CWalletTx wtx(this,tx);
 
@@ -1741,6 +2355,12 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
+        setShieldedWalletTxs.erase(hash);
+        setTimeLockedWalletTxs.erase(hash);
+        InvalidateBalanceCache();
+        std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+            EraseFromCoinIndex(it->second);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1820,9 +2440,146 @@ mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
             }
         }
     }
-    return noteData;
+    return noteData;
+}
+
+
+namespace {
+
+/**
+ * Trial decryption of every (output, incoming viewing key) pair of one
+ * transaction. Pairs are handed out in small batches to whichever threads
+ * call Run(); each output is skipped as soon as one key has decrypted it.
+ */
+class CSaplingDecryptJob
+{
+private:
+    const std::vector<OutputDescription>& vOutputs;
+    const std::vector<SaplingIncomingViewingKey>& vIvks;
+    std::vector<int>& vKeyIndex;
+    std::vector<SaplingNotePlaintext>& vPlaintexts;
+    const size_t nPairs;
+    std::unique_ptr<std::atomic<bool>[]> vFound;
+    std::atomic<size_t> nNextPair;
+
+public:
+    CSaplingDecryptJob(const std::vector<OutputDescription>& vOutputsIn,
+                       const std::vector<SaplingIncomingViewingKey>& vIvksIn,
+                       std::vector<int>& vKeyIndexIn,
+                       std::vector<SaplingNotePlaintext>& vPlaintextsIn) :
+        vOutputs(vOutputsIn), vIvks(vIvksIn), vKeyIndex(vKeyIndexIn), vPlaintexts(vPlaintextsIn),
+        nPairs(vOutputsIn.size() * vIvksIn.size()), vFound(new std::atomic<bool>[vOutputsIn.size()]), nNextPair(0)
+    {
+        for (size_t i = 0; i < vOutputs.size(); i++) {
+            vFound[i] = false;
+        }
+    }
+
+    void Run()
+    {
+        const size_t nBatch = SAPLING_DECRYPT_MIN_PAIRS_PER_THREAD;
+        while (true) {
+            size_t nStart = nNextPair.fetch_add(nBatch);
+            if (nStart >= nPairs) {
+                return;
+            }
+            size_t nEnd = std::min(nPairs, nStart + nBatch);
+            for (size_t p = nStart; p < nEnd; p++) {
+                size_t i = p / vIvks.size();
+                size_t k = p % vIvks.size();
+                if (vFound[i].load(std::memory_order_relaxed)) {
+                    continue;
+                }
+                const OutputDescription& output = vOutputs[i];
+                auto result = SaplingNotePlaintext::decrypt(output.encCiphertext, vIvks[k], output.ephemeralKey, output.cm);
+                if (!result) {
+                    continue;
+                }
+                bool fExpected = false;
+                if (vFound[i].compare_exchange_strong(fExpected, true)) {
+                    vKeyIndex[i] = k;
+                    vPlaintexts[i] = result.get();
+                }
+            }
+        }
+    }
+};
+
+/** One thread's share of a CSaplingDecryptJob, for CCheckQueue. */
+class CSaplingDecryptCheck
+{
+private:
+    CSaplingDecryptJob* job;
+
+public:
+    CSaplingDecryptCheck() : job(NULL) {}
+    CSaplingDecryptCheck(CSaplingDecryptJob* jobIn) : job(jobIn) {}
+
+    bool operator()()
+    {
+        job->Run();
+        return true;
+    }
+
+    void swap(CSaplingDecryptCheck& check)
+    {
+        std::swap(job, check.job);
+    }
+};
+
+//! Workers started by ThreadSaplingDecrypt(); the queue takes one job at a time
+CCheckQueue<CSaplingDecryptCheck> saplingdecryptqueue(1);
+CCriticalSection cs_saplingdecryptqueue;
+
+} // anon namespace
+
+void ThreadSaplingDecrypt()
+{
+    RenameThread("vidulum-saplingdec");
+    saplingdecryptqueue.Thread();
+}
+
+int GetSaplingDecryptThreads(size_t nPairs, int nThreads)
+{
+    if (nThreads <= 0 || nThreads > nSaplingDecryptThreads)
+        nThreads = nSaplingDecryptThreads;
+    return std::max<int>(1, std::min<size_t>(nThreads, nPairs / SAPLING_DECRYPT_MIN_PAIRS_PER_THREAD));
 }
 
+/**
+ * Trial-decrypts every (output, incoming viewing key) pair on the calling
+ * thread and up to nThreads - 1 workers of the Sapling decryption pool.
+ * On return vKeyIndex[i] is the index in vIvks of the key that decrypted
+ * output i, or -1, and vPlaintexts[i] holds the corresponding plaintext.
+ */
+static void TrialDecryptSaplingOutputs(
+    const std::vector<OutputDescription>& vOutputs,
+    const std::vector<SaplingIncomingViewingKey>& vIvks,
+    int nThreads,
+    std::vector<int>& vKeyIndex,
+    std::vector<SaplingNotePlaintext>& vPlaintexts)
+{
+    const size_t nPairs = vOutputs.size() * vIvks.size();
+    vKeyIndex.assign(vOutputs.size(), -1);
+    vPlaintexts.assign(vOutputs.size(), SaplingNotePlaintext());
+    if (nPairs == 0) {
+        return;
+    }
+
+    CSaplingDecryptJob job(vOutputs, vIvks, vKeyIndex, vPlaintexts);
+    nThreads = GetSaplingDecryptThreads(nPairs, nThreads);
+    if (nThreads == 1) {
+        job.Run();
+        return;
+    }
+
+    // The queue serves one caller at a time
+    LOCK(cs_saplingdecryptqueue);
+    CCheckQueueControl<CSaplingDecryptCheck> control(&saplingdecryptqueue);
+    std::vector<CSaplingDecryptCheck> vChecks(nThreads, CSaplingDecryptCheck(&job));
+    control.Add(vChecks);
+    control.Wait();
+}
 
 /**
  * Finds all output notes in the given transaction that have been sent to
@@ -1831,36 +2588,51 @@ mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
  * It should never be necessary to call this method with a CWalletTx, because
  * the result of FindMySaplingNotes (for the addresses available at the time) will
  * already have been cached in CWalletTx.mapSaplingNoteData.
+ *
+ * Trial decryption runs on up to nThreads threads (nSaplingDecryptThreads
+ * if 0), see GetSaplingDecryptThreads(), without holding cs_SpendingKeyStore.
  */
-std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(const CTransaction &tx) const
+std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(const CTransaction &tx, int nThreads) const
 {
-    LOCK(cs_SpendingKeyStore);
     uint256 hash = tx.GetHash();
 
     mapSaplingNoteData_t noteData;
     SaplingIncomingViewingKeyMap viewingKeysToAdd;
 
+    if (tx.vShieldedOutput.empty()) {
+        return std::make_pair(noteData, viewingKeysToAdd);
+    }
+
+    std::vector<SaplingIncomingViewingKey> vIvks;
+    {
+        LOCK(cs_SpendingKeyStore);
+        vIvks.reserve(mapSaplingFullViewingKeys.size());
+        for (auto it = mapSaplingFullViewingKeys.begin(); it != mapSaplingFullViewingKeys.end(); ++it) {
+            vIvks.push_back(it->first);
+        }
+    }
+
     // Protocol Spec: 4.19 Block Chain Scanning (Sapling)
+    std::vector<int> vKeyIndex;
+    std::vector<SaplingNotePlaintext> vPlaintexts;
+    TrialDecryptSaplingOutputs(tx.vShieldedOutput, vIvks, nThreads > 0 ? nThreads : nSaplingDecryptThreads, vKeyIndex, vPlaintexts);
+
+    LOCK(cs_SpendingKeyStore);
     for (uint32_t i = 0; i < tx.vShieldedOutput.size(); ++i) {
-        const OutputDescription output = tx.vShieldedOutput[i];
-        for (auto it = mapSaplingFullViewingKeys.begin(); it != mapSaplingFullViewingKeys.end(); ++it) {
-            SaplingIncomingViewingKey ivk = it->first;
-            auto result = SaplingNotePlaintext::decrypt(output.encCiphertext, ivk, output.ephemeralKey, output.cm);
-            if (!result) {
-                continue;
-            }
-            auto address = ivk.address(result.get().d);
-            if (address && mapSaplingIncomingViewingKeys.count(address.get()) == 0) {
-                viewingKeysToAdd[address.get()] = ivk;
-            }
-            // We don't cache the nullifier here as computing it requires knowledge of the note position
-            // in the commitment tree, which can only be determined when the transaction has been mined.
-            SaplingOutPoint op {hash, i};
-            SaplingNoteData nd;
-            nd.ivk = ivk;
-            noteData.insert(std::make_pair(op, nd));
-            break;
+        if (vKeyIndex[i] < 0) {
+            continue;
         }
+        SaplingIncomingViewingKey ivk = vIvks[vKeyIndex[i]];
+        auto address = ivk.address(vPlaintexts[i].d);
+        if (address && mapSaplingIncomingViewingKeys.count(address.get()) == 0) {
+            viewingKeysToAdd[address.get()] = ivk;
+        }
+        // We don't cache the nullifier here as computing it requires knowledge of the note position
+        // in the commitment tree, which can only be determined when the transaction has been mined.
+        SaplingOutPoint op {hash, i};
+        SaplingNoteData nd;
+        nd.ivk = ivk;
+        noteData.insert(std::make_pair(op, nd));
     }
 
     return std::make_pair(noteData, viewingKeysToAdd);
@@ -2445,7 +3217,7 @@ bool CWallet::LoadCryptedHDSeed(const uint256& seedFp, const std::vector<unsigne
     return CCryptoKeyStore::SetCryptedHDSeed(seedFp, seed);
 }
 
-void CWalletTx::SetSproutNoteData(mapSproutNoteData_t &noteData)
+void CWalletTx::SetSproutNoteData(const mapSproutNoteData_t &noteData)
 {
     mapSproutNoteData.clear();
     for (const std::pair<JSOutPoint, SproutNoteData> nd : noteData) {
@@ -2461,7 +3233,7 @@ void CWalletTx::SetSproutNoteData(mapSproutNoteData_t &noteData)
     }
 }
 
-void CWalletTx::SetSaplingNoteData(mapSaplingNoteData_t &noteData)
+void CWalletTx::SetSaplingNoteData(const mapSaplingNoteData_t &noteData)
 {
     mapSaplingNoteData.clear();
     for (const std::pair<SaplingOutPoint, SaplingNoteData> nd : noteData) {
@@ -2732,10 +3504,188 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
     }
 }
 
+namespace {
+
+/** A block read ahead by a wallet rescan, with its trial decryption results. */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<mapSproutNoteData_t> vSproutNoteData;
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> vSaplingNoteData;
+    std::vector<bool> vIsMine;
+    bool fScanned;
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fScanned(false) {}
+};
+
+/**
+ * Front end of ScanForWalletTransactions. One thread reads the blocks in
+ * vChain from disk, up to WALLET_RESCAN_PREFETCH_BLOCKS ahead of the caller,
+ * and nScanThreads threads trial-decrypt them and check IsMine. Next() hands
+ * the blocks back in chain order. Neither stage touches chainActive or
+ * mapWallet, so no thread takes cs_main or cs_wallet and the caller may hold
+ * them. The block positions are therefore taken by the caller under cs_main;
+ * a null position stands for a block whose data is not on disk. Reading stops
+ * at the first block that cannot be read, which ReadFailed() then returns.
+ */
+class CRescanPipeline
+{
+private:
+    const CWallet& wallet;
+    const std::vector<CBlockIndex*> vChain;
+    const std::vector<CDiskBlockPos> vPos;
+
+    boost::mutex mutex;
+    //! Signalled when the reader may read further ahead
+    boost::condition_variable condReader;
+    //! Signalled when a block is ready to be scanned
+    boost::condition_variable condScanner;
+    //! Signalled when a block has been scanned
+    boost::condition_variable condNext;
+    //! Blocks read so far and not yet returned by Next(), in chain order
+    std::deque<std::shared_ptr<CRescanBlock>> queue;
+    //! Blocks read so far and not yet picked up by a scanner thread
+    std::deque<std::shared_ptr<CRescanBlock>> queueToScan;
+    bool fReadDone;
+    bool fInterrupted;
+    //! The block the reader failed to read, if any
+    CBlockIndex* pindexReadFailed;
+
+    boost::thread_group threads;
+
+    void ReadBlocks()
+    {
+        RenameThread("vidulum-rescanrd");
+        for (size_t i = 0; i < vChain.size(); i++) {
+            CBlockIndex* pindex = vChain[i];
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fInterrupted && queue.size() >= WALLET_RESCAN_PREFETCH_BLOCKS) {
+                    condReader.wait(lock);
+                }
+                if (fInterrupted) {
+                    break;
+                }
+            }
+            std::shared_ptr<CRescanBlock> pblock = std::make_shared<CRescanBlock>(pindex);
+            // The hash check also catches a block file that was pruned and
+            // reused since the position was taken.
+            if (vPos[i].IsNull() || !ReadBlockFromDisk(pblock->block, vPos[i]) ||
+                pblock->block.GetHash() != pindex->GetBlockHash()) {
+                LogPrintf("%s: cannot read block %s at height %d\n", __func__, pindex->GetBlockHash().ToString(), pindex->nHeight);
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pindexReadFailed = pindex;
+                break;
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                queue.push_back(pblock);
+                queueToScan.push_back(pblock);
+            }
+            condScanner.notify_one();
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fReadDone = true;
+        }
+        condScanner.notify_all();
+        condNext.notify_all();
+    }
+
+    void ScanBlocks()
+    {
+        RenameThread("vidulum-rescan");
+        while (true) {
+            std::shared_ptr<CRescanBlock> pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fInterrupted && !fReadDone && queueToScan.empty()) {
+                    condScanner.wait(lock);
+                }
+                if (fInterrupted || queueToScan.empty()) {
+                    return;
+                }
+                pblock = queueToScan.front();
+                queueToScan.pop_front();
+            }
+            // Blocks are scanned in parallel, so each one decrypts on a
+            // single thread.
+            for (const CTransaction& tx : pblock->block.vtx) {
+                pblock->vSproutNoteData.push_back(wallet.FindMySproutNotes(tx));
+                pblock->vSaplingNoteData.push_back(wallet.FindMySaplingNotes(tx, 1));
+                pblock->vIsMine.push_back(wallet.IsMine(tx));
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pblock->fScanned = true;
+            }
+            condNext.notify_all();
+        }
+    }
+
+public:
+    CRescanPipeline(const CWallet& walletIn, const std::vector<CBlockIndex*>& vChainIn, const std::vector<CDiskBlockPos>& vPosIn, int nScanThreads) :
+        wallet(walletIn), vChain(vChainIn), vPos(vPosIn), fReadDone(false), fInterrupted(false), pindexReadFailed(nullptr)
+    {
+        assert(vChain.size() == vPos.size());
+        threads.create_thread(boost::bind(&CRescanPipeline::ReadBlocks, this));
+        for (int i = 0; i < std::max(1, nScanThreads); i++) {
+            threads.create_thread(boost::bind(&CRescanPipeline::ScanBlocks, this));
+        }
+    }
+
+    ~CRescanPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fInterrupted = true;
+        }
+        condReader.notify_all();
+        condScanner.notify_all();
+        condNext.notify_all();
+        threads.join_all();
+    }
+
+    /** Returns the next block of vChain, or nullptr after the last one. */
+    std::shared_ptr<CRescanBlock> Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(queue.empty() ? fReadDone : queue.front()->fScanned)) {
+            condNext.wait(lock);
+        }
+        if (queue.empty()) {
+            return nullptr;
+        }
+        std::shared_ptr<CRescanBlock> pblock = queue.front();
+        queue.pop_front();
+        condReader.notify_one();
+        return pblock;
+    }
+
+    /** Returns the block that could not be read, once Next() has returned nullptr. */
+    CBlockIndex* ReadFailed()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return pindexReadFailed;
+    }
+};
+
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and trial-decrypted ahead by a CRescanPipeline. cs_main
+ * and cs_wallet are only taken to commit each block, in chain order, so
+ * that the node keeps connecting blocks and serving RPCs meanwhile. Blocks
+ * connected (or disconnected) during the rescan are handled at the end,
+ * with the locks held throughout.
+ *
+ * Returns the number of transactions found, or -1 if a block could not be
+ * read; the wallet may then be missing transactions from that block on.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -2744,9 +3694,16 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     const CChainParams& chainParams = Params();
 
     CBlockIndex* pindex = pindexStart;
+    // Last block committed by the pipeline
+    CBlockIndex* pindexLast = nullptr;
 
     std::vector<uint256> myTxHashes;
+    CRescanWitnessCache witnessCache;
 
+    std::vector<CBlockIndex*> vChain;
+    std::vector<CDiskBlockPos> vPos;
+    double dProgressStart;
+    double dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -2756,15 +3713,77 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+
+        for (CBlockIndex* pindexChain = pindex; pindexChain; pindexChain = chainActive.Next(pindexChain)) {
+            vChain.push_back(pindexChain);
+            vPos.push_back(pindexChain->GetBlockPos());
+        }
+    }
+
+    // Block that could not be read, which ends the rescan
+    const CBlockIndex* pindexFailed = nullptr;
+    if (!vChain.empty()) {
+        CRescanPipeline pipeline(*this, vChain, vPos, nSaplingDecryptThreads);
+        while (std::shared_ptr<CRescanBlock> pblock = pipeline.Next()) {
+            LOCK2(cs_main, cs_wallet);
+            if (!chainActive.Contains(pblock->pindex)) {
+                // The rest of vChain has been reorganised away
+                break;
+            }
+            if (pblock->pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pblock->pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+            const CBlock& block = pblock->block;
+            for (size_t i = 0; i < block.vtx.size(); i++) {
+                const CTransaction& tx = block.vtx[i];
+                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate, pblock->vSproutNoteData[i], pblock->vSaplingNoteData[i], pblock->vIsMine[i])) {
+                    myTxHashes.push_back(tx.GetHash());
+                    ret++;
+                }
+            }
+            // Increment note witness caches
+            IncrementRescanWitnesses(witnessCache, pblock->pindex, block);
+            pindexLast = pblock->pindex;
+
+            if (GetTime() >= nNow + 60) {
+                nNow = GetTime();
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexLast->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexLast));
+            }
+        }
+        pindexFailed = pipeline.ReadFailed();
+    }
+
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        // Catch up with the blocks connected and disconnected since vChain
+        // was taken.
+        if (pindexFailed && !chainActive.Contains(pindexFailed)) {
+            // A block that was reorganised away meanwhile does not matter
+            pindexFailed = nullptr;
+        }
+        if (pindexFailed) {
+            pindex = nullptr;
+        } else if (pindexLast) {
+            const CBlockIndex* pindexFork = chainActive.FindFork(pindexLast);
+            while (pindexLast && pindexLast != pindexFork) {
+                DecrementRescanWitnesses(witnessCache, pindexLast);
+                pindexLast = pindexLast->pprev;
+            }
+            pindex = pindexLast ? chainActive.Next(pindexLast) : chainActive.Genesis();
+        } else if (pindex && !chainActive.Contains(pindex)) {
+            const CBlockIndex* pindexFork = chainActive.FindFork(pindex);
+            pindex = pindexFork ? chainActive.Next(pindexFork) : chainActive.Genesis();
+        }
         while (pindex)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
             CBlock block;
-            ReadBlockFromDisk(block, pindex);
+            if (!ReadBlockFromDisk(block, pindex)) {
+                pindexFailed = pindex;
+                break;
+            }
             BOOST_FOREACH(CTransaction& tx, block.vtx)
             {
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
@@ -2772,25 +3791,16 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                     ret++;
                 }
             }
-
-            SproutMerkleTree sproutTree;
-            SaplingMerkleTree saplingTree;
-            // This should never fail: we should always be able to get the tree
-            // state on the path to the tip of our chain
-            assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
-            if (pindex->pprev) {
-                if (NetworkUpgradeActive(pindex->pprev->nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
-                    assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
-                }
-            }
-            // Increment note witness caches
-            ChainTip(pindex, &block, sproutTree, saplingTree, true);
-
+            IncrementRescanWitnesses(witnessCache, pindex, block);
+            pindexLast = pindex;
             pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
-            }
+        }
+        if (pindexFailed) {
+            // The witnesses would skip the blocks from pindexFailed on
+            LogPrintf("%s: failed to read block %s at height %d, rescan aborted\n", __func__, pindexFailed->GetBlockHash().ToString(), pindexFailed->nHeight);
+            ret = -1;
+        } else if (pindexLast) {
+            MergeRescanWitnesses(witnessCache, pindexLast->nHeight);
         }
 
         // After rescanning, persist Sapling note data that might have changed, e.g. nullifiers.
@@ -3159,12 +4169,9 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        nTotal = GetCachedCredit("balance", [](const CWalletTx& wtx) {
+            return wtx.IsTrusted() ? wtx.GetAvailableCredit() : 0;
+        });
     }
 
     return nTotal;
@@ -3178,12 +4185,9 @@ CAmount CWallet::GetAnonymizableBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizableCredit();
-        }
+        nTotal = GetCachedCredit("anonymizable", [](const CWalletTx& wtx) {
+            return wtx.IsTrusted() ? wtx.GetAnonymizableCredit() : 0;
+        });
     }
 
     return nTotal;
@@ -3196,12 +4200,9 @@ CAmount CWallet::GetAnonymizedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
+        nTotal = GetCachedCredit("anonymized", [](const CWalletTx& wtx) {
+            return wtx.IsTrusted() ? wtx.GetAnonymizedCredit() : 0;
+        });
     }
 
     return nTotal;
@@ -3250,21 +4251,21 @@ CAmount CWallet::GetNormalizedAnonymizedBalance() const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            uint256 hash = (*it).first;
+        nTotal = GetCachedCredit("normalizedanonymized", [this](const CWalletTx& wtx) -> CAmount {
+            CAmount nCredit = 0;
+            uint256 hash = wtx.GetHash();
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            for (unsigned int i = 0; i < wtx.vout.size(); i++) {
                 CTxIn vin = CTxIn(hash, i);
 
-                if (IsSpent(hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
-                if (pcoin->GetDepthInMainChain() < 0) continue;
+                if (IsSpent(hash, i) || IsMine(wtx.vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
+                if (wtx.GetDepthInMainChain() < 0) continue;
 
                 int rounds = GetInputObfuscationRounds(vin);
-                nTotal += pcoin->vout[i].nValue * rounds / nVidulumSendRounds;
+                nCredit += wtx.vout[i].nValue * rounds / nVidulumSendRounds;
             }
-        }
+            return nCredit;
+        });
     }
 
     return nTotal;
@@ -3277,11 +4278,10 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
+        std::string strName = unconfirmed ? "denominatedunconfirmed" : "denominated";
+        nTotal = GetCachedCredit(strName, [unconfirmed](const CWalletTx& wtx) {
+            return wtx.GetDenominatedCredit(unconfirmed);
+        });
     }
 
     return nTotal;
@@ -3328,12 +4328,11 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        nTotal = GetCachedCredit("unconfirmed", [](const CWalletTx& wtx) -> CAmount {
+            if (!CheckFinalTx(wtx) || (!wtx.IsTrusted() && wtx.GetDepthInMainChain() == 0))
+                return wtx.GetAvailableCredit();
+            return 0;
+        });
     }
     return nTotal;
 }
@@ -3343,11 +4342,9 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
+        nTotal = GetCachedCredit("immature", [](const CWalletTx& wtx) {
+            return wtx.GetImmatureCredit();
+        });
     }
     return nTotal;
 }
@@ -3357,12 +4354,9 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
+        nTotal = GetCachedCredit("watchonly", [](const CWalletTx& wtx) {
+            return wtx.IsTrusted() ? wtx.GetAvailableWatchOnlyCredit() : 0;
+        });
     }
 
     return nTotal;
@@ -3373,12 +4367,11 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
+        nTotal = GetCachedCredit("unconfirmedwatchonly", [](const CWalletTx& wtx) -> CAmount {
+            if (!CheckFinalTx(wtx) || (!wtx.IsTrusted() && wtx.GetDepthInMainChain() == 0))
+                return wtx.GetAvailableWatchOnlyCredit();
+            return 0;
+        });
     }
     return nTotal;
 }
@@ -3388,11 +4381,9 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
+        nTotal = GetCachedCredit("immaturewatchonly", [](const CWalletTx& wtx) {
+            return wtx.GetImmatureWatchOnlyCredit();
+        });
     }
     return nTotal;
 }
@@ -3401,79 +4392,121 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
  * populate vCoins with vector of available COutputs.
  */
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue, bool fIncludeCoinBase, AvailableCoinsType coin_type, bool useIX) const
+{
+    AvailableCoinsByValue(vCoins, fOnlyConfirmed, coinControl, fIncludeZeroValue, fIncludeCoinBase, coin_type, useIX);
+
+    // Keep the order callers such as listunspent saw before the index
+    std::sort(vCoins.begin(), vCoins.end(), CompareByOutPoint());
+}
+
+/**
+ * As AvailableCoins, in value order, which is how the coin index holds them.
+ */
+void CWallet::AvailableCoinsByValue(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue, bool fIncludeCoinBase, AvailableCoinsType coin_type, bool useIX) const
 {
     vCoins.clear();
 
     {
         LOCK2(cs_main, cs_wallet);
-        int count = 1;
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // The denominations are only known late in init, and the buckets
+        // depend on them
+        if (fCoinIndexDirty || nCoinIndexDenominations != obfuScationDenominations.size())
+            RebuildCoinIndex();
+
+        // Only visit the buckets holding outputs the coin type can select
+        bool fUseBucket[COIN_BUCKET_COUNT];
+        fUseBucket[COIN_BUCKET_OTHER] = coin_type != ONLY_DENOMINATED && coin_type != ONLY_15000;
+        fUseBucket[COIN_BUCKET_DENOMINATED] = coin_type == ALL_COINS || coin_type == ONLY_DENOMINATED || coin_type == ONLY_NOT15000IFMN;
+        fUseBucket[COIN_BUCKET_COLLATERAL] = coin_type == ALL_COINS || coin_type == ONLY_NOT15000IFMN;
+        fUseBucket[COIN_BUCKET_15000] = coin_type != ONLY_NOT15000IFMN || !fMasterNode;
+
+        std::vector<COutPoint> vIrreversiblySpent;
+        for (int fCoinBase = 0; fCoinBase < 2; fCoinBase++)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!CheckFinalTx(*pcoin))
+            if (fCoinBase && !fIncludeCoinBase)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+            for (int nBucket = 0; nBucket < COIN_BUCKET_COUNT; nBucket++)
+            {
+                if (!fUseBucket[nBucket])
+                    continue;
 
-            if (pcoin->IsCoinBase() && !fIncludeCoinBase)
-                continue;
+                const size_t nMerged = vCoins.size();
+                for (const std::pair<CAmount, COutPoint>& coin : coinIndex[fCoinBase][nBucket])
+                {
+                    const uint256& wtxid = coin.second.hash;
+                    const unsigned int i = coin.second.n;
+                    const CWalletTx* pcoin = &mapWallet.at(wtxid);
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                    if (!CheckFinalTx(*pcoin))
+                        continue;
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            if (useIX && nDepth < 6)
-            {
-                continue;
-            }
+                    if (fOnlyConfirmed && !pcoin->IsTrusted())
+                        continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (coin_type == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (coin_type == ONLY_NOT15000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == 15000 * COIN);
-                } else if (coin_type == ONLY_NONDENOMINATED_NOT15000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if (found && fMasterNode) found = pcoin->vout[i].nValue != 15000 * COIN; // do not use Hot MN funds
-                } else if (coin_type == ONLY_15000) {
-                    found = pcoin->vout[i].nValue == 15000 * COIN;
-                } else {
-                    found = true;
-                }
+                    if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+                        continue;
 
-                if(!found) continue;
+                    int nDepth = pcoin->GetDepthInMainChain(false);
+                    if (useIX && nDepth < 6)
+                    {
+                        continue;
+                    }
 
-                isminetype mine = IsMine(pcoin->vout[i]);
+                    bool found = false;
+                    if (coin_type == ONLY_DENOMINATED) {
+                        found = IsDenominatedAmount(pcoin->vout[i].nValue);
+                    } else if (coin_type == ONLY_NOT15000IFMN) {
+                        found = !(fMasterNode && pcoin->vout[i].nValue == 15000 * COIN);
+                    } else if (coin_type == ONLY_NONDENOMINATED_NOT15000IFMN) {
+                        if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
+                        found = !IsDenominatedAmount(pcoin->vout[i].nValue);
+                        if (found && fMasterNode) found = pcoin->vout[i].nValue != 15000 * COIN; // do not use Hot MN funds
+                    } else if (coin_type == ONLY_15000) {
+                        found = pcoin->vout[i].nValue == 15000 * COIN;
+                    } else {
+                        found = true;
+                    }
 
-                if (IsSpent(wtxid, i))
-                {
-                    continue;
-                }
-                if (mine == ISMINE_NO)
-                {
-                    continue;
-                }
-                if (IsLockedCoin((*it).first, i) && coin_type != ONLY_15000)
-                {
-                    continue;
-                }
-                if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected((*it).first, i))
-                {
-                    continue;
-                }
+                    if(!found) continue;
 
-                bool fIsSpendable = false;
-                if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
-                    fIsSpendable = true;
+                    isminetype mine = IsMine(pcoin->vout[i]);
 
-                vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
+                    if (IsSpent(wtxid, i))
+                    {
+                        if (IsSpentIrreversibly(wtxid, i))
+                            vIrreversiblySpent.push_back(coin.second);
+                        continue;
+                    }
+                    if (mine == ISMINE_NO)
+                    {
+                        continue;
+                    }
+                    if (IsLockedCoin(wtxid, i) && coin_type != ONLY_15000)
+                    {
+                        continue;
+                    }
+                    if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(wtxid, i))
+                    {
+                        continue;
+                    }
+
+                    bool fIsSpendable = false;
+                    if ((mine & ISMINE_SPENDABLE) != ISMINE_NO)
+                        fIsSpendable = true;
+
+                    vCoins.emplace_back(COutput(pcoin, i, nDepth, fIsSpendable));
+                }
+                std::inplace_merge(vCoins.begin(), vCoins.begin() + nMerged, vCoins.end(), CompareOutputValue());
             }
         }
+
+        // Outputs can no longer be unspent by a reorg, drop them from the index
+        for (const COutPoint& outpoint : vIrreversiblySpent) {
+            const CWalletTx& wtx = mapWallet.at(outpoint.hash);
+            CAmount nValue = wtx.vout[outpoint.n].nValue;
+            coinIndex[wtx.IsCoinBase()][GetCoinBucket(nValue)].erase(std::make_pair(nValue, outpoint));
+        }
     }
 }
 
@@ -3523,22 +4556,44 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+/** Shuffles each run of equal values in vValue, which is in value order. */
+static void ShuffleEqualValues(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue)
+{
+    for (size_t nStart = 0; nStart < vValue.size(); ) {
+        size_t nEnd = nStart + 1;
+        while (nEnd < vValue.size() && vValue[nEnd].first == vValue[nStart].first)
+            nEnd++;
+        random_shuffle(vValue.begin() + nStart, vValue.begin() + nEnd, GetRandInt);
+        nStart = nEnd;
+    }
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoinsIn,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
+    // Coins from SelectCoins come in value order from the coin index, so the
+    // scan stops at the smallest coin above the target and nothing is sorted
+    const vector<COutput>* pvCoins = &vCoinsIn;
+    vector<COutput> vSorted;
+    if (!std::is_sorted(vCoinsIn.begin(), vCoinsIn.end(), CompareOutputValue())) {
+        vSorted = vCoinsIn;
+        std::sort(vSorted.begin(), vSorted.end(), CompareOutputValue());
+        pvCoins = &vSorted;
+    }
+
     // List of values less than target
     pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<CAmount>::max();
     coinLowestLarger.second.first = NULL;
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
+    // Equal coins matching the target, or the smallest above it; one is picked at random
+    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vExact, vLowestLarger;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(const COutput &output, vCoins)
+    BOOST_FOREACH(const COutput &output, *pvCoins)
     {
         if (!output.fSpendable)
             continue;
@@ -3555,20 +4610,36 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            vExact.push_back(coin);
+        }
+        else if (!vExact.empty())
+        {
+            break;
         }
         else if (n < nTargetValue + CENT)
         {
             vValue.push_back(coin);
             nTotalLower += n;
         }
-        else if (n < coinLowestLarger.first)
+        else if (vLowestLarger.empty() || n == vLowestLarger[0].first)
         {
-            coinLowestLarger = coin;
+            vLowestLarger.push_back(coin);
         }
+        else
+        {
+            break;
+        }
+    }
+
+    if (!vExact.empty())
+    {
+        const pair<CAmount, pair<const CWalletTx*,unsigned int> >& coin = vExact[GetRandInt(vExact.size())];
+        setCoinsRet.insert(coin.second);
+        nValueRet += coin.first;
+        return true;
     }
+    if (!vLowestLarger.empty())
+        coinLowestLarger = vLowestLarger[GetRandInt(vLowestLarger.size())];
 
     if (nTotalLower == nTargetValue)
     {
@@ -3589,8 +4660,9 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Solve subset sum by stochastic approximation, largest coins first
+    std::reverse(vValue.begin(), vValue.end());
+    ShuffleEqualValues(vValue);
     vector<char> vfBest;
     CAmount nBest;
 
@@ -3629,8 +4701,8 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
 {
     // Output parameter fOnlyCoinbaseCoinsRet is set to true when the only available coins are coinbase utxos.
     vector<COutput> vCoinsNoCoinbase, vCoinsWithCoinbase;
-    AvailableCoins(vCoinsNoCoinbase, true, coinControl, false, false, coin_type, useIX);
-    AvailableCoins(vCoinsWithCoinbase, true, coinControl, false, true, coin_type, useIX);
+    AvailableCoinsByValue(vCoinsNoCoinbase, true, coinControl, false, false, coin_type, useIX);
+    AvailableCoinsByValue(vCoinsWithCoinbase, true, coinControl, false, true, coin_type, useIX);
     fOnlyCoinbaseCoinsRet = vCoinsNoCoinbase.size() == 0 && vCoinsWithCoinbase.size() > 0;
 
     // If coinbase utxos can only be sent to zaddrs, exclude any coinbase utxos from coin selection.
@@ -5144,6 +6216,7 @@ bool CWallet::UpdatedTransaction(const uint256 &hashTx)
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end())
         {
+            InvalidateBalanceCache();
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -5155,18 +6228,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    InvalidateBalanceCache();
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    InvalidateBalanceCache();
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    InvalidateBalanceCache();
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -5194,18 +6270,21 @@ void CWallet::LockNote(const JSOutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedSproutNotes
     setLockedSproutNotes.insert(output);
+    InvalidateBalanceCache();
 }
 
 void CWallet::UnlockNote(const JSOutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedSproutNotes
     setLockedSproutNotes.erase(output);
+    InvalidateBalanceCache();
 }
 
 void CWallet::UnlockAllSproutNotes()
 {
     AssertLockHeld(cs_wallet); // setLockedSproutNotes
     setLockedSproutNotes.clear();
+    InvalidateBalanceCache();
 }
 
 bool CWallet::IsLockedNote(const JSOutPoint& outpt) const
@@ -5226,18 +6305,21 @@ void CWallet::LockNote(const SaplingOutPoint& output)
 {
     AssertLockHeld(cs_wallet);
     setLockedSaplingNotes.insert(output);
+    InvalidateBalanceCache();
 }
 
 void CWallet::UnlockNote(const SaplingOutPoint& output)
 {
     AssertLockHeld(cs_wallet);
     setLockedSaplingNotes.erase(output);
+    InvalidateBalanceCache();
 }
 
 void CWallet::UnlockAllSaplingNotes()
 {
     AssertLockHeld(cs_wallet);
     setLockedSaplingNotes.clear();
+    InvalidateBalanceCache();
 }
 
 bool CWallet::IsLockedNote(const SaplingOutPoint& output) const
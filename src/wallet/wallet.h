@@ -28,6 +28,7 @@
 
 #include <univalue.h>
 #include <algorithm>
+#include <functional>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -45,6 +46,7 @@ extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern int nSaplingDecryptThreads;
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -63,6 +65,20 @@ static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
 //  unless there is some exceptional network disruption.
 static const unsigned int WITNESS_CACHE_SIZE = MAX_REORG_LENGTH + 1;
 
+//! -saplingdecryptthreads default (0 = one per core)
+static const int DEFAULT_SAPLING_DECRYPT_THREADS = 0;
+//! Maximum number of threads used to trial-decrypt the outputs of one transaction
+static const int MAX_SAPLING_DECRYPT_THREADS = 16;
+//! Fewest (output, viewing key) pairs worth handing to an extra decryption thread
+static const size_t SAPLING_DECRYPT_MIN_PAIRS_PER_THREAD = 16;
+
+/** Worker of the Sapling trial decryption pool; nSaplingDecryptThreads - 1 are started at init. */
+void ThreadSaplingDecrypt();
+/** Number of threads, the caller included, that trial-decrypt nPairs pairs when asking for nThreads (0 for the default). */
+int GetSaplingDecryptThreads(size_t nPairs, int nThreads = 0);
+//! Number of blocks a wallet rescan reads and trial-decrypts ahead of the block it is committing
+static const unsigned int WALLET_RESCAN_PREFETCH_BLOCKS = 32;
+
 //! Size of HD seed in bytes
 static const size_t HD_WALLET_SEED_LENGTH = 32;
 
@@ -93,6 +109,15 @@ enum AvailableCoinsType {
     ONLY_15000 = 5                        // find masternode outputs including locked ones (use with caution)
 };
 
+/** Coin types the wallet's transparent outputs are indexed by, see CWallet::AvailableCoins */
+enum WalletCoinBucket {
+    COIN_BUCKET_OTHER = 0,
+    COIN_BUCKET_DENOMINATED,
+    COIN_BUCKET_COLLATERAL,
+    COIN_BUCKET_15000,
+    COIN_BUCKET_COUNT
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -234,8 +259,12 @@ public:
     boost::optional<uint256> nullifier;
 
     /**
-     * Cached incremental witnesses for spendable Notes.
-     * Beginning of the list is the most recent witness.
+     * Cached incremental witness for spendable Notes, at witnessHeight.
+     *
+     * The list holds at most one witness; CWallet::DecrementNoteWitnesses
+     * rewinds it to the wallet's note commitment checkpoints instead of
+     * keeping a copy per block. It stays a list so that wallets written by
+     * earlier versions, which did, can still be read.
      */
     std::list<SproutWitness> witnesses;
 
@@ -322,6 +351,57 @@ public:
 typedef std::map<JSOutPoint, SproutNoteData> mapSproutNoteData_t;
 typedef std::map<SaplingOutPoint, SaplingNoteData> mapSaplingNoteData_t;
 
+/**
+ * Note commitment trees after a block connected to the wallet. The wallet
+ * keeps these for the last WITNESS_CACHE_SIZE blocks so that the witnesses
+ * of its notes can be rewound when blocks are disconnected.
+ */
+class CNoteCommitmentCheckpoint
+{
+public:
+    int nHeight;
+    SproutMerkleTree sproutTree;
+    SaplingMerkleTree saplingTree;
+
+    CNoteCommitmentCheckpoint() : nHeight(-1) { }
+    CNoteCommitmentCheckpoint(int nHeight, const SproutMerkleTree& sproutTree, const SaplingMerkleTree& saplingTree) :
+            nHeight(nHeight), sproutTree(sproutTree), saplingTree(saplingTree) { }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nHeight);
+        READWRITE(sproutTree);
+        READWRITE(saplingTree);
+    }
+};
+
+//! Beginning of the list is the most recent checkpoint
+typedef std::list<CNoteCommitmentCheckpoint> NoteCommitmentCheckpoints;
+
+/** Witness for one note found by a wallet rescan. */
+template<typename Witness>
+struct RescanNoteWitnesses
+{
+    //! Height of the block containing the note
+    int nHeight;
+    Witness witness;
+};
+
+/**
+ * Witnesses for the notes found by CWallet::ScanForWalletTransactions. They
+ * are kept out of mapWallet until the rescan reaches the tip, because blocks
+ * connected in the meantime increment the wallet's own witness caches.
+ */
+struct CRescanWitnessCache
+{
+    std::map<JSOutPoint, RescanNoteWitnesses<SproutWitness>> sprout;
+    std::map<SaplingOutPoint, RescanNoteWitnesses<SaplingWitness>> sapling;
+    //! Trees after the blocks the rescan has committed
+    NoteCommitmentCheckpoints checkpoints;
+};
+
 /** Decrypted note and its location in a transaction. */
 struct CSproutNotePlaintextEntry
 {
@@ -587,8 +667,8 @@ public:
         MarkDirty();
     }
 
-    void SetSproutNoteData(mapSproutNoteData_t &noteData);
-    void SetSaplingNoteData(mapSaplingNoteData_t &noteData);
+    void SetSproutNoteData(const mapSproutNoteData_t &noteData);
+    void SetSaplingNoteData(const mapSaplingNoteData_t &noteData);
 
     //! filter decides which addresses will count towards the debit
     CAmount GetDebit(const isminefilter& filter) const;
@@ -821,6 +901,60 @@ private:
     void AddToSaplingSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /**
+     * Balances computed since the wallet, the chain tip, the mempool and the
+     * SwiftX locks last changed, by name. Repeated balance queries are answered from here
+     * instead of walking mapWallet again.
+     */
+    mutable std::map<std::string, CAmount> mapBalanceCache;
+    /**
+     * The part of the balances in mapBalanceCache contributed by the wallet
+     * transactions outside setBalanceCacheMempoolTxs. It survives mempool
+     * changes, after which only the transactions in that set are visited.
+     */
+    mutable std::map<std::string, CAmount> mapConfirmedBalanceCache;
+    //! Wallet transactions whose contribution to a balance depends on the
+    //! mempool: those not in the active chain, and those with an output one
+    //! of these spends
+    mutable std::set<uint256> setBalanceCacheMempoolTxs;
+    mutable int64_t nBalanceCacheUpdates;
+    mutable const CBlockIndex* pindexBalanceCacheTip;
+    mutable unsigned int nBalanceCacheMempoolUpdates;
+    //! SwiftX locks add to the depth of unconfirmed transactions
+    mutable bool fBalanceCacheSwiftTX;
+    mutable unsigned int nBalanceCacheLockUpdates;
+    //! Bumped whenever a change to the wallet may change a balance
+    int64_t nBalanceUpdates;
+    //! Transactions in mapWallet with a time-based lock time, whose finality
+    //! changes with the clock rather than with the chain
+    std::set<uint256> setTimeLockedWalletTxs;
+
+    void InvalidateBalanceCache();
+    bool PrepareBalanceCache() const;
+
+    /**
+     * The wallet's own transparent outputs that are not spent by a transaction
+     * buried deeper than MAX_REORG_LENGTH, bucketed by coinbase and coin type
+     * and ordered by value, so that AvailableCoins only visits the outputs a
+     * selection can use instead of every output in mapWallet. Built on first
+     * use and rebuilt after MarkDirty, as imports change which outputs are ours,
+     * or when the obfuscation denominations it was bucketed by have changed.
+     */
+    typedef std::set<std::pair<CAmount, COutPoint> > CoinBucket;
+    mutable CoinBucket coinIndex[2][COIN_BUCKET_COUNT];
+    mutable bool fCoinIndexDirty;
+    mutable size_t nCoinIndexDenominations;
+
+    WalletCoinBucket GetCoinBucket(CAmount nValue) const;
+    void AddToCoinIndex(const CWalletTx& wtx) const;
+    void EraseFromCoinIndex(const CWalletTx& wtx) const;
+    void RebuildCoinIndex() const;
+    bool IsSpentIrreversibly(const uint256& hash, unsigned int n) const;
+    bool IsNullifierSpentIrreversibly(const TxNullifiers& mapTxNullifiers, const uint256& nullifier) const;
+    //! Whether all of the wallet's notes in wtx are spent irreversibly
+    bool AreNotesSpentIrreversibly(const CWalletTx& wtx) const;
+    void AvailableCoinsByValue(std::vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl* coinControl, bool fIncludeZeroValue, bool fIncludeCoinBase, AvailableCoinsType nCoinType, bool fUseIX) const;
+
 public:
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
@@ -835,8 +969,24 @@ public:
      * incremental witness cache in any transaction in mapWallet.
      */
     int64_t nWitnessCacheSize;
+    /*
+     * Note commitment trees after each of the last nWitnessCacheSize blocks,
+     * used to rewind note witnesses when a block is disconnected.
+     */
+    NoteCommitmentCheckpoints noteCommitmentCheckpoints;
+    //! Heights whose checkpoint was added, replaced or dropped since the
+    //! checkpoints were last written
+    std::set<int> setDirtyNoteCommitmentCheckpoints;
+    /*
+     * Height of the lowest block with notes whose witnesses were dropped
+     * by a reorg deeper than the checkpoints, or -1. The wallet is rescanned
+     * from there once the next block is connected.
+     */
+    int nWitnessRescanHeight;
 
     void ClearNoteWitnessCache();
+    //! Adds a checkpoint read from the wallet database
+    void LoadNoteCommitmentCheckpoint(const CNoteCommitmentCheckpoint& checkpoint);
 
 protected:
     /**
@@ -851,6 +1001,27 @@ protected:
      */
     void DecrementNoteWitnesses(const CBlockIndex* pindex);
 
+    /**
+     * pindex is the block a rescan has just committed.
+     */
+    void IncrementRescanWitnesses(CRescanWitnessCache& cache,
+                                  const CBlockIndex* pindex,
+                                  const CBlock& block);
+    /**
+     * pindex is a block committed by the rescan that has since been disconnected.
+     */
+    void DecrementRescanWitnesses(CRescanWitnessCache& cache, const CBlockIndex* pindex);
+    /**
+     * Moves the rescan's witnesses into mapWallet. nHeight is the height of
+     * the last block the rescan committed, which must be the tip.
+     */
+    void MergeRescanWitnesses(CRescanWitnessCache& cache, int nHeight);
+    /**
+     * Runs the rescan nWitnessRescanHeight asks for, if any. Requires
+     * cs_main.
+     */
+    void RescanDroppedWitnesses();
+
     template <typename WalletDB>
     void SetBestChainINTERNAL(WalletDB& walletdb, const CBlockLocator& loc) {
         if (!walletdb.TxnBegin()) {
@@ -859,8 +1030,9 @@ protected:
             return;
         }
         try {
-            for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                if (!walletdb.WriteTx(wtxItem.first, wtxItem.second)) {
+            // Only transactions with notes have witnesses to update
+            for (const uint256& hash : setShieldedWalletTxs) {
+                if (!walletdb.WriteTx(hash, mapWallet.at(hash))) {
                     LogPrintf("SetBestChain(): Failed to write CWalletTx, aborting atomic write\n");
                     walletdb.TxnAbort();
                     return;
@@ -871,6 +1043,17 @@ protected:
                 walletdb.TxnAbort();
                 return;
             }
+            for (int nHeight : setDirtyNoteCommitmentCheckpoints) {
+                auto it = std::find_if(noteCommitmentCheckpoints.begin(), noteCommitmentCheckpoints.end(),
+                                       [nHeight](const CNoteCommitmentCheckpoint& checkpoint) { return checkpoint.nHeight == nHeight; });
+                if (it != noteCommitmentCheckpoints.end() ?
+                        !walletdb.WriteNoteCommitmentCheckpoint(*it) :
+                        !walletdb.EraseNoteCommitmentCheckpoint(nHeight)) {
+                    LogPrintf("SetBestChain(): Failed to write note commitment checkpoint, aborting atomic write\n");
+                    walletdb.TxnAbort();
+                    return;
+                }
+            }
             if (!walletdb.WriteBestBlock(loc)) {
                 LogPrintf("SetBestChain(): Failed to write best block, aborting atomic write\n");
                 walletdb.TxnAbort();
@@ -888,6 +1071,7 @@ protected:
             LogPrintf("SetBestChain(): Couldn't commit atomic write\n");
             return;
         }
+        setDirtyNoteCommitmentCheckpoints.clear();
     }
 
 private:
@@ -955,6 +1139,15 @@ public:
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nWitnessCacheSize = 0;
+        nWitnessRescanHeight = -1;
+        nBalanceCacheUpdates = -1;
+        pindexBalanceCacheTip = NULL;
+        nBalanceCacheMempoolUpdates = 0;
+        fBalanceCacheSwiftTX = false;
+        nBalanceCacheLockUpdates = 0;
+        nBalanceUpdates = 0;
+        fCoinIndexDirty = true;
+        nCoinIndexDenominations = 0;
     }
 
     /**
@@ -1010,6 +1203,9 @@ public:
     std::map<uint256, SaplingOutPoint> mapSaplingNullifiersToNotes;
 
     std::map<uint256, CWalletTx> mapWallet;
+    //! Hashes of the transactions in mapWallet that may have note data
+    //! needing witnesses; dropped once all the notes are spent irreversibly
+    std::set<uint256> setShieldedWalletTxs;
 
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
@@ -1030,7 +1226,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, bool fIncludeZeroValue = false , bool fIncludeCoinBase=true, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
     bool IsSproutSpent(const uint256& nullifier) const;
@@ -1185,11 +1381,17 @@ public:
     void MarkDirty();
     bool UpdateNullifierNoteMap();
     void UpdateNullifierNoteMapWithTx(const CWalletTx& wtx);
+    void AddToShieldedTxs(const CWalletTx& wtx);
+    void AddToTimeLockedTxs(const CWalletTx& wtx);
     void UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx);
     void UpdateSaplingNullifierNoteMapForBlock(const CBlock* pblock);
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                  const mapSproutNoteData_t& sproutNoteData,
+                                  const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>& saplingNoteDataAndAddressesToAdd,
+                                  bool fIsMine);
     void EraseFromWallet(const uint256 &hash);
     void WitnessNoteCommitment(
          std::vector<uint256> commitments,
@@ -1205,6 +1407,18 @@ public:
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+    /**
+     * Looks up a balance cached under strName by CacheBalance. Both require
+     * cs_main and cs_wallet, held across computing the balance.
+     */
+    bool GetCachedBalance(const std::string& strName, CAmount& nBalance) const;
+    void CacheBalance(const std::string& strName, CAmount nBalance) const;
+    /**
+     * The sum of credit over the wallet transactions, cached under strName.
+     * After a mempool change only the transactions whose credit may depend
+     * on the mempool are visited again. Requires cs_main and cs_wallet.
+     */
+    CAmount GetCachedCredit(const std::string& strName, const std::function<CAmount(const CWalletTx&)>& credit) const;
     bool FundTransaction(CMutableTransaction& tx, CAmount& nFeeRet, int& nChangePosRet, std::string& strFailReason);
     bool CreateTransaction(const std::vector<CRecipient>& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosRet,
                            std::string& strFailReason, const CCoinControl *coinControl = NULL, bool sign = true, AvailableCoinsType coin_type=ALL_COINS, bool useIX=false, CAmount nFeePay=0);
@@ -1249,7 +1463,9 @@ boost::optional<uint256> GetSproutNoteNullifier(
         const uint256& hSig,
         uint8_t n) const;
     mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx) const;
-    std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx) const;
+    std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx, int nThreads = 0) const;
+    uint256 GetSaplingNoteNullifier(const CWalletTx& wtx, const SaplingOutPoint& op,
+                                    const libzcash::SaplingIncomingViewingKey& ivk, uint64_t position) const;
     bool IsSproutNullifierFromMe(const uint256& nullifier) const;
     bool IsSaplingNullifierFromMe(const uint256& nullifier) const;
 
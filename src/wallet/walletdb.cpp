@@ -243,6 +243,18 @@ bool CWalletDB::WriteWitnessCacheSize(int64_t nWitnessCacheSize)
     return Write(std::string("witnesscachesize"), nWitnessCacheSize);
 }
 
+bool CWalletDB::WriteNoteCommitmentCheckpoint(const CNoteCommitmentCheckpoint& checkpoint)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("witnesscheckpoint"), checkpoint.nHeight), checkpoint);
+}
+
+bool CWalletDB::EraseNoteCommitmentCheckpoint(int nHeight)
+{
+    nWalletDBUpdated++;
+    return Erase(std::make_pair(std::string("witnesscheckpoint"), nHeight));
+}
+
 bool CWalletDB::ReadPool(int64_t nPool, CKeyPool& keypool)
 {
     return Read(std::make_pair(std::string("pool"), nPool), keypool);
@@ -811,6 +823,12 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             ssValue >> pwallet->nWitnessCacheSize;
         }
+        else if (strType == "witnesscheckpoint")
+        {
+            CNoteCommitmentCheckpoint checkpoint;
+            ssValue >> checkpoint;
+            pwallet->LoadNoteCommitmentCheckpoint(checkpoint);
+        }
         else if (strType == "hdseed")
         {
             uint256 seedFp;
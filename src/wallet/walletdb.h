@@ -24,6 +24,7 @@ class CAccountingEntry;
 struct CBlockLocator;
 class CKeyPool;
 class CMasterKey;
+class CNoteCommitmentCheckpoint;
 class CScript;
 class CWallet;
 class CWalletTx;
@@ -151,6 +152,8 @@ public:
     bool WriteDefaultKey(const CPubKey& vchPubKey);
 
     bool WriteWitnessCacheSize(int64_t nWitnessCacheSize);
+    bool WriteNoteCommitmentCheckpoint(const CNoteCommitmentCheckpoint& checkpoint);
+    bool EraseNoteCommitmentCheckpoint(int nHeight);
 
     bool ReadPool(int64_t nPool, CKeyPool& keypool);
     bool WritePool(int64_t nPool, const CKeyPool& keypool);
@@ -1,9 +1,14 @@
 #include <cstdio>
 #include <future>
 #include <map>
+#include <sstream>
 #include <thread>
+#ifndef WIN32
+#include <poll.h>
+#endif
 #include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include "coins.h"
 #include "util.h"
@@ -15,10 +20,14 @@
 #include "chainparams.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
+#include "cuckoocache.h"
 #include "main.h"
 #include "miner.h"
+#include "net.h"
+#include "netbase.h"
 #include "pow.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "script/sign.h"
 #include "sodium.h"
 #include "streams.h"
@@ -225,6 +234,91 @@ double benchmark_verify_equihash()
     return timer_stop(tv_start);
 }
 
+namespace {
+
+/**
+ * The std::set based signature cache that CCuckooCache replaced, keyed by
+ * the same salted entry hashes so that only the data structures differ.
+ */
+class CSetSignatureCache
+{
+private:
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_sigcache;
+    int64_t nMaxCacheSize;
+
+public:
+    CSetSignatureCache(int64_t nMaxCacheSizeIn) : nMaxCacheSize(nMaxCacheSizeIn) {}
+
+    bool Contains(const uint256& entry, bool erase)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        return setValid.count(entry) > 0;
+    }
+
+    void Insert(const uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        {
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+        setValid.insert(entry);
+    }
+};
+
+template <typename Cache>
+double benchmark_sigcache_lookups(Cache& cache, size_t nThreads)
+{
+    // Mempool acceptance fills the cache, then nThreads script check
+    // workers look up a block's worth of signatures, half of which are
+    // cached, and store the other half.
+    const size_t nEntries = DEFAULT_MAX_SIG_CACHE_SIZE;
+    const size_t nBlockSigs = 20000;
+    std::vector<uint256> entries(nEntries + nBlockSigs / 2);
+    for (uint256& entry : entries) {
+        entry = GetRandHash();
+    }
+    for (size_t i = 0; i < nEntries; i++) {
+        cache.Insert(entries[i]);
+    }
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nThreads; t++) {
+        threads.emplace_back([&cache, &entries, nEntries, nBlockSigs, nThreads, t]() {
+            for (size_t i = t; i < nBlockSigs; i += nThreads) {
+                const uint256& entry = entries[nEntries - nBlockSigs / 2 + i];
+                if (!cache.Contains(entry, false)) {
+                    cache.Insert(entry);
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return timer_stop(tv_start);
+}
+
+}
+
+double benchmark_sigcache(bool fCuckoo, size_t nThreads)
+{
+    if (fCuckoo) {
+        CCuckooCache cache;
+        cache.Setup(DEFAULT_MAX_SIG_CACHE_SIZE);
+        return benchmark_sigcache_lookups(cache, nThreads);
+    } else {
+        CSetSignatureCache cache(DEFAULT_MAX_SIG_CACHE_SIZE);
+        return benchmark_sigcache_lookups(cache, nThreads);
+    }
+}
+
 double benchmark_large_tx(size_t nInputs)
 {
     // Create priv/pub key
@@ -297,6 +391,53 @@ double benchmark_try_decrypt_notes(size_t nAddrs)
     return timer_stop(tv_start);
 }
 
+std::vector<std::pair<int, double>> benchmark_try_decrypt_sapling_notes(size_t nAddrs, int nMaxThreads)
+{
+    CWallet wallet;
+    auto m = libzcash::SaplingExtendedSpendingKey::Master(HDSeed::Random());
+    for (int i = 0; i < nAddrs; i++) {
+        auto sk = m.Derive(i | ZIP32_HARDENED_KEY_LIMIT);
+        wallet.AddSaplingZKey(sk, sk.DefaultAddress());
+    }
+
+    // A typical two-output transaction that pays none of the wallet's
+    // addresses, so that every (output, key) pair has to be tried.
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    for (int i = 0; i < 2; i++) {
+        auto address = libzcash::SaplingSpendingKey::random().default_address();
+        SaplingNote note(address, GetRand(MAX_MONEY));
+        std::array<unsigned char, ZC_MEMO_SIZE> memo;
+        libzcash::SaplingNotePlaintext notePlaintext(note, memo);
+        auto res = notePlaintext.encrypt(note.pk_d);
+        if (!res) {
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "SaplingNotePlaintext::encrypt() failed");
+        }
+        OutputDescription odesc;
+        odesc.cm = note.cm().get();
+        odesc.ephemeralKey = res.get().second.get_epk();
+        odesc.encCiphertext = res.get().first;
+        mtx.vShieldedOutput.push_back(odesc);
+    }
+    CTransaction tx(mtx);
+
+    // Time the same scan asking for 1, 2, 4, ... up to nMaxThreads threads,
+    // and report how many the pool actually used
+    std::vector<std::pair<int, double>> ret;
+    size_t nPairs = tx.vShieldedOutput.size() * nAddrs;
+    for (int nThreads = 1; ; nThreads = std::min(2 * nThreads, nMaxThreads)) {
+        struct timeval tv_start;
+        timer_start(tv_start);
+        auto nd = wallet.FindMySaplingNotes(tx, nThreads);
+        ret.push_back(std::make_pair(GetSaplingDecryptThreads(nPairs, nThreads), timer_stop(tv_start)));
+        if (nThreads >= nMaxThreads)
+            break;
+    }
+    return ret;
+}
+
 double benchmark_increment_note_witnesses(size_t nTxs)
 {
     CWallet wallet;
@@ -630,3 +771,223 @@ double benchmark_verify_sapling_output()
     }
     return timer_stop(tv_start);
 }
+
+// Writes held up at least this long are counted as stalls, i.e. LevelDB made
+// them wait for a compaction rather than only appending to its log.
+static const int64_t DB_PROFILE_STALL_MICROS = 10000;
+static const size_t DB_PROFILE_CACHE_SIZE = 64 << 20;
+
+// Sum the compaction table of the "leveldb.stats" property over all levels
+static void ParseCompactionStats(const std::string& strStats, DBProfileBenchmark& result)
+{
+    std::istringstream ss(strStats);
+    std::string line;
+    while (std::getline(ss, line)) {
+        int nLevel, nFiles;
+        double dSize, dTime, dRead, dWrite;
+        if (sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &nLevel, &nFiles, &dSize, &dTime, &dRead, &dWrite) == 6) {
+            result.compactiontime += dTime;
+            result.compactionreadmb += dRead;
+            result.compactionwritemb += dWrite;
+        }
+    }
+}
+
+// Replay the writes of the last nBlocks active blocks into a fresh database
+// per profile: block headers, a transaction index, coins created and spent,
+// and address index entries for every output.
+std::vector<DBProfileBenchmark> benchmark_db_profiles(int nBlocks)
+{
+    AssertLockHeld(cs_main);
+    CBlockIndex* pindexStart = chainActive[std::max(0, chainActive.Height() - nBlocks + 1)];
+    const CDBProfile* profiles[] = {&DBPROFILE_DEFAULT, &DBPROFILE_CHAINSTATE, &DBPROFILE_BLOCK_INDEX};
+
+    std::vector<DBProfileBenchmark> results;
+    for (size_t i = 0; i < ARRAYLEN(profiles); i++) {
+        DBProfileBenchmark result;
+        result.profile = profiles[i]->name;
+        boost::filesystem::path path = GetDataDir() / "benchmark" / ("dbprofile-" + result.profile);
+        {
+            CDBWrapper db(path, DB_PROFILE_CACHE_SIZE, false, true, *profiles[i]);
+            for (CBlockIndex* pindex = pindexStart; pindex; pindex = chainActive.Next(pindex)) {
+                CBlock block;
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !ReadBlockFromDisk(block, pindex))
+                    throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available on disk");
+
+                int64_t nStart = GetTimeMicros();
+                CDBBatch batch(db);
+                batch.Write(std::make_pair('b', pindex->GetBlockHash()), block.GetBlockHeader());
+                CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+                BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+                    const uint256& txid = tx.GetHash();
+                    batch.Write(std::make_pair('t', txid), pos);
+                    pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+                    if (!tx.IsCoinBase()) {
+                        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                            batch.Erase(std::make_pair('c', txin.prevout.hash));
+                    }
+                    batch.Write(std::make_pair('c', txid), CCoins(tx, pindex->nHeight));
+                    for (unsigned int n = 0; n < tx.vout.size(); n++) {
+                        const CScript& script = tx.vout[n].scriptPubKey;
+                        uint160 hashScript = Hash160(script.begin(), script.end());
+                        batch.Write(std::make_pair(std::make_pair('d', hashScript), std::make_pair(pindex->nHeight, std::make_pair(txid, n))), tx.vout[n].nValue);
+                    }
+                }
+                int64_t nWriteStart = GetTimeMicros();
+                db.WriteBatch(batch);
+                int64_t nEnd = GetTimeMicros();
+
+                result.runningtime += (nEnd - nStart) * 0.000001;
+                result.writetime += (nEnd - nWriteStart) * 0.000001;
+                if (nEnd - nWriteStart >= DB_PROFILE_STALL_MICROS)
+                    result.nStalls++;
+            }
+            std::string strStats;
+            if (db.GetProperty("leveldb.stats", strStats))
+                ParseCompactionStats(strStats, result);
+        }
+
+        boost::filesystem::recursive_directory_iterator end;
+        for (boost::filesystem::recursive_directory_iterator it(path); it != end; ++it) {
+            if (boost::filesystem::is_regular_file(it->status()))
+                result.nDiskBytes += boost::filesystem::file_size(it->path());
+        }
+        boost::filesystem::remove_all(path);
+        results.push_back(result);
+    }
+    return results;
+}
+
+#ifndef WIN32
+namespace {
+
+/** Time each phase of the loopback peers benchmark may take, in milliseconds */
+const int64_t LOOPBACK_PEERS_TIMEOUT = 60 * 1000;
+
+/** A benchmark connection to this node, and what it has received so far */
+struct LoopbackPeer
+{
+    SOCKET hSocket;
+    std::vector<char> vRecv;
+    bool fVerack;
+    bool fPong;
+
+    LoopbackPeer() : hSocket(INVALID_SOCKET), fVerack(false), fPong(false) {}
+    LoopbackPeer(const LoopbackPeer&) = delete;
+    ~LoopbackPeer() { CloseSocket(hSocket); }
+};
+
+/** Frame a message the way CNode::EndMessage does */
+std::vector<char> LoopbackMessage(const char* pszCommand, const CDataStream& payload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, hash.begin(), sizeof(hdr.nChecksum));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    std::vector<char> msg(ss.begin(), ss.end());
+    msg.insert(msg.end(), payload.begin(), payload.end());
+    return msg;
+}
+
+void SendLoopbackMessage(LoopbackPeer& peer, const std::vector<char>& msg)
+{
+    // The messages are small enough to always fit in an idle socket's buffer
+    if (send(peer.hSocket, &msg[0], msg.size(), MSG_NOSIGNAL) != (ssize_t)msg.size())
+        throw std::runtime_error("loopback peer could not send");
+}
+
+/** Consume the complete messages a peer received, noting verack and pong */
+void ReadLoopbackMessages(LoopbackPeer& peer)
+{
+    size_t nOffset = 0;
+    while (peer.vRecv.size() - nOffset >= CMessageHeader::HEADER_SIZE) {
+        CDataStream ss(&peer.vRecv[nOffset], &peer.vRecv[nOffset] + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr(Params().MessageStart());
+        ss >> hdr;
+        if (peer.vRecv.size() - nOffset < CMessageHeader::HEADER_SIZE + hdr.nMessageSize)
+            break;
+        std::string strCommand = hdr.GetCommand();
+        if (strCommand == "verack")
+            peer.fVerack = true;
+        else if (strCommand == "pong")
+            peer.fPong = true;
+        nOffset += CMessageHeader::HEADER_SIZE + hdr.nMessageSize;
+    }
+    peer.vRecv.erase(peer.vRecv.begin(), peer.vRecv.begin() + nOffset);
+}
+
+/** Receive on all peers until each of them has the given flag set */
+void WaitForLoopbackPeers(std::vector<LoopbackPeer>& peers, bool LoopbackPeer::*pfDone)
+{
+    int64_t nEnd = GetTimeMillis() + LOOPBACK_PEERS_TIMEOUT;
+    std::vector<struct pollfd> vPoll(peers.size());
+    while (true) {
+        size_t nPending = 0;
+        for (size_t i = 0; i < peers.size(); i++) {
+            // poll() skips negative descriptors
+            vPoll[i].fd = peers[i].*pfDone ? -1 : peers[i].hSocket;
+            vPoll[i].events = POLLIN;
+            vPoll[i].revents = 0;
+            if (!(peers[i].*pfDone))
+                nPending++;
+        }
+        if (nPending == 0)
+            return;
+        int64_t nLeft = nEnd - GetTimeMillis();
+        if (nLeft <= 0)
+            throw std::runtime_error(strprintf("%u of %u loopback peers timed out", nPending, peers.size()));
+        if (poll(&vPoll[0], vPoll.size(), nLeft) < 0 && errno != EINTR)
+            throw std::runtime_error("loopback peers poll failed");
+
+        for (size_t i = 0; i < peers.size(); i++) {
+            if (vPoll[i].revents == 0)
+                continue;
+            char pchBuf[0x10000];
+            ssize_t nBytes = recv(peers[i].hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes == 0 || (nBytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                throw std::runtime_error("loopback peer was disconnected, is -maxconnections above the peer count?");
+            if (nBytes > 0) {
+                peers[i].vRecv.insert(peers[i].vRecv.end(), pchBuf, pchBuf + nBytes);
+                ReadLoopbackMessages(peers[i]);
+            }
+        }
+    }
+}
+
+}
+
+double benchmark_loopback_peers(int nPeers)
+{
+    // Connect nPeers inbound peers to this node over loopback, have them all
+    // complete the version handshake, then time a ping to all of them at once
+    CService addrNode("127.0.0.1", GetListenPort());
+    std::vector<LoopbackPeer> peers(nPeers);
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (LoopbackPeer& peer : peers) {
+        if (!ConnectSocket(addrNode, peer.hSocket, nConnectTimeout))
+            throw std::runtime_error("loopback peer could not connect, is the node listening?");
+        CDataStream version(SER_NETWORK, PROTOCOL_VERSION);
+        version << PROTOCOL_VERSION << (uint64_t)0 << GetTime() << CAddress(addrNode) << CAddress(CService("0.0.0.0", 0))
+                << GetRand(std::numeric_limits<uint64_t>::max()) << strSubVersion << 0 << false;
+        SendLoopbackMessage(peer, LoopbackMessage("version", version));
+    }
+    WaitForLoopbackPeers(peers, &LoopbackPeer::fVerack);
+
+    for (LoopbackPeer& peer : peers) {
+        SendLoopbackMessage(peer, LoopbackMessage("verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION)));
+        CDataStream ping(SER_NETWORK, PROTOCOL_VERSION);
+        ping << GetRand(std::numeric_limits<uint64_t>::max());
+        SendLoopbackMessage(peer, LoopbackMessage("ping", ping));
+    }
+    WaitForLoopbackPeers(peers, &LoopbackPeer::fPong);
+    return timer_stop(tv_start);
+}
+#else
+double benchmark_loopback_peers(int nPeers)
+{
+    throw std::runtime_error("loopbackpeers is not supported on Windows");
+}
+#endif
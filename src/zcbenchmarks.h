@@ -2,8 +2,29 @@
 #define BENCHMARKS_H
 
 #include <sys/time.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include <string>
+#include <vector>
+
+/** Results of replaying a block range into a database opened with one profile */
+struct DBProfileBenchmark
+{
+    std::string profile;
+    double runningtime;
+    //! Time spent in LevelDB writes
+    double writetime;
+    //! Writes that had to wait for a compaction
+    int nStalls;
+    double compactiontime;
+    double compactionreadmb;
+    double compactionwritemb;
+    uint64_t nDiskBytes;
+
+    DBProfileBenchmark() : runningtime(0), writetime(0), nStalls(0), compactiontime(0), compactionreadmb(0), compactionwritemb(0), nDiskBytes(0) {}
+};
+
 extern double benchmark_sleep();
 extern double benchmark_parameter_loading();
 extern double benchmark_create_joinsplit();
@@ -13,7 +34,9 @@ extern std::vector<double> benchmark_solve_equihash_threaded(int nThreads);
 extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
 extern double benchmark_verify_equihash();
 extern double benchmark_large_tx(size_t nInputs);
+extern double benchmark_sigcache(bool fCuckoo, size_t nThreads);
 extern double benchmark_try_decrypt_notes(size_t nAddrs);
+extern std::vector<std::pair<int, double>> benchmark_try_decrypt_sapling_notes(size_t nAddrs, int nMaxThreads);
 extern double benchmark_increment_note_witnesses(size_t nTxs);
 extern double benchmark_connectblock_slow();
 extern double benchmark_sendtoaddress(CAmount amount);
@@ -23,5 +46,7 @@ extern double benchmark_create_sapling_spend();
 extern double benchmark_create_sapling_output();
 extern double benchmark_verify_sapling_spend();
 extern double benchmark_verify_sapling_output();
+extern std::vector<DBProfileBenchmark> benchmark_db_profiles(int nBlocks);
+extern double benchmark_loopback_peers(int nPeers);
 
 #endif